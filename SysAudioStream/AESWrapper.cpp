@@ -1,4 +1,5 @@
 #include "AESWrapper.h"
+#include "Trace.h"
 
 #include <cmath>
 #include <stdexcept>
@@ -50,6 +51,15 @@ void AESWrapper::GenerateKey(std::string password)
 
 size_t AESWrapper::Encrypt(const byte* buffer, size_t buffer_len, byte* encrypted_buffer) 
 {
+    memcpy(encrypted_buffer, buffer, buffer_len);
+
+    return EncryptInPlace(encrypted_buffer, buffer_len);
+}
+
+size_t AESWrapper::EncryptInPlace(byte* buffer, size_t buffer_len)
+{
+    TRACE_SCOPE("encrypt");
+
     int new_buf_size = buffer_len;
 
     if (buffer_len % AES_BLOCKLEN) {
@@ -60,12 +70,10 @@ size_t AESWrapper::Encrypt(const byte* buffer, size_t buffer_len, byte* encrypte
         new_buf_size += AES_BLOCKLEN;
     }
 
-    memcpy(encrypted_buffer, buffer, buffer_len);
-
-    pkcs7_padding_pad_buffer(encrypted_buffer, buffer_len, new_buf_size, AES_BLOCKLEN);
+    pkcs7_padding_pad_buffer(buffer, buffer_len, new_buf_size, AES_BLOCKLEN);
 
     AES_init_ctx_iv(&m_encrypt_ctx, m_key, m_iv);
-    AES_CBC_encrypt_buffer(&m_encrypt_ctx, encrypted_buffer, new_buf_size);
+    AES_CBC_encrypt_buffer(&m_encrypt_ctx, buffer, new_buf_size);
 
     return new_buf_size;
 }
@@ -24,6 +24,10 @@ public:
     void GenerateKey(std::string password);
 
     size_t Encrypt(const byte* buffer, size_t buffer_len, byte* encrypted_buffer);
+
+    // Pads and encrypts buffer where it is, it needs room for up to
+    // AES_BLOCKLEN bytes of padding after buffer_len
+    size_t EncryptInPlace(byte* buffer, size_t buffer_len);
     size_t Decrypt(byte* encrypted_buffer, size_t encrypted_buffer_len, byte* decrypted_buffer);
 
 private:
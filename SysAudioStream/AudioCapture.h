@@ -0,0 +1,45 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+struct StreamMetrics;
+
+// What AudioStream drives on Linux: PulseAudioCapture, or SyntheticCapture
+// for tests and benchmarks. Audio is delivered as interleaved float at
+// GetSamplerate() and GetChannels().
+class AudioCapture
+{
+    public:
+        virtual ~AudioCapture() {}
+
+        // pts_ns is the monotonic time the first frame was rendered
+        typedef std::function<int(uint32_t audio_size, uint8_t* data, int64_t pts_ns)> PacketCallback;
+
+        virtual void SetAudioReadyCallback(PacketCallback callback) = 0;
+        virtual void SetDeviceName(std::string device_name) = 0;
+
+        // Where holes and overruns of the capture are counted
+        virtual void SetMetrics(StreamMetrics* metrics) = 0;
+
+        // "float 32 <rate|native> [channels]"
+        virtual bool InitializeAudioDevice(const std::string& audio_fmt) = 0;
+        virtual void StopCapture() = 0;
+
+        virtual void AsyncStartCapture() = 0;
+        virtual void AsyncStopCapture() = 0;
+
+        // Paused capture delivers nothing
+        virtual void SetPlaybackState(bool playing) = 0;
+
+        virtual int GetAudioFormat() const = 0;
+        virtual int GetBitsPerSample() const = 0;
+        virtual int GetChannels() const = 0;
+        virtual int GetSamplerate() const = 0;
+        virtual int GetEnginePeriod() const = 0;
+};
+
+#endif
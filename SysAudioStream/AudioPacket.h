@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+
+// Highest StreamSettings::protocol_version the server speaks
+// 0 = raw samples only
+// 1 = every audio packet starts with an AudioPacketHeader
+// 2 = Opus can be negotiated, one Opus frame per audio packet
+// 3 = lossless can be negotiated, one LosslessCodec frame per audio packet,
+//     and the hello may request any pcm/float layout including 24-in-32
+// 4 = several receivers share one server: the hello may request a sample
+//     rate, the reply carries a session id that cmd packets echo back, and a
+//     session without cmd packets for SESSION_TIMEOUT_S is dropped
+// 5 = the hello may request 1, 2, 4, 6 or 8 channels, the capture is
+//     downmixed per session, older receivers get stereo
+// 6 = while the capture is silent, packets without payload stand for
+//     AudioPacketHeader::frames frames of silence (DTX)
+// 7 = receivers send link reports (cmd 5) and the server may switch the
+//     session's format, announced in cmd replies as a new format generation
+//     and used once the receiver echoes it back. The top byte of
+//     AudioPacketHeader::frames is the generation of the packet's format.
+#define AUDIO_PROTOCOL_VERSION 7
+
+// Protocol 4 receivers ping at least this often to keep their session
+#define SESSION_TIMEOUT_S 30
+
+// Silence packets go out at least this often while the capture is silent
+#define DTX_KEEPALIVE_MS 200
+
+// StreamSettings::audio_format
+#define AUDIO_FORMAT_PCM 0
+#define AUDIO_FORMAT_FLOAT 1
+#define AUDIO_FORMAT_OPUS 2
+#define AUDIO_FORMAT_LOSSLESS 3
+
+// Protocol 7 split of AudioPacketHeader::frames
+#define AUDIO_FRAMES_MASK 0x00ffffffu
+#define AUDIO_GENERATION_SHIFT 24
+
+// Encrypted together with the samples that follow it
+struct AudioPacketHeader
+{
+	// Increments by one per packet within a session
+	uint32_t sequence;
+
+	// Audio frames in this packet, or of silence if it has no payload. From
+	// protocol 7 only the low 24 bits, see AUDIO_FRAMES_MASK.
+	uint32_t frames;
+
+	// Server monotonic time (ns) at which the first frame was rendered on
+	// the PC. cmd replies carry the same clock for offset estimation.
+	int64_t pts_ns;
+};
+
+static_assert(sizeof(AudioPacketHeader) == 16, "AudioPacketHeader must stay one AES block");
+
+// Every datagram: a random IV, then the AES-CBC encrypted payload
+struct EncryptedData 
+{
+	uint8_t iv[16];
+	uint8_t* data;
+};
+
+// Hello sent by a receiver to the connection port and the server's reply
+struct StreamSettings 
+{
+	int android_port;
+
+	int audio_format;
+	int bits_per_sample;
+
+	// Channels in WAVE order, see ChannelMixer.h. A protocol 5 hello may
+	// ask for fewer than the capture has.
+	int n_channels;
+	int sample_rate;
+	int engine_period;
+	int cmd_port;
+
+	// Sent by the receiver in its hello and answered with the version the
+	// session will use, see AUDIO_PROTOCOL_VERSION. Missing means 0.
+	int protocol_version;
+
+	// Opus bit/s. A protocol 2 receiver may ask for Opus by sending
+	// audio_format = AUDIO_FORMAT_OPUS, optionally with its bitrate here.
+	// A protocol 3 receiver may ask for AUDIO_FORMAT_LOSSLESS likewise.
+	// For codec sessions engine_period is the frame size in frames.
+	int codec_bitrate;
+
+	// Bits each sample occupies on the wire, 0 = bits_per_sample. 32 with
+	// bits_per_sample = 24 sends 24-bit samples in 32-bit words. From
+	// protocol 3 a receiver may request any pcm/float format in its hello.
+	int container_bits;
+
+	// Set in the reply from protocol 4, cmd packets of the session carry it.
+	// A protocol 4 hello may also ask for any sample_rate in its range.
+	int session_id;
+};
+
+// Sent by a receiver to StreamSettings::cmd_port, answered in kind
+struct CmdStreamPacket 
+{
+	// cmd = 0 (measure latency)
+	// cmd = 1 (play stream)
+	// cmd = 2 (pause stream)
+	// cmd = 3 (stop stream)
+	// cmd = 4 (receiver buffer level report)
+	// cmd = 5 (receiver link report, protocol 7)
+	int cmd;
+
+	// cmd = 4: frames queued in the receiver's playback buffer
+	int buffer_frames;
+
+	// Filled in every reply with the clock used for AudioPacketHeader::pts_ns
+	int64_t server_time_ns;
+
+	// StreamSettings::session_id, 0 from receivers before protocol 4 which
+	// are told apart by address
+	uint32_t session_id;
+
+	// cmd = 5: audio packets received and found missing by sequence since
+	// the previous report, interarrival jitter (RFC 3550) and the round trip
+	// of its last ping, in us
+	uint32_t packets_received;
+	uint32_t packets_lost;
+	int jitter_us;
+	int rtt_us;
+
+	// Protocol 7. Sent: the newest format generation the receiver was told
+	// about. Replied: the generation the server wants to use with its
+	// format, which it switches to once the receiver echoes it.
+	uint32_t format_generation;
+	int audio_format;
+	int bits_per_sample;
+	int container_bits;
+	int sample_rate;
+	int n_channels;
+	int codec_bitrate;
+};
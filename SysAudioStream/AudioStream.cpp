@@ -1,18 +1,79 @@
 #include "AudioStream.h"
 
-AudioStream::AudioStream(std::string password, int conn_socket_port, std::string audio_fmt)
+// Hellos from further receivers are ignored until one leaves
+#define MAX_CLIENT_SESSIONS 32
+
+// Rates a protocol 4 hello may ask for
+#define MIN_SESSION_RATE 8000
+#define MAX_SESSION_RATE 384000
+
+// The IV and the header go in front of the payload
+static_assert(PACKET_HEADROOM == 16 + sizeof(AudioPacketHeader), "packet headroom must fit the IV and header");
+
+// Longest the first mixed source waits for the others
+#define MIX_MAX_LATENCY_MS 30
+
+// A capture callback this late after the previous block's audio ran out
+// is traced as a stall
+#define CAPTURE_STALL_MS 20
+
+// Labels of ClientSession::abr_switches, the last one is the only way up
+static const char* const ABR_SWITCH_REASON_NAMES[ABR_SWITCH_REASONS] = { "loss", "jitter", "queueing_delay", "clean" };
+
+#if defined(__linux__)
+// PulseAudio, or the synthetic source for tests and benchmarks
+static std::unique_ptr<AudioCapture> CreateCapture(const std::string& device_name)
+{
+	if (device_name == SYNTHETIC_DEVICE_NAME)
+		return std::make_unique<SyntheticCapture>();
+
+	return std::make_unique<PulseAudioCapture>();
+}
+#endif
+
+AudioStream::AudioStream(std::string password, int conn_socket_port, std::string audio_fmt, std::string device_name)
 {
 	m_cmd_socket = 0;
 	m_cmd_socket_port = 0;
 
 	m_send_audio_socket = 0;
 
+	m_dither = DitherType::None;
+	m_resampler_quality = ResamplerQuality::Medium;
+
+	m_dtx_enabled = true;
+	m_dtx_threshold_dbfs = -80.0;
+	m_dtx_hold_ms = 300;
+	m_silence_rate = 0;
+
+	m_dtx_stat_frames = 0;
+	m_dtx_stat_silent_frames = 0;
+	m_dtx_stat_packets = 0;
+	m_dtx_stat_saved_bytes = 0;
+	m_dtx_stat_start_ns = 0;
+
+	m_next_session_id = 1;
+	m_capture_started = false;
+
+	m_pending_count = 0;
+	m_last_capture_ns = 0;
+	m_last_capture_block_ns = 0;
+
 	m_connection_receiver_socket = 0;
 	m_connection_receiver_socket_port = 0;
 
 	m_audio_fmt = audio_fmt;
+	m_device_name = device_name;
 	m_connection_receiver_socket_port = conn_socket_port;
 
+	if (!ParseAudioFormat(audio_fmt, &m_format_config))
+		throw std::invalid_argument("invalid audio format");
+
+	// Capture always runs in float at the device's own rate, the wire format
+	// and rate are produced per session. The configured rate is what
+	// receivers get unless they ask for another one.
+	m_capture_fmt = "float 32 native";
+
 	int key_size = AESWrapper::KeySize();
 
 	if (password.size() > key_size)
@@ -27,6 +88,35 @@ AudioStream::AudioStream(std::string password, int conn_socket_port, std::string
 
 AudioStream::~AudioStream()
 {
+	// A scrape may be running, it has to be done before anything goes
+	RemoveMetricsCollector(this);
+
+	// The cmd thread starts and stops the capture, it has to be gone first
+	#if defined(_WIN32)
+	shutdown(m_cmd_socket, SD_BOTH);
+	shutdown(m_connection_receiver_socket, SD_BOTH);
+	#elif defined(__linux__)
+	shutdown(m_cmd_socket, SHUT_RDWR);
+	shutdown(m_connection_receiver_socket, SHUT_RDWR);
+	#endif
+
+	if (m_cmd_thread && m_cmd_thread->joinable())
+		m_cmd_thread->join();
+
+	m_cmd_thread.reset();
+
+	if (m_connections_thread && m_connections_thread->joinable())
+		m_connections_thread->join();
+
+	m_connections_thread.reset();
+
+	#if defined(__linux__)
+	for (auto& capture : m_extra_captures)
+		capture->StopCapture();
+
+	m_extra_captures.clear();
+	#endif
+
 	if (m_capture) {
 		m_capture->StopCapture();
 #if defined(_WIN32)
@@ -38,32 +128,18 @@ AudioStream::~AudioStream()
 	#if defined(_WIN32)
 	MFShutdown();
 
-	shutdown(m_cmd_socket, SD_BOTH);
-	shutdown(m_connection_receiver_socket, SD_BOTH);
 	shutdown(m_send_audio_socket, SD_BOTH);
 
 	closesocket(m_cmd_socket);
 	closesocket(m_connection_receiver_socket);
 	closesocket(m_send_audio_socket);
 	#elif defined(__linux__)
-	shutdown(m_cmd_socket, SHUT_RDWR);
-	shutdown(m_connection_receiver_socket, SHUT_RDWR);
 	shutdown(m_send_audio_socket, SHUT_RDWR);
 	
 	close(m_cmd_socket);
 	close(m_connection_receiver_socket);
 	close(m_send_audio_socket);
 	#endif
-
-	if (m_cmd_thread && m_cmd_thread->joinable())
-		m_cmd_thread->join();
-
-	m_cmd_thread.reset();
-
-	if (m_connections_thread && m_connections_thread->joinable())
-		m_connections_thread->join();
-
-	m_connections_thread.reset();
 }
 
 bool AudioStream::Init()
@@ -76,7 +152,7 @@ bool AudioStream::Init()
 
 	if (FAILED(hr)) {
 		_com_error err(hr);
-		printf("(err-init): MFStartup Error\n");
+		LOG_ERROR("(err-init): MFStartup Error\n");
 		printf("(err-init): %ws\n", err.ErrorMessage());
 		return false;
 	}
@@ -88,7 +164,7 @@ bool AudioStream::Init()
 	ret = WSAStartup(MAKEWORD(2, 2), &wsaData);
 	if (ret) {
 		_com_error err(hr);
-		printf("(err-init): WSAStartup Error\n");
+		LOG_ERROR("(err-init): WSAStartup Error\n");
 		printf("(err-init): %ws\n", err.ErrorMessage());
 		return false;
 	}
@@ -97,10 +173,10 @@ bool AudioStream::Init()
 	m_send_audio_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	if (m_send_audio_socket == -1) {
 #if defined(_WIN32)
-		printf("(err-init): send_audio_socket failed with error: %ld\n", WSAGetLastError());
+		LOG_ERROR("(err-init): send_audio_socket failed with error: %ld\n", WSAGetLastError());
 		WSACleanup();
 #elif defined(__linux__)
-		printf("(err-init): send_audio_socket failed with error: %d\n", errno);
+		LOG_ERROR("(err-init): send_audio_socket failed with error: %d\n", errno);
 #endif
 		return false;
 	}
@@ -108,10 +184,10 @@ bool AudioStream::Init()
 	m_connection_receiver_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	if (m_connection_receiver_socket == -1) {
 #if defined(_WIN32)
-		printf("(err-init): connection_receiver_socket failed with error: %ld\n", WSAGetLastError());
+		LOG_ERROR("(err-init): connection_receiver_socket failed with error: %ld\n", WSAGetLastError());
 		WSACleanup();
 #elif defined(__linux__)		
-		printf("(err-init): connection_receiver_socket failed with error: %d\n", errno);
+		LOG_ERROR("(err-init): connection_receiver_socket failed with error: %d\n", errno);
 #endif
 		return false;
 	}
@@ -124,9 +200,9 @@ bool AudioStream::Init()
 	ret = bind(m_connection_receiver_socket, reinterpret_cast<sockaddr*>(&connReceiverAddr), sizeof(connReceiverAddr));
 	if (ret < 0) {
 		#if defined(_WIN32)
-		printf("(err-init): connection_receiver_socket bind() failed (errno: %ld)\n", WSAGetLastError());
+		LOG_ERROR("(err-init): connection_receiver_socket bind() failed (errno: %ld)\n", WSAGetLastError());
 		#elif defined(__linux__)
-		printf("(err-init): connection_receiver_socket bind() failed (errno: %d)\n", errno);
+		LOG_ERROR("(err-init): connection_receiver_socket bind() failed (errno: %d)\n", errno);
 		#endif	
 		return false;
 	}
@@ -134,32 +210,67 @@ bool AudioStream::Init()
 	#if defined(_WIN32)
 	m_capture = winrt::make_self<winrt::SDKTemplate::WASAPICapture>();
 	#elif defined(__linux__)
-	m_capture = std::make_unique<PulseAudioCapture>();
+	m_capture = CreateCapture(m_device_name);
 	#endif
 
-	m_capture->SetAudioReadyCallback([this](uint32_t audio_size, uint8_t* audio_samples)
-	{
-		EncryptedData* enc_audio_data = reinterpret_cast<EncryptedData*>(m_audio_streaming_buffer);
+	m_capture->SetDeviceName(m_device_name);
+	m_capture->SetMetrics(&m_metrics);
+
+	#if defined(__linux__)
+	if (m_sources.size() > 1) {
+		// Every source goes through the mixer, which hands on the mix
+		for (size_t i = 1; i < m_sources.size(); i++) {
+			auto capture = CreateCapture(m_sources[i].device);
+			AudioCapture* source_capture = capture.get();
+			int source = (int)i;
 
-		m_random_gen.Generate(enc_audio_data->iv, 16);
-		m_aes_wrapper.SetIv(enc_audio_data->iv, 16);
+			capture->SetDeviceName(m_sources[i].device);
+			capture->SetMetrics(&m_metrics);
+			capture->SetAudioReadyCallback([this, source, source_capture](uint32_t audio_size, uint8_t* audio_samples, int64_t pts_ns)
+			{
+				int channels = source_capture->GetChannels();
 
-		byte* data_ptr = (byte*)(&enc_audio_data->data);
+				m_mixer.Push(source, reinterpret_cast<const float*>(audio_samples), audio_size / (channels * sizeof(float)), channels, pts_ns);
+				return 0;
+			});
 
-		int data_size = m_aes_wrapper.Encrypt(audio_samples, audio_size, data_ptr);
-		int data_total_size = sizeof(enc_audio_data->iv) + data_size;
+			m_extra_captures.push_back(std::move(capture));
+		}
+
+		m_capture->SetAudioReadyCallback([this](uint32_t audio_size, uint8_t* audio_samples, int64_t pts_ns)
+		{
+			int channels = m_capture->GetChannels();
+
+			m_mixer.Push(0, reinterpret_cast<const float*>(audio_samples), audio_size / (channels * sizeof(float)), channels, pts_ns);
+			return 0;
+		});
 
-		int ret = send(m_send_audio_socket, (const char*)m_audio_streaming_buffer, data_total_size, 0);
+		m_mixer.SetOutputCallback([this](const float* samples, size_t frames, int64_t pts_ns)
+		{
+			std::lock_guard<std::mutex> lk(m_session_mutex);
+
+			OnAudioCaptured((uint32_t)(frames * m_mixer.GetChannels() * sizeof(float)), (uint8_t*)samples, pts_ns);
+		});
+	}
+	else
+	#endif
+	m_capture->SetAudioReadyCallback([this](uint32_t audio_size, uint8_t* audio_samples, int64_t pts_ns)
+	{
+		std::lock_guard<std::mutex> lk(m_session_mutex);
 
-		return 0;
+		return OnAudioCaptured(audio_size, audio_samples, pts_ns);
 	});
 
+	// Open the device up front so the first client doesn't wait for it
+	if (!InitializeCapture())
+		LOG_WARNING("(warning-init): failed to pre-warm audio device\n");
+
 	m_cmd_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	if (m_cmd_socket == -1) {
 		#if defined(_WIN32)
-		printf("(err-init): cmd_socket failed with error: %ld\n", WSAGetLastError());
+		LOG_ERROR("(err-init): cmd_socket failed with error: %ld\n", WSAGetLastError());
 		#elif defined(__linux__)
-		printf("(err-init): cmd_socket failed with error: %s (errno: %d)\n", strerror(errno), errno);
+		LOG_ERROR("(err-init): cmd_socket failed with error: %s (errno: %d)\n", strerror(errno), errno);
 		#endif
 		return false;
 	}
@@ -172,9 +283,9 @@ bool AudioStream::Init()
 	ret = bind(m_cmd_socket, reinterpret_cast<sockaddr*>(&cmd_sockaddr), sizeof(cmd_sockaddr));
 	if (ret < 0) {
 		#if defined(_WIN32)
-		printf("(err-init): cmd_socket bind() failed (errno: %ld)\n", WSAGetLastError());
+		LOG_ERROR("(err-init): cmd_socket bind() failed (errno: %ld)\n", WSAGetLastError());
 		#elif defined(__linux__)
-		printf("(err-init): cmd_socket bind() failed:  %s (errno: %d)\n", strerror(errno), errno);
+		LOG_ERROR("(err-init): cmd_socket bind() failed:  %s (errno: %d)\n", strerror(errno), errno);
 		#endif
 		return false;
 	}
@@ -186,176 +297,1579 @@ bool AudioStream::Init()
 	m_connections_thread = std::make_unique<std::thread>(&AudioStream::t_connection_receiver, this);
 	m_cmd_thread = std::make_unique<std::thread>(&AudioStream::t_cmd_receiver, this);
 
+	AddMetricsCollector(this, [this](MetricsWriter* writer) { CollectMetrics(writer); });
+
 	return true;
 }
 
-void AudioStream::t_cmd_receiver()
+void AudioStream::SetDither(DitherType dither)
 {
-	AESWrapper local_aes_wrapper;
-	local_aes_wrapper.GenerateKey(m_password);
+	m_dither = dither;
+}
 
-	byte local_buffer[8192] = { 0 };
+void AudioStream::SetResamplerQuality(ResamplerQuality quality)
+{
+	m_resampler_quality = quality;
+}
 
-	while (true) {
-		sockaddr_in remote_sockaddr{};
-		socklen_t remote_addrlen = sizeof(remote_sockaddr);
+void AudioStream::SetDtx(bool enabled, double threshold_dbfs, int hold_ms)
+{
+	m_dtx_enabled = enabled;
+	m_dtx_threshold_dbfs = threshold_dbfs;
+	m_dtx_hold_ms = hold_ms;
+}
 
-		int recv_bytes = recvfrom(m_cmd_socket, (char*)local_buffer, 8192, 0, reinterpret_cast<sockaddr*>(&remote_sockaddr), &remote_addrlen);
+void AudioStream::SetSources(const std::vector<CaptureSource>& sources)
+{
+	if (sources.empty())
+		return;
 
-		if (recv_bytes <= 0) {
-			#if defined(_WIN32)
-			printf("(cmd-thread): recvfrom failed with error: %d\n", WSAGetLastError());
-			#elif defined(__linux__)
-			printf("(cmd-thread): recvfrom failed with error: %s(errno: %d)\n", strerror(errno), errno);
-			#endif
-			break;
-		}
+	m_device_name = sources[0].device;
 
-		auto enc_data = reinterpret_cast<EncryptedData*>(local_buffer);
+	#if defined(_WIN32)
+	if (sources.size() > 1)
+		LOG_WARNING("(warning-audio): mixing sources needs PulseAudio, capturing only the first one\n");
 
-		local_aes_wrapper.SetIv(enc_data->iv, 16);
-		int ret = local_aes_wrapper.Decrypt(&local_buffer[16], recv_bytes - 16, &local_buffer[16]);
+	m_sources.assign(sources.begin(), sources.begin() + 1);
+	#else
+	m_sources = sources;
+	#endif
 
-		if (ret <= 0) {
-			printf("(cmd-thread): invalid command packet\n");
-			continue;
+	for (size_t i = 0; i < m_sources.size(); i++)
+		m_mixer.SetGain((int)i, m_sources[i].gain_db);
+}
+
+void AudioStream::SetTiers(const std::vector<AudioFormatConfig>& tiers)
+{
+	m_tier_formats = tiers;
+
+	// The configured format is always one of them
+	if (!m_tier_formats.empty())
+		m_tier_formats.insert(m_tier_formats.begin(), m_format_config);
+}
+
+bool AudioStream::ParseAudioFormat(const std::string& audio_fmt, AudioFormatConfig* format)
+{
+	std::vector<std::string> audio_config;
+
+	std::string temp;
+	std::stringstream sstr(audio_fmt);
+
+	while (sstr >> temp) {
+		audio_config.push_back(temp);
+	}
+
+	if (audio_config.size() < 3)
+		return false;
+
+	*format = AudioFormatConfig{};
+
+	try {
+		format->sample_rate = std::stoi(audio_config[2]);
+
+		if (audio_config[0] == "pcm" && audio_config.size() == 3) {
+			format->audio_format = AUDIO_FORMAT_PCM;
+
+			if (audio_config[1] == "24in32") {
+				format->bits_per_sample = 24;
+				format->container_bits = 32;
+
+				return true;
+			}
+
+			format->bits_per_sample = std::stoi(audio_config[1]);
+
+			return format->bits_per_sample == 16 || format->bits_per_sample == 24 || format->bits_per_sample == 32;
 		}
+		else if (audio_config[0] == "float" && audio_config.size() == 3) {
+			format->audio_format = AUDIO_FORMAT_FLOAT;
+			format->bits_per_sample = 32;
 
-		auto cmd_pkt = reinterpret_cast<CmdStreamPacket*>(&local_buffer[16]);
+			return true;
+		}
+		else if (audio_config[0] == "opus" && audio_config.size() <= 4) {
+			format->audio_format = AUDIO_FORMAT_OPUS;
+			format->bits_per_sample = 16;
+			format->bitrate = std::stoi(audio_config[1]) * 1000;
+			format->frame_ms = audio_config.size() == 4 ? std::stod(audio_config[3]) : 10;
 
-		switch (cmd_pkt->cmd) 
-		{
-			case 0: 
-				// Nothind to do
-				// Ping command
-				break;
-			case 1:
-				printf("(cmd-thread): capturing audio\n");
-				m_capture->SetPlaybackState(true);
-				break;
-			case 2:
-				printf("(cmd-thread): pausing audio capture\n");
-				m_capture->SetPlaybackState(false);
-				break;
-			case 3:
-				printf("(cmd-thread): stopping audio capture\n");
-				m_capture->AsyncStopCapture();
-				break;
+			return OpusCodec::IsValidConfig(format->sample_rate, format->frame_ms);
 		}
+		else if (audio_config[0] == "lossless" && audio_config.size() <= 4) {
+			format->audio_format = AUDIO_FORMAT_LOSSLESS;
+			format->bits_per_sample = std::stoi(audio_config[1]);
+			format->frame_ms = audio_config.size() == 4 ? std::stod(audio_config[3]) : 10;
 
-		m_random_gen.Generate(enc_data->iv, 16);
-		local_aes_wrapper.SetIv(enc_data->iv, 16);
+			return LosslessCodec::IsValidConfig(format->bits_per_sample, format->sample_rate, format->frame_ms);
+		}
+	}
+	catch (const std::exception&) {
+	}
 
-		uint8_t* data_ptr = (uint8_t*)(&enc_data->data);
+	return false;
+}
 
-		int data_size = local_aes_wrapper.Encrypt(reinterpret_cast<const byte*>(&local_buffer[16]), sizeof(CmdStreamPacket), data_ptr);
-		int data_total_size = 16 + data_size;
+AudioFormatConfig AudioStream::NegotiateFormat(const StreamSettings* hello, int protocol_version) const
+{
+	AudioFormatConfig format = m_format_config;
 
-		ret = sendto(m_cmd_socket, (const char*)local_buffer, data_total_size, 0, (sockaddr*)&remote_sockaddr, remote_addrlen);
-		if (ret < 0) {
-			#if defined(_WIN32)
-			printf("(cmd-thread): sendto failed with error: %d\n", WSAGetLastError());
-			#elif defined(__linux__)
-			printf("(cmd-thread): sendto failed with error: %s(errno: %d)\n", strerror(errno), errno);
-			#endif
-			m_capture->AsyncStopCapture();
+	// Capture is float whatever the format, so every client can get the
+	// pcm/float layout it asks for
+	if (protocol_version >= 3 && (hello->audio_format == AUDIO_FORMAT_PCM || hello->audio_format == AUDIO_FORMAT_FLOAT)) {
+		AudioFormatConfig requested = format;
+
+		requested.audio_format = hello->audio_format;
+		requested.bits_per_sample = hello->audio_format == AUDIO_FORMAT_FLOAT ? 32 : hello->bits_per_sample;
+		requested.container_bits = hello->bits_per_sample == 24 && hello->container_bits == 32 ? 32 : 0;
+
+		if (requested.bits_per_sample == 16 || requested.bits_per_sample == 24 || requested.bits_per_sample == 32)
+			format = requested;
+	}
+
+	if (protocol_version >= 2 && hello->audio_format == AUDIO_FORMAT_OPUS) {
+		if (format.audio_format != AUDIO_FORMAT_OPUS) {
+			format.audio_format = AUDIO_FORMAT_OPUS;
+			format.bits_per_sample = 16;
+			format.bitrate = 96000;
+			format.frame_ms = 10;
+			format.sample_rate = 48000;
 		}
+
+		if (hello->codec_bitrate > 0)
+			format.bitrate = hello->codec_bitrate;
 	}
 
-	#if defined(_WIN32)
-	closesocket(m_cmd_socket);
-	#elif defined(__linux__)
-	close(m_cmd_socket);
-	#endif
+	if (format.audio_format == AUDIO_FORMAT_OPUS &&
+		(protocol_version < 2 || !OpusCodec::IsAvailable() || !OpusCodec::IsValidConfig(format.sample_rate, format.frame_ms))) {
+		LOG_WARNING("(cr-thread): opus not possible for this receiver, using pcm 16\n");
+
+		format.audio_format = AUDIO_FORMAT_PCM;
+		format.bits_per_sample = 16;
+	}
+
+	if (protocol_version >= 3 && hello->audio_format == AUDIO_FORMAT_LOSSLESS &&
+		format.audio_format != AUDIO_FORMAT_LOSSLESS) {
+		format.audio_format = AUDIO_FORMAT_LOSSLESS;
+		format.bits_per_sample = hello->bits_per_sample == 24 ? 24 : 16;
+		format.frame_ms = 10;
+	}
+
+	// Same samples uncompressed for receivers that can't decode them
+	if (format.audio_format == AUDIO_FORMAT_LOSSLESS &&
+		(protocol_version < 3 || !LosslessCodec::IsValidConfig(format.bits_per_sample, format.sample_rate, format.frame_ms))) {
+		LOG_WARNING("(cr-thread): lossless not possible for this receiver, using pcm %d\n", format.bits_per_sample);
+
+		format.audio_format = AUDIO_FORMAT_PCM;
+	}
+
+	if (protocol_version < 3)
+		format.container_bits = 0;
+
+	// Stereo unless the receiver asks, Opus only does up to stereo here
+	int requested_channels = protocol_version >= 5 && hello->n_channels > 0 ? hello->n_channels : 2;
+
+	if (format.audio_format == AUDIO_FORMAT_OPUS)
+		requested_channels = std::min(requested_channels, 2);
+
+	format.channels = GetDownmixChannels(m_capture->GetChannels(), requested_channels);
+
+	// Any rate the codec takes, capture is resampled per client anyway
+	if (protocol_version >= 4 && hello->sample_rate >= MIN_SESSION_RATE && hello->sample_rate <= MAX_SESSION_RATE) {
+		bool supported = true;
+
+		if (format.audio_format == AUDIO_FORMAT_OPUS)
+			supported = OpusCodec::IsValidConfig(hello->sample_rate, format.frame_ms);
+		else if (format.audio_format == AUDIO_FORMAT_LOSSLESS)
+			supported = LosslessCodec::IsValidConfig(format.bits_per_sample, hello->sample_rate, format.frame_ms);
+
+		if (supported)
+			format.sample_rate = hello->sample_rate;
+	}
+
+	format = SnapToTier(format, protocol_version);
+
+	if (format.audio_format == AUDIO_FORMAT_OPUS)
+		format.channels = std::min(format.channels, 2);
+
+	return format;
 }
 
-void AudioStream::t_connection_receiver()
+AudioFormatConfig AudioStream::SnapToTier(const AudioFormatConfig& format, int protocol_version) const
 {
-	byte local_buffer[8192] = { 0 };
+	// Receivers before protocol 3 can't ask for a format
+	if (m_tier_formats.empty() || protocol_version < 3)
+		return format;
 
-	printf("(cr-thread): waiting for Android app to connect...\n");
+	const AudioFormatConfig* best = nullptr;
+	int64_t best_score = 0;
 
-	while (true) {
-		sockaddr_in remote_sockaddr{};
-		socklen_t remote_sockaddr_size = sizeof(remote_sockaddr);
+	for (const AudioFormatConfig& tier : m_tier_formats) {
+		if (tier.audio_format == AUDIO_FORMAT_OPUS && !OpusCodec::IsAvailable())
+			continue;
 
-		int recv_bytes = recvfrom(m_connection_receiver_socket, (char*)local_buffer, 8192, 0, reinterpret_cast<sockaddr*>(&remote_sockaddr), &remote_sockaddr_size);
+		// Same codec first, then the closest rate, then the closest depth
+		int64_t score = (tier.audio_format != format.audio_format ? 1LL << 40 : 0) +
+			(int64_t)std::abs(tier.sample_rate - format.sample_rate) * 1000 +
+			std::abs(tier.bits_per_sample - format.bits_per_sample) * 10 +
+			(tier.container_bits != format.container_bits ? 1 : 0);
 
-		if (recv_bytes <= 0) {
-			#if defined(_WIN32)
-			printf("(cr-thread): recvfrom failed with error: %d\n", WSAGetLastError());
-			#elif defined(__linux__)
-			printf("(cr-thread): recvfrom failed with error: %s(errno: %d)\n", strerror(errno), errno);
-			#endif
-			break;
+		if (!best || score < best_score) {
+			best = &tier;
+			best_score = score;
 		}
+	}
 
-		in_addr remote_address = remote_sockaddr.sin_addr;
+	if (!best)
+		return format;
 
-		char remote_sockaddr_name[INET_ADDRSTRLEN];
-		inet_ntop(AF_INET, &remote_address, remote_sockaddr_name, INET_ADDRSTRLEN);
+	AudioFormatConfig snapped = *best;
 
-		m_capture->StopCapture();
-		bool initialized = m_capture->InitializeAudioDevice(m_audio_fmt);
+	snapped.channels = format.channels;
+
+	return snapped;
+}
+
+int AudioStream::OnAudioCaptured(uint32_t audio_size, uint8_t* audio_samples, int64_t pts_ns)
+{
+	// Capture delivers interleaved float
+	const float* samples = reinterpret_cast<const float*>(audio_samples);
+	int channels = m_capture->GetChannels();
+	int capture_rate = m_capture->GetSamplerate();
+	size_t frames = audio_size / (channels * sizeof(float));
+
+	TRACE_SCOPE("capture");
+
+	int64_t start_ns = MonotonicNowNs();
+
+	if (m_last_capture_ns) {
+		m_metrics.capture_interval.Record(start_ns - m_last_capture_ns);
+
+		if (start_ns - m_last_capture_ns > m_last_capture_block_ns + CAPTURE_STALL_MS * 1000000LL)
+			TRACE_GLITCH("capture stall");
+	}
+
+	m_last_capture_ns = start_ns;
+	m_last_capture_block_ns = capture_rate ? (int64_t)frames * 1000000000LL / capture_rate : 0;
+
+	if (m_silence_rate != capture_rate) {
+		m_silence.Reset(capture_rate, m_dtx_threshold_dbfs, m_dtx_hold_ms);
+		m_silence_rate = capture_rate;
+	}
+
+	bool silent = m_dtx_enabled && m_silence.Process(samples, frames, channels);
+
+	for (auto& stage : m_stages)
+		stage->needed = false;
+
+	for (auto& tier : m_tiers) {
+		tier->needed = false;
+		tier->silencing = false;
+	}
+
+	// Receivers from protocol 6 are told about silence instead of sent it.
+	// A session with drift compensation encodes its own resampled audio.
+	for (auto& session : m_sessions) {
+		if (!session->playing)
+			continue;
 
-		if (!initialized) {
-			printf("(err-cr-thread): failed to initialize audio device\n");
+		if (silent && session->protocol_version >= 6) {
+			session->tier->silencing = true;
 			continue;
 		}
 
-		auto enc_data = reinterpret_cast<EncryptedData*>(local_buffer);
+		session->stage->needed = true;
 
-		m_aes_wrapper.SetIv(enc_data->iv, 16);
-		recv_bytes = m_aes_wrapper.Decrypt(&local_buffer[16], recv_bytes - 16, &local_buffer[16]);
+		if (!session->drift_active)
+			session->tier->needed = true;
+	}
 
-		if (recv_bytes <= 0) {
-			printf("(err-cr-thread): aes decrypt failed\n");
+	// Each rate and layout is produced once however many sessions use it.
+	// Downmixing first leaves fewer channels to resample.
+	for (auto& stage : m_stages) {
+		const float* stage_in = samples;
+
+		if (!stage->needed)
 			continue;
+
+		if (stage->channels != channels) {
+			// The device may come back with another channel count
+			if (stage->mixer.GetInputChannels() != channels)
+				stage->mixer.Init(channels, stage->channels);
+
+			size_t mix_samples = frames * stage->channels;
+
+			if (stage->mix_buffer.size() < mix_samples)
+				stage->mix_buffer.resize(mix_samples);
+
+			stage->mixer.Process(samples, frames, stage->mix_buffer.data());
+			stage_in = stage->mix_buffer.data();
 		}
 
-		auto recv_data = reinterpret_cast<StreamSettings*>(&local_buffer[16]);
-		u_short remote_port = recv_data->android_port;
+		if (stage->sample_rate == capture_rate) {
+			stage->samples = stage_in;
+			stage->frames = frames;
+			stage->pts_ns = pts_ns;
+			continue;
+		}
 
-		printf("(cr-thread): sending audio samples to %s:%u\n", remote_sockaddr_name, remote_port);
+		// Or at another native rate
+		if (stage->resampler.GetInputRate() != capture_rate)
+			stage->resampler.Init(capture_rate, stage->sample_rate, stage->channels, m_resampler_quality);
 
-		// Sending audio data settings to Android side
-		EncryptedData* enc_metadata = reinterpret_cast<EncryptedData*>(local_buffer);
+		size_t max_samples = stage->resampler.GetMaxOutput(frames) * stage->channels;
 
-		StreamSettings st_settings{};
-		st_settings.audio_format = m_capture->GetAudioFormat();
-		st_settings.bits_per_sample = m_capture->GetBitsPerSample();
-		st_settings.engine_period = m_capture->GetEnginePeriod();
-		st_settings.n_channels = m_capture->GetChannels();
-		st_settings.sample_rate = m_capture->GetSamplerate();
-		st_settings.cmd_port = m_cmd_socket_port;
+		if (stage->buffer.size() < max_samples)
+			stage->buffer.resize(max_samples);
 
-		m_random_gen.Generate(enc_metadata->iv, 16);
-		m_aes_wrapper.SetIv(enc_metadata->iv, 16);
+		double offset;
 
-		byte* data_ptr = (byte*)(&enc_metadata->data);
+		stage->frames = stage->resampler.Process(stage_in, frames, stage->buffer.data(), &offset);
+		stage->samples = stage->buffer.data();
+		stage->pts_ns = pts_ns + (int64_t)(offset * 1e9 / capture_rate);
+	}
 
-		int dataSize = m_aes_wrapper.Encrypt(reinterpret_cast<const byte*>(&st_settings), sizeof(st_settings), data_ptr);
-		int dataTotalSize = 16 + dataSize;
+	// Each wire format is converted or encoded once for all its sessions
+	for (auto& tier : m_tiers) {
+		tier->payloads.clear();
 
-		int ret = sendto(m_connection_receiver_socket, (const char*)local_buffer, dataTotalSize, 0, (sockaddr*)&remote_sockaddr, remote_sockaddr_size);
-		if (ret < 0) {
-			#if defined(_WIN32)
-			printf("(cr-thread): sendto failed with error: %d\n", WSAGetLastError());
-			#elif defined(__linux__)
-			printf("(cr-thread): sendto failed with error: %s(errno: %d)\n", strerror(errno), errno);
-			#endif
-			return;
+		if (tier->needed) {
+			tier->silent = false;
+			EncodeTierAudio(tier.get());
+			continue;
 		}
 
-		remote_sockaddr.sin_port = htons(remote_port);
-		connect(m_send_audio_socket, (sockaddr*)&remote_sockaddr, remote_sockaddr_size);
+		tier->flushed_frames = 0;
 
-		m_capture->AsyncStartCapture();
+		// Audio queued short of a codec frame goes into the silence
+		if (tier->silencing && !tier->silent) {
+			tier->silent = true;
+
+			if (tier->format.audio_format == AUDIO_FORMAT_OPUS)
+				tier->flushed_frames = tier->opus.Flush(&tier->flushed_pts_ns);
+			else if (tier->format.audio_format == AUDIO_FORMAT_LOSSLESS)
+				tier->flushed_frames = tier->lossless.Flush(&tier->flushed_pts_ns);
+		}
 	}
 
-	#if defined(_WIN32)
-	closesocket(m_connection_receiver_socket);
-	#elif defined(__linux__)
-	close(m_connection_receiver_socket);
-	#endif
-}
\ No newline at end of file
+	m_metrics.convert.Record(MonotonicNowNs() - start_ns);
+
+	for (auto& session : m_sessions) {
+		if (!session->playing)
+			continue;
+
+		if (silent && session->protocol_version >= 6) {
+			SendSilence(session.get(), frames, capture_rate, pts_ns);
+			continue;
+		}
+
+		EndSilence(session.get());
+
+		if (session->drift_active)
+			SendSessionAudio(session.get(), session->stage->samples, session->stage->frames, session->stage->pts_ns);
+		else
+			SendTierAudio(session.get(), session->tier);
+	}
+
+	FlushPackets();
+
+	if (m_dtx_enabled)
+		ReportDtx(MonotonicNowNs(), frames, silent);
+
+	return 0;
+}
+
+void AudioStream::SendSilence(ClientSession* session, size_t capture_frames, int capture_rate, int64_t pts_ns)
+{
+	bool starting = !session->silence_active;
+
+	if (starting) {
+		session->silence_active = true;
+		session->silence_frames = 0;
+		session->silence_pts_ns = pts_ns;
+
+		// Audio queued short of a codec frame goes into the silence, the
+		// tier's was flushed once for all its sessions
+		int64_t queued_pts_ns = 0;
+		size_t queued = 0;
+
+		if (!session->drift_active) {
+			queued = session->tier->flushed_frames;
+			queued_pts_ns = session->tier->flushed_pts_ns;
+		}
+		else if (session->format.audio_format == AUDIO_FORMAT_OPUS) {
+			queued = session->opus.Flush(&queued_pts_ns);
+		}
+		else if (session->format.audio_format == AUDIO_FORMAT_LOSSLESS) {
+			queued = session->lossless.Flush(&queued_pts_ns);
+		}
+
+		if (queued) {
+			session->silence_frames = (double)queued;
+			session->silence_pts_ns = queued_pts_ns;
+		}
+	}
+
+	int sample_rate = session->format.sample_rate;
+
+	session->silence_frames += (double)capture_frames * sample_rate / capture_rate;
+
+	// The first packet right away so the receiver knows
+	if (starting || session->silence_frames * 1000 >= (double)sample_rate * DTX_KEEPALIVE_MS)
+		SendSilencePacket(session);
+}
+
+void AudioStream::SendSilencePacket(ClientSession* session)
+{
+	uint32_t frames = (uint32_t)session->silence_frames;
+
+	if (!frames)
+		return;
+
+	int sent = SendAudioPacket(session, AcquirePacket(), 0, frames, session->silence_pts_ns);
+
+	session->silence_frames -= frames;
+	session->silence_pts_ns += (int64_t)frames * 1000000000LL / session->format.sample_rate;
+
+	// What the same stretch would have cost as audio, raw pcm before the
+	// session sent any
+	double bytes_per_frame = session->audio_frames ?
+		(double)session->audio_bytes / session->audio_frames :
+		(double)session->format.channels * GetSampleBytes(session->wire_type);
+
+	m_dtx_stat_packets++;
+	m_dtx_stat_saved_bytes += (int64_t)(frames * bytes_per_frame) - sent;
+}
+
+void AudioStream::EndSilence(ClientSession* session)
+{
+	if (!session->silence_active)
+		return;
+
+	SendSilencePacket(session);
+
+	session->silence_active = false;
+	session->silence_frames = 0;
+}
+
+void AudioStream::ReportDtx(int64_t now_ns, size_t capture_frames, bool silent)
+{
+	if (!m_dtx_stat_start_ns)
+		m_dtx_stat_start_ns = now_ns;
+
+	m_dtx_stat_frames += capture_frames;
+
+	if (silent)
+		m_dtx_stat_silent_frames += capture_frames;
+
+	if (now_ns - m_dtx_stat_start_ns < 10000000000LL)
+		return;
+
+	if (m_dtx_stat_packets) {
+		LOG_INFO("(dtx): capture silent %.0f%% of the last 10 s, %lld silence packets saved %.1f KB\n",
+			100.0 * m_dtx_stat_silent_frames / m_dtx_stat_frames, (long long)m_dtx_stat_packets, m_dtx_stat_saved_bytes / 1024.0);
+	}
+
+	m_dtx_stat_frames = 0;
+	m_dtx_stat_silent_frames = 0;
+	m_dtx_stat_packets = 0;
+	m_dtx_stat_saved_bytes = 0;
+	m_dtx_stat_start_ns = now_ns;
+}
+
+void AudioStream::SendSessionAudio(ClientSession* session, const float* samples, size_t frames, int64_t pts_ns)
+{
+	int channels = session->format.channels;
+
+	if (session->drift_active) {
+		double ratio = session->drift.GetRatio();
+		size_t max_samples = ((size_t)(frames * ratio) + 2) * channels;
+
+		if (session->drift_buffer.size() < max_samples)
+			session->drift_buffer.resize(max_samples);
+
+		frames = session->drift_resampler.Process(samples, frames, channels, ratio, session->drift_buffer.data());
+		samples = session->drift_buffer.data();
+	}
+
+	// Payloads are written straight into the buffer they are sent from
+	if (session->format.audio_format == AUDIO_FORMAT_OPUS) {
+		// Largest Opus packet is 1275 bytes per frame
+		const size_t max_opus_size = 1500;
+
+		session->opus.Push(samples, frames, pts_ns);
+
+		int64_t frame_pts_ns;
+
+		for (;;) {
+			PacketBuffer* buffer = AcquirePacket();
+			int size = session->opus.EncodeNext(PacketPool::GetPayload(buffer), max_opus_size, &frame_pts_ns);
+
+			if (size <= 0) {
+				m_packet_pool.Release(buffer);
+				break;
+			}
+
+			SendAudioPacket(session, buffer, size, session->opus.GetFrameSize(), frame_pts_ns);
+		}
+
+		return;
+	}
+
+	if (session->format.audio_format == AUDIO_FORMAT_LOSSLESS) {
+		size_t max_frame_size = session->lossless.GetMaxFrameBytes();
+
+		session->lossless.Push(samples, frames, pts_ns);
+
+		int64_t frame_pts_ns;
+
+		for (;;) {
+			PacketBuffer* buffer = AcquirePacket();
+			int size = session->lossless.EncodeNext(PacketPool::GetPayload(buffer), max_frame_size, &frame_pts_ns);
+
+			if (size <= 0) {
+				m_packet_pool.Release(buffer);
+				break;
+			}
+
+			SendAudioPacket(session, buffer, size, session->lossless.GetFrameSize(), frame_pts_ns);
+		}
+
+		return;
+	}
+
+	// Blocks bigger than an MTU go out as several packets of even size
+	size_t frame_bytes = channels * GetSampleBytes(session->wire_type);
+	size_t max_frames = PACKET_SPLIT_PAYLOAD / frame_bytes;
+	size_t packets = (frames + max_frames - 1) / max_frames;
+
+	while (frames) {
+		size_t count = (frames + packets - 1) / packets;
+		PacketBuffer* buffer = AcquirePacket();
+
+		session->converter.Convert(samples, count * channels, PacketPool::GetPayload(buffer));
+
+		SendAudioPacket(session, buffer, count * frame_bytes, (uint32_t)count, pts_ns);
+
+		samples += count * channels;
+		frames -= count;
+		packets--;
+		pts_ns += (int64_t)count * 1000000000LL / session->format.sample_rate;
+	}
+}
+
+void AudioStream::EncodeTierAudio(EncodeTier* tier)
+{
+	const RateStage* stage = tier->stage;
+	const float* samples = stage->samples;
+	size_t frames = stage->frames;
+	int64_t pts_ns = stage->pts_ns;
+	int channels = tier->format.channels;
+
+	size_t used = 0;
+
+	// Grows the payload store to the largest it needed so far
+	auto reserve = [tier, &used](size_t size)
+	{
+		if (tier->payload_buffer.size() < used + size)
+			tier->payload_buffer.resize(used + size);
+
+		return tier->payload_buffer.data() + used;
+	};
+
+	auto add_payload = [tier, &used](size_t size, size_t frames, int64_t pts_ns)
+	{
+		tier->payloads.push_back({ used, size, (uint32_t)frames, pts_ns });
+		used += size;
+	};
+
+	if (tier->format.audio_format == AUDIO_FORMAT_OPUS || tier->format.audio_format == AUDIO_FORMAT_LOSSLESS) {
+		bool opus = tier->format.audio_format == AUDIO_FORMAT_OPUS;
+
+		// Largest Opus packet is 1275 bytes per frame
+		size_t max_size = opus ? 1500 : tier->lossless.GetMaxFrameBytes();
+		size_t frame_size = opus ? tier->opus.GetFrameSize() : tier->lossless.GetFrameSize();
+
+		if (opus)
+			tier->opus.Push(samples, frames, pts_ns);
+		else
+			tier->lossless.Push(samples, frames, pts_ns);
+
+		int64_t frame_pts_ns;
+		int size;
+
+		for (;;) {
+			uint8_t* payload = reserve(max_size);
+
+			size = opus ? tier->opus.EncodeNext(payload, max_size, &frame_pts_ns) :
+				tier->lossless.EncodeNext(payload, max_size, &frame_pts_ns);
+
+			if (size <= 0)
+				break;
+
+			add_payload(size, frame_size, frame_pts_ns);
+		}
+
+		return;
+	}
+
+	// Blocks bigger than an MTU go out as several packets of even size
+	size_t frame_bytes = channels * GetSampleBytes(tier->wire_type);
+	size_t max_frames = PACKET_SPLIT_PAYLOAD / frame_bytes;
+	size_t packets = (frames + max_frames - 1) / max_frames;
+
+	while (frames) {
+		size_t count = (frames + packets - 1) / packets;
+
+		tier->converter.Convert(samples, count * channels, reserve(count * frame_bytes));
+		add_payload(count * frame_bytes, count, pts_ns);
+
+		samples += count * channels;
+		frames -= count;
+		packets--;
+		pts_ns += (int64_t)count * 1000000000LL / tier->format.sample_rate;
+	}
+}
+
+void AudioStream::SendTierAudio(ClientSession* session, const EncodeTier* tier)
+{
+	for (const EncodeTier::Payload& payload : tier->payloads) {
+		PacketBuffer* buffer = AcquirePacket();
+
+		memcpy(PacketPool::GetPayload(buffer), tier->payload_buffer.data() + payload.offset, payload.size);
+
+		SendAudioPacket(session, buffer, payload.size, payload.frames, payload.pts_ns);
+	}
+}
+
+int AudioStream::SendAudioPacket(ClientSession* session, PacketBuffer* buffer, size_t payload_size, uint32_t frames, int64_t pts_ns)
+{
+	bool has_audio = payload_size != 0;
+
+	uint8_t* packet = PacketPool::GetPayload(buffer);
+
+	// Receivers before protocol 1 get the bare payload
+	if (session->protocol_version >= 1) {
+		packet -= sizeof(AudioPacketHeader);
+
+		AudioPacketHeader* header = reinterpret_cast<AudioPacketHeader*>(packet);
+
+		header->sequence = session->sequence++;
+		header->frames = frames;
+
+		if (session->protocol_version >= 7)
+			header->frames = (frames & AUDIO_FRAMES_MASK) | (session->generation << AUDIO_GENERATION_SHIFT);
+		header->pts_ns = pts_ns;
+
+		payload_size += sizeof(AudioPacketHeader);
+	}
+
+	// The IV goes right in front, see EncryptedData
+	uint8_t* iv = packet - 16;
+
+	int64_t encrypt_ns = MonotonicNowNs();
+
+	m_random_gen.Generate(iv, 16);
+	m_aes_wrapper.SetIv(iv, 16);
+
+	int data_size = m_aes_wrapper.EncryptInPlace(packet, payload_size);
+	int data_total_size = 16 + data_size;
+
+	buffer->packet = iv;
+	buffer->size = data_total_size;
+	buffer->addr = session->addr;
+	buffer->queued_ns = MonotonicNowNs();
+
+	m_metrics.encrypt.Record(buffer->queued_ns - encrypt_ns);
+
+	m_pending_packets[m_pending_count++] = buffer;
+
+	session->sent_packets++;
+	session->sent_bytes += data_total_size;
+
+	if (has_audio) {
+		session->audio_bytes += data_total_size;
+		session->audio_frames += frames;
+	}
+
+	if (session->hello_time_ns) {
+		LOG_INFO("(audio): session %u first packet sent %.2f ms after hello\n", session->id, (MonotonicNowNs() - session->hello_time_ns) / 1e6);
+		session->hello_time_ns = 0;
+	}
+
+	return data_total_size;
+}
+
+PacketBuffer* AudioStream::AcquirePacket()
+{
+	PacketBuffer* buffer = m_packet_pool.Acquire();
+
+	// Every buffer is queued, send them to free some
+	if (!buffer) {
+		FlushPackets();
+		buffer = m_packet_pool.Acquire();
+	}
+
+	return buffer;
+}
+
+void AudioStream::FlushPackets()
+{
+	size_t count = m_pending_count;
+
+	if (!count)
+		return;
+
+	TRACE_SCOPE("send");
+
+	int64_t send_ns = MonotonicNowNs();
+	uint64_t bytes = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		m_metrics.queue.Record(send_ns - m_pending_packets[i]->queued_ns);
+		bytes += m_pending_packets[i]->size;
+	}
+
+	#if defined(_WIN32)
+	for (size_t i = 0; i < count; i++) {
+		PacketBuffer* buffer = m_pending_packets[i];
+
+		if (sendto(m_send_audio_socket, (const char*)buffer->packet, (int)buffer->size, 0, (sockaddr*)&buffer->addr, sizeof(buffer->addr)) == SOCKET_ERROR)
+			m_metrics.send_errors.Add();
+	}
+	#elif defined(__linux__)
+	mmsghdr messages[PACKET_POOL_SIZE];
+	iovec vectors[PACKET_POOL_SIZE];
+
+	for (size_t i = 0; i < count; i++) {
+		PacketBuffer* buffer = m_pending_packets[i];
+
+		vectors[i].iov_base = buffer->packet;
+		vectors[i].iov_len = buffer->size;
+
+		memset(&messages[i], 0, sizeof(messages[i]));
+		messages[i].msg_hdr.msg_name = &buffer->addr;
+		messages[i].msg_hdr.msg_namelen = sizeof(buffer->addr);
+		messages[i].msg_hdr.msg_iov = &vectors[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	size_t sent = 0;
+
+	while (sent < count) {
+		int ret = sendmmsg(m_send_audio_socket, messages + sent, (unsigned int)(count - sent), 0);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+			m_metrics.send_errors.Add();
+
+		// A datagram that can't go out is dropped like a failed sendto
+		sent += ret > 0 ? ret : 1;
+	}
+	#endif
+
+	m_metrics.send.Record(MonotonicNowNs() - send_ns);
+	m_metrics.packets.Add(count);
+	m_metrics.bytes.Add(bytes);
+
+	for (size_t i = 0; i < count; i++)
+		m_packet_pool.Release(m_pending_packets[i]);
+
+	m_pending_count = 0;
+}
+
+ClientSession* AudioStream::FindSession(const sockaddr_in& addr, uint32_t session_id)
+{
+	for (auto& session : m_sessions) {
+		if (session->addr.sin_addr.s_addr != addr.sin_addr.s_addr)
+			continue;
+
+		// Receivers before protocol 4 don't know their id
+		if (session_id ? session->id == session_id : session->protocol_version < 4)
+			return session.get();
+	}
+
+	return nullptr;
+}
+
+RateStage* AudioStream::AcquireRateStage(int sample_rate, int channels)
+{
+	for (auto& stage : m_stages) {
+		if (stage->sample_rate == sample_rate && stage->channels == channels) {
+			stage->users++;
+			return stage.get();
+		}
+	}
+
+	auto stage = std::make_unique<RateStage>();
+
+	stage->sample_rate = sample_rate;
+	stage->channels = channels;
+	stage->samples = nullptr;
+	stage->frames = 0;
+	stage->pts_ns = 0;
+	stage->users = 1;
+
+	m_stages.push_back(std::move(stage));
+
+	return m_stages.back().get();
+}
+
+EncodeTier* AudioStream::AcquireEncodeTier(const ClientSession* session)
+{
+	const AudioFormatConfig& format = session->format;
+	bool dtx = session->protocol_version >= 6;
+
+	for (auto& tier : m_tiers) {
+		const AudioFormatConfig& other = tier->format;
+
+		if (tier->stage == session->stage && tier->dtx == dtx && tier->wire_type == session->wire_type &&
+			other.audio_format == format.audio_format && other.bits_per_sample == format.bits_per_sample &&
+			other.bitrate == format.bitrate && other.frame_ms == format.frame_ms) {
+			tier->users++;
+			return tier.get();
+		}
+	}
+
+	auto tier = std::make_unique<EncodeTier>();
+
+	// The session's codecs were set up the same way, so this can't fail
+	if (format.audio_format == AUDIO_FORMAT_OPUS)
+		tier->opus.Init(format.sample_rate, format.channels, format.bitrate, format.frame_ms);
+	else if (format.audio_format == AUDIO_FORMAT_LOSSLESS)
+		tier->lossless.Init(format.sample_rate, format.channels, format.bits_per_sample, format.frame_ms, m_dither);
+
+	tier->format = format;
+	tier->wire_type = session->wire_type;
+	tier->dtx = dtx;
+	tier->stage = session->stage;
+	tier->converter.Reset(tier->wire_type, format.channels, m_dither);
+	tier->silent = false;
+	tier->flushed_frames = 0;
+	tier->flushed_pts_ns = 0;
+	tier->users = 1;
+	tier->needed = false;
+	tier->silencing = false;
+
+	m_tiers.push_back(std::move(tier));
+
+	return m_tiers.back().get();
+}
+
+void AudioStream::AttachSession(ClientSession* session)
+{
+	session->stage = AcquireRateStage(session->format.sample_rate, session->format.channels);
+	session->tier = AcquireEncodeTier(session);
+}
+
+void AudioStream::DetachSession(ClientSession* session)
+{
+	EncodeTier* tier = session->tier;
+
+	if (tier && --tier->users == 0) {
+		m_tiers.erase(std::find_if(m_tiers.begin(), m_tiers.end(),
+			[tier](const std::unique_ptr<EncodeTier>& t) { return t.get() == tier; }));
+	}
+
+	RateStage* stage = session->stage;
+
+	if (stage && --stage->users == 0) {
+		m_stages.erase(std::find_if(m_stages.begin(), m_stages.end(),
+			[stage](const std::unique_ptr<RateStage>& s) { return s.get() == stage; }));
+	}
+
+	session->tier = nullptr;
+	session->stage = nullptr;
+}
+
+void AudioStream::RemoveSession(ClientSession* session)
+{
+	DetachSession(session);
+
+	m_sessions.erase(std::find_if(m_sessions.begin(), m_sessions.end(),
+		[session](const std::unique_ptr<ClientSession>& s) { return s.get() == session; }));
+}
+
+void AudioStream::OnLinkReport(ClientSession* session, const CmdStreamPacket* report)
+{
+	int current = session->bitrate.GetRung();
+	int rung = session->bitrate.AddReport(MonotonicNowNs(), report->packets_received, report->packets_lost, report->jitter_us, report->rtt_us);
+
+	session->reported_lost += report->packets_lost;
+
+	// One switch at a time, the receiver has to confirm each
+	if (rung < 0 || session->pending_rung >= 0)
+		return;
+
+	session->pending_rung = rung;
+
+	// BitrateController names the congestion signal that stepped down
+	int reason = ABR_SWITCH_REASONS - 1;
+
+	if (rung > current) {
+		if (strcmp(session->bitrate.GetReason(), "loss") == 0)
+			reason = 0;
+		else if (strcmp(session->bitrate.GetReason(), "jitter") == 0)
+			reason = 1;
+		else
+			reason = 2;
+	}
+
+	session->abr_switches[reason]++;
+
+	LOG_INFO("(abr): session %u loss %.1f%% jitter %.1f ms rtt %.1f ms, %s %s -> %s\n", session->id,
+		session->bitrate.GetLoss() * 100, session->bitrate.GetJitterUs() / 1000.0, session->bitrate.GetRttUs() / 1000.0,
+		rung > current ? "stepping down on" : "stepping up after a clean", rung > current ? session->bitrate.GetReason() : "link",
+		GetFormatName(session->ladder[rung]).c_str());
+}
+
+void AudioStream::SwitchSessionFormat(ClientSession* session, int rung)
+{
+	const AudioFormatConfig& format = session->ladder[rung];
+	int previous_rate = session->format.sample_rate;
+
+	// Runs between two capture callbacks, so the next packet is the first
+	// of the new format and capture carries on untouched
+	DetachSession(session);
+
+	session->format = format;
+	session->wire_type = GetSampleType(format.audio_format, format.bits_per_sample, format.container_bits);
+	session->converter.Reset(session->wire_type, format.channels, m_dither);
+
+	// The session's own codecs, for drift compensation
+	if (format.audio_format == AUDIO_FORMAT_OPUS)
+		session->opus.Init(format.sample_rate, format.channels, format.bitrate, format.frame_ms);
+	else
+		session->opus.Close();
+
+	if (format.audio_format == AUDIO_FORMAT_LOSSLESS)
+		session->lossless.Init(format.sample_rate, format.channels, format.bits_per_sample, format.frame_ms, m_dither);
+	else
+		session->lossless.Close();
+
+	if (format.sample_rate != previous_rate) {
+		session->drift.Reset(format.sample_rate);
+		session->drift_resampler.Reset();
+		session->silence_frames = session->silence_frames * format.sample_rate / previous_rate;
+	}
+
+	AttachSession(session);
+
+	session->generation++;
+	session->pending_rung = -1;
+	session->bitrate.SetRung(MonotonicNowNs(), rung);
+
+	LOG_INFO("(abr): session %u switched to %s, format generation %u\n", session->id, GetFormatName(format).c_str(), session->generation);
+}
+
+bool AudioStream::RemoveExpiredSessions(int64_t now_ns)
+{
+	const int64_t timeout_ns = SESSION_TIMEOUT_S * 1000000000LL;
+
+	bool removed = false;
+
+	for (size_t i = 0; i < m_sessions.size();) {
+		ClientSession* session = m_sessions[i].get();
+
+		// Older receivers may never ping, they are only replaced
+		if (session->protocol_version >= 4 && now_ns - session->last_seen_ns > timeout_ns) {
+			LOG_WARNING("(cmd-thread): session %u timed out\n", session->id);
+			RemoveSession(session);
+			removed = true;
+		}
+		else {
+			i++;
+		}
+	}
+
+	return removed;
+}
+
+void AudioStream::UpdateCaptureState()
+{
+	std::lock_guard<std::mutex> state_lk(m_capture_state_mutex);
+
+	bool any_session;
+	bool any_playing = false;
+
+	{
+		std::lock_guard<std::mutex> lk(m_session_mutex);
+
+		any_session = !m_sessions.empty();
+
+		for (auto& session : m_sessions)
+			any_playing = any_playing || session->playing;
+
+		// Nothing is delivered while paused, the gap isn't a capture interval
+		if (!any_playing)
+			m_last_capture_ns = 0;
+	}
+
+	if (!any_session) {
+		if (m_capture_started) {
+			LOG_INFO("(audio): no sessions left, stopping capture\n");
+			m_capture->AsyncStopCapture();
+
+			#if defined(__linux__)
+			for (auto& capture : m_extra_captures)
+				capture->AsyncStopCapture();
+			#endif
+
+			m_capture_started = false;
+		}
+
+		return;
+	}
+
+	if (!m_capture_started) {
+		// Nothing queued from before the stop lines up with the new audio
+		m_mixer.Reset();
+
+		m_capture->AsyncStartCapture();
+
+		#if defined(__linux__)
+		for (auto& capture : m_extra_captures)
+			capture->AsyncStartCapture();
+		#endif
+
+		m_capture_started = true;
+	}
+
+	m_capture->SetPlaybackState(any_playing);
+
+	#if defined(__linux__)
+	for (auto& capture : m_extra_captures)
+		capture->SetPlaybackState(any_playing);
+	#endif
+}
+
+void AudioStream::CollectMetrics(MetricsWriter* writer)
+{
+	std::string labels = "stream=\"" + std::to_string(m_connection_receiver_socket_port) + "\"";
+
+	writer->AddHistogram("sas_capture_interval_seconds", "Time between capture callbacks", labels, m_metrics.capture_interval);
+	writer->AddHistogram("sas_convert_seconds", "Downmixing, resampling and encoding of one capture block", labels, m_metrics.convert);
+	writer->AddHistogram("sas_encrypt_seconds", "Encryption of one packet", labels, m_metrics.encrypt);
+	writer->AddHistogram("sas_queue_seconds", "Time from a packet being queued to its batch being sent", labels, m_metrics.queue);
+	writer->AddHistogram("sas_send_seconds", "Sending one batch of packets", labels, m_metrics.send);
+	writer->AddHistogram("sas_capture_latency_seconds", "Time audio waits in the capture buffers, sampled", labels, m_metrics.capture_latency);
+
+	writer->AddCounter("sas_packets", "Audio packets sent", labels, m_metrics.packets.Get());
+	writer->AddCounter("sas_bytes", "Audio packet bytes sent", labels, m_metrics.bytes.Get());
+	writer->AddCounter("sas_send_errors", "Failed audio packet sends", labels, m_metrics.send_errors.Get());
+	writer->AddCounter("sas_capture_holes", "Holes in the captured audio", labels, m_metrics.capture_holes.Get());
+	writer->AddCounter("sas_capture_overruns", "Capture buffer overruns", labels, m_metrics.capture_overruns.Get());
+	writer->AddCounter("sas_capture_retunes", "Capture buffer size changes after alerts", labels, m_metrics.capture_retunes.Get());
+
+	struct SessionMetrics
+	{
+		uint32_t id;
+		uint64_t packets;
+		uint64_t bytes;
+		uint64_t lost;
+		int rtt_us;
+		int jitter_us;
+		double loss;
+		int rung;
+		uint32_t generation;
+		uint64_t switches[ABR_SWITCH_REASONS] = {};
+	};
+
+	// Copied out so the capture thread waits for the copy only
+	std::vector<SessionMetrics> sessions;
+
+	{
+		std::lock_guard<std::mutex> lk(m_session_mutex);
+
+		for (auto& session : m_sessions) {
+			sessions.push_back({ session->id, session->sent_packets, session->sent_bytes, session->reported_lost,
+				session->bitrate.GetRttUs(), session->bitrate.GetJitterUs(), session->bitrate.GetLoss(),
+				session->bitrate.GetRung(), session->generation });
+
+			std::copy(std::begin(session->abr_switches), std::end(session->abr_switches), sessions.back().switches);
+		}
+	}
+
+	writer->AddGauge("sas_sessions", "Connected receivers", labels, (double)sessions.size());
+
+	for (auto& session : sessions) {
+		std::string session_labels = labels + ",session=\"" + std::to_string(session.id) + "\"";
+
+		writer->AddCounter("sas_session_packets", "Audio packets sent to the receiver", session_labels, session.packets);
+		writer->AddCounter("sas_session_bytes", "Audio packet bytes sent to the receiver", session_labels, session.bytes);
+		writer->AddCounter("sas_session_lost", "Packets the receiver reported lost", session_labels, session.lost);
+		writer->AddGauge("sas_session_loss_ratio", "Recent loss reported by the receiver", session_labels, session.loss);
+		writer->AddGauge("sas_session_rtt_seconds", "Round trip reported by the receiver", session_labels, session.rtt_us / 1e6);
+		writer->AddGauge("sas_session_jitter_seconds", "Interarrival jitter reported by the receiver", session_labels, session.jitter_us / 1e6);
+		writer->AddGauge("sas_session_rung", "Rung of the format ladder in use, 0 is the negotiated format", session_labels, session.rung);
+		writer->AddGauge("sas_session_format_generation", "Format changes confirmed by the receiver", session_labels, session.generation);
+
+		for (int i = 0; i < ABR_SWITCH_REASONS; i++) {
+			std::string switch_labels = session_labels + ",direction=\"" + (i == ABR_SWITCH_REASONS - 1 ? "up" : "down") +
+				"\",reason=\"" + ABR_SWITCH_REASON_NAMES[i] + "\"";
+
+			writer->AddCounter("sas_session_format_switches", "Format ladder steps announced to the receiver", switch_labels, session.switches[i]);
+		}
+	}
+}
+
+bool AudioStream::InitializeCapture()
+{
+	if (!m_capture->InitializeAudioDevice(m_capture_fmt))
+		return false;
+
+	#if defined(__linux__)
+	if (m_extra_captures.empty())
+		return true;
+
+	int channels = m_capture->GetChannels();
+	int sample_rate = m_capture->GetSamplerate();
+
+	// The server converts the other sources to the first one's format
+	std::string source_fmt = "float 32 " + std::to_string(sample_rate) + " " + std::to_string(channels);
+
+	for (size_t i = 0; i < m_extra_captures.size(); i++) {
+		if (!m_extra_captures[i]->InitializeAudioDevice(source_fmt))
+			LOG_WARNING("(warning-audio): failed to open mixed source '%s', it stays silent\n", m_sources[i + 1].device.c_str());
+	}
+
+	if (m_mixer.GetChannels() != channels || m_mixer.GetSampleRate() != sample_rate) {
+		m_mixer.Init((int)m_sources.size(), channels, sample_rate, MIX_MAX_LATENCY_MS);
+
+		LOG_INFO("(audio): mixing %zu sources at %d Hz %s, up to %d ms added latency\n", m_sources.size(), sample_rate,
+			GetChannelLayoutName(channels).c_str(), MIX_MAX_LATENCY_MS);
+	}
+	#endif
+
+	return true;
+}
+
+void AudioStream::GetSessionSettings(const ClientSession* session, StreamSettings* settings) const
+{
+	int capture_rate = m_capture->GetSamplerate();
+
+	settings->audio_format = session->format.audio_format;
+	settings->bits_per_sample = session->format.bits_per_sample;
+	settings->container_bits = session->format.container_bits;
+	settings->n_channels = session->format.channels;
+	settings->sample_rate = session->format.sample_rate;
+	settings->cmd_port = m_cmd_socket_port;
+	settings->protocol_version = session->protocol_version;
+	settings->session_id = (int)session->id;
+
+	// Capture period in frames of the session's rate
+	settings->engine_period = capture_rate ? (int)((int64_t)m_capture->GetEnginePeriod() * session->format.sample_rate / capture_rate) : 0;
+
+	if (session->format.audio_format == AUDIO_FORMAT_OPUS) {
+		settings->engine_period = session->opus.GetFrameSize();
+		settings->codec_bitrate = session->opus.GetBitrate();
+	}
+	else if (session->format.audio_format == AUDIO_FORMAT_LOSSLESS) {
+		settings->engine_period = session->lossless.GetFrameSize();
+	}
+}
+
+void AudioStream::t_cmd_receiver()
+{
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "sas-cmd-%u", m_connection_receiver_socket_port);
+
+	SetThreadName(thread_name);
+	SetThreadAffinity(GetRealtimeConfig().network_cpus);
+	TRACE_THREAD("cmd");
+
+	AESWrapper local_aes_wrapper;
+	local_aes_wrapper.GenerateKey(m_password);
+
+	byte local_buffer[8192] = { 0 };
+
+	// Wake up now and then to drop receivers that went away silently
+	#if defined(_WIN32)
+	DWORD recv_timeout = 5000;
+	#elif defined(__linux__)
+	timeval recv_timeout = { 5, 0 };
+	#endif
+
+	setsockopt(m_cmd_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&recv_timeout, sizeof(recv_timeout));
+
+	while (true) {
+		sockaddr_in remote_sockaddr{};
+		socklen_t remote_addrlen = sizeof(remote_sockaddr);
+
+		int recv_bytes = recvfrom(m_cmd_socket, (char*)local_buffer, 8192, 0, reinterpret_cast<sockaddr*>(&remote_sockaddr), &remote_addrlen);
+
+		TRACE_SCOPE("cmd");
+
+		#if defined(_WIN32)
+		bool timed_out = recv_bytes < 0 && WSAGetLastError() == WSAETIMEDOUT;
+		#elif defined(__linux__)
+		bool timed_out = recv_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+		#endif
+
+		bool expired;
+
+		{
+			std::lock_guard<std::mutex> lk(m_session_mutex);
+			expired = RemoveExpiredSessions(MonotonicNowNs());
+		}
+
+		if (expired)
+			UpdateCaptureState();
+
+		if (timed_out)
+			continue;
+
+		if (recv_bytes <= 0) {
+			#if defined(_WIN32)
+			LOG_WARNING("(cmd-thread): recvfrom failed with error: %d\n", WSAGetLastError());
+			#elif defined(__linux__)
+			LOG_WARNING("(cmd-thread): recvfrom failed with error: %s(errno: %d)\n", strerror(errno), errno);
+			#endif
+			break;
+		}
+
+		auto enc_data = reinterpret_cast<EncryptedData*>(local_buffer);
+
+		local_aes_wrapper.SetIv(enc_data->iv, 16);
+		int ret = local_aes_wrapper.Decrypt(&local_buffer[16], recv_bytes - 16, &local_buffer[16]);
+
+		if (ret <= 0) {
+			LOG_WARNING("(cmd-thread): invalid command packet\n");
+			continue;
+		}
+
+		// Older receivers only send the cmd field
+		if (ret < (int)sizeof(CmdStreamPacket))
+			memset(&local_buffer[16 + ret], 0, sizeof(CmdStreamPacket) - ret);
+
+		auto cmd_pkt = reinterpret_cast<CmdStreamPacket*>(&local_buffer[16]);
+
+		bool state_changed = false;
+
+		{
+			std::lock_guard<std::mutex> lk(m_session_mutex);
+
+			ClientSession* session = FindSession(remote_sockaddr, cmd_pkt->session_id);
+			bool known = session != nullptr;
+
+			if (session) {
+				session->last_seen_ns = MonotonicNowNs();
+
+				// The receiver knows the announced format, use it from the
+				// next packet on
+				if (session->pending_rung >= 0 && cmd_pkt->format_generation == session->generation + 1)
+					SwitchSessionFormat(session, session->pending_rung);
+
+				switch (cmd_pkt->cmd) 
+				{
+					case 0: 
+						// Nothind to do
+						// Ping command
+						break;
+					case 1:
+						LOG_INFO("(cmd-thread): session %u playing\n", session->id);
+						session->playing = true;
+						state_changed = true;
+						break;
+					case 2:
+						LOG_INFO("(cmd-thread): session %u paused\n", session->id);
+						session->playing = false;
+						state_changed = true;
+						break;
+					case 3:
+						LOG_INFO("(cmd-thread): session %u stopped\n", session->id);
+						RemoveSession(session);
+						state_changed = true;
+						break;
+					case 4:
+						session->drift.AddReport(MonotonicNowNs(), cmd_pkt->buffer_frames);
+
+						// Its audio is resampled for its clock from now on
+						if (!session->drift_active)
+							LOG_INFO("(cmd-thread): session %u compensates drift, encoding its own audio\n", session->id);
+
+						session->drift_active = true;
+						break;
+					case 5:
+						OnLinkReport(session, cmd_pkt);
+						break;
+				}
+
+				// Removed by cmd 3 otherwise
+				session = FindSession(remote_sockaddr, cmd_pkt->session_id);
+			}
+
+			// Protocol 7 replies carry the format to use next
+			if (session && session->protocol_version >= 7) {
+				bool pending = session->pending_rung >= 0;
+				const AudioFormatConfig& format = pending ? session->ladder[session->pending_rung] : session->format;
+
+				cmd_pkt->format_generation = pending ? session->generation + 1 : session->generation;
+				cmd_pkt->audio_format = format.audio_format;
+				cmd_pkt->bits_per_sample = format.bits_per_sample;
+				cmd_pkt->container_bits = format.container_bits;
+				cmd_pkt->sample_rate = format.sample_rate;
+				cmd_pkt->n_channels = format.channels;
+				cmd_pkt->codec_bitrate = format.audio_format == AUDIO_FORMAT_OPUS ? format.bitrate : 0;
+			}
+
+			if (!known && cmd_pkt->cmd != 0) {
+				LOG_WARNING("(cmd-thread): cmd %d for unknown session %u\n", cmd_pkt->cmd, cmd_pkt->session_id);
+			}
+		}
+
+		if (state_changed)
+			UpdateCaptureState();
+
+		cmd_pkt->server_time_ns = MonotonicNowNs();
+
+		m_random_gen.Generate(enc_data->iv, 16);
+		local_aes_wrapper.SetIv(enc_data->iv, 16);
+
+		uint8_t* data_ptr = (uint8_t*)(&enc_data->data);
+
+		int data_size = local_aes_wrapper.Encrypt(reinterpret_cast<const byte*>(&local_buffer[16]), sizeof(CmdStreamPacket), data_ptr);
+		int data_total_size = 16 + data_size;
+
+		ret = sendto(m_cmd_socket, (const char*)local_buffer, data_total_size, 0, (sockaddr*)&remote_sockaddr, remote_addrlen);
+		if (ret < 0) {
+			#if defined(_WIN32)
+			LOG_WARNING("(cmd-thread): sendto failed with error: %d\n", WSAGetLastError());
+			#elif defined(__linux__)
+			LOG_WARNING("(cmd-thread): sendto failed with error: %s(errno: %d)\n", strerror(errno), errno);
+			#endif
+
+			// The receiver is unreachable, stop sending it audio
+			{
+				std::lock_guard<std::mutex> lk(m_session_mutex);
+
+				ClientSession* session = FindSession(remote_sockaddr, cmd_pkt->session_id);
+
+				if (session)
+					RemoveSession(session);
+			}
+
+			UpdateCaptureState();
+		}
+	}
+
+	#if defined(_WIN32)
+	closesocket(m_cmd_socket);
+	#elif defined(__linux__)
+	close(m_cmd_socket);
+	#endif
+}
+
+void AudioStream::t_connection_receiver()
+{
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "sas-conn-%u", m_connection_receiver_socket_port);
+
+	SetThreadName(thread_name);
+	SetThreadAffinity(GetRealtimeConfig().network_cpus);
+	TRACE_THREAD("connection");
+
+	// The capture thread encrypts with m_aes_wrapper
+	AESWrapper local_aes_wrapper;
+	local_aes_wrapper.GenerateKey(m_password);
+
+	byte local_buffer[8192] = { 0 };
+
+	LOG_INFO("(cr-thread): waiting for Android app to connect...\n");
+
+	while (true) {
+		sockaddr_in remote_sockaddr{};
+		socklen_t remote_sockaddr_size = sizeof(remote_sockaddr);
+
+		int recv_bytes = recvfrom(m_connection_receiver_socket, (char*)local_buffer, 8192, 0, reinterpret_cast<sockaddr*>(&remote_sockaddr), &remote_sockaddr_size);
+
+		TRACE_SCOPE("hello");
+
+		if (recv_bytes <= 0) {
+			#if defined(_WIN32)
+			LOG_WARNING("(cr-thread): recvfrom failed with error: %d\n", WSAGetLastError());
+			#elif defined(__linux__)
+			LOG_WARNING("(cr-thread): recvfrom failed with error: %s(errno: %d)\n", strerror(errno), errno);
+			#endif
+			break;
+		}
+
+		int64_t hello_time_ns = MonotonicNowNs();
+
+		in_addr remote_address = remote_sockaddr.sin_addr;
+
+		char remote_sockaddr_name[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &remote_address, remote_sockaddr_name, INET_ADDRSTRLEN);
+
+		auto enc_data = reinterpret_cast<EncryptedData*>(local_buffer);
+
+		local_aes_wrapper.SetIv(enc_data->iv, 16);
+		recv_bytes = local_aes_wrapper.Decrypt(&local_buffer[16], recv_bytes - 16, &local_buffer[16]);
+
+		if (recv_bytes <= 0) {
+			LOG_ERROR("(err-cr-thread): aes decrypt failed\n");
+			continue;
+		}
+
+		// Older receivers send a shorter StreamSettings
+		if (recv_bytes < (int)sizeof(StreamSettings))
+			memset(&local_buffer[16 + recv_bytes], 0, sizeof(StreamSettings) - recv_bytes);
+
+		auto recv_data = reinterpret_cast<StreamSettings*>(&local_buffer[16]);
+		u_short remote_port = recv_data->android_port;
+		int protocol_version = std::min(std::max(recv_data->protocol_version, 0), AUDIO_PROTOCOL_VERSION);
+
+		sockaddr_in audio_addr = remote_sockaddr;
+		audio_addr.sin_port = htons(remote_port);
+
+		StreamSettings st_settings{};
+		std::unique_ptr<ClientSession> new_session;
+
+		{
+			std::lock_guard<std::mutex> lk(m_session_mutex);
+
+			// A retrying client sends the same hello again, answer it without
+			// restarting the audio it may already be playing
+			for (auto& session : m_sessions) {
+				if (session->addr.sin_addr.s_addr == audio_addr.sin_addr.s_addr && session->addr.sin_port == audio_addr.sin_port) {
+					session->last_seen_ns = hello_time_ns;
+					GetSessionSettings(session.get(), &st_settings);
+					break;
+				}
+			}
+
+			// A hello replacing an older receiver's session always fits
+			if (!st_settings.session_id && m_sessions.size() >= MAX_CLIENT_SESSIONS && !FindSession(remote_sockaddr, 0)) {
+				LOG_WARNING("(cr-thread): %d sessions already, ignoring %s:%u\n", MAX_CLIENT_SESSIONS, remote_sockaddr_name, remote_port);
+				continue;
+			}
+		}
+
+		bool same_session = st_settings.session_id != 0;
+
+		if (!same_session) {
+			bool initialized = InitializeCapture();
+
+			if (!initialized) {
+				LOG_ERROR("(err-cr-thread): failed to initialize audio device\n");
+				continue;
+			}
+
+			AudioFormatConfig format = NegotiateFormat(recv_data, protocol_version);
+			int channels = format.channels;
+
+			new_session = std::make_unique<ClientSession>();
+			ClientSession* session = new_session.get();
+
+			if (format.audio_format == AUDIO_FORMAT_OPUS &&
+				!session->opus.Init(format.sample_rate, channels, format.bitrate, format.frame_ms)) {
+				format.audio_format = AUDIO_FORMAT_PCM;
+				format.bits_per_sample = 16;
+			}
+
+			// A frame has to fit one encrypted datagram
+			if (format.audio_format == AUDIO_FORMAT_LOSSLESS &&
+				(!session->lossless.Init(format.sample_rate, channels, format.bits_per_sample, format.frame_ms, m_dither) ||
+				 session->lossless.GetMaxFrameBytes() > PACKET_MAX_PAYLOAD)) {
+				LOG_WARNING("(cr-thread): lossless frame does not fit a packet, using pcm %d\n", format.bits_per_sample);
+				format.audio_format = AUDIO_FORMAT_PCM;
+			}
+
+			if (format.audio_format != AUDIO_FORMAT_LOSSLESS)
+				session->lossless.Close();
+
+			session->protocol_version = protocol_version;
+			session->addr = audio_addr;
+			session->playing = false;
+			session->last_seen_ns = hello_time_ns;
+			session->format = format;
+			session->wire_type = GetSampleType(format.audio_format, format.bits_per_sample, format.container_bits);
+			session->converter.Reset(session->wire_type, channels, m_dither);
+			session->sequence = 0;
+			session->stage = nullptr;
+			session->tier = nullptr;
+			session->ladder = protocol_version >= 7 ? BuildFormatLadder(format, OpusCodec::IsAvailable()) : std::vector<AudioFormatConfig>{ format };
+			session->bitrate.Reset((int)session->ladder.size());
+			session->generation = 0;
+			session->pending_rung = -1;
+			std::fill(std::begin(session->abr_switches), std::end(session->abr_switches), 0);
+			session->drift.Reset(format.sample_rate);
+			session->drift_active = false;
+			session->hello_time_ns = hello_time_ns;
+			session->silence_active = false;
+			session->silence_frames = 0;
+			session->silence_pts_ns = 0;
+			session->audio_bytes = 0;
+			session->audio_frames = 0;
+			session->sent_packets = 0;
+			session->sent_bytes = 0;
+			session->reported_lost = 0;
+
+			std::lock_guard<std::mutex> lk(m_session_mutex);
+
+			session->id = m_next_session_id++;
+			GetSessionSettings(session, &st_settings);
+		}
+
+		// Sending audio data settings to Android side
+		EncryptedData* enc_metadata = reinterpret_cast<EncryptedData*>(local_buffer);
+
+		m_random_gen.Generate(enc_metadata->iv, 16);
+		local_aes_wrapper.SetIv(enc_metadata->iv, 16);
+
+		byte* data_ptr = (byte*)(&enc_metadata->data);
+
+		int dataSize = local_aes_wrapper.Encrypt(reinterpret_cast<const byte*>(&st_settings), sizeof(st_settings), data_ptr);
+		int dataTotalSize = 16 + dataSize;
+
+		int ret = sendto(m_connection_receiver_socket, (const char*)local_buffer, dataTotalSize, 0, (sockaddr*)&remote_sockaddr, remote_sockaddr_size);
+		if (ret < 0) {
+			#if defined(_WIN32)
+			LOG_WARNING("(cr-thread): sendto failed with error: %d\n", WSAGetLastError());
+			#elif defined(__linux__)
+			LOG_WARNING("(cr-thread): sendto failed with error: %s(errno: %d)\n", strerror(errno), errno);
+			#endif
+			return;
+		}
+
+		if (same_session) {
+			LOG_INFO("(cr-thread): repeated hello from %s:%u, keeping session %d\n", remote_sockaddr_name, remote_port, st_settings.session_id);
+			continue;
+		}
+
+		uint32_t session_id = new_session->id;
+		int sample_rate = new_session->format.sample_rate;
+		int channels = new_session->format.channels;
+
+		{
+			std::lock_guard<std::mutex> lk(m_session_mutex);
+
+			// A receiver that can't name its session only ever has one
+			ClientSession* previous;
+
+			while ((previous = FindSession(remote_sockaddr, 0)) != nullptr) {
+				LOG_INFO("(cr-thread): session %u replaced by %u\n", previous->id, session_id);
+				RemoveSession(previous);
+			}
+
+			AttachSession(new_session.get());
+			m_sessions.push_back(std::move(new_session));
+
+			LOG_INFO("(cr-thread): %zu sessions share %zu encode tiers\n", m_sessions.size(), m_tiers.size());
+		}
+
+		UpdateCaptureState();
+
+		LOG_INFO("(cr-thread): session %u sending audio samples to %s:%u at %d Hz %s (capture %d Hz %s)\n",
+			session_id, remote_sockaddr_name, remote_port, sample_rate, GetChannelLayoutName(channels).c_str(),
+			m_capture->GetSamplerate(), GetChannelLayoutName(m_capture->GetChannels()).c_str());
+		LOG_INFO("(cr-thread): session ready %.2f ms after hello\n", (MonotonicNowNs() - hello_time_ns) / 1e6);
+	}
+
+	#if defined(_WIN32)
+	closesocket(m_connection_receiver_socket);
+	#elif defined(__linux__)
+	close(m_connection_receiver_socket);
+	#endif
+}
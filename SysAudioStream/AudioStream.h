@@ -3,65 +3,325 @@
 #include <thread>
 #include <cstdint>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
 #include "pch.h"
 
 #include "PulseAudioCapture.h"
+#include "SyntheticCapture.h"
 #include "WASAPICapture.h"
 
 #include "AESWrapper.h"
+#include "Log.h"
 #include "RandomGenerator.h"
+#include "Realtime.h"
+#include "DriftCompensator.h"
+#include "SampleFormat.h"
+#include "AudioPacket.h"
+#include "Clock.h"
+#include "OpusCodec.h"
+#include "LosslessCodec.h"
+#include "Resampler.h"
+#include "ChannelMixer.h"
+#include "SilenceDetector.h"
+#include "SourceMixer.h"
+#include "PacketPool.h"
+#include "BitrateController.h"
+#include "Metrics.h"
+#include "Trace.h"
+
+#include <mutex>
 
 #ifdef __linux__
 typedef int SOCKET;
 #endif
 
-struct EncryptedData 
-{
-	uint8_t iv[16];
-	uint8_t* data;
-};
+// Why a session changed rungs: three ways down, and up after a clean link
+#define ABR_SWITCH_REASONS 4
 
-struct StreamSettings 
+// Audio format line from config.ini:
+// pcm <16|24|24in32|32> <rate>, float 32 <rate>, opus <kbit/s> <rate> [frame ms]
+// or lossless <16|24> <rate> [frame ms]
+struct AudioFormatConfig
 {
-	int android_port;
-
 	int audio_format;
 	int bits_per_sample;
-	int n_channels;
+	int container_bits;
+	int sample_rate;
+
+	// Per session, the capture downmixed to this many
+	int channels;
+
+	// Opus only
+	int bitrate;
+
+	// Opus and lossless
+	double frame_ms;
+};
+
+// Capture downmixed and resampled for one client rate and channel count,
+// computed once per capture callback and shared by every session using it
+struct RateStage
+{
 	int sample_rate;
-	int engine_period;
-	int cmd_port;
+	int channels;
+
+	ChannelMixer mixer;
+	std::vector<float> mix_buffer;
+
+	Resampler resampler;
+	std::vector<float> buffer;
+
+	// Output of the current callback
+	const float* samples;
+	size_t frames;
+	int64_t pts_ns;
+
+	int users;
+
+	// Some playing session needs audio from this callback, a stage whose
+	// sessions all get silence packets is skipped
+	bool needed;
+};
+
+// Wire format produced once per capture callback from a RateStage and
+// shared by every session with that format: the payloads are converted or
+// encoded once and only wrapped and encrypted per session
+struct EncodeTier
+{
+	AudioFormatConfig format;
+	SampleType wire_type;
+
+	// Sessions are protocol 6 and get silence packets together
+	bool dtx;
+
+	RateStage* stage;
+
+	SampleConverter converter;
+	OpusCodec opus;
+	LosslessCodec lossless;
+
+	// Payloads of the current callback, each one packet
+	struct Payload
+	{
+		size_t offset;
+		size_t size;
+		uint32_t frames;
+		int64_t pts_ns;
+	};
+
+	std::vector<uint8_t> payload_buffer;
+	std::vector<Payload> payloads;
+
+	// Audio queued in the codec when the tier went silent, handed to each
+	// session's silence count
+	bool silent;
+	size_t flushed_frames;
+	int64_t flushed_pts_ns;
+
+	int users;
+	bool needed;
+
+	// A playing session of the tier gets silence packets this callback
+	bool silencing;
+};
+
+// One receiver. Created by the connection thread, used by the capture
+// thread and removed by the cmd thread, all under m_session_mutex.
+struct ClientSession
+{
+	uint32_t id;
+	int protocol_version;
+
+	// Audio destination, the receiver's address with its android_port
+	sockaddr_in addr;
+
+	bool playing;
+	int64_t last_seen_ns;
+
+	AudioFormatConfig format;
+	SampleType wire_type;
+	uint32_t sequence;
+
+	RateStage* stage;
+	EncodeTier* tier;
+
+	// The session's own coding, used instead of the tier's once drift
+	// compensation resamples its audio
+	SampleConverter converter;
+	OpusCodec opus;
+	LosslessCodec lossless;
+
+	// Receiver clock drift compensation, active once the receiver sends
+	// buffer level reports
+	DriftEstimator drift;
+	AdaptiveResampler drift_resampler;
+	bool drift_active;
+	std::vector<float> drift_buffer;
+
+	// steady_clock time of the hello that started the session, cleared
+	// when its first audio packet goes out
+	int64_t hello_time_ns;
+
+	// Silence not yet reported to the receiver, in frames of its rate
+	bool silence_active;
+	double silence_frames;
+	int64_t silence_pts_ns;
+
+	// Adaptive format, protocol 7. ladder[0] is the negotiated format.
+	std::vector<AudioFormatConfig> ladder;
+	BitrateController bitrate;
+	uint32_t generation;
+
+	// Rung announced to the receiver and not acknowledged yet, -1 if none
+	int pending_rung;
+
+	// Rung changes announced since the hello, by reason
+	uint64_t abr_switches[ABR_SWITCH_REASONS];
+
+	// Wire bytes and frames of audio packets, to estimate what DTX saves
+	uint64_t audio_bytes;
+	uint64_t audio_frames;
+
+	// Since the hello, for the metrics endpoint
+	uint64_t sent_packets;
+	uint64_t sent_bytes;
+	uint64_t reported_lost;
 };
 
-struct CmdStreamPacket 
+// One capture device of a mixed stream, device empty for the default
+struct CaptureSource
 {
-	// cmd = 0 (measure latency)
-	// cmd = 1 (play stream)
-	// cmd = 2 (pause stream)
-	// cmd = 3 (stop stream)
-	int cmd;
+	std::string device;
+	double gain_db;
 };
 
 class AudioStream
 {
 public:
-	AudioStream(std::string password, int conn_socket_port, std::string audio_fmt);
+	AudioStream(std::string password, int conn_socket_port, std::string audio_fmt, std::string device_name = "");
 	~AudioStream();
 
 	bool Init();
 
+	// Dither applied when reducing capture floats to 16 or 24 bits, set
+	// before Init
+	void SetDither(DitherType dither);
+
+	// Filter used for clients at another rate than the capture, set before
+	// Init
+	void SetResamplerQuality(ResamplerQuality quality);
+
+	// Silence packets instead of audio for protocol 6 receivers while the
+	// capture is silent, see SilenceDetector. Set before Init.
+	void SetDtx(bool enabled, double threshold_dbfs, int hold_ms);
+
+	// Devices mixed into this stream instead of the one given to the
+	// constructor, the first one sets the rate and clock. PulseAudio only,
+	// set before Init.
+	void SetSources(const std::vector<CaptureSource>& sources);
+
+	// Formats offered besides the configured one. Hellos asking for others
+	// get the closest of them, so encoding work is bounded by the number
+	// of tiers however many receivers there are. Set before Init.
+	void SetTiers(const std::vector<AudioFormatConfig>& tiers);
+
+	static bool ParseAudioFormat(const std::string& audio_fmt, AudioFormatConfig* format);
+
 private:
 	void t_cmd_receiver();
 	void t_connection_receiver();
 
+	AudioFormatConfig NegotiateFormat(const StreamSettings* hello, int protocol_version) const;
+
+	// Closest configured tier the receiver can decode, format if none
+	AudioFormatConfig SnapToTier(const AudioFormatConfig& format, int protocol_version) const;
+
+	// Capture thread, runs with m_session_mutex held
+	int OnAudioCaptured(uint32_t audio_size, uint8_t* audio_samples, int64_t pts_ns);
+	void SendSessionAudio(ClientSession* session, const float* samples, size_t frames, int64_t pts_ns);
+	void EncodeTierAudio(EncodeTier* tier);
+	void SendTierAudio(ClientSession* session, const EncodeTier* tier);
+
+	// capture_frames of silence at the capture rate, reported to the
+	// receiver at least every DTX_KEEPALIVE_MS
+	void SendSilence(ClientSession* session, size_t capture_frames, int capture_rate, int64_t pts_ns);
+	void SendSilencePacket(ClientSession* session);
+	void EndSilence(ClientSession* session);
+	void ReportDtx(int64_t now_ns, size_t capture_frames, bool silent);
+
+	// Encrypts the payload_size bytes at PacketPool::GetPayload(buffer) in
+	// place and queues the datagram, returns its size
+	int SendAudioPacket(ClientSession* session, PacketBuffer* buffer, size_t payload_size, uint32_t frames, int64_t pts_ns);
+
+	// A free packet buffer, sending the queued ones first if there is none
+	PacketBuffer* AcquirePacket();
+
+	// Sends the queued packets, with one sendmmsg call on Linux
+	void FlushPackets();
+
+	// With m_session_mutex held
+	ClientSession* FindSession(const sockaddr_in& addr, uint32_t session_id);
+	RateStage* AcquireRateStage(int sample_rate, int channels);
+	EncodeTier* AcquireEncodeTier(const ClientSession* session);
+
+	// Gets the stage and tier for session->format, or gives them up
+	void AttachSession(ClientSession* session);
+	void DetachSession(ClientSession* session);
+
+	// Link report of a protocol 7 receiver, may announce another rung
+	void OnLinkReport(ClientSession* session, const CmdStreamPacket* report);
+
+	// Moves the session to rung once its receiver knows the format
+	void SwitchSessionFormat(ClientSession* session, int rung);
+	void RemoveSession(ClientSession* session);
+	bool RemoveExpiredSessions(int64_t now_ns);
+	void GetSessionSettings(const ClientSession* session, StreamSettings* settings) const;
+
+	// Opens every capture device, the mixed sources at the rate and
+	// channels of the first one
+	bool InitializeCapture();
+
+	// Starts, pauses or stops capture to match the sessions, takes
+	// m_session_mutex itself so the capture callback can't deadlock on it
+	void UpdateCaptureState();
+
+	// Metrics endpoint collector, runs on its thread
+	void CollectMetrics(MetricsWriter* writer);
+
 	AESWrapper m_aes_wrapper;
 
 	std::string m_password;
 	std::string m_audio_fmt;
+	std::string m_device_name;
+
+	AudioFormatConfig m_format_config;
+	std::vector<AudioFormatConfig> m_tier_formats;
+	std::string m_capture_fmt;
+	DitherType m_dither;
+	ResamplerQuality m_resampler_quality;
+
+	bool m_dtx_enabled;
+	double m_dtx_threshold_dbfs;
+	int m_dtx_hold_ms;
+
+	// Capture thread
+	SilenceDetector m_silence;
+	int m_silence_rate;
+
+	// DTX effect since the last report
+	int64_t m_dtx_stat_frames;
+	int64_t m_dtx_stat_silent_frames;
+	int64_t m_dtx_stat_packets;
+	int64_t m_dtx_stat_saved_bytes;
+	int64_t m_dtx_stat_start_ns;
 
 	SOCKET m_cmd_socket;
 	u_short m_cmd_socket_port;
 
+	// Unconnected, every packet is addressed to its session
 	SOCKET m_send_audio_socket;
 
 	SOCKET m_connection_receiver_socket;
@@ -72,11 +332,37 @@ private:
 
 	RandomGenerator m_random_gen;
 
+	std::mutex m_session_mutex;
+	std::vector<std::unique_ptr<ClientSession>> m_sessions;
+	std::vector<std::unique_ptr<RateStage>> m_stages;
+	std::vector<std::unique_ptr<EncodeTier>> m_tiers;
+	uint32_t m_next_session_id;
+
+	// Serializes UpdateCaptureState, whether AsyncStartCapture has run
+	std::mutex m_capture_state_mutex;
+	bool m_capture_started;
+
+	// Capture thread. Packets of a capture block are built in pooled
+	// buffers and go out together at its end.
+	PacketPool m_packet_pool;
+	PacketBuffer* m_pending_packets[PACKET_POOL_SIZE];
+	size_t m_pending_count;
+
+	// Recorded on the capture thread and by the capture backends, read by
+	// the metrics endpoint
+	StreamMetrics m_metrics;
+	int64_t m_last_capture_ns;
+	int64_t m_last_capture_block_ns;
+
 	#ifdef _WIN32
 	winrt::com_ptr<winrt::SDKTemplate::WASAPICapture> m_capture;
 	#elif defined(__linux__)
-	std::unique_ptr<PulseAudioCapture> m_capture;
+	std::unique_ptr<AudioCapture> m_capture;
+
+	// Sources after the first, mixed into m_capture's audio by m_mixer
+	std::vector<std::unique_ptr<AudioCapture>> m_extra_captures;
 	#endif
 
-	byte m_audio_streaming_buffer[65536] = { 0 };
+	std::vector<CaptureSource> m_sources;
+	SourceMixer m_mixer;
 };
\ No newline at end of file
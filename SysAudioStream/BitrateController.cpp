@@ -0,0 +1,223 @@
+#include "BitrateController.h"
+
+#include <algorithm>
+
+#include "AudioStream.h"
+
+// Link state that counts as congested
+#define CONGESTED_LOSS 0.02
+#define CONGESTED_JITTER_US 40000
+#define CONGESTED_QUEUE_US 50000
+
+// Below this loss a report is clean
+#define CLEAN_LOSS 0.005
+
+// A switch gets this long to take effect before the next step down
+#define SWITCH_SETTLE_NS 2000000000LL
+
+// Clean time before stepping up, doubled up to the maximum whenever an up
+// step is followed by a step down within the minimum
+#define MIN_HOLD_NS 10000000000LL
+#define MAX_HOLD_NS 120000000000LL
+
+std::vector<AudioFormatConfig> BuildFormatLadder(const AudioFormatConfig& start, bool opus_available)
+{
+	std::vector<AudioFormatConfig> ladder = { start };
+
+	AudioFormatConfig format = start;
+
+	if (start.audio_format != AUDIO_FORMAT_OPUS) {
+		// Lossless stays lossless, it is already smaller than pcm
+		if (format.bits_per_sample > 16 || format.audio_format == AUDIO_FORMAT_FLOAT) {
+			if (format.audio_format == AUDIO_FORMAT_FLOAT)
+				format.audio_format = AUDIO_FORMAT_PCM;
+
+			format.bits_per_sample = 16;
+			format.container_bits = 0;
+
+			ladder.push_back(format);
+		}
+
+		for (int rate : { 48000, 32000 }) {
+			if (format.sample_rate <= rate)
+				continue;
+
+			if (format.audio_format == AUDIO_FORMAT_LOSSLESS &&
+				!LosslessCodec::IsValidConfig(format.bits_per_sample, rate, format.frame_ms))
+				continue;
+
+			format.sample_rate = rate;
+			ladder.push_back(format);
+		}
+	}
+
+	if (!opus_available)
+		return ladder;
+
+	AudioFormatConfig opus = format;
+
+	opus.audio_format = AUDIO_FORMAT_OPUS;
+	opus.bits_per_sample = 16;
+	opus.container_bits = 0;
+	opus.sample_rate = 48000;
+	opus.channels = std::min(format.channels, 2);
+
+	if (start.audio_format != AUDIO_FORMAT_OPUS)
+		opus.frame_ms = 10;
+
+	for (int bitrate : { 128000, 96000, 64000, 48000, 32000 }) {
+		if (start.audio_format == AUDIO_FORMAT_OPUS && bitrate >= start.bitrate)
+			continue;
+
+		opus.bitrate = bitrate;
+		ladder.push_back(opus);
+	}
+
+	return ladder;
+}
+
+std::string GetFormatName(const AudioFormatConfig& format)
+{
+	std::string name;
+
+	switch (format.audio_format)
+	{
+		case AUDIO_FORMAT_PCM:
+			name = "pcm " + std::to_string(format.bits_per_sample) + (format.container_bits == 32 ? "in32" : "");
+			break;
+
+		case AUDIO_FORMAT_FLOAT:
+			name = "float 32";
+			break;
+
+		case AUDIO_FORMAT_OPUS:
+			name = "opus " + std::to_string(format.bitrate / 1000) + "k";
+			break;
+
+		case AUDIO_FORMAT_LOSSLESS:
+			name = "lossless " + std::to_string(format.bits_per_sample);
+			break;
+	}
+
+	return name + " " + std::to_string(format.sample_rate) + " " + GetChannelLayoutName(format.channels);
+}
+
+BitrateController::BitrateController()
+{
+	Reset(1);
+}
+
+void BitrateController::Reset(int rungs)
+{
+	m_rungs = rungs;
+	m_rung = 0;
+
+	m_loss = 0;
+	m_jitter_us = 0;
+	m_rtt_us = 0;
+	m_min_rtt_us = 0;
+
+	m_switch_ns = 0;
+	m_clean_since_ns = 0;
+	m_last_up = false;
+
+	m_hold_ns = MIN_HOLD_NS;
+
+	m_reason = "";
+}
+
+int BitrateController::AddReport(int64_t now_ns, uint32_t received, uint32_t lost, int jitter_us, int rtt_us)
+{
+	uint32_t total = received + lost;
+
+	if (total)
+		m_loss = 0.7 * m_loss + 0.3 * ((double)lost / total);
+
+	m_jitter_us = 0.7 * m_jitter_us + 0.3 * std::max(jitter_us, 0);
+
+	// Queueing delay shows as round trips above the quietest one seen
+	if (rtt_us > 0) {
+		m_rtt_us = rtt_us;
+
+		if (!m_min_rtt_us || rtt_us < m_min_rtt_us)
+			m_min_rtt_us = rtt_us;
+	}
+
+	m_reason = nullptr;
+
+	if (m_loss > CONGESTED_LOSS)
+		m_reason = "loss";
+	else if (m_jitter_us > CONGESTED_JITTER_US)
+		m_reason = "jitter";
+	else if (m_min_rtt_us && m_rtt_us > 2 * m_min_rtt_us + CONGESTED_QUEUE_US)
+		m_reason = "queueing delay";
+
+	if (m_reason) {
+		m_clean_since_ns = 0;
+
+		if (m_rung + 1 >= m_rungs || now_ns - m_switch_ns < SWITCH_SETTLE_NS)
+			return -1;
+
+		// Taking back an up step soon after means the link can't carry it
+		if (m_last_up && now_ns - m_switch_ns < MIN_HOLD_NS)
+			m_hold_ns = std::min<int64_t>(m_hold_ns * 2, MAX_HOLD_NS);
+
+		return m_rung + 1;
+	}
+
+	m_reason = "";
+
+	if (m_loss >= CLEAN_LOSS) {
+		m_clean_since_ns = 0;
+		return -1;
+	}
+
+	if (!m_clean_since_ns)
+		m_clean_since_ns = now_ns;
+
+	// A long stable stretch forgives earlier failed up steps
+	if (now_ns - m_switch_ns > MAX_HOLD_NS)
+		m_hold_ns = MIN_HOLD_NS;
+
+	if (m_rung > 0 && now_ns - m_clean_since_ns >= m_hold_ns && now_ns - m_switch_ns >= m_hold_ns)
+		return m_rung - 1;
+
+	return -1;
+}
+
+void BitrateController::SetRung(int64_t now_ns, int rung)
+{
+	m_last_up = rung < m_rung;
+	m_rung = rung;
+	m_switch_ns = now_ns;
+	m_clean_since_ns = 0;
+
+	// Averages of the old format say little about the new one
+	m_loss = 0;
+	m_jitter_us = 0;
+}
+
+int BitrateController::GetRung() const
+{
+	return m_rung;
+}
+
+double BitrateController::GetLoss() const
+{
+	return m_loss;
+}
+
+int BitrateController::GetJitterUs() const
+{
+	return (int)m_jitter_us;
+}
+
+int BitrateController::GetRttUs() const
+{
+	return m_rtt_us;
+}
+
+const char* BitrateController::GetReason() const
+{
+	return m_reason;
+}
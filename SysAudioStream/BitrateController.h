@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct AudioFormatConfig;
+
+// Formats a session may step through under congestion, best first: the
+// negotiated one, 24 -> 16 bit, lower rates, then Opus bitrates
+std::vector<AudioFormatConfig> BuildFormatLadder(const AudioFormatConfig& start, bool opus_available);
+
+// "pcm 16 48000 stereo", "opus 96k 48000 stereo", ...
+std::string GetFormatName(const AudioFormatConfig& format);
+
+// Picks a rung of a session's format ladder from the link reports of its
+// receiver. Steps down as soon as loss, jitter or queueing delay show
+// congestion, and back up after a clean hold time that doubles each time
+// an up step has to be taken back quickly.
+class BitrateController
+{
+public:
+	BitrateController();
+
+	void Reset(int rungs);
+
+	// Counts since the previous report, returns the rung to switch to or
+	// -1 to stay
+	int AddReport(int64_t now_ns, uint32_t received, uint32_t lost, int jitter_us, int rtt_us);
+
+	// The switch to rung has been made
+	void SetRung(int64_t now_ns, int rung);
+	int GetRung() const;
+
+	// Averaged link state, for the log
+	double GetLoss() const;
+	int GetJitterUs() const;
+	int GetRttUs() const;
+
+	// Why the last AddReport stepped down
+	const char* GetReason() const;
+
+private:
+	int m_rungs;
+	int m_rung;
+
+	double m_loss;
+	double m_jitter_us;
+	int m_rtt_us;
+	int m_min_rtt_us;
+
+	int64_t m_switch_ns;
+	int64_t m_clean_since_ns;
+	bool m_last_up;
+
+	int64_t m_hold_ns;
+
+	const char* m_reason;
+};
@@ -0,0 +1,395 @@
+#include "ChannelMixer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// -3 dB for a channel folded into another
+static const double FOLD = 0.70710678118654752;
+
+bool IsKnownChannelLayout(int channels)
+{
+	return channels == 1 || channels == 2 || channels == 4 || channels == 6 || channels == 8;
+}
+
+std::string GetChannelLayoutName(int channels)
+{
+	switch (channels)
+	{
+		case 1: return "mono";
+		case 2: return "stereo";
+		case 4: return "quad";
+		case 6: return "5.1";
+		case 8: return "7.1";
+	}
+
+	return std::to_string(channels) + " channels";
+}
+
+namespace {
+
+// Next layout down the downmix chain, 0 at the end of it
+int next_layout(int channels)
+{
+	switch (channels)
+	{
+		case 8: return 6;
+		case 6: return 2;
+		case 4: return 2;
+		case 2: return 1;
+	}
+
+	return 0;
+}
+
+}
+
+int GetDownmixChannels(int in_channels, int requested)
+{
+	int channels = in_channels;
+
+	if (!IsKnownChannelLayout(channels))
+		return std::max(1, std::min(channels, requested));
+
+	while (channels > requested && next_layout(channels))
+		channels = next_layout(channels);
+
+	return channels;
+}
+
+namespace {
+
+typedef double Matrix[MAX_MIX_CHANNELS][MAX_MIX_CHANNELS];
+
+// One step of the chain, out x in
+void step_matrix(int channels, Matrix m)
+{
+	memset(m, 0, sizeof(Matrix));
+
+	switch (channels)
+	{
+		case 8:
+			for (int c = 0; c < 4; c++)
+				m[c][c] = 1.0;
+
+			// Back and side surround share the 5.1 surround pair
+			m[4][4] = FOLD;
+			m[4][6] = FOLD;
+			m[5][5] = FOLD;
+			m[5][7] = FOLD;
+			break;
+
+		case 6:
+			m[0][0] = 1.0;
+			m[0][2] = FOLD;
+			m[0][4] = FOLD;
+			m[1][1] = 1.0;
+			m[1][2] = FOLD;
+			m[1][5] = FOLD;
+			break;
+
+		case 4:
+			m[0][0] = 1.0;
+			m[0][2] = FOLD;
+			m[1][1] = 1.0;
+			m[1][3] = FOLD;
+			break;
+
+		case 2:
+			m[0][0] = FOLD;
+			m[0][1] = FOLD;
+			break;
+	}
+}
+
+void scalar_mix(const float* in, size_t frames, int in_channels, const float* columns, float* out, int out_channels)
+{
+	for (size_t f = 0; f < frames; f++) {
+		const float* x = in + f * in_channels;
+		float* y = out + f * out_channels;
+
+		for (int o = 0; o < out_channels; o++) {
+			float sum = x[0] * columns[o];
+
+			for (int i = 1; i < in_channels; i++)
+				sum += x[i] * columns[i * MAX_MIX_CHANNELS + o];
+
+			y[o] = sum;
+		}
+	}
+}
+
+// The vector kernels store whole vectors and let the next frame overwrite
+// the excess, except where that would run past the end of out. Stereo to
+// mono would leave all but one lane idle that way, so it runs across
+// frames instead.
+#ifdef SAS_SIMD_X86
+void sse2_mix(const float* in, size_t frames, int in_channels, const float* columns, float* out, int out_channels)
+{
+	alignas(16) float tail[4];
+
+	size_t f = 0;
+
+	if (in_channels == 2 && out_channels == 1) {
+		__m128 left = _mm_set1_ps(columns[0]);
+		__m128 right = _mm_set1_ps(columns[MAX_MIX_CHANNELS]);
+
+		for (; f + 4 <= frames; f += 4) {
+			__m128 a = _mm_loadu_ps(in + f * 2);
+			__m128 b = _mm_loadu_ps(in + f * 2 + 4);
+
+			__m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+			_mm_storeu_ps(out + f, _mm_add_ps(_mm_mul_ps(l, left), _mm_mul_ps(r, right)));
+		}
+	}
+
+	for (; f < frames; f++) {
+		const float* x = in + f * in_channels;
+		float* y = out + f * out_channels;
+		size_t room = (frames - f) * out_channels;
+
+		__m128 acc0 = _mm_mul_ps(_mm_set1_ps(x[0]), _mm_load_ps(columns));
+
+		for (int i = 1; i < in_channels; i++)
+			acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_set1_ps(x[i]), _mm_load_ps(columns + i * MAX_MIX_CHANNELS)));
+
+		if (out_channels > 4) {
+			__m128 acc1 = _mm_mul_ps(_mm_set1_ps(x[0]), _mm_load_ps(columns + 4));
+
+			for (int i = 1; i < in_channels; i++)
+				acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_set1_ps(x[i]), _mm_load_ps(columns + i * MAX_MIX_CHANNELS + 4)));
+
+			_mm_storeu_ps(y, acc0);
+
+			if (room >= 8) {
+				_mm_storeu_ps(y + 4, acc1);
+			}
+			else {
+				_mm_store_ps(tail, acc1);
+				memcpy(y + 4, tail, (out_channels - 4) * sizeof(float));
+			}
+		}
+		else if (room >= 4) {
+			_mm_storeu_ps(y, acc0);
+		}
+		else {
+			_mm_store_ps(tail, acc0);
+			memcpy(y, tail, out_channels * sizeof(float));
+		}
+	}
+}
+
+SAS_TARGET_AVX2 void avx2_mix(const float* in, size_t frames, int in_channels, const float* columns, float* out, int out_channels)
+{
+	alignas(32) float tail[8];
+
+	size_t f = 0;
+
+	if (in_channels == 2 && out_channels == 1) {
+		__m256 weights = _mm256_setr_ps(columns[0], columns[MAX_MIX_CHANNELS], columns[0], columns[MAX_MIX_CHANNELS],
+			columns[0], columns[MAX_MIX_CHANNELS], columns[0], columns[MAX_MIX_CHANNELS]);
+
+		for (; f + 8 <= frames; f += 8) {
+			__m256 a = _mm256_mul_ps(_mm256_loadu_ps(in + f * 2), weights);
+			__m256 b = _mm256_mul_ps(_mm256_loadu_ps(in + f * 2 + 8), weights);
+
+			// Pair sums come out as frames 0 1 4 5 2 3 6 7
+			__m256 sum = _mm256_hadd_ps(a, b);
+
+			_mm256_storeu_ps(out + f, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(sum), _MM_SHUFFLE(3, 1, 2, 0))));
+		}
+	}
+
+	for (; f < frames; f++) {
+		const float* x = in + f * in_channels;
+		float* y = out + f * out_channels;
+
+		__m256 acc = _mm256_mul_ps(_mm256_set1_ps(x[0]), _mm256_load_ps(columns));
+
+		for (int i = 1; i < in_channels; i++)
+			acc = _mm256_fmadd_ps(_mm256_set1_ps(x[i]), _mm256_load_ps(columns + i * MAX_MIX_CHANNELS), acc);
+
+		if ((frames - f) * out_channels >= 8) {
+			_mm256_storeu_ps(y, acc);
+		}
+		else {
+			_mm256_store_ps(tail, acc);
+			memcpy(y, tail, out_channels * sizeof(float));
+		}
+	}
+}
+#endif
+
+#ifdef SAS_SIMD_NEON
+void neon_mix(const float* in, size_t frames, int in_channels, const float* columns, float* out, int out_channels)
+{
+	float tail[4];
+
+	size_t f = 0;
+
+	if (in_channels == 2 && out_channels == 1) {
+		for (; f + 4 <= frames; f += 4) {
+			float32x4x2_t lr = vld2q_f32(in + f * 2);
+
+			vst1q_f32(out + f, vfmaq_n_f32(vmulq_n_f32(lr.val[0], columns[0]), lr.val[1], columns[MAX_MIX_CHANNELS]));
+		}
+	}
+
+	for (; f < frames; f++) {
+		const float* x = in + f * in_channels;
+		float* y = out + f * out_channels;
+		size_t room = (frames - f) * out_channels;
+
+		float32x4_t acc0 = vmulq_n_f32(vld1q_f32(columns), x[0]);
+
+		for (int i = 1; i < in_channels; i++)
+			acc0 = vfmaq_n_f32(acc0, vld1q_f32(columns + i * MAX_MIX_CHANNELS), x[i]);
+
+		if (out_channels > 4) {
+			float32x4_t acc1 = vmulq_n_f32(vld1q_f32(columns + 4), x[0]);
+
+			for (int i = 1; i < in_channels; i++)
+				acc1 = vfmaq_n_f32(acc1, vld1q_f32(columns + i * MAX_MIX_CHANNELS + 4), x[i]);
+
+			vst1q_f32(y, acc0);
+
+			if (room >= 8) {
+				vst1q_f32(y + 4, acc1);
+			}
+			else {
+				vst1q_f32(tail, acc1);
+				memcpy(y + 4, tail, (out_channels - 4) * sizeof(float));
+			}
+		}
+		else if (room >= 4) {
+			vst1q_f32(y, acc0);
+		}
+		else {
+			vst1q_f32(tail, acc0);
+			memcpy(y, tail, out_channels * sizeof(float));
+		}
+	}
+}
+#endif
+
+}
+
+ChannelMixer::ChannelMixer()
+{
+	m_in_channels = 0;
+	m_out_channels = 0;
+
+	memset(m_columns, 0, sizeof(m_columns));
+
+	m_level = GetSimdLevel();
+}
+
+bool ChannelMixer::Init(int in_channels, int out_channels)
+{
+	if (in_channels < 1 || in_channels > MAX_MIX_CHANNELS || out_channels < 1 || out_channels > MAX_MIX_CHANNELS)
+		return false;
+
+	Matrix matrix = {};
+
+	for (int c = 0; c < in_channels; c++)
+		matrix[c][c] = 1.0;
+
+	int channels = in_channels;
+
+	while (channels > out_channels && next_layout(channels) >= out_channels) {
+		Matrix step, product = {};
+
+		step_matrix(channels, step);
+
+		for (int o = 0; o < MAX_MIX_CHANNELS; o++) {
+			for (int i = 0; i < in_channels; i++) {
+				for (int k = 0; k < channels; k++)
+					product[o][i] += step[o][k] * matrix[k][i];
+			}
+		}
+
+		memcpy(matrix, product, sizeof(Matrix));
+		channels = next_layout(channels);
+	}
+
+	// Off the chain, mono goes to the front pair and the rest by position
+	if (channels != out_channels) {
+		memset(matrix, 0, sizeof(Matrix));
+
+		for (int o = 0; o < out_channels; o++) {
+			if (in_channels == 1 && o < 2)
+				matrix[o][0] = 1.0;
+			else if (o < in_channels)
+				matrix[o][o] = 1.0;
+		}
+	}
+
+	double peak = 0;
+
+	for (int o = 0; o < out_channels; o++) {
+		double sum = 0;
+
+		for (int i = 0; i < in_channels; i++)
+			sum += std::fabs(matrix[o][i]);
+
+		peak = std::max(peak, sum);
+	}
+
+	double scale = peak > 1.0 ? 1.0 / peak : 1.0;
+
+	memset(m_columns, 0, sizeof(m_columns));
+
+	for (int i = 0; i < in_channels; i++) {
+		for (int o = 0; o < out_channels; o++)
+			m_columns[i * MAX_MIX_CHANNELS + o] = (float)(matrix[o][i] * scale);
+	}
+
+	m_in_channels = in_channels;
+	m_out_channels = out_channels;
+
+	return true;
+}
+
+int ChannelMixer::GetInputChannels() const
+{
+	return m_in_channels;
+}
+
+int ChannelMixer::GetOutputChannels() const
+{
+	return m_out_channels;
+}
+
+void ChannelMixer::SetSimdLevel(SimdLevel level)
+{
+	m_level = IsSimdLevelSupported(level) ? level : SimdLevel::Scalar;
+}
+
+void ChannelMixer::Process(const float* in, size_t frames, float* out)
+{
+	if (!m_in_channels || !frames)
+		return;
+
+	switch (m_level)
+	{
+#ifdef SAS_SIMD_X86
+		case SimdLevel::Avx2:
+			avx2_mix(in, frames, m_in_channels, m_columns, out, m_out_channels);
+			return;
+
+		case SimdLevel::Sse2:
+			sse2_mix(in, frames, m_in_channels, m_columns, out, m_out_channels);
+			return;
+#endif
+#ifdef SAS_SIMD_NEON
+		case SimdLevel::Neon:
+			neon_mix(in, frames, m_in_channels, m_columns, out, m_out_channels);
+			return;
+#endif
+		default:
+			scalar_mix(in, frames, m_in_channels, m_columns, out, m_out_channels);
+			return;
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "Simd.h"
+
+// Channels are in WAVE order for every count the mixer knows:
+// 1 mono, 2 FL FR, 4 FL FR BL BR, 6 FL FR FC LFE BL BR,
+// 8 FL FR FC LFE BL BR SL SR
+#define MAX_MIX_CHANNELS 8
+
+// Whether a count has a known layout, and its name ("5.1", ...)
+bool IsKnownChannelLayout(int channels);
+std::string GetChannelLayoutName(int channels);
+
+// Most channels, up to requested, that in_channels downmixes to
+int GetDownmixChannels(int in_channels, int requested);
+
+// Capture layout converted to the count a client asked for. Downmixes
+// follow 7.1 -> 5.1 -> stereo -> mono (and quad -> stereo) with -3 dB for
+// folded channels and no LFE, then scaled so no output can exceed full
+// scale. Counts outside that chain copy the channels they share.
+//
+// Each frame is one vector of outputs accumulated over the inputs, with
+// AVX2, SSE2 or NEON.
+class ChannelMixer
+{
+public:
+	ChannelMixer();
+
+	bool Init(int in_channels, int out_channels);
+
+	int GetInputChannels() const;
+	int GetOutputChannels() const;
+
+	// Interleaved in and out, out has room for frames * out channels
+	void Process(const float* in, size_t frames, float* out);
+
+	// Forces a kernel family, for benchmarks
+	void SetSimdLevel(SimdLevel level);
+
+private:
+	int m_in_channels;
+	int m_out_channels;
+
+	// One column of MAX_MIX_CHANNELS outputs per input channel
+	alignas(32) float m_columns[MAX_MIX_CHANNELS * MAX_MIX_CHANNELS];
+
+	SimdLevel m_level;
+};
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// Monotonic time used for every timestamp the server produces. On Linux
+// this is CLOCK_MONOTONIC, on Windows it is QPC time.
+inline int64_t MonotonicNowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
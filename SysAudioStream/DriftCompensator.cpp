@@ -0,0 +1,182 @@
+#include "DriftCompensator.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+DriftEstimator::DriftEstimator()
+{
+	Reset(48000);
+}
+
+void DriftEstimator::Reset(int sample_rate)
+{
+	std::lock_guard<std::mutex> lk(m_mutex);
+
+	m_sample_rate = sample_rate;
+	m_count = 0;
+
+	m_has_target = false;
+	m_target_frames = 0;
+
+	m_drift_ppm = 0;
+	m_level_ppm = 0;
+
+	m_ratio = 1.0;
+}
+
+void DriftEstimator::AddReport(int64_t time_ns, int buffer_frames)
+{
+	std::lock_guard<std::mutex> lk(m_mutex);
+
+	if (m_count == MAX_REPORTS)
+		Update();
+
+	m_times_ns[m_count] = time_ns;
+	m_levels[m_count] = buffer_frames;
+	m_count++;
+
+	if (time_ns - m_times_ns[0] >= WINDOW_NS)
+		Update();
+}
+
+void DriftEstimator::Update()
+{
+	if (m_count < 4) {
+		m_count = 0;
+		return;
+	}
+
+	// Least squares fit of the buffer level over the window. The ratio was
+	// constant during it, so the slope is the drift left uncorrected.
+	double mean_t = 0, mean_l = 0;
+
+	for (int i = 0; i < m_count; i++) {
+		mean_t += (m_times_ns[i] - m_times_ns[0]) / 1e9;
+		mean_l += m_levels[i];
+	}
+
+	mean_t /= m_count;
+	mean_l /= m_count;
+
+	double cov = 0, var = 0;
+
+	for (int i = 0; i < m_count; i++) {
+		double dt = (m_times_ns[i] - m_times_ns[0]) / 1e9 - mean_t;
+
+		cov += dt * (m_levels[i] - mean_l);
+		var += dt * dt;
+	}
+
+	m_count = 0;
+
+	if (var <= 0)
+		return;
+
+	double slope = cov / var;
+
+	// The first window only sets the level the session settled at
+	if (!m_has_target) {
+		m_has_target = true;
+		m_target_frames = mean_l;
+	}
+
+	// The ratio applied over the window, level correction included, less
+	// what still made the buffer grow is what the receiver's clock needs.
+	// Summing slopes instead would leave a level offset in place for good,
+	// the drift term cancelling the level term.
+	double applied_ppm = (m_ratio.load(std::memory_order_relaxed) - 1.0) * 1e6;
+
+	m_drift_ppm = applied_ppm - slope / m_sample_rate * 1e6;
+	m_drift_ppm = std::clamp(m_drift_ppm, -MAX_PPM, MAX_PPM);
+
+	m_level_ppm = -(mean_l - m_target_frames) / (LEVEL_CORRECTION_S * m_sample_rate) * 1e6;
+
+	double ppm = std::clamp(m_drift_ppm + m_level_ppm, -MAX_PPM, MAX_PPM);
+
+	m_ratio = 1.0 + ppm * 1e-6;
+
+	LOG_INFO("(drift): receiver clock %+.1f ppm, buffer %.0f frames (target %.0f), correcting %+.1f ppm\n",
+		m_drift_ppm, mean_l, m_target_frames, ppm);
+}
+
+double DriftEstimator::GetRatio() const
+{
+	return m_ratio.load(std::memory_order_relaxed);
+}
+
+double DriftEstimator::GetDriftPpm() const
+{
+	return m_drift_ppm;
+}
+
+AdaptiveResampler::AdaptiveResampler()
+{
+	m_channels = 0;
+	m_history_frames = 0;
+	m_pos = 1.0;
+}
+
+void AdaptiveResampler::Reset()
+{
+	m_history_frames = 0;
+	m_pos = 1.0;
+}
+
+size_t AdaptiveResampler::Process(const float* in, size_t in_frames, int channels, double ratio, float* out)
+{
+	if (channels != m_channels) {
+		m_channels = channels;
+		Reset();
+	}
+
+	size_t total_frames = m_history_frames + in_frames;
+
+	if (m_history.size() < total_frames * channels)
+		m_history.resize(total_frames * channels);
+
+	memcpy(&m_history[m_history_frames * channels], in, in_frames * channels * sizeof(float));
+
+	const float* buf = m_history.data();
+
+	double step = 1.0 / ratio;
+	size_t out_frames = 0;
+
+	// Catmull-Rom between frames idx and idx + 1, using idx - 1 and idx + 2
+	while (m_pos + 2 < (double)total_frames) {
+		size_t idx = (size_t)m_pos;
+		float t = (float)(m_pos - idx);
+
+		const float* x0 = &buf[(idx - 1) * channels];
+		const float* x1 = x0 + channels;
+		const float* x2 = x1 + channels;
+		const float* x3 = x2 + channels;
+
+		float* y = &out[out_frames * channels];
+
+		for (size_t c = 0; c < channels; c++) {
+			float a = -0.5f * x0[c] + 1.5f * x1[c] - 1.5f * x2[c] + 0.5f * x3[c];
+			float b = x0[c] - 2.5f * x1[c] + 2.0f * x2[c] - 0.5f * x3[c];
+			float d = -0.5f * x0[c] + 0.5f * x2[c];
+
+			y[c] = ((a * t + b) * t + d) * t + x1[c];
+		}
+
+		out_frames++;
+		m_pos += step;
+	}
+
+	// Keep the frames the next call still needs
+	size_t keep_from = (size_t)m_pos - 1;
+
+	if (keep_from > total_frames)
+		keep_from = total_frames;
+
+	m_history_frames = total_frames - keep_from;
+	memmove(m_history.data(), &m_history[keep_from * channels], m_history_frames * channels * sizeof(float));
+	m_pos -= keep_from;
+
+	return out_frames;
+}
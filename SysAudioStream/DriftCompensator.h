@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Estimates how fast the receiver's playback buffer drifts from the
+// buffer-level reports it sends on the cmd socket and turns that into a
+// resampling ratio that keeps the buffer (and so the latency) flat.
+class DriftEstimator
+{
+public:
+	DriftEstimator();
+
+	// Starts over for a new session at the given stream rate
+	void Reset(int sample_rate);
+
+	// buffer_frames is the receiver's queued playback audio at time_ns
+	void AddReport(int64_t time_ns, int buffer_frames);
+
+	// Output frames per input frame, read from the capture thread
+	double GetRatio() const;
+	double GetDriftPpm() const;
+
+private:
+	void Update();
+
+	static constexpr int MAX_REPORTS = 256;
+
+	// Length of the regression window, the ratio only changes between windows
+	static constexpr int64_t WINDOW_NS = 10000000000LL;
+
+	// Time over which a buffer level offset from the target is paid back
+	static constexpr double LEVEL_CORRECTION_S = 60.0;
+
+	static constexpr double MAX_PPM = 1000.0;
+
+	std::mutex m_mutex;
+
+	int m_sample_rate;
+
+	int64_t m_times_ns[MAX_REPORTS];
+	int m_levels[MAX_REPORTS];
+	int m_count;
+
+	bool m_has_target;
+	double m_target_frames;
+
+	double m_drift_ppm;
+	double m_level_ppm;
+
+	std::atomic<double> m_ratio;
+};
+
+// Cubic-interpolating resampler for ratios close to 1, used to add or drop
+// a fraction of a frame per packet without audible artifacts.
+class AdaptiveResampler
+{
+public:
+	AdaptiveResampler();
+
+	void Reset();
+
+	// Returns the number of frames written to out, which must have room for
+	// at least in_frames * ratio + 2 frames
+	size_t Process(const float* in, size_t in_frames, int channels, double ratio, float* out);
+
+private:
+	int m_channels;
+
+	// Input frames not fully consumed yet, starting one frame before m_pos
+	std::vector<float> m_history;
+	size_t m_history_frames;
+
+	double m_pos;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Interleaved float FIFO that turns capture chunks of any size into the
+// fixed frames a codec works on, keeping track of the first frame's pts.
+class FrameQueue
+{
+public:
+	FrameQueue() : m_channels(0), m_sample_rate(0), m_frames(0), m_pts_ns(0) {}
+
+	void Reset(int channels, int sample_rate, size_t reserve_frames)
+	{
+		m_channels = channels;
+		m_sample_rate = sample_rate;
+		m_frames = 0;
+
+		if (m_buffer.size() < reserve_frames * channels)
+			m_buffer.resize(reserve_frames * channels);
+	}
+
+	void Push(const float* in, size_t frames, int64_t pts_ns)
+	{
+		if (!m_frames)
+			m_pts_ns = pts_ns;
+
+		size_t needed = (m_frames + frames) * m_channels;
+
+		if (m_buffer.size() < needed)
+			m_buffer.resize(needed);
+
+		memcpy(&m_buffer[m_frames * m_channels], in, frames * m_channels * sizeof(float));
+		m_frames += frames;
+	}
+
+	void Pop(size_t frames)
+	{
+		m_frames -= frames;
+		memmove(m_buffer.data(), &m_buffer[frames * m_channels], m_frames * m_channels * sizeof(float));
+		m_pts_ns += (int64_t)frames * 1000000000LL / m_sample_rate;
+	}
+
+	void Clear()
+	{
+		m_frames = 0;
+	}
+
+	size_t GetFrames() const { return m_frames; }
+	const float* GetData() const { return m_buffer.data(); }
+	int64_t GetPts() const { return m_pts_ns; }
+
+private:
+	int m_channels;
+	int m_sample_rate;
+
+	std::vector<float> m_buffer;
+	size_t m_frames;
+	int64_t m_pts_ns;
+};
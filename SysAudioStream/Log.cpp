@@ -0,0 +1,235 @@
+#include "pch.h"
+#include "Log.h"
+#include "Realtime.h"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#ifdef __linux__
+#include <syslog.h>
+#endif
+
+// Bounded multi-producer queue after Dmitry Vyukov's: each slot's sequence
+// says whose turn it is, so producers only race for the enqueue position
+// and never wait for one another
+static LogRecord g_records[LOG_RING_SIZE];
+static std::atomic<uint64_t> g_sequences[LOG_RING_SIZE];
+static std::atomic<uint64_t> g_enqueue_pos{ 0 };
+static uint64_t g_dequeue_pos = 0;
+
+static std::atomic<uint64_t> g_dropped{ 0 };
+
+static LogConfig g_log_config;
+static std::atomic<bool> g_log_running{ false };
+static std::unique_ptr<std::thread> g_log_thread;
+
+std::atomic<int> g_log_level{ (int)LogLevel::Info };
+
+bool ParseLogLevel(const std::string& name, LogLevel* level)
+{
+	if (name == "error")
+		*level = LogLevel::Error;
+	else if (name == "warning")
+		*level = LogLevel::Warning;
+	else if (name == "info")
+		*level = LogLevel::Info;
+	else if (name == "debug")
+		*level = LogLevel::Debug;
+	else
+		return false;
+
+	return true;
+}
+
+bool ParseLogSink(const std::string& name, LogSink* sink)
+{
+	if (name == "stdout")
+		*sink = LogSink::Stdout;
+	else if (name == "journal")
+		*sink = LogSink::Journal;
+	#ifdef __linux__
+	else if (name == "syslog")
+		*sink = LogSink::Syslog;
+	#endif
+	else
+		return false;
+
+	return true;
+}
+
+bool LogThreadRunning()
+{
+	return g_log_running.load(std::memory_order_acquire);
+}
+
+LogRecord* LogAcquire()
+{
+	uint64_t pos = g_enqueue_pos.load(std::memory_order_relaxed);
+
+	while (true) {
+		uint64_t sequence = g_sequences[pos % LOG_RING_SIZE].load(std::memory_order_acquire);
+		int64_t diff = (int64_t)(sequence - pos);
+
+		if (diff == 0) {
+			if (g_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				return &g_records[pos % LOG_RING_SIZE];
+		}
+		else if (diff < 0) {
+			// The log thread is a lap behind
+			g_dropped.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		else {
+			pos = g_enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+void LogCommit(LogRecord* record)
+{
+	size_t index = record - g_records;
+	uint64_t sequence = g_sequences[index].load(std::memory_order_relaxed);
+
+	// The slot was handed out at position sequence
+	g_sequences[index].store(sequence + 1, std::memory_order_release);
+}
+
+// syslog priorities by LogLevel, journald reads the same numbers
+static const int LOG_PRIORITIES[] = { 3, 4, 6, 7 };
+
+static void write_line(LogLevel level, const char* text)
+{
+	switch (g_log_config.sink) {
+		case LogSink::Stdout:
+			fputs(text, stdout);
+			break;
+
+		case LogSink::Journal:
+		case LogSink::Syslog:
+		{
+			// One entry per line, blank ones spaced out the terminal output
+			const char* line = text;
+
+			while (*line) {
+				const char* end = strchr(line, '\n');
+				size_t length = end ? (size_t)(end - line) : strlen(line);
+
+				if (length) {
+					#ifdef __linux__
+					if (g_log_config.sink == LogSink::Syslog)
+						syslog(LOG_PRIORITIES[(int)level], "%.*s", (int)length, line);
+					else
+					#endif
+					printf("<%d>%.*s\n", LOG_PRIORITIES[(int)level], (int)length, line);
+				}
+
+				line += length + (end ? 1 : 0);
+			}
+
+			break;
+		}
+	}
+}
+
+void LogWriteNow(const LogRecord& record)
+{
+	char text[1024];
+
+	if (record.suppressed) {
+		snprintf(text, sizeof(text), "(log): %u messages like the next one suppressed\n", record.suppressed);
+		write_line(record.level, text);
+	}
+
+	record.formatter(record, text, sizeof(text));
+	write_line(record.level, text);
+
+	if (g_log_config.sink != LogSink::Syslog)
+		fflush(stdout);
+}
+
+// Log thread, the only consumer
+static bool write_queued()
+{
+	bool wrote = false;
+
+	while (true) {
+		size_t index = g_dequeue_pos % LOG_RING_SIZE;
+
+		if (g_sequences[index].load(std::memory_order_acquire) != g_dequeue_pos + 1)
+			break;
+
+		LogWriteNow(g_records[index]);
+
+		// Free for the producers' next lap
+		g_sequences[index].store(g_dequeue_pos + LOG_RING_SIZE, std::memory_order_release);
+		g_dequeue_pos++;
+		wrote = true;
+	}
+
+	uint64_t dropped = g_dropped.exchange(0, std::memory_order_relaxed);
+
+	if (dropped) {
+		char text[64];
+
+		snprintf(text, sizeof(text), "(log): %llu messages dropped\n", (unsigned long long)dropped);
+		write_line(LogLevel::Warning, text);
+	}
+
+	return wrote;
+}
+
+static void t_log()
+{
+	SetThreadName("sas-log");
+
+	while (g_log_running.load(std::memory_order_acquire)) {
+		// Nothing wakes this thread, so writers never make a system call
+		if (!write_queued())
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	write_queued();
+}
+
+void StartLogging(const LogConfig& config)
+{
+	if (g_log_running)
+		return;
+
+	g_log_config = config;
+	g_log_level = (int)config.level;
+
+	#ifdef __linux__
+	if (config.sink == LogSink::Syslog)
+		openlog("SysAudioStream", LOG_PID, LOG_DAEMON);
+	#endif
+
+	for (uint64_t i = 0; i < LOG_RING_SIZE; i++)
+		g_sequences[i].store(g_dequeue_pos + i, std::memory_order_relaxed);
+
+	g_enqueue_pos.store(g_dequeue_pos, std::memory_order_relaxed);
+
+	g_log_running.store(true, std::memory_order_release);
+	g_log_thread = std::make_unique<std::thread>(t_log);
+}
+
+void StopLogging()
+{
+	if (!g_log_running)
+		return;
+
+	g_log_running.store(false, std::memory_order_release);
+
+	if (g_log_thread && g_log_thread->joinable())
+		g_log_thread->join();
+
+	g_log_thread.reset();
+
+	#ifdef __linux__
+	if (g_log_config.sink == LogSink::Syslog)
+		closelog();
+	#endif
+
+	g_log_config.sink = LogSink::Stdout;
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "Clock.h"
+
+// Records waiting for the log thread, messages beyond are dropped and
+// counted
+#define LOG_RING_SIZE 1024
+
+#define LOG_MAX_ARGS 8
+#define LOG_STRING_BYTES 160
+
+// Messages from one call site per second before the rest are suppressed
+#define LOG_BURST 5
+
+// printf-style logging that never blocks the calling thread. The call site
+// copies its format pointer and arguments into a fixed-size record in a
+// lock-free ring; the log thread formats and writes it. Strings passed for
+// %s are copied, everything else must be a number or pointer.
+//
+// LOG_INFO("(audio): session %u started\n", id);
+//
+// Until StartLogging, and in tools that never call it, messages are
+// written right away like printf.
+#define LOG_AT(level, format, ...) \
+	do { \
+		if (0) printf(format, ##__VA_ARGS__); \
+		static LogLimiter log_limiter_; \
+		if (LogEnabled(level)) \
+			LogWrite(level, &log_limiter_, format, ##__VA_ARGS__); \
+	} while (0)
+
+#define LOG_ERROR(format, ...) LOG_AT(LogLevel::Error, format, ##__VA_ARGS__)
+#define LOG_WARNING(format, ...) LOG_AT(LogLevel::Warning, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT(LogLevel::Info, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) LOG_AT(LogLevel::Debug, format, ##__VA_ARGS__)
+
+enum class LogLevel
+{
+	Error,
+	Warning,
+	Info,
+	Debug
+};
+
+enum class LogSink
+{
+	Stdout,
+
+	// Stdout with the <N> level prefixes journald reads from services
+	Journal,
+
+	// syslog(3), which journald also collects. Linux only.
+	Syslog
+};
+
+// From the 'log' line in config.ini
+struct LogConfig
+{
+	LogLevel level = LogLevel::Info;
+	LogSink sink = LogSink::Stdout;
+};
+
+bool ParseLogLevel(const std::string& name, LogLevel* level);
+bool ParseLogSink(const std::string& name, LogSink* sink);
+
+extern std::atomic<int> g_log_level;
+
+inline bool LogEnabled(LogLevel level)
+{
+	return (int)level <= g_log_level.load(std::memory_order_relaxed);
+}
+
+// Lets LOG_BURST messages of one call site through per second and counts
+// the rest, which are reported before the next message that gets through
+class LogLimiter
+{
+public:
+	bool Allow(int64_t now_ns, uint32_t* suppressed)
+	{
+		int64_t window_ns = m_window_ns.load(std::memory_order_relaxed);
+
+		if (now_ns - window_ns >= 1000000000LL && m_window_ns.compare_exchange_strong(window_ns, now_ns, std::memory_order_relaxed))
+			m_count.store(0, std::memory_order_relaxed);
+
+		if (m_count.fetch_add(1, std::memory_order_relaxed) >= LOG_BURST) {
+			m_suppressed.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		*suppressed = m_suppressed.exchange(0, std::memory_order_relaxed);
+
+		return true;
+	}
+
+private:
+	std::atomic<int64_t> m_window_ns{ 0 };
+	std::atomic<uint32_t> m_count{ 0 };
+	std::atomic<uint32_t> m_suppressed{ 0 };
+};
+
+struct LogRecord;
+
+typedef int (*LogFormatter)(const LogRecord& record, char* out, size_t size);
+
+struct LogRecord
+{
+	LogLevel level;
+	uint32_t suppressed;
+	int64_t time_ns;
+
+	const char* format;
+	LogFormatter formatter;
+
+	// Numbers as their bytes, strings as offsets into strings
+	uint64_t args[LOG_MAX_ARGS];
+	char strings[LOG_STRING_BYTES];
+	size_t strings_used;
+};
+
+template<typename T>
+using LogIsString = std::integral_constant<bool,
+	std::is_same<typename std::decay<T>::type, const char*>::value || std::is_same<typename std::decay<T>::type, char*>::value>;
+
+template<typename T>
+inline void LogStoreArg(LogRecord* record, int index, T value, std::true_type)
+{
+	size_t free = LOG_STRING_BYTES - record->strings_used;
+
+	record->args[index] = record->strings_used;
+
+	if (!free)
+		return;
+
+	// Byte by byte up to the NUL, so nothing past a short literal is read
+	char* out = record->strings + record->strings_used;
+	size_t length = 0;
+
+	while (value && length + 1 < free && value[length]) {
+		out[length] = value[length];
+		length++;
+	}
+
+	out[length] = 0;
+	record->strings_used += length + 1;
+}
+
+template<typename T>
+inline void LogStoreArg(LogRecord* record, int index, T value, std::false_type)
+{
+	static_assert(sizeof(T) <= sizeof(uint64_t) && std::is_trivially_copyable<T>::value, "log arguments must be numbers, pointers or strings");
+
+	memcpy(&record->args[index], &value, sizeof(T));
+}
+
+template<typename T>
+inline T LogLoadArg(const LogRecord& record, int index, std::false_type)
+{
+	T value;
+	memcpy(&value, &record.args[index], sizeof(T));
+
+	return value;
+}
+
+template<typename T>
+inline const char* LogLoadArg(const LogRecord& record, int index, std::true_type)
+{
+	// Past the end when the strings ran out of room
+	return record.args[index] < LOG_STRING_BYTES ? record.strings + record.args[index] : "";
+}
+
+// The format was checked against the arguments at the call site
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+#endif
+
+template<typename... Args, size_t... I>
+inline int LogFormatArgs(const LogRecord& record, char* out, size_t size, std::index_sequence<I...>)
+{
+	return snprintf(out, size, record.format, LogLoadArg<Args>(record, (int)I, LogIsString<Args>())...);
+}
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+template<typename... Args>
+inline int LogFormat(const LogRecord& record, char* out, size_t size)
+{
+	return LogFormatArgs<Args...>(record, out, size, std::index_sequence_for<Args...>());
+}
+
+bool LogThreadRunning();
+
+// A free record for the calling thread to fill, nullptr if the ring is full
+LogRecord* LogAcquire();
+void LogCommit(LogRecord* record);
+
+// Formats and writes the record on the calling thread
+void LogWriteNow(const LogRecord& record);
+
+template<typename... Args>
+inline void LogWrite(LogLevel level, LogLimiter* limiter, const char* format, Args... args)
+{
+	static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+
+	int64_t now_ns = MonotonicNowNs();
+	uint32_t suppressed;
+
+	if (!limiter->Allow(now_ns, &suppressed))
+		return;
+
+	LogRecord local;
+	LogRecord* record = &local;
+	bool queued = LogThreadRunning();
+
+	// Dropped rather than waited for when the ring is full
+	if (queued && !(record = LogAcquire()))
+		return;
+
+	record->level = level;
+	record->suppressed = suppressed;
+	record->time_ns = now_ns;
+	record->format = format;
+	record->formatter = &LogFormat<Args...>;
+	record->strings_used = 0;
+
+	int index = 0;
+	(void)index;
+
+	using expand = int[];
+	(void)expand{ 0, (LogStoreArg(record, index++, args, LogIsString<Args>()), 0)... };
+
+	if (queued)
+		LogCommit(record);
+	else
+		LogWriteNow(*record);
+}
+
+// Starts the log thread, messages are queued from then on
+void StartLogging(const LogConfig& config);
+
+// Writes what is queued and stops the thread
+void StopLogging();
@@ -0,0 +1,962 @@
+#include "LosslessCodec.h"
+#include "Clock.h"
+#include "Log.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define MAX_CHANNELS 8
+#define MAX_FIXED_ORDER 4
+#define MAX_LPC_ORDER 12
+#define MAX_PARTITION_ORDER 8
+#define MAX_RICE_PARAM 30
+
+enum SubframeType
+{
+	SUBFRAME_CONSTANT = 0,
+	SUBFRAME_VERBATIM = 1,
+	SUBFRAME_FIXED = 2,
+	SUBFRAME_LPC = 3,
+};
+
+namespace {
+
+// How one channel of a frame gets coded, together with its exact size
+struct Subframe
+{
+	int type;
+	int order;
+
+	int precision;
+	int shift;
+	int32_t coefs[MAX_LPC_ORDER];
+
+	int partition_order;
+	int rice[1 << MAX_PARTITION_ORDER];
+
+	uint64_t bits;
+};
+
+class BitWriter
+{
+public:
+	BitWriter(uint8_t* out) : m_out(out), m_pos(0), m_acc(0), m_bits(0) {}
+
+	// bits <= 32
+	void Put(uint32_t value, int bits)
+	{
+		if (!bits)
+			return;
+
+		m_acc = (m_acc << bits) | (value & (0xFFFFFFFFu >> (32 - bits)));
+		m_bits += bits;
+
+		while (m_bits >= 8) {
+			m_bits -= 8;
+			m_out[m_pos++] = (uint8_t)(m_acc >> m_bits);
+		}
+	}
+
+	void PutRice(uint32_t value, int k)
+	{
+		uint32_t q = value >> k;
+
+		for (; q >= 31; q -= 31)
+			Put(0, 31);
+
+		Put(1, q + 1);
+		Put(value, k);
+	}
+
+	size_t Finish()
+	{
+		if (m_bits)
+			m_out[m_pos++] = (uint8_t)(m_acc << (8 - m_bits));
+
+		m_bits = 0;
+
+		return m_pos;
+	}
+
+private:
+	uint8_t* m_out;
+	size_t m_pos;
+	uint64_t m_acc;
+	int m_bits;
+};
+
+class BitReader
+{
+public:
+	BitReader(const uint8_t* data, size_t size) : m_data(data), m_size(size), m_pos(0), m_acc(0), m_bits(0), m_error(false) {}
+
+	// bits <= 32
+	uint32_t Get(int bits)
+	{
+		if (!bits)
+			return 0;
+
+		while (m_bits < bits) {
+			if (m_pos >= m_size) {
+				m_error = true;
+				return 0;
+			}
+
+			m_acc = (m_acc << 8) | m_data[m_pos++];
+			m_bits += 8;
+		}
+
+		m_bits -= bits;
+
+		return (uint32_t)(m_acc >> m_bits) & (0xFFFFFFFFu >> (32 - bits));
+	}
+
+	int32_t GetSigned(int bits)
+	{
+		uint32_t value = Get(bits);
+
+		if (bits < 32 && (value >> (bits - 1)))
+			value |= ~0u << bits;
+
+		return (int32_t)value;
+	}
+
+	uint32_t GetRice(int k)
+	{
+		uint32_t q = 0;
+
+		while (!m_error && !Get(1))
+			q++;
+
+		return (q << k) | Get(k);
+	}
+
+	bool HasError() const { return m_error; }
+
+private:
+	const uint8_t* m_data;
+	size_t m_size;
+	size_t m_pos;
+	uint64_t m_acc;
+	int m_bits;
+	bool m_error;
+};
+
+inline uint32_t zigzag(int32_t value)
+{
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+inline int32_t unzigzag(uint32_t value)
+{
+	return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+void fixed_residual(const int32_t* x, int n, int order, int32_t* res)
+{
+	for (int i = order; i < n; i++) {
+		switch (order)
+		{
+			case 0: res[i] = x[i]; break;
+			case 1: res[i] = x[i] - x[i - 1]; break;
+			case 2: res[i] = x[i] - 2 * x[i - 1] + x[i - 2]; break;
+			case 3: res[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]; break;
+			default: res[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]; break;
+		}
+	}
+}
+
+void fixed_restore(int32_t* x, int n, int order)
+{
+	for (int i = order; i < n; i++) {
+		switch (order)
+		{
+			case 0: break;
+			case 1: x[i] += x[i - 1]; break;
+			case 2: x[i] += 2 * x[i - 1] - x[i - 2]; break;
+			case 3: x[i] += 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3]; break;
+			default: x[i] += 4 * x[i - 1] - 6 * x[i - 2] + 4 * x[i - 3] - x[i - 4]; break;
+		}
+	}
+}
+
+// Sum of absolute residuals of every fixed order in one pass
+int best_fixed_order(const int32_t* x, int n)
+{
+	uint64_t sum[MAX_FIXED_ORDER + 1] = {};
+
+	for (int i = MAX_FIXED_ORDER; i < n; i++) {
+		int64_t e0 = x[i];
+		int64_t e1 = e0 - x[i - 1];
+		int64_t e2 = e1 - (x[i - 1] - x[i - 2]);
+		int64_t e3 = e2 - (x[i - 1] - 2 * (int64_t)x[i - 2] + x[i - 3]);
+		int64_t e4 = e3 - (x[i - 1] - 3 * (int64_t)x[i - 2] + 3 * (int64_t)x[i - 3] - x[i - 4]);
+
+		sum[0] += e0 < 0 ? -e0 : e0;
+		sum[1] += e1 < 0 ? -e1 : e1;
+		sum[2] += e2 < 0 ? -e2 : e2;
+		sum[3] += e3 < 0 ? -e3 : e3;
+		sum[4] += e4 < 0 ? -e4 : e4;
+	}
+
+	int best = 0;
+
+	for (int order = 1; order <= MAX_FIXED_ORDER; order++) {
+		if (sum[order] < sum[best])
+			best = order;
+	}
+
+	return best;
+}
+
+// Reference predictor, also used by the decoder. 64-bit accumulation keeps
+// it exact for any sample width and coefficient precision.
+void lpc_residual_scalar(const int32_t* x, int from, int n, const int32_t* q, int order, int shift, int32_t* res)
+{
+	for (int i = from; i < n; i++) {
+		int64_t sum = 0;
+
+		for (int j = 0; j < order; j++)
+			sum += (int64_t)q[j] * x[i - 1 - j];
+
+		res[i] = x[i] - (int32_t)(sum >> shift);
+	}
+}
+
+#ifdef SAS_SIMD_X86
+// Eight residuals at a time when the prediction provably fits in 32 bits
+SAS_TARGET_AVX2 void lpc_residual_avx2_32(const int32_t* x, int n, const int32_t* q, int order, int shift, int32_t* res)
+{
+	__m128i sh = _mm_cvtsi32_si128(shift);
+	int i = order;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256i sum = _mm256_setzero_si256();
+
+		for (int j = 0; j < order; j++) {
+			__m256i xv = _mm256_loadu_si256((const __m256i*)(x + i - 1 - j));
+			sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(_mm256_set1_epi32(q[j]), xv));
+		}
+
+		__m256i cur = _mm256_loadu_si256((const __m256i*)(x + i));
+		_mm256_storeu_si256((__m256i*)(res + i), _mm256_sub_epi32(cur, _mm256_sra_epi32(sum, sh)));
+	}
+
+	lpc_residual_scalar(x, i, n, q, order, shift, res);
+}
+
+// Four residuals at a time with 64-bit sums, for 24-bit audio. AVX2 has no
+// 64-bit arithmetic shift, so the sum is biased positive and shifted logically.
+SAS_TARGET_AVX2 void lpc_residual_avx2_64(const int32_t* x, int n, const int32_t* q, int order, int shift, int32_t* res)
+{
+	const int64_t bias = 1LL << 62;
+
+	__m128i sh = _mm_cvtsi32_si128(shift);
+	__m256i bias_in = _mm256_set1_epi64x(bias);
+	__m256i bias_out = _mm256_set1_epi64x(bias >> shift);
+	__m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+	int i = order;
+
+	for (; i + 4 <= n; i += 4) {
+		__m256i sum = bias_in;
+
+		for (int j = 0; j < order; j++) {
+			__m256i xv = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)(x + i - 1 - j)));
+			sum = _mm256_add_epi64(sum, _mm256_mul_epi32(xv, _mm256_set1_epi64x(q[j])));
+		}
+
+		__m256i pred = _mm256_sub_epi64(_mm256_srl_epi64(sum, sh), bias_out);
+		__m256i cur = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)(x + i)));
+		__m256i r = _mm256_permutevar8x32_epi32(_mm256_sub_epi64(cur, pred), pack);
+
+		_mm_storeu_si128((__m128i*)(res + i), _mm256_castsi256_si128(r));
+	}
+
+	lpc_residual_scalar(x, i, n, q, order, shift, res);
+}
+#endif
+
+void lpc_residual(const int32_t* x, int n, const int32_t* q, int order, int shift, bool fits_32, int32_t* res)
+{
+#ifdef SAS_SIMD_X86
+	if (CpuHasAvx2()) {
+		if (fits_32)
+			lpc_residual_avx2_32(x, n, q, order, shift, res);
+		else
+			lpc_residual_avx2_64(x, n, q, order, shift, res);
+
+		return;
+	}
+#endif
+
+	lpc_residual_scalar(x, order, n, q, order, shift, res);
+}
+
+// Chooses the partition order and per-partition Rice parameters for
+// res[order..n) and returns the exact number of bits they take
+uint64_t plan_residual(const int32_t* res, int n, int order, Subframe* sf)
+{
+	uint64_t sums[1 << MAX_PARTITION_ORDER];
+
+	int max_po = 0;
+
+	while (max_po < MAX_PARTITION_ORDER && !(n & ((2 << max_po) - 1)) && (n >> (max_po + 1)) >= order)
+		max_po++;
+
+	// Sums of the finest partitioning, merged pairwise for coarser ones
+	int parts = 1 << max_po;
+	int part_size = n >> max_po;
+
+	for (int p = 0; p < parts; p++) {
+		int from = p ? p * part_size : order;
+		uint64_t sum = 0;
+
+		for (int i = from; i < (p + 1) * part_size; i++)
+			sum += zigzag(res[i]);
+
+		sums[p] = sum;
+	}
+
+	uint64_t best_bits = UINT64_MAX;
+
+	for (int po = max_po; po >= 0; po--) {
+		int count = 1 << po;
+		int size = n >> po;
+		uint64_t bits = 4;
+		int rice[1 << MAX_PARTITION_ORDER];
+
+		for (int p = 0; p < count; p++) {
+			uint64_t samples = p ? size : size - order;
+			uint64_t mean = samples ? sums[p] / samples : 0;
+			int k = 0;
+
+			while (k < MAX_RICE_PARAM && (mean >> (k + 1)))
+				k++;
+
+			// (sum >> k) is a close estimate of the unary part
+			uint64_t cost = samples * (k + 1) + (sums[p] >> k);
+
+			if (k > 0) {
+				uint64_t lower = samples * k + (sums[p] >> (k - 1));
+
+				if (lower < cost) {
+					cost = lower;
+					k--;
+				}
+			}
+
+			rice[p] = k;
+			bits += 5 + cost;
+		}
+
+		if (bits < best_bits) {
+			best_bits = bits;
+			sf->partition_order = po;
+			memcpy(sf->rice, rice, count * sizeof(int));
+		}
+
+		for (int p = 0; p < count / 2; p++)
+			sums[p] = sums[2 * p] + sums[2 * p + 1];
+	}
+
+	// Exact size of the chosen parameters
+	int count = 1 << sf->partition_order;
+	int size = n >> sf->partition_order;
+	uint64_t bits = 4 + 5 * (uint64_t)count;
+
+	for (int p = 0; p < count; p++) {
+		int k = sf->rice[p];
+
+		for (int i = p ? p * size : order; i < (p + 1) * size; i++)
+			bits += (zigzag(res[i]) >> k) + 1 + k;
+	}
+
+	return bits;
+}
+
+void write_residual(BitWriter& bw, const int32_t* res, int n, int order, const Subframe& sf)
+{
+	int count = 1 << sf.partition_order;
+	int size = n >> sf.partition_order;
+
+	bw.Put(sf.partition_order, 4);
+
+	for (int p = 0; p < count; p++) {
+		int k = sf.rice[p];
+
+		bw.Put(k, 5);
+
+		for (int i = p ? p * size : order; i < (p + 1) * size; i++)
+			bw.PutRice(zigzag(res[i]), k);
+	}
+}
+
+bool read_residual(BitReader& br, int32_t* res, int n, int order)
+{
+	int po = br.Get(4);
+
+	if (po > MAX_PARTITION_ORDER || (n & ((1 << po) - 1)) || (n >> po) < order)
+		return false;
+
+	int count = 1 << po;
+	int size = n >> po;
+
+	for (int p = 0; p < count && !br.HasError(); p++) {
+		int k = br.Get(5);
+
+		for (int i = p ? p * size : order; i < (p + 1) * size && !br.HasError(); i++)
+			res[i] = unzigzag(br.GetRice(k));
+	}
+
+	return !br.HasError();
+}
+
+// Levinson-Durbin on a Welch windowed copy, coefficients for every order
+// up to max_order. Returns the highest usable order.
+int compute_lpc(const int32_t* x, int n, int max_order, double coefs[MAX_LPC_ORDER][MAX_LPC_ORDER], double err[MAX_LPC_ORDER])
+{
+	double ac[MAX_LPC_ORDER + 1] = {};
+	double windowed[8192];
+
+	if (n > 8192)
+		return 0;
+
+	double half = (n - 1) / 2.0;
+	double denom = (n + 1) / 2.0;
+
+	for (int i = 0; i < n; i++) {
+		double w = (i - half) / denom;
+		windowed[i] = x[i] * (1.0 - w * w);
+	}
+
+	for (int lag = 0; lag <= max_order; lag++) {
+		double sum = 0;
+
+		for (int i = lag; i < n; i++)
+			sum += windowed[i] * windowed[i - lag];
+
+		ac[lag] = sum;
+	}
+
+	if (ac[0] <= 0)
+		return 0;
+
+	double a[MAX_LPC_ORDER] = {};
+	double tmp[MAX_LPC_ORDER];
+	double e = ac[0];
+
+	for (int m = 1; m <= max_order; m++) {
+		double acc = ac[m];
+
+		for (int j = 1; j < m; j++)
+			acc -= a[j - 1] * ac[m - j];
+
+		double k = acc / e;
+
+		for (int j = 1; j < m; j++)
+			tmp[j - 1] = a[j - 1] - k * a[m - j - 1];
+
+		for (int j = 1; j < m; j++)
+			a[j - 1] = tmp[j - 1];
+
+		a[m - 1] = k;
+		e *= 1.0 - k * k;
+
+		if (!(e > 0))
+			return m - 1;
+
+		memcpy(coefs[m - 1], a, sizeof(a));
+		err[m - 1] = e;
+	}
+
+	return max_order;
+}
+
+// Quantizes with error feedback so rounding doesn't accumulate
+bool quantize_lpc(const double* coefs, int order, int precision, Subframe* sf)
+{
+	double cmax = 0;
+
+	for (int j = 0; j < order; j++)
+		cmax = std::max(cmax, std::fabs(coefs[j]));
+
+	if (cmax <= 0)
+		return false;
+
+	int log2cmax;
+	std::frexp(cmax, &log2cmax);
+
+	int shift = precision - 1 - log2cmax;
+
+	if (shift > 15)
+		shift = 15;
+
+	if (shift < 0)
+		return false;
+
+	int32_t qmax = (1 << (precision - 1)) - 1;
+	double error = 0;
+
+	for (int j = 0; j < order; j++) {
+		error += coefs[j] * (1 << shift);
+
+		int32_t q = (int32_t)std::lround(error);
+		q = std::min(std::max(q, -qmax - 1), qmax);
+
+		sf->coefs[j] = q;
+		error -= q;
+	}
+
+	sf->precision = precision;
+	sf->shift = shift;
+
+	return true;
+}
+
+// Picks the cheapest coding of one channel, res gets its residual
+void analyze_subframe(const int32_t* x, int n, int sample_bits, int32_t* res, int32_t* scratch, Subframe* sf)
+{
+	Subframe candidate;
+
+	sf->type = SUBFRAME_VERBATIM;
+	sf->order = 0;
+	sf->bits = 2 + (uint64_t)n * sample_bits;
+
+	bool constant = true;
+
+	for (int i = 1; i < n && constant; i++)
+		constant = x[i] == x[0];
+
+	if (constant) {
+		sf->type = SUBFRAME_CONSTANT;
+		sf->bits = 2 + sample_bits;
+		return;
+	}
+
+	// Fixed polynomial predictor
+	candidate.type = SUBFRAME_FIXED;
+	candidate.order = n > MAX_FIXED_ORDER ? best_fixed_order(x, n) : 0;
+
+	fixed_residual(x, n, candidate.order, scratch);
+	candidate.bits = 2 + 3 + (uint64_t)candidate.order * sample_bits + plan_residual(scratch, n, candidate.order, &candidate);
+
+	if (candidate.bits < sf->bits) {
+		*sf = candidate;
+		memcpy(res, scratch, n * sizeof(int32_t));
+	}
+
+	// LPC, order picked from the expected residual bits per sample
+	double coefs[MAX_LPC_ORDER][MAX_LPC_ORDER];
+	double err[MAX_LPC_ORDER];
+
+	int precision = sample_bits <= 17 ? 12 : 15;
+	int max_order = compute_lpc(x, n, std::min(MAX_LPC_ORDER, n / 4), coefs, err);
+
+	int best_order = 0;
+	double best_estimate = 0;
+
+	for (int order = 1; order <= max_order; order++) {
+		double bps = 0.5 * std::log2(0.48045 * err[order - 1] / n);
+		double estimate = (n - order) * std::max(bps, 0.0) + order * (precision + sample_bits);
+
+		if (!best_order || estimate < best_estimate) {
+			best_order = order;
+			best_estimate = estimate;
+		}
+	}
+
+	if (!best_order || !quantize_lpc(coefs[best_order - 1], best_order, precision, &candidate))
+		return;
+
+	candidate.type = SUBFRAME_LPC;
+	candidate.order = best_order;
+
+	// Prediction bound decides between the 32 and 64-bit kernels, and
+	// rejects predictors whose residual might not fit in 32 bits
+	int64_t max_abs = 0;
+	int64_t coef_sum = 0;
+
+	for (int i = 0; i < n; i++)
+		max_abs = std::max(max_abs, (int64_t)std::abs(x[i]));
+
+	for (int j = 0; j < best_order; j++)
+		coef_sum += std::abs(candidate.coefs[j]);
+
+	int64_t bound = coef_sum * max_abs;
+
+	if ((bound >> candidate.shift) + max_abs >= (1LL << 30))
+		return;
+
+	lpc_residual(x, n, candidate.coefs, best_order, candidate.shift, bound < (1LL << 31), scratch);
+	candidate.bits = 2 + 4 + 4 + 5 + (uint64_t)best_order * (precision + sample_bits) + plan_residual(scratch, n, best_order, &candidate);
+
+	if (candidate.bits < sf->bits) {
+		*sf = candidate;
+		memcpy(res, scratch, n * sizeof(int32_t));
+	}
+}
+
+void write_subframe(BitWriter& bw, const int32_t* x, const int32_t* res, int n, int sample_bits, const Subframe& sf)
+{
+	bw.Put(sf.type, 2);
+
+	switch (sf.type)
+	{
+		case SUBFRAME_CONSTANT:
+			bw.Put(x[0], sample_bits);
+			break;
+
+		case SUBFRAME_VERBATIM:
+			for (int i = 0; i < n; i++)
+				bw.Put(x[i], sample_bits);
+
+			break;
+
+		case SUBFRAME_FIXED:
+			bw.Put(sf.order, 3);
+
+			for (int i = 0; i < sf.order; i++)
+				bw.Put(x[i], sample_bits);
+
+			write_residual(bw, res, n, sf.order, sf);
+			break;
+
+		case SUBFRAME_LPC:
+			bw.Put(sf.order - 1, 4);
+			bw.Put(sf.precision - 1, 4);
+			bw.Put(sf.shift, 5);
+
+			for (int j = 0; j < sf.order; j++)
+				bw.Put(sf.coefs[j], sf.precision);
+
+			for (int i = 0; i < sf.order; i++)
+				bw.Put(x[i], sample_bits);
+
+			write_residual(bw, res, n, sf.order, sf);
+			break;
+	}
+}
+
+bool read_subframe(BitReader& br, int32_t* x, int n, int sample_bits)
+{
+	int type = br.Get(2);
+
+	switch (type)
+	{
+		case SUBFRAME_CONSTANT:
+		{
+			int32_t value = br.GetSigned(sample_bits);
+
+			for (int i = 0; i < n; i++)
+				x[i] = value;
+
+			break;
+		}
+
+		case SUBFRAME_VERBATIM:
+			for (int i = 0; i < n; i++)
+				x[i] = br.GetSigned(sample_bits);
+
+			break;
+
+		case SUBFRAME_FIXED:
+		{
+			int order = br.Get(3);
+
+			if (order > MAX_FIXED_ORDER || order > n)
+				return false;
+
+			for (int i = 0; i < order; i++)
+				x[i] = br.GetSigned(sample_bits);
+
+			if (!read_residual(br, x, n, order))
+				return false;
+
+			fixed_restore(x, n, order);
+			break;
+		}
+
+		case SUBFRAME_LPC:
+		{
+			int order = br.Get(4) + 1;
+			int precision = br.Get(4) + 1;
+			int shift = br.Get(5);
+			int32_t coefs[16];
+
+			if (order > n)
+				return false;
+
+			for (int j = 0; j < order; j++)
+				coefs[j] = br.GetSigned(precision);
+
+			for (int i = 0; i < order; i++)
+				x[i] = br.GetSigned(sample_bits);
+
+			if (!read_residual(br, x, n, order))
+				return false;
+
+			for (int i = order; i < n; i++) {
+				int64_t sum = 0;
+
+				for (int j = 0; j < order; j++)
+					sum += (int64_t)coefs[j] * x[i - 1 - j];
+
+				x[i] += (int32_t)(sum >> shift);
+			}
+
+			break;
+		}
+	}
+
+	return !br.HasError();
+}
+
+}
+
+LosslessCodec::LosslessCodec()
+{
+	m_sample_rate = 0;
+	m_channels = 0;
+	m_bits_per_sample = 0;
+	m_frame_size = 0;
+
+	m_stat_frames = 0;
+	m_stat_encode_ns = 0;
+	m_stat_bytes = 0;
+	m_stat_raw_bytes = 0;
+	m_stat_start_ns = 0;
+}
+
+bool LosslessCodec::IsValidConfig(int bits_per_sample, int sample_rate, double frame_ms)
+{
+	if (bits_per_sample != 16 && bits_per_sample != 24)
+		return false;
+
+	if (frame_ms < 2.5 || frame_ms > 20)
+		return false;
+
+	int frame_size = (int)std::lround(sample_rate * frame_ms / 1000.0);
+
+	return frame_size >= 16 && frame_size <= 8192;
+}
+
+bool LosslessCodec::Init(int sample_rate, int channels, int bits_per_sample, double frame_ms, DitherType dither)
+{
+	Close();
+
+	if (!IsValidConfig(bits_per_sample, sample_rate, frame_ms) || channels < 1 || channels > MAX_CHANNELS)
+		return false;
+
+	m_sample_rate = sample_rate;
+	m_channels = channels;
+	m_bits_per_sample = bits_per_sample;
+	m_frame_size = (int)std::lround(sample_rate * frame_ms / 1000.0);
+
+	m_queue.Reset(channels, sample_rate, (size_t)m_frame_size * 8);
+	m_converter.Reset(SampleType::S24In32, channels, dither);
+
+	// Interleaved input, one plane per channel plus mid and side, and a
+	// residual and scratch plane per candidate
+	m_samples.resize((size_t)m_frame_size * channels);
+	m_planes.resize((size_t)m_frame_size * (channels + 2));
+	m_residual.resize((size_t)m_frame_size * (channels + 3));
+
+	m_stat_frames = 0;
+	m_stat_encode_ns = 0;
+	m_stat_bytes = 0;
+	m_stat_raw_bytes = 0;
+	m_stat_start_ns = MonotonicNowNs();
+
+	LOG_INFO("(lossless): %d bit, %d frames per packet%s\n", bits_per_sample, m_frame_size, CpuHasAvx2() ? ", avx2" : "");
+
+	return true;
+}
+
+void LosslessCodec::Close()
+{
+	m_frame_size = 0;
+}
+
+int LosslessCodec::GetFrameSize() const
+{
+	return m_frame_size;
+}
+
+size_t LosslessCodec::GetMaxFrameBytes() const
+{
+	// Every channel verbatim with the widened side channel bit
+	return 4 + (size_t)m_channels * (((size_t)m_frame_size * (m_bits_per_sample + 1) + 2 + 7) / 8);
+}
+
+void LosslessCodec::Push(const float* in, size_t frames, int64_t pts_ns)
+{
+	if (!m_frame_size)
+		return;
+
+	m_queue.Push(in, frames, pts_ns);
+}
+
+int LosslessCodec::EncodeNext(uint8_t* out, size_t max_size, int64_t* pts_ns)
+{
+	if (!m_frame_size || m_queue.GetFrames() < (size_t)m_frame_size)
+		return 0;
+
+	if (max_size < GetMaxFrameBytes())
+		return -1;
+
+	int64_t start_ns = MonotonicNowNs();
+
+	m_converter.Quantize(m_queue.GetData(), m_samples.size(), m_bits_per_sample, m_samples.data());
+
+	size_t size = EncodeFrame(m_samples.data(), out);
+
+	int64_t end_ns = MonotonicNowNs();
+
+	*pts_ns = m_queue.GetPts();
+	m_queue.Pop(m_frame_size);
+
+	m_stat_frames++;
+	m_stat_encode_ns += end_ns - start_ns;
+	m_stat_bytes += size;
+	m_stat_raw_bytes += (int64_t)m_samples.size() * (m_bits_per_sample / 8);
+
+	if (end_ns - m_stat_start_ns >= 10000000000LL)
+		Report(end_ns);
+
+	return (int)size;
+}
+
+size_t LosslessCodec::Flush(int64_t* pts_ns)
+{
+	size_t frames = m_queue.GetFrames();
+
+	*pts_ns = m_queue.GetPts();
+	m_queue.Clear();
+
+	return frames;
+}
+
+size_t LosslessCodec::EncodeFrame(const int32_t* samples, uint8_t* out)
+{
+	int n = m_frame_size;
+	int channels = m_channels;
+
+	int32_t* planes = m_planes.data();
+
+	for (int ch = 0; ch < channels; ch++) {
+		int32_t* plane = planes + (size_t)ch * n;
+
+		for (int i = 0; i < n; i++)
+			plane[i] = samples[(size_t)i * channels + ch];
+	}
+
+	Subframe independent[MAX_CHANNELS];
+	Subframe mid_side[2];
+
+	int32_t* scratch = m_residual.data() + (size_t)(channels + 2) * n;
+
+	for (int ch = 0; ch < channels; ch++)
+		analyze_subframe(planes + (size_t)ch * n, n, m_bits_per_sample, m_residual.data() + (size_t)ch * n, scratch, &independent[ch]);
+
+	int mode = 0;
+
+	// Mid/side only pays off when the channels are correlated
+	if (channels == 2) {
+		int32_t* left = planes;
+		int32_t* right = planes + n;
+		int32_t* mid = planes + 2 * n;
+		int32_t* side = planes + 3 * n;
+
+		for (int i = 0; i < n; i++) {
+			mid[i] = (left[i] + right[i]) >> 1;
+			side[i] = left[i] - right[i];
+		}
+
+		analyze_subframe(mid, n, m_bits_per_sample, m_residual.data() + 2 * (size_t)n, scratch, &mid_side[0]);
+		analyze_subframe(side, n, m_bits_per_sample + 1, m_residual.data() + 3 * (size_t)n, scratch, &mid_side[1]);
+
+		if (mid_side[0].bits + mid_side[1].bits < independent[0].bits + independent[1].bits)
+			mode = 1;
+	}
+
+	out[0] = (uint8_t)mode;
+	out[1] = (uint8_t)m_bits_per_sample;
+	out[2] = (uint8_t)(n & 0xFF);
+	out[3] = (uint8_t)(n >> 8);
+
+	BitWriter bw(out + 4);
+
+	if (mode == 1) {
+		write_subframe(bw, planes + 2 * (size_t)n, m_residual.data() + 2 * (size_t)n, n, m_bits_per_sample, mid_side[0]);
+		write_subframe(bw, planes + 3 * (size_t)n, m_residual.data() + 3 * (size_t)n, n, m_bits_per_sample + 1, mid_side[1]);
+	}
+	else {
+		for (int ch = 0; ch < channels; ch++)
+			write_subframe(bw, planes + (size_t)ch * n, m_residual.data() + (size_t)ch * n, n, m_bits_per_sample, independent[ch]);
+	}
+
+	return 4 + bw.Finish();
+}
+
+int LosslessCodec::Decode(const uint8_t* data, size_t size, int channels, int32_t* out, size_t max_frames)
+{
+	if (size < 4 || channels < 1)
+		return -1;
+
+	int mode = data[0];
+	int bits = data[1];
+	int n = data[2] | (data[3] << 8);
+
+	if (mode > 1 || (mode == 1 && channels != 2) || bits < 8 || bits > 24 || !n || (size_t)n > max_frames)
+		return -1;
+
+	std::vector<int32_t> planes((size_t)n * channels);
+	BitReader br(data + 4, size - 4);
+
+	for (int ch = 0; ch < channels; ch++) {
+		int sample_bits = mode == 1 && ch == 1 ? bits + 1 : bits;
+
+		if (!read_subframe(br, planes.data() + (size_t)ch * n, n, sample_bits))
+			return -1;
+	}
+
+	if (mode == 1) {
+		int32_t* mid = planes.data();
+		int32_t* side = planes.data() + n;
+
+		for (int i = 0; i < n; i++) {
+			int32_t m = (int32_t)((uint32_t)mid[i] << 1) | (side[i] & 1);
+
+			mid[i] = (m + side[i]) >> 1;
+			side[i] = (m - side[i]) >> 1;
+		}
+	}
+
+	for (int ch = 0; ch < channels; ch++) {
+		for (int i = 0; i < n; i++)
+			out[(size_t)i * channels + ch] = planes[(size_t)ch * n + i];
+	}
+
+	return n;
+}
+
+void LosslessCodec::Report(int64_t now_ns)
+{
+	double seconds = (now_ns - m_stat_start_ns) / 1e9;
+
+	if (m_stat_frames) {
+		LOG_INFO("(lossless): %.1f us encode per %.1f ms frame, %.1f kbit/s (%.0f%% of pcm)\n",
+			m_stat_encode_ns / 1e3 / m_stat_frames, m_frame_size * 1000.0 / m_sample_rate,
+			m_stat_bytes * 8 / seconds / 1000, m_stat_raw_bytes ? 100.0 * m_stat_bytes / m_stat_raw_bytes : 0.0);
+	}
+
+	m_stat_frames = 0;
+	m_stat_encode_ns = 0;
+	m_stat_bytes = 0;
+	m_stat_raw_bytes = 0;
+	m_stat_start_ns = now_ns;
+}
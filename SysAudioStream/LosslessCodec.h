@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "FrameQueue.h"
+#include "SampleFormat.h"
+
+// Bit-exact compression of the quantized wire samples in the spirit of
+// FLAC: stereo decorrelation, fixed or LPC prediction per channel and Rice
+// coded residuals. Like Opus, audio is cut into fixed frames and each frame
+// becomes one audio packet.
+//
+// Frame payload:
+//   u8  channel mode (0 independent, 1 mid/side)
+//   u8  bits per sample
+//   u16 frames
+//   one bit packed subframe per channel, each starting with a 2 bit type
+//   (constant, verbatim, fixed, lpc), padded to a byte at the very end
+class LosslessCodec
+{
+public:
+	LosslessCodec();
+
+	// 16 or 24 bit, 2.5 to 20 ms frames
+	static bool IsValidConfig(int bits_per_sample, int sample_rate, double frame_ms);
+
+	bool Init(int sample_rate, int channels, int bits_per_sample, double frame_ms, DitherType dither = DitherType::None);
+	void Close();
+
+	// Frames (per channel) in each encoded packet
+	int GetFrameSize() const;
+
+	// Upper bound of one encoded frame
+	size_t GetMaxFrameBytes() const;
+
+	void Push(const float* in, size_t frames, int64_t pts_ns);
+
+	// Encodes the next complete frame, returns its size in bytes, 0 when
+	// not enough audio is queued and -1 on error
+	int EncodeNext(uint8_t* out, size_t max_size, int64_t* pts_ns);
+
+	// Drops audio queued short of a frame, returns how many frames that
+	// was and the pts of the first
+	size_t Flush(int64_t* pts_ns);
+
+	// Decodes one frame into interleaved samples, returns the frame count or
+	// -1 if the data is malformed
+	static int Decode(const uint8_t* data, size_t size, int channels, int32_t* out, size_t max_frames);
+
+private:
+	size_t EncodeFrame(const int32_t* samples, uint8_t* out);
+	void Report(int64_t now_ns);
+
+	int m_sample_rate;
+	int m_channels;
+	int m_bits_per_sample;
+	int m_frame_size;
+
+	FrameQueue m_queue;
+	SampleConverter m_converter;
+
+	std::vector<int32_t> m_samples;
+	std::vector<int32_t> m_planes;
+	std::vector<int32_t> m_residual;
+
+	// Encode cost and output size since the last report
+	int64_t m_stat_frames;
+	int64_t m_stat_encode_ns;
+	int64_t m_stat_bytes;
+	int64_t m_stat_raw_bytes;
+	int64_t m_stat_start_ns;
+};
@@ -1,4 +1,5 @@
 #include "AudioStream.h"
+#include "ThreadStats.h"
 
 #include <stdint.h>
 #include <stdio.h>
@@ -8,6 +9,8 @@
 #include <random>
 #include <algorithm>
 #include <thread>
+#include <vector>
+#include <sstream>
 
 #ifdef _WIN32
 #include <iphlpapi.h>
@@ -30,6 +33,56 @@ int main()
     int main_socket_port = 5540;
     std::string audio_format;
 
+    // Extra streams captured by this same process, one per config line:
+    // zone <socket port> <device|default> <audio format>
+    struct ZoneConfig
+    {
+        int port;
+        std::string device;
+        std::string audio_format;
+    };
+
+    std::vector<ZoneConfig> zones;
+
+    // Devices mixed into the main stream, one per config line, the first
+    // sets the rate: mix <device|default> [gain dB]
+    std::vector<CaptureSource> mix_sources;
+
+    // Formats offered to receivers besides the configured one, one per
+    // config line: tier <audio format>
+    std::vector<AudioFormatConfig> tiers;
+
+    // realtime <priority> <capture cpus|-> <network cpus|->
+    RealtimeConfig realtime_config;
+
+    // dither <none|tpdf|shaped>
+    DitherType dither = DitherType::None;
+
+    // resampler <low|medium|high>
+    ResamplerQuality resampler_quality = ResamplerQuality::Medium;
+
+    // dtx <on|off> [threshold dBFS] [hold ms]
+    bool dtx_enabled = true;
+    double dtx_threshold_dbfs = -80.0;
+    int dtx_hold_ms = 300;
+
+#ifdef __linux__
+    // PulseAudio overflows, holes and latency that count as trouble within
+    // 10 s: capture_alert <latency ms|0> <losses|0> [retune|log]
+    CaptureAlertConfig capture_alert;
+#endif
+
+    // OpenMetrics endpoint on 127.0.0.1: metrics <port|/unix/socket/path>
+    std::string metrics_address;
+
+    // Trace dumps after glitches and on SIGUSR1, needs a build with
+    // SAS_WITH_TRACE: trace <directory>
+    std::string trace_directory;
+
+    // Queued logging from the audio threads, journal prefixes the levels for
+    // journald: log <error|warning|info|debug> [stdout|journal|syslog]
+    LogConfig log_config;
+
     std::ifstream fin;
     std::ofstream fout;
 
@@ -67,6 +120,149 @@ int main()
 
         main_socket_port = std::stoi(temp_str);
 
+        while (std::getline(fin, temp_str)) {
+            std::stringstream line(temp_str);
+            std::string key;
+
+            if (!(line >> key))
+                continue;
+
+            if (key == "zone") {
+                ZoneConfig zone;
+                AudioFormatConfig format;
+
+                // The rest is an audio format line, frame ms and all
+                if (!(line >> zone.port >> zone.device >> std::ws) || !std::getline(line, zone.audio_format) ||
+                    !AudioStream::ParseAudioFormat(zone.audio_format, &format)) {
+                    printf("(warning-main): ignoring invalid zone line '%s'\n", temp_str.c_str());
+                    continue;
+                }
+
+                if (zone.device == "default")
+                    zone.device.clear();
+
+                zones.push_back(zone);
+            }
+            else if (key == "mix") {
+                CaptureSource source;
+
+                if (!(line >> source.device)) {
+                    printf("(warning-main): ignoring invalid mix line '%s'\n", temp_str.c_str());
+                    continue;
+                }
+
+                if (!(line >> source.gain_db))
+                    source.gain_db = 0.0;
+
+                if (source.device == "default")
+                    source.device.clear();
+
+                mix_sources.push_back(source);
+            }
+            else if (key == "tier") {
+                std::string tier_format;
+                AudioFormatConfig tier;
+
+                std::getline(line, tier_format);
+
+                if (!AudioStream::ParseAudioFormat(tier_format, &tier)) {
+                    printf("(warning-main): ignoring invalid tier line '%s'\n", temp_str.c_str());
+                    continue;
+                }
+
+                tiers.push_back(tier);
+            }
+            else if (key == "realtime") {
+                std::string capture_cpus = "-", network_cpus = "-";
+                int priority = realtime_config.priority;
+                std::vector<int> capture_list, network_list;
+
+                // Words left out keep their defaults, wrong ones disable it
+                line >> priority >> capture_cpus >> network_cpus;
+
+                if ((line.fail() && !line.eof()) || !ParseCpuList(capture_cpus, &capture_list) || !ParseCpuList(network_cpus, &network_list)) {
+                    printf("(warning-main): ignoring invalid realtime line '%s'\n", temp_str.c_str());
+                    continue;
+                }
+
+                realtime_config.enabled = true;
+                realtime_config.priority = priority;
+                realtime_config.capture_cpus = capture_list;
+                realtime_config.network_cpus = network_list;
+            }
+            else if (key == "dither") {
+                std::string name;
+
+                if (!(line >> name) || !ParseDitherType(name, &dither))
+                    printf("(warning-main): ignoring invalid dither line '%s'\n", temp_str.c_str());
+            }
+            else if (key == "resampler") {
+                std::string name;
+
+                if (!(line >> name) || !ParseResamplerQuality(name, &resampler_quality))
+                    printf("(warning-main): ignoring invalid resampler line '%s'\n", temp_str.c_str());
+            }
+            else if (key == "dtx") {
+                std::string mode;
+                double threshold;
+                int hold_ms;
+
+                if (!(line >> mode) || (mode != "on" && mode != "off")) {
+                    printf("(warning-main): ignoring invalid dtx line '%s'\n", temp_str.c_str());
+                    continue;
+                }
+
+                dtx_enabled = mode == "on";
+
+                if (line >> threshold) {
+                    dtx_threshold_dbfs = threshold;
+
+                    if (line >> hold_ms)
+                        dtx_hold_ms = hold_ms;
+                }
+            }
+            else if (key == "metrics") {
+                std::string address;
+
+                if (!(line >> address) || (address[0] != '/' && address.find_first_not_of("0123456789") != std::string::npos)) {
+                    printf("(warning-main): ignoring invalid metrics line '%s'\n", temp_str.c_str());
+                    continue;
+                }
+
+                metrics_address = address;
+            }
+            else if (key == "capture_alert") {
+#ifdef __linux__
+                std::string mode = "log";
+
+                if (!(line >> capture_alert.max_latency_ms >> capture_alert.max_losses) || ((line >> mode) && mode != "retune" && mode != "log")) {
+                    printf("(warning-main): ignoring invalid capture_alert line '%s'\n", temp_str.c_str());
+                    capture_alert = CaptureAlertConfig();
+                    continue;
+                }
+
+                capture_alert.retune = mode == "retune";
+#else
+                printf("(warning-main): capture_alert needs PulseAudio, ignoring it\n");
+#endif
+            }
+            else if (key == "trace") {
+                if (!(line >> trace_directory))
+                    printf("(warning-main): ignoring invalid trace line '%s'\n", temp_str.c_str());
+            }
+            else if (key == "log") {
+                std::string level, sink = "stdout";
+
+                if (!(line >> level) || !ParseLogLevel(level, &log_config.level) || ((line >> sink) && !ParseLogSink(sink, &log_config.sink))) {
+                    printf("(warning-main): ignoring invalid log line '%s'\n", temp_str.c_str());
+                    log_config = LogConfig();
+                }
+            }
+            else {
+                printf("(warning-main): ignoring unknown config line '%s'\n", temp_str.c_str());
+            }
+        }
+
         fin.close();
     }
 
@@ -190,8 +386,69 @@ int main()
     printf("(main): pair code = %s\n", pair_code.c_str());
     printf("(main): audio config = %s\n\n", audio_format.c_str());
 
-    std::unique_ptr<AudioStream> audio_stream = std::make_unique<AudioStream>(pair_code, main_socket_port, audio_format);
-    bool initialized = audio_stream->Init();
+    for (const ZoneConfig& zone : zones) {
+        printf("(main): zone socket port = %d, device = %s, audio config = %s\n", zone.port,
+            zone.device.empty() ? "default" : zone.device.c_str(), zone.audio_format.c_str());
+    }
+
+    if (!zones.empty())
+        printf("\n");
+
+    for (const CaptureSource& source : mix_sources) {
+        printf("(main): mixed source = %s, gain = %.1f dB\n", source.device.empty() ? "default" : source.device.c_str(), source.gain_db);
+    }
+
+    if (!mix_sources.empty())
+        printf("\n");
+
+    if (!tiers.empty())
+        printf("(main): %zu extra format tiers\n\n", tiers.size());
+
+    if (realtime_config.enabled) {
+        printf("(main): realtime priority = %d\n\n", realtime_config.priority);
+
+        SetRealtimeConfig(realtime_config);
+
+        if (realtime_config.lock_memory)
+            LockProcessMemory();
+    }
+
+    StartLogging(log_config);
+
+#ifdef __linux__
+    StartThreadStats();
+#endif
+
+    if (!trace_directory.empty())
+        StartTraceDumps(trace_directory);
+
+#ifdef __linux__
+    PulseAudioCapture::SetAlertConfig(capture_alert);
+#endif
+
+    std::vector<std::unique_ptr<AudioStream>> audio_streams;
+    audio_streams.push_back(std::make_unique<AudioStream>(pair_code, main_socket_port, audio_format));
+    audio_streams[0]->SetSources(mix_sources);
+
+    for (const ZoneConfig& zone : zones) {
+        audio_streams.push_back(std::make_unique<AudioStream>(pair_code, zone.port, zone.audio_format, zone.device));
+    }
+
+    bool initialized = true;
+
+    for (auto& audio_stream : audio_streams) {
+        audio_stream->SetDither(dither);
+        audio_stream->SetResamplerQuality(resampler_quality);
+        audio_stream->SetDtx(dtx_enabled, dtx_threshold_dbfs, dtx_hold_ms);
+        audio_stream->SetTiers(tiers);
+        initialized = audio_stream->Init() && initialized;
+    }
+
+    // Started after the streams, which set up sockets on Windows
+    MetricsServer metrics_server;
+
+    if (initialized && !metrics_address.empty() && !metrics_server.Start(metrics_address))
+        printf("(warning-main): metrics endpoint disabled\n");
 
     while (initialized)
     {
@@ -199,7 +456,10 @@ int main()
     }
 
     printf("(main): exiting\n\n");
-    audio_stream.reset();
+    audio_streams.clear();
+    StopTraceDumps();
+    StopThreadStats();
+    StopLogging();
 
 #ifdef _WIN32
     system("pause");
@@ -0,0 +1,353 @@
+#include "pch.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "Realtime.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/un.h>
+#endif
+
+// Upper bounds of the exported histogram buckets
+static const int64_t BUCKET_LIMITS_NS[] = {
+	10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+	100000000, 250000000, 500000000, 1000000000
+};
+
+static std::mutex g_collectors_mutex;
+static std::map<const void*, MetricsCollector> g_collectors;
+
+Histogram::Histogram()
+	: m_shards(new Shard[METRICS_SHARDS])
+{
+	for (int i = 0; i < METRICS_SHARDS; i++) {
+		for (auto& count : m_shards[i].counts)
+			count.store(0, std::memory_order_relaxed);
+
+		m_shards[i].sum.store(0, std::memory_order_relaxed);
+	}
+}
+
+uint64_t Histogram::BucketLimit(int bucket)
+{
+	if (bucket < HISTOGRAM_SUB_COUNT)
+		return (uint64_t)bucket;
+
+	int shift = bucket / HISTOGRAM_SUB_COUNT - 1;
+	uint64_t lowest = (uint64_t)(HISTOGRAM_SUB_COUNT + bucket % HISTOGRAM_SUB_COUNT) << shift;
+
+	return lowest + ((1ULL << shift) - 1);
+}
+
+uint64_t Histogram::CountBelow(int64_t limit_ns) const
+{
+	uint64_t count = 0;
+
+	// A bucket counts once all of it is at or below the limit
+	for (int bucket = 0; bucket < HISTOGRAM_BUCKETS && BucketLimit(bucket) <= (uint64_t)limit_ns; bucket++) {
+		for (int i = 0; i < METRICS_SHARDS; i++)
+			count += m_shards[i].counts[bucket].load(std::memory_order_relaxed);
+	}
+
+	return count;
+}
+
+uint64_t Histogram::Count() const
+{
+	uint64_t count = 0;
+
+	for (int i = 0; i < METRICS_SHARDS; i++) {
+		for (auto& bucket : m_shards[i].counts)
+			count += bucket.load(std::memory_order_relaxed);
+	}
+
+	return count;
+}
+
+uint64_t Histogram::Sum() const
+{
+	uint64_t sum = 0;
+
+	for (int i = 0; i < METRICS_SHARDS; i++)
+		sum += m_shards[i].sum.load(std::memory_order_relaxed);
+
+	return sum;
+}
+
+Counter::Counter()
+{
+	for (auto& shard : m_shards)
+		shard.value.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Counter::Get() const
+{
+	uint64_t value = 0;
+
+	for (auto& shard : m_shards)
+		value += shard.value.load(std::memory_order_relaxed);
+
+	return value;
+}
+
+MetricsWriter::Family& MetricsWriter::GetFamily(const char* name, const char* type, const char* help)
+{
+	Family& family = m_families[name];
+
+	family.type = type;
+	family.help = help;
+
+	return family;
+}
+
+void MetricsWriter::AddCounter(const char* name, const char* help, const std::string& labels, uint64_t value)
+{
+	Family& family = GetFamily(name, "counter", help);
+
+	family.samples += std::string(name) + "_total{" + labels + "} " + std::to_string(value) + "\n";
+}
+
+void MetricsWriter::AddCounter(const char* name, const char* help, const std::string& labels, double value)
+{
+	Family& family = GetFamily(name, "counter", help);
+	char number[32];
+
+	snprintf(number, sizeof(number), "%.9g", value);
+	family.samples += std::string(name) + "_total{" + labels + "} " + number + "\n";
+}
+
+void MetricsWriter::AddGauge(const char* name, const char* help, const std::string& labels, double value)
+{
+	Family& family = GetFamily(name, "gauge", help);
+	char number[32];
+
+	snprintf(number, sizeof(number), "%.9g", value);
+	family.samples += std::string(name) + "{" + labels + "} " + number + "\n";
+}
+
+void MetricsWriter::AddHistogram(const char* name, const char* help, const std::string& labels, const Histogram& histogram)
+{
+	Family& family = GetFamily(name, "histogram", help);
+	std::string prefix = std::string(name) + "_bucket{" + labels + (labels.empty() ? "" : ",");
+	char number[32];
+
+	// Counted before the buckets, so a value recorded meanwhile can't make
+	// a bucket exceed the total
+	uint64_t count = histogram.Count();
+	uint64_t sum = histogram.Sum();
+
+	for (int64_t limit_ns : BUCKET_LIMITS_NS) {
+		snprintf(number, sizeof(number), "%g", limit_ns / 1e9);
+		family.samples += prefix + "le=\"" + number + "\"} " + std::to_string(std::min(histogram.CountBelow(limit_ns), count)) + "\n";
+	}
+
+	family.samples += prefix + "le=\"+Inf\"} " + std::to_string(count) + "\n";
+
+	snprintf(number, sizeof(number), "%.9g", sum / 1e9);
+	family.samples += std::string(name) + "_count{" + labels + "} " + std::to_string(count) + "\n";
+	family.samples += std::string(name) + "_sum{" + labels + "} " + number + "\n";
+}
+
+std::string MetricsWriter::Finish() const
+{
+	std::string text;
+
+	for (auto& entry : m_families) {
+		text += "# TYPE " + entry.first + " " + entry.second.type + "\n";
+		text += "# HELP " + entry.first + " " + entry.second.help + "\n";
+		text += entry.second.samples;
+	}
+
+	text += "# EOF\n";
+
+	return text;
+}
+
+void AddMetricsCollector(const void* owner, MetricsCollector collector)
+{
+	std::lock_guard<std::mutex> lk(g_collectors_mutex);
+
+	g_collectors[owner] = collector;
+}
+
+void RemoveMetricsCollector(const void* owner)
+{
+	std::lock_guard<std::mutex> lk(g_collectors_mutex);
+
+	g_collectors.erase(owner);
+}
+
+std::string RenderMetrics()
+{
+	MetricsWriter writer;
+
+	std::lock_guard<std::mutex> lk(g_collectors_mutex);
+
+	for (auto& entry : g_collectors)
+		entry.second(&writer);
+
+	return writer.Finish();
+}
+
+MetricsServer::MetricsServer()
+{
+	m_socket = -1;
+	m_running = false;
+}
+
+MetricsServer::~MetricsServer()
+{
+	Stop();
+}
+
+bool MetricsServer::Start(const std::string& address)
+{
+	m_address = address;
+
+	#ifdef __linux__
+	if (!address.empty() && address[0] == '/') {
+		sockaddr_un unix_addr{};
+		unix_addr.sun_family = AF_UNIX;
+
+		if (address.size() >= sizeof(unix_addr.sun_path)) {
+			LOG_ERROR("(metrics): socket path %s is too long\n", address.c_str());
+			return false;
+		}
+
+		strcpy(unix_addr.sun_path, address.c_str());
+
+		// Left behind by a previous run
+		unlink(address.c_str());
+
+		m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+		if (m_socket < 0 || bind(m_socket, reinterpret_cast<sockaddr*>(&unix_addr), sizeof(unix_addr)) < 0 || listen(m_socket, 4) < 0) {
+			LOG_ERROR("(metrics): unable to listen on %s: %s (errno: %d)\n", address.c_str(), strerror(errno), errno);
+			return false;
+		}
+	}
+	else
+	#endif
+	{
+		sockaddr_in local_addr{};
+		local_addr.sin_family = AF_INET;
+		local_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		local_addr.sin_port = htons((u_short)std::stoi(address));
+
+		m_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+		int reuse = 1;
+		setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+		if (m_socket < 0 || bind(m_socket, reinterpret_cast<sockaddr*>(&local_addr), sizeof(local_addr)) < 0 || listen(m_socket, 4) < 0) {
+			#if defined(_WIN32)
+			LOG_ERROR("(metrics): unable to listen on port %s: %d\n", address.c_str(), WSAGetLastError());
+			#elif defined(__linux__)
+			LOG_ERROR("(metrics): unable to listen on port %s: %s (errno: %d)\n", address.c_str(), strerror(errno), errno);
+			#endif
+			return false;
+		}
+	}
+
+	LOG_INFO("(metrics): serving OpenMetrics on %s\n", address.c_str());
+
+	m_running = true;
+	m_thread = std::make_unique<std::thread>(&MetricsServer::t_serve, this);
+
+	return true;
+}
+
+void MetricsServer::Stop()
+{
+	if (!m_running)
+		return;
+
+	m_running = false;
+
+	// Wakes the accept
+	#if defined(_WIN32)
+	shutdown(m_socket, SD_BOTH);
+	closesocket(m_socket);
+	#elif defined(__linux__)
+	shutdown(m_socket, SHUT_RDWR);
+	close(m_socket);
+	#endif
+
+	if (m_thread && m_thread->joinable())
+		m_thread->join();
+
+	m_thread.reset();
+
+	#ifdef __linux__
+	if (!m_address.empty() && m_address[0] == '/')
+		unlink(m_address.c_str());
+	#endif
+}
+
+void MetricsServer::t_serve()
+{
+	SetThreadName("sas-metrics");
+
+	std::vector<char> request(4096);
+
+	while (m_running) {
+		auto client = accept(m_socket, nullptr, nullptr);
+
+		#if defined(_WIN32)
+		if (client == INVALID_SOCKET)
+			break;
+		#elif defined(__linux__)
+		if (client < 0)
+			break;
+		#endif
+
+		// The request line is all that matters, a slow client is cut off
+		#if defined(_WIN32)
+		DWORD timeout = 1000;
+		#elif defined(__linux__)
+		timeval timeout = { 1, 0 };
+		#endif
+
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+		int received = recv(client, request.data(), (int)request.size() - 1, 0);
+
+		std::string response;
+
+		if (received > 0 && strncmp(request.data(), "GET ", 4) == 0) {
+			std::string body = RenderMetrics();
+
+			response = "HTTP/1.0 200 OK\r\n"
+				"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+				"Content-Length: " + std::to_string(body.size()) + "\r\n"
+				"Connection: close\r\n\r\n" + body;
+		}
+		else {
+			response = "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		}
+
+		for (size_t sent = 0; sent < response.size();) {
+			#if defined(_WIN32)
+			int ret = send(client, response.data() + sent, (int)(response.size() - sent), 0);
+			#elif defined(__linux__)
+			int ret = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+			#endif
+
+			if (ret <= 0)
+				break;
+
+			sent += ret;
+		}
+
+		#if defined(_WIN32)
+		closesocket(client);
+		#elif defined(__linux__)
+		close(client);
+		#endif
+	}
+}
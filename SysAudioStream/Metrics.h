@@ -0,0 +1,197 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "pch.h"
+
+// Histogram precision: 2^HISTOGRAM_SUB_BITS buckets per power of two, so
+// a recorded value is known to within 12.5%, as in HdrHistogram
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+// Copies of every metric, each written by the threads mapped to it. Few
+// threads record, so each gets a cache line of its own in practice.
+#define METRICS_SHARDS 8
+
+// Index of the calling thread's shard, handed out in turn
+inline int MetricsShard()
+{
+	static std::atomic<int> next_shard{ 0 };
+	static thread_local int shard = next_shard.fetch_add(1, std::memory_order_relaxed) % METRICS_SHARDS;
+
+	return shard;
+}
+
+// Durations in ns. Record is wait-free: a bucket lookup and two relaxed
+// atomic adds in the calling thread's shard, nothing is allocated.
+class Histogram
+{
+public:
+	Histogram();
+
+	void Record(int64_t value_ns)
+	{
+		uint64_t value = value_ns > 0 ? (uint64_t)value_ns : 0;
+		Shard& shard = m_shards[MetricsShard()];
+
+		shard.counts[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+		shard.sum.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	// Recorded values at or below limit_ns, within the bucket precision,
+	// and all of them
+	uint64_t CountBelow(int64_t limit_ns) const;
+	uint64_t Count() const;
+	uint64_t Sum() const;
+
+	static int BucketOf(uint64_t value)
+	{
+		if (value < HISTOGRAM_SUB_COUNT)
+			return (int)value;
+
+		#ifdef _MSC_VER
+		unsigned long msb;
+		_BitScanReverse64(&msb, value);
+		#else
+		int msb = 63 - __builtin_clzll(value);
+		#endif
+
+		int sub = (int)(value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1);
+
+		return ((int)msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT + sub;
+	}
+
+	// Largest value that falls into bucket
+	static uint64_t BucketLimit(int bucket);
+
+private:
+	struct alignas(64) Shard
+	{
+		std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS];
+		std::atomic<uint64_t> sum;
+	};
+
+	std::unique_ptr<Shard[]> m_shards;
+};
+
+class Counter
+{
+public:
+	Counter();
+
+	void Add(uint64_t value = 1)
+	{
+		m_shards[MetricsShard()].value.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	uint64_t Get() const;
+
+private:
+	struct alignas(64) Shard
+	{
+		std::atomic<uint64_t> value;
+	};
+
+	Shard m_shards[METRICS_SHARDS];
+};
+
+// Collects samples by metric family and renders them in the OpenMetrics
+// text format. labels is the inside of the braces, 'stream="5540"'.
+class MetricsWriter
+{
+public:
+	void AddCounter(const char* name, const char* help, const std::string& labels, uint64_t value);
+	void AddCounter(const char* name, const char* help, const std::string& labels, double value);
+	void AddGauge(const char* name, const char* help, const std::string& labels, double value);
+
+	// Exported in seconds, with fixed buckets from 10 us to 1 s
+	void AddHistogram(const char* name, const char* help, const std::string& labels, const Histogram& histogram);
+
+	std::string Finish() const;
+
+private:
+	struct Family
+	{
+		const char* type;
+		const char* help;
+		std::string samples;
+	};
+
+	Family& GetFamily(const char* name, const char* type, const char* help);
+
+	std::map<std::string, Family> m_families;
+};
+
+// Writes the metrics of one owner when they are scraped, from the
+// endpoint's thread
+typedef std::function<void(MetricsWriter* writer)> MetricsCollector;
+
+void AddMetricsCollector(const void* owner, MetricsCollector collector);
+void RemoveMetricsCollector(const void* owner);
+
+// Every registered collector's metrics, OpenMetrics text
+std::string RenderMetrics();
+
+// What one AudioStream records on its capture and send path. Capture
+// backends count holes and overruns into the stream they feed.
+struct StreamMetrics
+{
+	// Between capture callbacks
+	Histogram capture_interval;
+
+	// Downmixing, resampling and encoding of one capture block for all
+	// rate stages and tiers
+	Histogram convert;
+
+	// Per packet
+	Histogram encrypt;
+
+	// From a packet being queued to its batch going out
+	Histogram queue;
+
+	// One batch, sendmmsg on Linux
+	Histogram send;
+
+	// Sampled once a second, how long audio waits in the capture buffers
+	Histogram capture_latency;
+
+	Counter packets;
+	Counter bytes;
+	Counter send_errors;
+	Counter capture_holes;
+	Counter capture_overruns;
+	Counter capture_retunes;
+};
+
+// Serves RenderMetrics over HTTP on 127.0.0.1:port, or on a Unix socket
+// when address starts with '/'. Any GET gets the metrics.
+class MetricsServer
+{
+public:
+	MetricsServer();
+	~MetricsServer();
+
+	bool Start(const std::string& address);
+	void Stop();
+
+private:
+	void t_serve();
+
+	std::string m_address;
+
+	#ifdef _WIN32
+	SOCKET m_socket;
+	#else
+	int m_socket;
+	#endif
+
+	std::atomic<bool> m_running;
+	std::unique_ptr<std::thread> m_thread;
+};
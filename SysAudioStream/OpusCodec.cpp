@@ -0,0 +1,177 @@
+#include "OpusCodec.h"
+#include "Clock.h"
+#include "Log.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+OpusCodec::OpusCodec()
+{
+#ifdef SAS_WITH_OPUS
+	m_encoder = nullptr;
+#endif
+
+	m_sample_rate = 0;
+	m_channels = 0;
+	m_bitrate = 0;
+	m_frame_size = 0;
+
+	m_stat_frames = 0;
+	m_stat_encode_ns = 0;
+	m_stat_bytes = 0;
+	m_stat_start_ns = 0;
+}
+
+OpusCodec::~OpusCodec()
+{
+	Close();
+}
+
+bool OpusCodec::IsAvailable()
+{
+#ifdef SAS_WITH_OPUS
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool OpusCodec::IsValidConfig(int sample_rate, double frame_ms)
+{
+	if (sample_rate != 8000 && sample_rate != 12000 && sample_rate != 16000 &&
+		sample_rate != 24000 && sample_rate != 48000)
+		return false;
+
+	return frame_ms == 2.5 || frame_ms == 5 || frame_ms == 10 || frame_ms == 20;
+}
+
+bool OpusCodec::Init(int sample_rate, int channels, int bitrate, double frame_ms)
+{
+	Close();
+
+	if (!IsValidConfig(sample_rate, frame_ms))
+		return false;
+
+#ifdef SAS_WITH_OPUS
+	int err = OPUS_OK;
+
+	// Restricted low-delay drops the SILK layer and its lookahead
+	m_encoder = opus_encoder_create(sample_rate, channels, OPUS_APPLICATION_RESTRICTED_LOWDELAY, &err);
+
+	if (err != OPUS_OK || !m_encoder) {
+		LOG_ERROR("(opus): opus_encoder_create failed: %s\n", opus_strerror(err));
+		m_encoder = nullptr;
+		return false;
+	}
+
+	opus_encoder_ctl(m_encoder, OPUS_SET_BITRATE(bitrate));
+	opus_encoder_ctl(m_encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_MUSIC));
+
+	m_sample_rate = sample_rate;
+	m_channels = channels;
+	m_bitrate = bitrate;
+	m_frame_size = (int)std::lround(sample_rate * frame_ms / 1000.0);
+
+	m_queue.Reset(channels, sample_rate, (size_t)m_frame_size * 8);
+
+	m_stat_frames = 0;
+	m_stat_encode_ns = 0;
+	m_stat_bytes = 0;
+	m_stat_start_ns = MonotonicNowNs();
+
+	return true;
+#else
+	LOG_ERROR("(opus): server was built without Opus support\n");
+	return false;
+#endif
+}
+
+void OpusCodec::Close()
+{
+#ifdef SAS_WITH_OPUS
+	if (m_encoder)
+		opus_encoder_destroy(m_encoder);
+
+	m_encoder = nullptr;
+#endif
+
+	m_frame_size = 0;
+}
+
+int OpusCodec::GetFrameSize() const
+{
+	return m_frame_size;
+}
+
+int OpusCodec::GetBitrate() const
+{
+	return m_bitrate;
+}
+
+void OpusCodec::Push(const float* in, size_t frames, int64_t pts_ns)
+{
+	if (!m_frame_size)
+		return;
+
+	m_queue.Push(in, frames, pts_ns);
+}
+
+int OpusCodec::EncodeNext(uint8_t* out, size_t max_size, int64_t* pts_ns)
+{
+#ifdef SAS_WITH_OPUS
+	if (!m_encoder || m_queue.GetFrames() < (size_t)m_frame_size)
+		return 0;
+
+	int64_t start_ns = MonotonicNowNs();
+
+	int size = opus_encode_float(m_encoder, m_queue.GetData(), m_frame_size, out, (opus_int32)max_size);
+
+	int64_t end_ns = MonotonicNowNs();
+
+	*pts_ns = m_queue.GetPts();
+	m_queue.Pop(m_frame_size);
+
+	if (size < 0) {
+		LOG_ERROR("(opus): opus_encode_float failed: %s\n", opus_strerror(size));
+		return -1;
+	}
+
+	m_stat_frames++;
+	m_stat_encode_ns += end_ns - start_ns;
+	m_stat_bytes += size;
+
+	if (end_ns - m_stat_start_ns >= 10000000000LL)
+		Report(end_ns);
+
+	return size;
+#else
+	return -1;
+#endif
+}
+
+size_t OpusCodec::Flush(int64_t* pts_ns)
+{
+	size_t frames = m_queue.GetFrames();
+
+	*pts_ns = m_queue.GetPts();
+	m_queue.Clear();
+
+	return frames;
+}
+
+void OpusCodec::Report(int64_t now_ns)
+{
+	double seconds = (now_ns - m_stat_start_ns) / 1e9;
+
+	if (m_stat_frames) {
+		LOG_INFO("(opus): %.1f us encode per %.1f ms frame, %.1f kbit/s (target %d)\n",
+			m_stat_encode_ns / 1e3 / m_stat_frames, m_frame_size * 1000.0 / m_sample_rate,
+			m_stat_bytes * 8 / seconds / 1000, m_bitrate / 1000);
+	}
+
+	m_stat_frames = 0;
+	m_stat_encode_ns = 0;
+	m_stat_bytes = 0;
+	m_stat_start_ns = now_ns;
+}
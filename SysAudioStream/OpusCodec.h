@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "FrameQueue.h"
+
+#ifdef SAS_WITH_OPUS
+#include <opus/opus.h>
+#endif
+
+// Optional Opus stage between capture and encryption. Captured audio of
+// any chunk size is queued and cut into fixed Opus frames, each of which
+// becomes one audio packet.
+class OpusCodec
+{
+public:
+	OpusCodec();
+	~OpusCodec();
+
+	// False when the server was built without libopus
+	static bool IsAvailable();
+
+	// Opus only accepts 8/12/16/24/48 kHz and 2.5/5/10/20 ms frames
+	static bool IsValidConfig(int sample_rate, double frame_ms);
+
+	bool Init(int sample_rate, int channels, int bitrate, double frame_ms);
+	void Close();
+
+	// Frames (per channel) in each encoded packet
+	int GetFrameSize() const;
+	int GetBitrate() const;
+
+	void Push(const float* in, size_t frames, int64_t pts_ns);
+
+	// Encodes the next complete frame, returns its size in bytes, 0 when
+	// not enough audio is queued and -1 on error
+	int EncodeNext(uint8_t* out, size_t max_size, int64_t* pts_ns);
+
+	// Drops audio queued short of a frame, returns how many frames that
+	// was and the pts of the first
+	size_t Flush(int64_t* pts_ns);
+
+private:
+	void Report(int64_t now_ns);
+
+#ifdef SAS_WITH_OPUS
+	OpusEncoder* m_encoder;
+#endif
+
+	int m_sample_rate;
+	int m_channels;
+	int m_bitrate;
+	int m_frame_size;
+
+	FrameQueue m_queue;
+
+	// Encode cost and output size since the last report
+	int64_t m_stat_frames;
+	int64_t m_stat_encode_ns;
+	int64_t m_stat_bytes;
+	int64_t m_stat_start_ns;
+};
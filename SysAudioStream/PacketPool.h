@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "pch.h"
+
+// Buffer an audio packet is built in, IV included, room for the largest
+// datagram
+#define PACKET_BUFFER_SIZE 65536
+
+// Room in front of the payload for the IV and the AudioPacketHeader, so
+// codecs write the payload in place and nothing is moved to prepend them
+#define PACKET_HEADROOM 32
+
+// Largest UDP payload over IPv4, and the largest that fits a 1500 byte
+// Ethernet MTU without IP fragmentation
+#define UDP_MAX_DATAGRAM 65507
+#define UDP_MTU_DATAGRAM 1472
+
+// Payload bytes that fit a datagram of that size next to the IV, the header
+// and the padding block EncryptInPlace always adds, in whole AES blocks
+#define PACKET_PAYLOAD_FOR(datagram) ((((datagram) - PACKET_HEADROOM - 16) / 16) * 16)
+
+// Largest payload of one packet, what a codec frame has to fit
+#define PACKET_MAX_PAYLOAD PACKET_PAYLOAD_FOR(UDP_MAX_DATAGRAM)
+
+// Pcm and float blocks are split at this, so no packet is fragmented and a
+// lost fragment can't take a whole block with it
+#define PACKET_SPLIT_PAYLOAD PACKET_PAYLOAD_FOR(UDP_MTU_DATAGRAM)
+
+// Packets one capture block can queue before they have to go out
+#define PACKET_POOL_SIZE 64
+
+struct PacketBuffer
+{
+	// PACKET_BUFFER_SIZE bytes, 64 byte aligned
+	uint8_t* data;
+
+	// Datagram start within data and its length, set when it is queued
+	uint8_t* packet;
+	size_t size;
+	int64_t queued_ns;
+
+	sockaddr_in addr;
+};
+
+// Fixed set of packet buffers in one cache line aligned block, allocated
+// once. Acquire and Release never allocate; Acquire returns nullptr when
+// every buffer is queued. Not thread safe, the capture thread owns it.
+class PacketPool
+{
+public:
+	PacketPool()
+	{
+		m_storage.resize(PACKET_POOL_SIZE * PACKET_BUFFER_SIZE + 63);
+
+		uint8_t* base = m_storage.data() + ((64 - (uintptr_t)m_storage.data() % 64) % 64);
+
+		m_buffers.resize(PACKET_POOL_SIZE);
+		m_free.reserve(PACKET_POOL_SIZE);
+
+		for (size_t i = 0; i < PACKET_POOL_SIZE; i++) {
+			m_buffers[i].data = base + i * PACKET_BUFFER_SIZE;
+			m_buffers[i].packet = nullptr;
+			m_buffers[i].size = 0;
+
+			m_free.push_back(&m_buffers[PACKET_POOL_SIZE - 1 - i]);
+		}
+	}
+
+	PacketPool(const PacketPool&) = delete;
+	PacketPool& operator=(const PacketPool&) = delete;
+
+	PacketBuffer* Acquire()
+	{
+		if (m_free.empty())
+			return nullptr;
+
+		PacketBuffer* buffer = m_free.back();
+		m_free.pop_back();
+
+		return buffer;
+	}
+
+	void Release(PacketBuffer* buffer)
+	{
+		buffer->packet = nullptr;
+		buffer->size = 0;
+
+		m_free.push_back(buffer);
+	}
+
+	// Where codecs write the payload
+	static uint8_t* GetPayload(PacketBuffer* buffer) { return buffer->data + PACKET_HEADROOM; }
+
+private:
+	std::vector<uint8_t> m_storage;
+	std::vector<PacketBuffer> m_buffers;
+	std::vector<PacketBuffer*> m_free;
+};
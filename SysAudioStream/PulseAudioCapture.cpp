@@ -1,126 +1,29 @@
 #ifdef __linux__
 
 #include "pch.h"
+#include <algorithm>
 #include <sstream>
+#include <vector>
 #include "PulseAudioCapture.h"
-#include <thread>
+#include "Clock.h"
+#include "ChannelMixer.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Trace.h"
 
-pa_operation *pa_op = nullptr;
+// Timing info is refreshed this often while audio is read
+#define TIMING_UPDATE_MS 1000
 
-pa_stream *stream = NULL;
-pa_mainloop *pa_ml = nullptr;
-pa_mainloop_api *pa_mlapi = nullptr;
-pa_context *pa_ctx = nullptr;
+// Alerts are judged over this long, which also spaces out retuning
+#define ALERT_WINDOW_MS 10000
 
-std::unique_ptr<std::thread> mainloop_thread;
+// Range retuning moves the fragment size in
+#define MIN_FRAGMENT_MS 5
+#define MAX_FRAGMENT_MS 200
 
-PulseAudioCapture* self_obj = nullptr;
+CaptureAlertConfig PulseAudioCapture::s_alertConfig;
 
-char* default_device_name = nullptr;
-
-void pa_state_cb(pa_context *c, void *userdata);
-void pa_get_default_sink_monitor(pa_context *c, const pa_server_info *i, void *userdata);
-int pa_set_initial_config();
-
-static pa_sample_spec ss = {
-    .format = PA_SAMPLE_FLOAT32LE,
-    .rate = 48000,
-    .channels = 2
-};
-
-void pa_state_cb(pa_context *c, void *userdata) 
-{
-	pa_context_state_t state;
-	int *pa_ready = (int*) userdata;
-
-	state = pa_context_get_state(c);
-	switch  (state) {
-		case PA_CONTEXT_UNCONNECTED:
-		case PA_CONTEXT_CONNECTING:
-		case PA_CONTEXT_AUTHORIZING:
-		case PA_CONTEXT_SETTING_NAME:
-		default:
-			break;
-
-		case PA_CONTEXT_FAILED:
-            printf("(pulseaudio): Connection failure: %s\n", pa_strerror(pa_context_errno(c)));
-
-		case PA_CONTEXT_TERMINATED:
-			*pa_ready = 2;
-			break;
-		case PA_CONTEXT_READY:
-			*pa_ready = 1;
-			break;
-	}
-}
-
-void pa_get_default_sink_monitor(pa_context *c, const pa_server_info *i, void *userdata)
-{
-	char *monitor = (char*)calloc(strlen(i->default_sink_name) + 9, 1);
-    strcat(monitor, i->default_sink_name);
-	strcat(monitor, ".monitor");
-
-    default_device_name = monitor;
-}
-
-int pa_set_initial_config() 
-{
-    int state = 0;
-    int pa_ready = 0;
-    int ret = 0;
-
-    pa_ml = pa_mainloop_new();
-    pa_mlapi = pa_mainloop_get_api(pa_ml);
-    pa_ctx = pa_context_new(pa_mlapi, "SysAudioStream");
-
-    pa_context_connect(pa_ctx, NULL, PA_CONTEXT_NOFLAGS, NULL);
-    pa_context_set_state_callback(pa_ctx, pa_state_cb, &pa_ready);
-    
-    while (true) {
-        if (pa_ready == 0) {
-            pa_mainloop_iterate(pa_ml, 1, NULL);
-            continue;
-        }
-
-        if (pa_ready == 2) {
-            pa_context_disconnect(pa_ctx);
-            pa_context_unref(pa_ctx);
-            pa_mainloop_free(pa_ml);
-            return -1;
-        }
-
-        switch (state) 
-        {
-            case 0:
-                pa_op = pa_context_get_server_info(pa_ctx, pa_get_default_sink_monitor, NULL);
-                state++;
-                break;
-                
-            case 1:
-                if (pa_operation_get_state(pa_op) == PA_OPERATION_DONE) {
-                    pa_operation_unref(pa_op);
-                    return 0;
-                }
-                break;
-
-            default:
-                printf("(pulseaudio): in state %d\n", state);
-                return -1;
-        }
-
-        pa_mainloop_iterate(pa_ml, 1, NULL);
-    }
-}
-
-void quit(int ret) 
-{
-    if (pa_mlapi) {
-        pa_mlapi->quit(pa_mlapi, ret);
-        pa_mlapi = nullptr;
-    }
-}
-
-void stream_state_callback(pa_stream *s, void *userdata) 
+void PulseAudioCapture::stream_state_callback(pa_stream *s, void *userdata)
 {
     switch (pa_stream_get_state(s)) {
         case PA_STREAM_CREATING:
@@ -132,19 +35,19 @@ void stream_state_callback(pa_stream *s, void *userdata)
                 const pa_buffer_attr *stream_attr;
                 char cmt[PA_CHANNEL_MAP_SNPRINT_MAX], sst[PA_SAMPLE_SPEC_SNPRINT_MAX];
 
-                printf("(pulseaudio): Stream successfully created.\n");
+                LOG_INFO("(pulseaudio): Stream successfully created.\n");
 
                 if (!(stream_attr = pa_stream_get_buffer_attr(s)))
-                    printf("(pulseaudio): pa_stream_get_buffer_attr() failed: %s\n", pa_strerror(pa_context_errno(pa_stream_get_context(s))));
+                    LOG_ERROR("(pulseaudio): pa_stream_get_buffer_attr() failed: %s\n", pa_strerror(pa_context_errno(pa_stream_get_context(s))));
                 else {
-                    printf("(pulseaudio): Buffer metrics: maxlength=%u, fragsize=%u\n", stream_attr->maxlength, stream_attr->fragsize);                    
+                    LOG_DEBUG("(pulseaudio): Buffer metrics: maxlength=%u, fragsize=%u\n", stream_attr->maxlength, stream_attr->fragsize);
                 }
 
-                printf("(pulseaudio): Using sample spec '%s', channel map '%s'.\n",
+                LOG_INFO("(pulseaudio): Using sample spec '%s', channel map '%s'.\n",
                         pa_sample_spec_snprint(sst, sizeof(sst), pa_stream_get_sample_spec(s)),
                         pa_channel_map_snprint(cmt, sizeof(cmt), pa_stream_get_channel_map(s)));
 
-                printf("(pulseaudio): Connected to device %s (%u, %ssuspended).\n",
+                LOG_INFO("(pulseaudio): Connected to device %s (%u, %ssuspended).\n",
                         pa_stream_get_device_name(s),
                         pa_stream_get_device_index(s),
                         pa_stream_is_suspended(s) ? "" : "not ");
@@ -154,94 +57,237 @@ void stream_state_callback(pa_stream *s, void *userdata)
 
         case PA_STREAM_FAILED:
         default:
-            printf("(pulseaudio): Stream error: %s\n", pa_strerror(pa_context_errno(pa_stream_get_context(s))));
-            quit(1);
+            LOG_WARNING("(pulseaudio): Stream error: %s\n", pa_strerror(pa_context_errno(pa_stream_get_context(s))));
     }
 }
 
-void stream_read_callback(pa_stream *s, size_t length, void *userdata) 
+void PulseAudioCapture::stream_read_callback(pa_stream *s, size_t length, void *userdata)
 {
+    PulseAudioCapture *self = (PulseAudioCapture*) userdata;
+
+    TRACE_THREAD("pulseaudio");
+    TRACE_SCOPE("pa_read");
+
     const void *data;
     size_t actualbytes = 0;
 
     if (pa_stream_peek(s, &data, &actualbytes) < 0) {
-        printf("(pulseaudio): pa_stream_peek() failed: %s\n", pa_strerror(pa_context_errno(pa_ctx)));
-        quit(1);
+        LOG_ERROR("(pulseaudio): pa_stream_peek() failed: %s\n", pa_strerror(pa_context_errno(pa_stream_get_context(s))));
         return;
     }
 
     if (!actualbytes) {
-		printf("(pulseaudio): no audio data\n");
+        LOG_WARNING("(pulseaudio): no audio data\n");
         return;
     }
 
 	if (!data) {
-		printf("(pulseaudio): got audio hole of %u bytes\n",
+		LOG_WARNING("(pulseaudio): got audio hole of %u bytes\n",
 		     (unsigned int)actualbytes);
+		if (self->m_metrics)
+			self->m_metrics->capture_holes.Add();
+		TRACE_GLITCH("capture hole");
+		self->CheckAlert(MonotonicNowNs(), 1, 0);
 		pa_stream_drop(s);
 		return;
 	}
 
-    self_obj->m_callback(actualbytes, (uint8_t*) data);
+    int64_t now_ns = MonotonicNowNs();
+
+    if (now_ns - self->m_lastTimingNs >= TIMING_UPDATE_MS * 1000000LL) {
+        pa_operation *op = pa_stream_update_timing_info(s, stream_timing_callback, self);
+
+        if (op)
+            pa_operation_unref(op);
+
+        self->m_lastTimingNs = now_ns;
+    }
+    self->m_schedStats.Record(now_ns, (int64_t)(pa_bytes_to_usec(actualbytes, &self->m_sampleSpec) * 1000));
+
+    // The oldest frame in the record buffer was captured 'latency' ago. A
+    // monitor source sees it before the sink plays it, so add the sink latency.
+    int64_t pts_ns = now_ns;
+    pa_usec_t latency = 0;
+    int negative = 0;
+
+    if (pa_stream_get_latency(s, &latency, &negative) == 0) {
+        pts_ns += negative ? (int64_t)latency * 1000 : -(int64_t)latency * 1000;
+
+        const pa_timing_info *timing = pa_stream_get_timing_info(s);
+
+        if (timing)
+            pts_ns += (int64_t)timing->sink_usec * 1000;
+    }
+
+    self->m_callback(actualbytes, (uint8_t*) data, pts_ns);
 
     pa_stream_drop(s);
 }
 
-void stream_suspended_callback(pa_stream *s, void *userdata) 
+void PulseAudioCapture::stream_suspended_callback(pa_stream *s, void *userdata)
 {
     if (pa_stream_is_suspended(s))
-        printf("(pulseaudio): Stream device suspended.\n");
+        LOG_INFO("(pulseaudio): Stream device suspended.\n");
     else
-        printf("(pulseaudio): Stream device resumed.\n");
-    
+        LOG_INFO("(pulseaudio): Stream device resumed.\n");
+
 }
 
-void stream_started_callback(pa_stream *s, void *userdata) 
+void PulseAudioCapture::stream_started_callback(pa_stream *s, void *userdata)
 {
-    printf("(pulseaudio): Stream started.\n");
+    LOG_INFO("(pulseaudio): Stream started.\n");
 }
 
-void stream_moved_callback(pa_stream *s, void *userdata) 
+void PulseAudioCapture::stream_moved_callback(pa_stream *s, void *userdata)
 {
-    printf("(pulseaudio): Stream moved to device %s (%u, %ssuspended).\n", pa_stream_get_device_name(s), pa_stream_get_device_index(s), pa_stream_is_suspended(s) ? "" : "not ");
+    LOG_INFO("(pulseaudio): Stream moved to device %s (%u, %ssuspended).\n", pa_stream_get_device_name(s), pa_stream_get_device_index(s), pa_stream_is_suspended(s) ? "" : "not ");
 }
 
-void stream_buffer_attr_callback(pa_stream *s, void *userdata) 
+void PulseAudioCapture::stream_buffer_attr_callback(pa_stream *s, void *userdata)
 {
-    printf("(pulseaudio): Stream buffer attributes changed. \n");
+    const pa_buffer_attr *stream_attr = pa_stream_get_buffer_attr(s);
+
+    if (stream_attr)
+        LOG_INFO("(pulseaudio): Stream buffer attributes changed: maxlength=%u, fragsize=%u\n", stream_attr->maxlength, stream_attr->fragsize);
+    else
+        LOG_INFO("(pulseaudio): Stream buffer attributes changed.\n");
 }
 
-void stream_event_callback(pa_stream *s, const char *name, pa_proplist *pl, void *userdata) 
+void PulseAudioCapture::stream_overflow_callback(pa_stream *s, void *userdata)
 {
-    char *t;
+    PulseAudioCapture *self = (PulseAudioCapture*) userdata;
 
-    t = pa_proplist_to_string_sep(pl, ", ");
-    printf("(pulseaudio): Got event '%s', properties '%s'\n", name, t);
-    pa_xfree(t);
+    LOG_WARNING("(pulseaudio): Stream buffer overflow, audio was dropped\n");
+
+    if (self->m_metrics)
+        self->m_metrics->capture_overruns.Add();
+
+    TRACE_GLITCH("capture overflow");
+    self->CheckAlert(MonotonicNowNs(), 1, 0);
+}
+
+void PulseAudioCapture::stream_timing_callback(pa_stream *s, int success, void *userdata)
+{
+    PulseAudioCapture *self = (PulseAudioCapture*) userdata;
+    pa_usec_t latency = 0;
+    int negative = 0;
+
+    if (!success || pa_stream_get_latency(s, &latency, &negative) < 0)
+        return;
+
+    // How long the newest audio waited in the source and stream buffers
+    int64_t latency_ns = negative ? 0 : (int64_t)latency * 1000;
+
+    if (self->m_metrics)
+        self->m_metrics->capture_latency.Record(latency_ns);
+
+    self->CheckAlert(MonotonicNowNs(), 0, latency_ns);
 }
 
-void t_mainloop_thread()
-{    
-    printf("(pulseaudio): mainloop thread started\n");
+void PulseAudioCapture::CheckAlert(int64_t now_ns, int losses, int64_t latency_ns)
+{
+    if (!m_alertWindowNs)
+        m_alertWindowNs = now_ns;
 
-    int ret = 0;
+    m_windowLosses += losses;
+    m_windowMaxLatencyNs = std::max(m_windowMaxLatencyNs, latency_ns);
 
-    if (pa_mainloop_run(pa_ml, &ret) < 0) {
-        printf("(pulseaudio): pa_mainloop_run() failed.\n");
+    if (now_ns - m_alertWindowNs < ALERT_WINDOW_MS * 1000000LL)
         return;
+
+    bool lossy = s_alertConfig.max_losses && m_windowLosses >= s_alertConfig.max_losses;
+    bool slow = s_alertConfig.max_latency_ms && m_windowMaxLatencyNs > s_alertConfig.max_latency_ms * 1000000LL;
+
+    if (lossy || slow) {
+        LOG_WARNING("(pulseaudio): Capture alert: %d overflows or holes, latency up to %.1f ms in the last %d s\n",
+            m_windowLosses, m_windowMaxLatencyNs / 1e6, ALERT_WINDOW_MS / 1000);
+
+        // Losing audio is worse than latency, a larger fragment comes first
+        if (s_alertConfig.retune)
+            RetuneBuffer(lossy);
     }
 
-    printf("(pulseaudio): mainloop thread ended\n");
+    m_alertWindowNs = now_ns;
+    m_windowLosses = 0;
+    m_windowMaxLatencyNs = 0;
 }
 
-PulseAudioCapture::PulseAudioCapture() 
+void PulseAudioCapture::RetuneBuffer(bool grow)
 {
-    self_obj = this;
+    const pa_buffer_attr *current = m_stream ? pa_stream_get_buffer_attr(m_stream) : nullptr;
+
+    if (!current)
+        return;
+
+    pa_buffer_attr attr = *current;
+    uint32_t frame_size = (uint32_t)pa_frame_size(&m_sampleSpec);
+    uint32_t min_bytes = (uint32_t)pa_usec_to_bytes(MIN_FRAGMENT_MS * 1000, &m_sampleSpec);
+    uint32_t max_bytes = (uint32_t)pa_usec_to_bytes(MAX_FRAGMENT_MS * 1000, &m_sampleSpec);
+    uint32_t fragsize;
+
+    // Fewer, larger reads ride out a starved mainloop, smaller ones hand the
+    // audio on sooner
+    if (grow)
+        fragsize = std::max(attr.fragsize, std::min(attr.fragsize * 2, max_bytes));
+    else
+        fragsize = std::min(attr.fragsize, std::max(attr.fragsize / 2 / frame_size * frame_size, min_bytes));
+
+    if (fragsize == attr.fragsize) {
+        LOG_WARNING("(pulseaudio): Fragment of %.1f ms is already the %s retuning allows\n",
+            pa_bytes_to_usec(attr.fragsize, &m_sampleSpec) / 1000.0, grow ? "largest" : "smallest");
+        return;
+    }
+
+    LOG_INFO("(pulseaudio): Retuning the fragment from %.1f to %.1f ms\n",
+        pa_bytes_to_usec(attr.fragsize, &m_sampleSpec) / 1000.0, pa_bytes_to_usec(fragsize, &m_sampleSpec) / 1000.0);
+
+    attr.fragsize = fragsize;
+    attr.maxlength = (uint32_t)-1;
+
+    pa_operation *op = pa_stream_set_buffer_attr(m_stream, &attr, nullptr, nullptr);
+
+    if (op)
+        pa_operation_unref(op);
+
+    if (m_metrics)
+        m_metrics->capture_retunes.Add();
 }
 
-PulseAudioCapture::~PulseAudioCapture() 
+void PulseAudioCapture::stream_event_callback(pa_stream *s, const char *name, pa_proplist *pl, void *userdata)
 {
+    char *t;
 
+    t = pa_proplist_to_string_sep(pl, ", ");
+    LOG_DEBUG("(pulseaudio): Got event '%s', properties '%s'\n", name, t);
+    pa_xfree(t);
+}
+
+PulseAudioCapture::PulseAudioCapture()
+{
+    m_stream = nullptr;
+    m_metrics = nullptr;
+
+    m_lastTimingNs = 0;
+    m_alertWindowNs = 0;
+    m_windowLosses = 0;
+    m_windowMaxLatencyNs = 0;
+
+    m_sampleSpec.format = PA_SAMPLE_FLOAT32LE;
+    m_sampleSpec.rate = 48000;
+    m_sampleSpec.channels = 2;
+
+    pa_channel_map_init_extend(&m_channelMap, m_sampleSpec.channels, PA_CHANNEL_MAP_WAVEEX);
+
+    m_audioFormat = 0;
+    m_nChannels = 0;
+    m_sampleRate = 0;
+    m_enginePeriod = 0;
+    m_bitsPerSample = 0;
+}
+
+PulseAudioCapture::~PulseAudioCapture()
+{
+    StopCapture();
 }
 
 void PulseAudioCapture::SetAudioReadyCallback(PacketCallback callback)
@@ -249,13 +295,38 @@ void PulseAudioCapture::SetAudioReadyCallback(PacketCallback callback)
     m_callback = callback;
 }
 
-bool PulseAudioCapture::InitializeAudioDevice(std::string audio_fmt)
+void PulseAudioCapture::SetDeviceName(std::string device_name)
+{
+    m_deviceName = device_name;
+}
+
+void PulseAudioCapture::SetMetrics(StreamMetrics* metrics)
+{
+    m_metrics = metrics;
+}
+
+void PulseAudioCapture::SetAlertConfig(const CaptureAlertConfig& config)
+{
+    s_alertConfig = config;
+}
+
+bool PulseAudioCapture::InitializeAudioDevice(const std::string& audio_fmt)
 {
-    if (pa_set_initial_config() < 0) {
-        printf("(pulseaudio): Failed to set initial PulseAudio configuration\n");
+    // The server connection is kept for the lifetime of this object so a
+    // reconnecting client doesn't pay for a new context and stream
+    if (m_context && !m_context->IsConnected())
+        StopCapture();
+
+    if (!m_context)
+        m_context = PulseAudioContext::Acquire();
+
+    if (!m_context) {
+        LOG_ERROR("(pulseaudio): Failed to set initial PulseAudio configuration\n");
         return false;
     }
 
+    std::string record_device = m_deviceName.empty() ? m_context->GetDefaultSinkMonitor() : m_deviceName;
+
     std::vector<std::string> audio_config;
 
     std::string temp;
@@ -265,8 +336,10 @@ bool PulseAudioCapture::InitializeAudioDevice(std::string audio_fmt)
         audio_config.push_back(temp);
     }
 
-    if (audio_config.size() != 3) {
-        printf("(pulseaudio): Audio format has invalid number of configurations\n");
+    // An optional fourth token fixes the channel count, the server then
+    // converts to it
+    if (audio_config.size() != 3 && audio_config.size() != 4) {
+        LOG_ERROR("(pulseaudio): Audio format has invalid number of configurations\n");
         return false;
     }
 
@@ -274,132 +347,225 @@ bool PulseAudioCapture::InitializeAudioDevice(std::string audio_fmt)
     std::string config_bits = audio_config[1];
     std::string config_rate = audio_config[2];
 
-    m_bitsPerSample = std::stoi(config_bits);
-    m_sampleRate = std::stoi(config_rate);
+    // Capture always runs in float, AudioStream converts to the wire format
+    pa_sample_spec sample_spec = m_sampleSpec;
+
+    int bits_per_sample = std::stoi(config_bits);
+    int audio_format;
 
-    ss.rate = m_sampleRate;
+    sample_spec.format = PA_SAMPLE_FLOAT32LE;
+
+    // "native" records at the rate and channel count the sink already runs
+    // at so the server neither resamples nor downmixes, AudioStream
+    // converts per client instead
+    if (config_rate == "native") {
+        pa_sample_spec source_spec;
+        pa_channel_map source_map;
+
+        if (!record_device.empty() && m_context->GetSourceSampleSpec(record_device, &source_spec, &source_map)) {
+            char cmt[PA_CHANNEL_MAP_SNPRINT_MAX];
+
+            int channels = std::min((int)source_spec.channels, MAX_MIX_CHANNELS);
+
+            // Odd counts are widened to the next layout the mixer knows
+            while (!IsKnownChannelLayout(channels))
+                channels++;
+
+            sample_spec.rate = source_spec.rate;
+            sample_spec.channels = channels;
+
+            LOG_INFO("(pulseaudio): Sink runs at %u Hz with channel map '%s', capturing %s\n", source_spec.rate,
+                pa_channel_map_snprint(cmt, sizeof(cmt), &source_map), GetChannelLayoutName(channels).c_str());
+        }
+        else {
+            LOG_WARNING("(pulseaudio): Unknown native format of '%s', using %u Hz\n", record_device.c_str(), sample_spec.rate);
+        }
+    }
+    else {
+        sample_spec.rate = std::stoi(config_rate);
+    }
+
+    if (audio_config.size() == 4) {
+        int channels = std::stoi(audio_config[3]);
+
+        if (channels < 1 || channels > MAX_MIX_CHANNELS) {
+            LOG_ERROR("(pulseaudio): Unsupported channel count %d\n", channels);
+            return false;
+        }
+
+        sample_spec.channels = channels;
+    }
 
     if (config_fmt == "pcm") {
-        switch (m_bitsPerSample)
-        {
-            case 16:
-                ss.format = PA_SAMPLE_S16LE;
-                break;
-            
-            case 24:
-                ss.format = PA_SAMPLE_S24LE;
-                break;
-
-            case 32:
-                ss.format = PA_SAMPLE_S32LE;
-                break;
+        if (bits_per_sample != 16 && bits_per_sample != 24 && bits_per_sample != 32) {
+            LOG_ERROR("(pulseaudio): Unsupported pcm bits per sample %d\n", bits_per_sample);
+            return false;
         }
 
-        m_audioFormat = 0;
+        audio_format = 0;
     }
     else if (config_fmt == "float") {
-        ss.format = PA_SAMPLE_FLOAT32LE;
-        m_bitsPerSample = 32;
-        m_audioFormat = 1;
+        bits_per_sample = 32;
+        audio_format = 1;
     }
-    else return false;
+    else if (config_fmt == "lossless") {
+        if (bits_per_sample != 16 && bits_per_sample != 24) {
+            LOG_ERROR("(pulseaudio): Unsupported lossless bits per sample %d\n", bits_per_sample);
+            return false;
+        }
 
-    m_nChannels = ss.channels;
-    m_enginePeriod = 0;
+        audio_format = 3;
+    }
+    else return false;
 
-    if (!pa_sample_spec_valid(&ss)) {
-        printf("(pulseaudio): Invalid sample specification\n");
+    if (!pa_sample_spec_valid(&sample_spec)) {
+        LOG_ERROR("(pulseaudio): Invalid sample specification\n");
         return false;
     }
 
-    return true;
-}
-
-void PulseAudioCapture::StopCapture()
-{
-    quit(1);
+    PulseAudioLock lock(m_context.get());
 
-    if (mainloop_thread) {
-        if (mainloop_thread->joinable())
-            mainloop_thread->join();
+    m_bitsPerSample = bits_per_sample;
+    m_audioFormat = audio_format;
 
-        mainloop_thread.reset();
+    // Keep the pre-warmed stream if nothing about it changed
+    if (m_stream && PA_STREAM_IS_GOOD(pa_stream_get_state(m_stream)) &&
+        record_device == m_recordDevice &&
+        sample_spec.rate == m_sampleSpec.rate &&
+        sample_spec.channels == m_sampleSpec.channels) {
+        return true;
     }
 
-    mainloop_thread = nullptr;
+    DestroyStream();
 
-    if (stream) {
-		pa_stream_set_read_callback(stream, NULL, NULL);
-        pa_stream_set_state_callback(stream, NULL, NULL);
-        pa_stream_set_suspended_callback(stream, NULL, NULL);
-        pa_stream_set_moved_callback(stream, NULL, NULL);
-        pa_stream_set_started_callback(stream, NULL, NULL);
-        pa_stream_set_event_callback(stream, NULL, NULL);
-        pa_stream_set_buffer_attr_callback(stream, NULL, NULL);
+    m_sampleSpec = sample_spec;
+    m_recordDevice = record_device;
 
-        pa_stream_disconnect(stream);
-        pa_stream_unref(stream);
-    }
+    // Channels in the WAVE order AudioStream's downmix expects, the server
+    // only reorders to get there
+    pa_channel_map_init_extend(&m_channelMap, m_sampleSpec.channels, PA_CHANNEL_MAP_WAVEEX);
 
-    stream = nullptr;
+    m_sampleRate = sample_spec.rate;
+    m_nChannels = m_sampleSpec.channels;
+    m_enginePeriod = 0;
 
-    if (pa_ctx) {
-		pa_context_disconnect(pa_ctx);
-        pa_context_unref(pa_ctx);
-    }
+    return CreateStream();
+}
+
+bool PulseAudioCapture::CreateStream()
+{
+    pa_context *ctx = m_context->GetContext();
 
-    pa_ctx = nullptr;
+    if (!(m_stream = pa_stream_new(ctx, "Desktop Audio", &m_sampleSpec, &m_channelMap))) {
+        LOG_ERROR("(pulseaudio): pa_stream_new() failed: %s\n", pa_strerror(pa_context_errno(ctx)));
+        return false;
+    }
 
-    if (pa_ml) {
-        pa_mainloop_free(pa_ml);        
+    pa_stream_set_state_callback(m_stream, stream_state_callback, this);
+    pa_stream_set_read_callback(m_stream, stream_read_callback, this);
+    pa_stream_set_suspended_callback(m_stream, stream_suspended_callback, this);
+    pa_stream_set_moved_callback(m_stream, stream_moved_callback, this);
+    pa_stream_set_started_callback(m_stream, stream_started_callback, this);
+    pa_stream_set_event_callback(m_stream, stream_event_callback, this);
+    pa_stream_set_buffer_attr_callback(m_stream, stream_buffer_attr_callback, this);
+    pa_stream_set_overflow_callback(m_stream, stream_overflow_callback, this);
+
+    // The stream stays corked until a client asks to play
+    pa_stream_flags_t flags = (pa_stream_flags_t)(PA_STREAM_START_CORKED | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE);
+
+    if (pa_stream_connect_record(m_stream, m_recordDevice.empty() ? NULL : m_recordDevice.c_str(), 0, flags) < 0) {
+        LOG_ERROR("(pulseaudio): pa_stream_connect_record() failed: %s\n", pa_strerror(pa_context_errno(ctx)));
+        pa_stream_unref(m_stream);
+        m_stream = nullptr;
+        return false;
     }
 
-    pa_ml = nullptr;
+    return true;
 }
 
-void PulseAudioCapture::AsyncStartCapture()
+void PulseAudioCapture::DestroyStream()
 {
-    int r;
-    pa_buffer_attr buffer_attr;
+    if (m_stream) {
+        pa_stream_set_read_callback(m_stream, NULL, NULL);
+        pa_stream_set_state_callback(m_stream, NULL, NULL);
+        pa_stream_set_suspended_callback(m_stream, NULL, NULL);
+        pa_stream_set_moved_callback(m_stream, NULL, NULL);
+        pa_stream_set_started_callback(m_stream, NULL, NULL);
+        pa_stream_set_event_callback(m_stream, NULL, NULL);
+        pa_stream_set_buffer_attr_callback(m_stream, NULL, NULL);
+        pa_stream_set_overflow_callback(m_stream, NULL, NULL);
+
+        pa_stream_disconnect(m_stream);
+        pa_stream_unref(m_stream);
+    }
 
-    if (!(stream = pa_stream_new(pa_ctx, "Desktop Audio", &ss, NULL))) {
-        printf("(pulseaudio): pa_stream_new() failed: %s\n", pa_strerror(pa_context_errno(pa_ctx)));
-        StopCapture();
+    m_stream = nullptr;
+}
+
+void PulseAudioCapture::StopCapture()
+{
+    if (!m_context)
         return;
+
+    {
+        PulseAudioLock lock(m_context.get());
+        DestroyStream();
     }
 
-    pa_stream_set_state_callback(stream, stream_state_callback, NULL);
-    pa_stream_set_read_callback(stream, stream_read_callback, NULL);
-    pa_stream_set_suspended_callback(stream, stream_suspended_callback, NULL);
-    pa_stream_set_moved_callback(stream, stream_moved_callback, NULL);
-    pa_stream_set_started_callback(stream, stream_started_callback, NULL);
-    pa_stream_set_event_callback(stream, stream_event_callback, NULL);
-    pa_stream_set_buffer_attr_callback(stream, stream_buffer_attr_callback, NULL);
+    // The mainloop is torn down once the last instance lets go of it
+    m_context.reset();
+}
+
+void PulseAudioCapture::AsyncStartCapture()
+{
+    if (!m_context)
+        return;
 
-	pa_stream_flags_t flags = PA_STREAM_START_CORKED;
+    PulseAudioLock lock(m_context.get());
 
-    if ((r = pa_stream_connect_record(stream, default_device_name, 0, flags)) < 0) {
-        printf("(pulseaudio): pa_stream_connect_record() failed: %s\n", pa_strerror(pa_context_errno(pa_ctx)));
-        StopCapture();
+    if (!m_stream && !CreateStream())
         return;
-    }
 
-    free(default_device_name);
+    // A new session starts paused and without audio left over from the last one
+    pa_operation *op = pa_stream_cork(m_stream, 1, nullptr, nullptr);
 
-    mainloop_thread = std::make_unique<std::thread>(t_mainloop_thread);
+    if (op)
+        pa_operation_unref(op);
+
+    op = pa_stream_flush(m_stream, nullptr, nullptr);
+
+    if (op)
+        pa_operation_unref(op);
 }
 
 void PulseAudioCapture::AsyncStopCapture()
 {
-    
+    // The stream is only corked so the next session can start right away
+    SetPlaybackState(false);
 }
 
 void PulseAudioCapture::SetPlaybackState(bool playing)
 {
-    if (playing) 
-        pa_stream_cork(stream, 0, nullptr, nullptr); // Stream is resumed
-    else 
-        pa_stream_cork(stream, 1, nullptr, nullptr); // Stream is paused
+    if (!m_context || !m_stream)
+        return;
+
+    PulseAudioLock lock(m_context.get());
+    pa_operation *op;
+
+    if (playing)
+        op = pa_stream_cork(m_stream, 0, nullptr, nullptr); // Stream is resumed
+    else
+        op = pa_stream_cork(m_stream, 1, nullptr, nullptr); // Stream is paused
+
+    if (op)
+        pa_operation_unref(op);
+
+    // The alert window only covers time with audio flowing
+    if (!playing) {
+        m_alertWindowNs = 0;
+        m_windowLosses = 0;
+        m_windowMaxLatencyNs = 0;
+    }
 }
 
 int PulseAudioCapture::GetAudioFormat() const
@@ -427,4 +593,4 @@ int PulseAudioCapture::GetEnginePeriod() const
     return m_enginePeriod;
 }
 
-#endif
\ No newline at end of file
+#endif
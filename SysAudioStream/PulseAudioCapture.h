@@ -3,40 +3,101 @@
 #ifdef __linux__
 
 #include <functional>
-#include <thread>
+#include <memory>
+#include <string>
 
 #include <pulse/error.h>
 #include <pulse/pulseaudio.h>
 #include <cstdlib>
 #include <cstring>
 
-class PulseAudioCapture 
+#include "AudioCapture.h"
+#include "PulseAudioContext.h"
+#include "Realtime.h"
+
+// When the capture stream is in trouble, from the 'capture_alert' line in
+// config.ini. Losses are server buffer overflows and holes in the audio.
+struct CaptureAlertConfig
+{
+    // Within one alert window, 0 turns the check off
+    int max_latency_ms = 200;
+    int max_losses = 1;
+
+    // Grow the fragment on losses, shrink it on latency, instead of only
+    // logging the alert
+    bool retune = false;
+};
+
+class PulseAudioCapture : public AudioCapture
 {
     public:
         PulseAudioCapture();
         ~PulseAudioCapture();
 
-        typedef std::function<int(uint32_t audio_size, uint8_t* data)> PacketCallback;
+        void SetAudioReadyCallback(PacketCallback callback) override;
+
+        // Source to record from, empty selects the default sink monitor
+        void SetDeviceName(std::string device_name) override;
+
+        void SetMetrics(StreamMetrics* metrics) override;
 
-        void SetAudioReadyCallback(PacketCallback callback);
+        void AsyncStartCapture() override;
+        void AsyncStopCapture() override;
 
-        void AsyncStartCapture();
-        void AsyncStopCapture();
+        void SetPlaybackState(bool playing) override;
 
-        void SetPlaybackState(bool playing);
+        bool InitializeAudioDevice(const std::string& audio_fmt) override;
+        void StopCapture() override;
 
-        bool InitializeAudioDevice(std::string audio_fmt);
-        void StopCapture();
+        int GetAudioFormat() const override;
+        int GetBitsPerSample() const override;
+        int GetChannels() const override;
+        int GetSamplerate() const override;
+        int GetEnginePeriod() const override;
 
-        int GetAudioFormat() const;
-        int GetBitsPerSample() const;
-        int GetChannels() const;
-        int GetSamplerate() const;
-        int GetEnginePeriod() const;
+        // For every stream, set before capture starts
+        static void SetAlertConfig(const CaptureAlertConfig& config);
 
         PacketCallback m_callback;
 
     private:
+        static void stream_state_callback(pa_stream *s, void *userdata);
+        static void stream_read_callback(pa_stream *s, size_t length, void *userdata);
+        static void stream_suspended_callback(pa_stream *s, void *userdata);
+        static void stream_started_callback(pa_stream *s, void *userdata);
+        static void stream_moved_callback(pa_stream *s, void *userdata);
+        static void stream_buffer_attr_callback(pa_stream *s, void *userdata);
+        static void stream_event_callback(pa_stream *s, const char *name, pa_proplist *pl, void *userdata);
+        static void stream_overflow_callback(pa_stream *s, void *userdata);
+        static void stream_timing_callback(pa_stream *s, int success, void *userdata);
+
+        // Mainloop thread. Counts a loss or checks a latency sample against
+        // the alert thresholds, and retunes once the window is over.
+        void CheckAlert(int64_t now_ns, int losses, int64_t latency_ns);
+        void RetuneBuffer(bool grow);
+
+        // Must be called with the mainloop locked
+        bool CreateStream();
+        void DestroyStream();
+
+        std::shared_ptr<PulseAudioContext> m_context;
+        pa_stream *m_stream;
+        pa_sample_spec m_sampleSpec;
+        pa_channel_map m_channelMap;
+
+        SchedulingStats m_schedStats{ "pulseaudio" };
+        StreamMetrics *m_metrics;
+
+        static CaptureAlertConfig s_alertConfig;
+
+        // Mainloop thread
+        int64_t m_lastTimingNs;
+        int64_t m_alertWindowNs;
+        int m_windowLosses;
+        int64_t m_windowMaxLatencyNs;
+
+        std::string m_deviceName;
+        std::string m_recordDevice;
 
         int m_audioFormat;
         int m_nChannels;
@@ -46,4 +107,4 @@ class PulseAudioCapture
 
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,257 @@
+#ifdef __linux__
+
+#include "pch.h"
+#include "PulseAudioContext.h"
+#include "Log.h"
+#include "Realtime.h"
+
+std::mutex PulseAudioContext::s_mutex;
+std::weak_ptr<PulseAudioContext> PulseAudioContext::s_instance;
+
+void PulseAudioContext::context_state_callback(pa_context *c, void *userdata)
+{
+    PulseAudioContext *self = (PulseAudioContext*) userdata;
+
+    switch (pa_context_get_state(c)) {
+        case PA_CONTEXT_UNCONNECTED:
+        case PA_CONTEXT_CONNECTING:
+        case PA_CONTEXT_AUTHORIZING:
+        case PA_CONTEXT_SETTING_NAME:
+        default:
+            break;
+
+        case PA_CONTEXT_FAILED:
+            LOG_ERROR("(pulseaudio): Connection failure: %s\n", pa_strerror(pa_context_errno(c)));
+
+        case PA_CONTEXT_TERMINATED:
+        case PA_CONTEXT_READY:
+            self->Signal();
+            break;
+    }
+}
+
+void PulseAudioContext::server_info_callback(pa_context *c, const pa_server_info *i, void *userdata)
+{
+    PulseAudioContext *self = (PulseAudioContext*) userdata;
+
+    if (i && i->default_sink_name) {
+        self->m_default_sink_monitor = i->default_sink_name;
+        self->m_default_sink_monitor += ".monitor";
+    }
+
+    self->Signal();
+}
+
+void PulseAudioContext::source_info_callback(pa_context *c, const pa_source_info *i, int eol, void *userdata)
+{
+    PulseAudioContext *self = (PulseAudioContext*) userdata;
+
+    if (i) {
+        self->m_source_spec = i->sample_spec;
+        self->m_source_map = i->channel_map;
+        self->m_source_found = true;
+    }
+
+    if (eol)
+        self->Signal();
+}
+
+void PulseAudioContext::realtime_callback(pa_mainloop_api *api, void *userdata)
+{
+    const RealtimeConfig& config = GetRealtimeConfig();
+
+    if (SetThreadRealtime(config.priority))
+        LOG_INFO("(pulseaudio): mainloop thread running SCHED_FIFO %d\n", config.priority);
+
+    SetThreadAffinity(config.capture_cpus);
+}
+
+PulseAudioContext::PulseAudioContext()
+{
+    m_mainloop = nullptr;
+    m_context = nullptr;
+
+    m_source_spec = {};
+    m_source_map = {};
+    m_source_found = false;
+}
+
+PulseAudioContext::~PulseAudioContext()
+{
+    Disconnect();
+}
+
+std::shared_ptr<PulseAudioContext> PulseAudioContext::Acquire()
+{
+    std::lock_guard<std::mutex> lk(s_mutex);
+
+    std::shared_ptr<PulseAudioContext> instance = s_instance.lock();
+
+    // A context that lost the server is left to its current holders and
+    // replaced for everyone acquiring from now on
+    if (instance && instance->IsConnected())
+        return instance;
+
+    instance.reset(new PulseAudioContext());
+
+    if (!instance->Connect())
+        return nullptr;
+
+    s_instance = instance;
+
+    return instance;
+}
+
+bool PulseAudioContext::Connect()
+{
+    m_mainloop = pa_threaded_mainloop_new();
+
+    if (!m_mainloop) {
+        LOG_ERROR("(pulseaudio): pa_threaded_mainloop_new() failed\n");
+        return false;
+    }
+
+    // The capture callbacks run on it
+    pa_threaded_mainloop_set_name(m_mainloop, "sas-pulse");
+
+    m_context = pa_context_new(pa_threaded_mainloop_get_api(m_mainloop), "SysAudioStream");
+    pa_context_set_state_callback(m_context, context_state_callback, this);
+
+    if (pa_context_connect(m_context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0) {
+        LOG_ERROR("(pulseaudio): pa_context_connect() failed: %s\n", pa_strerror(pa_context_errno(m_context)));
+        Disconnect();
+        return false;
+    }
+
+    Lock();
+
+    if (pa_threaded_mainloop_start(m_mainloop) < 0) {
+        LOG_ERROR("(pulseaudio): pa_threaded_mainloop_start() failed\n");
+        Unlock();
+        Disconnect();
+        return false;
+    }
+
+    LOG_INFO("(pulseaudio): mainloop thread started\n");
+
+    // Runs on the mainloop thread itself, ahead of any stream callback
+    if (GetRealtimeConfig().enabled)
+        pa_mainloop_api_once(pa_threaded_mainloop_get_api(m_mainloop), realtime_callback, this);
+
+    pa_context_state_t state;
+
+    while ((state = pa_context_get_state(m_context)) != PA_CONTEXT_READY) {
+        if (!PA_CONTEXT_IS_GOOD(state)) {
+            Unlock();
+            Disconnect();
+            return false;
+        }
+
+        Wait();
+    }
+
+    Unlock();
+
+    return true;
+}
+
+void PulseAudioContext::Disconnect()
+{
+    if (m_mainloop)
+        pa_threaded_mainloop_stop(m_mainloop);
+
+    if (m_context) {
+        pa_context_set_state_callback(m_context, NULL, NULL);
+        pa_context_disconnect(m_context);
+        pa_context_unref(m_context);
+    }
+
+    m_context = nullptr;
+
+    if (m_mainloop) {
+        pa_threaded_mainloop_free(m_mainloop);
+        LOG_INFO("(pulseaudio): mainloop thread ended\n");
+    }
+
+    m_mainloop = nullptr;
+}
+
+void PulseAudioContext::Lock()
+{
+    pa_threaded_mainloop_lock(m_mainloop);
+}
+
+void PulseAudioContext::Unlock()
+{
+    pa_threaded_mainloop_unlock(m_mainloop);
+}
+
+void PulseAudioContext::Wait()
+{
+    pa_threaded_mainloop_wait(m_mainloop);
+}
+
+void PulseAudioContext::Signal()
+{
+    pa_threaded_mainloop_signal(m_mainloop, 0);
+}
+
+bool PulseAudioContext::IsConnected() const
+{
+    return m_context && pa_context_get_state(m_context) == PA_CONTEXT_READY;
+}
+
+pa_context* PulseAudioContext::GetContext() const
+{
+    return m_context;
+}
+
+pa_threaded_mainloop* PulseAudioContext::GetMainloop() const
+{
+    return m_mainloop;
+}
+
+std::string PulseAudioContext::GetDefaultSinkMonitor()
+{
+    PulseAudioLock lock(this);
+
+    m_default_sink_monitor.clear();
+
+    pa_operation *op = pa_context_get_server_info(m_context, server_info_callback, this);
+
+    if (!op)
+        return m_default_sink_monitor;
+
+    while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
+        Wait();
+
+    pa_operation_unref(op);
+
+    return m_default_sink_monitor;
+}
+
+bool PulseAudioContext::GetSourceSampleSpec(const std::string& source, pa_sample_spec *spec, pa_channel_map *map)
+{
+    PulseAudioLock lock(this);
+
+    m_source_found = false;
+
+    pa_operation *op = pa_context_get_source_info_by_name(m_context, source.c_str(), source_info_callback, this);
+
+    if (!op)
+        return false;
+
+    while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
+        Wait();
+
+    pa_operation_unref(op);
+
+    if (m_source_found) {
+        *spec = m_source_spec;
+        *map = m_source_map;
+    }
+
+    return m_source_found;
+}
+
+#endif
@@ -0,0 +1,82 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <pulse/error.h>
+#include <pulse/pulseaudio.h>
+
+// One threaded mainloop and server connection shared by every
+// PulseAudioCapture in the process. Stream callbacks of all instances run
+// on the single mainloop thread.
+class PulseAudioContext
+{
+    public:
+        ~PulseAudioContext();
+
+        // Returns the process-wide context, connecting to the server if no
+        // instance currently holds it. Returns nullptr if the connection fails.
+        static std::shared_ptr<PulseAudioContext> Acquire();
+
+        void Lock();
+        void Unlock();
+
+        // Must be called with the mainloop locked
+        void Wait();
+        void Signal();
+
+        bool IsConnected() const;
+
+        pa_context* GetContext() const;
+        pa_threaded_mainloop* GetMainloop() const;
+
+        // Blocks until the server reports its default sink
+        std::string GetDefaultSinkMonitor();
+
+        // Blocks until the server reports the sample spec and channel map of
+        // a source, for a monitor those its sink runs at. False if it doesn't
+        // exist.
+        bool GetSourceSampleSpec(const std::string& source, pa_sample_spec *spec, pa_channel_map *map);
+
+    private:
+        PulseAudioContext();
+
+        bool Connect();
+        void Disconnect();
+
+        static void context_state_callback(pa_context *c, void *userdata);
+        static void server_info_callback(pa_context *c, const pa_server_info *i, void *userdata);
+        static void source_info_callback(pa_context *c, const pa_source_info *i, int eol, void *userdata);
+        static void realtime_callback(pa_mainloop_api *api, void *userdata);
+
+        static std::mutex s_mutex;
+        static std::weak_ptr<PulseAudioContext> s_instance;
+
+        pa_threaded_mainloop *m_mainloop;
+        pa_context *m_context;
+
+        std::string m_default_sink_monitor;
+
+        pa_sample_spec m_source_spec;
+        pa_channel_map m_source_map;
+        bool m_source_found;
+};
+
+// Scoped lock of the shared mainloop
+class PulseAudioLock
+{
+    public:
+        PulseAudioLock(PulseAudioContext *context) : m_context(context) { m_context->Lock(); }
+        ~PulseAudioLock() { m_context->Unlock(); }
+
+        PulseAudioLock(const PulseAudioLock&) = delete;
+        void operator=(const PulseAudioLock&) = delete;
+
+    private:
+        PulseAudioContext *m_context;
+};
+
+#endif
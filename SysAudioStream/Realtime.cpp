@@ -0,0 +1,204 @@
+#include "pch.h"
+#include "Realtime.h"
+#include "Log.h"
+
+#include <cstring>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef SCHED_RESET_ON_FORK
+#define SCHED_RESET_ON_FORK 0x40000000
+#endif
+
+static RealtimeConfig g_realtime_config;
+
+void SetRealtimeConfig(const RealtimeConfig& config)
+{
+	g_realtime_config = config;
+}
+
+const RealtimeConfig& GetRealtimeConfig()
+{
+	return g_realtime_config;
+}
+
+bool ParseCpuList(const std::string& list, std::vector<int>* cpus)
+{
+	cpus->clear();
+
+	if (list == "-")
+		return true;
+
+	std::stringstream sstr(list);
+	std::string cpu;
+
+	while (std::getline(sstr, cpu, ',')) {
+		if (cpu.empty())
+			continue;
+
+		try {
+			size_t end = 0;
+			int index = std::stoi(cpu, &end);
+
+			if (end != cpu.size() || index < 0)
+				return false;
+
+			cpus->push_back(index);
+		}
+		catch (const std::exception&) {
+			return false;
+		}
+	}
+
+	return !cpus->empty();
+}
+
+bool SetThreadRealtime(int priority)
+{
+#if defined(_WIN32)
+	return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+#elif defined(__linux__)
+	sched_param param{};
+	param.sched_priority = priority;
+
+	int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO | SCHED_RESET_ON_FORK, &param);
+
+	if (ret == 0)
+		return true;
+
+	LOG_WARNING("(realtime): SCHED_FIFO %d refused: %s (errno: %d)\n", priority, strerror(ret), ret);
+
+	// Without CAP_SYS_NICE or an RLIMIT_RTPRIO grant, settle for the
+	// highest nice level we are allowed
+	if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), -11) == 0)
+		LOG_WARNING("(realtime): using nice -11 instead\n");
+
+	return false;
+#else
+	return false;
+#endif
+}
+
+bool SetThreadAffinity(const std::vector<int>& cpus)
+{
+	if (cpus.empty())
+		return true;
+
+#if defined(_WIN32)
+	DWORD_PTR mask = 0;
+
+	for (int cpu : cpus)
+		mask |= (DWORD_PTR)1 << cpu;
+
+	return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+
+	for (int cpu : cpus)
+		CPU_SET(cpu, &set);
+
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	if (ret != 0) {
+		LOG_ERROR("(realtime): pthread_setaffinity_np failed: %s (errno: %d)\n", strerror(ret), ret);
+		return false;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void SetThreadName(const char* name)
+{
+#if defined(_WIN32)
+	wchar_t wide_name[64];
+
+	if (MultiByteToWideChar(CP_UTF8, 0, name, -1, wide_name, 64) > 0)
+		SetThreadDescription(GetCurrentThread(), wide_name);
+#elif defined(__linux__)
+	char short_name[16];
+
+	snprintf(short_name, sizeof(short_name), "%s", name);
+	pthread_setname_np(pthread_self(), short_name);
+#endif
+}
+
+bool LockProcessMemory()
+{
+#if defined(__linux__)
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		LOG_ERROR("(realtime): mlockall failed: %s (errno: %d)\n", strerror(errno), errno);
+		return false;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+SchedulingStats::SchedulingStats(const char* name)
+{
+	m_name = name;
+
+	m_last_ns = 0;
+	m_last_expected_ns = 0;
+	m_last_report_ns = 0;
+
+	m_count = 0;
+	m_sum_late_ns = 0;
+	m_max_late_ns = 0;
+	m_late_2ms = 0;
+}
+
+void SchedulingStats::Record(int64_t now_ns, int64_t expected_ns)
+{
+	if (m_last_ns) {
+		int64_t late_ns = (now_ns - m_last_ns) - m_last_expected_ns;
+
+		if (late_ns < 0)
+			late_ns = 0;
+
+		m_count++;
+		m_sum_late_ns += late_ns;
+
+		if (late_ns > m_max_late_ns)
+			m_max_late_ns = late_ns;
+
+		if (late_ns > 2000000)
+			m_late_2ms++;
+	}
+	else {
+		m_last_report_ns = now_ns;
+	}
+
+	m_last_ns = now_ns;
+	m_last_expected_ns = expected_ns;
+
+	if (now_ns - m_last_report_ns >= 10000000000LL)
+		Report(now_ns);
+}
+
+void SchedulingStats::Report(int64_t now_ns)
+{
+	if (m_count) {
+		LOG_INFO("(%s): wake-up lateness avg %.1f us, max %.1f us, %lld of %lld over 2 ms\n", m_name,
+			m_sum_late_ns / 1e3 / m_count, m_max_late_ns / 1e3, (long long)m_late_2ms, (long long)m_count);
+	}
+
+	m_count = 0;
+	m_sum_late_ns = 0;
+	m_max_late_ns = 0;
+	m_late_2ms = 0;
+
+	m_last_report_ns = now_ns;
+}
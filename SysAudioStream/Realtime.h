@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Process-wide real-time settings, read from the 'realtime' line in config.ini
+struct RealtimeConfig
+{
+	bool enabled = false;
+
+	// SCHED_FIFO priority of the capture thread
+	int priority = 10;
+
+	// CPUs the capture (mainloop) thread and the socket threads may run on,
+	// empty leaves the affinity alone
+	std::vector<int> capture_cpus;
+	std::vector<int> network_cpus;
+
+	bool lock_memory = true;
+};
+
+void SetRealtimeConfig(const RealtimeConfig& config);
+const RealtimeConfig& GetRealtimeConfig();
+
+// Parses "2,3" or "-" (no CPUs), false on anything else
+bool ParseCpuList(const std::string& list, std::vector<int>* cpus);
+
+// All of these act on the calling thread and return false if the OS refused
+bool SetThreadRealtime(int priority);
+bool SetThreadAffinity(const std::vector<int>& cpus);
+
+// Shows up in top -H, ps -L and the thread metrics. Linux cuts it at 15
+// characters.
+void SetThreadName(const char* name);
+
+// Locks current and future pages so the capture path never page faults
+bool LockProcessMemory();
+
+// Tracks how late a periodic callback is woken compared to the audio it
+// was handed last time. Only touched from the callback's thread.
+class SchedulingStats
+{
+public:
+	SchedulingStats(const char* name);
+
+	// expected_ns is the duration of audio delivered by the previous call
+	void Record(int64_t now_ns, int64_t expected_ns);
+
+private:
+	void Report(int64_t now_ns);
+
+	const char* m_name;
+
+	int64_t m_last_ns;
+	int64_t m_last_expected_ns;
+	int64_t m_last_report_ns;
+
+	int64_t m_count;
+	int64_t m_sum_late_ns;
+	int64_t m_max_late_ns;
+	int64_t m_late_2ms;
+};
@@ -0,0 +1,346 @@
+#include "Resampler.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+// Rate pairs whose reduced ratio needs more phases than this are rounded
+// to the nearest ratio that doesn't
+#define MAX_PHASES 1024
+
+static const double PI = 3.14159265358979323846;
+
+bool ParseResamplerQuality(const std::string& name, ResamplerQuality* quality)
+{
+	if (name == "low")
+		*quality = ResamplerQuality::Low;
+	else if (name == "medium")
+		*quality = ResamplerQuality::Medium;
+	else if (name == "high")
+		*quality = ResamplerQuality::High;
+	else
+		return false;
+
+	return true;
+}
+
+namespace {
+
+double bessel_i0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+
+	for (int k = 1; k < 50; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+
+		if (term < sum * 1e-12)
+			break;
+	}
+
+	return sum;
+}
+
+int gcd(int a, int b)
+{
+	while (b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+// n is a multiple of 8
+float dot_scalar(const float* a, const float* b, int n)
+{
+	float sum = 0;
+
+	for (int i = 0; i < n; i++)
+		sum += a[i] * b[i];
+
+	return sum;
+}
+
+#ifdef SAS_SIMD_X86
+float dot_sse2(const float* a, const float* b, int n)
+{
+	__m128 acc0 = _mm_setzero_ps();
+	__m128 acc1 = _mm_setzero_ps();
+
+	for (int i = 0; i < n; i += 8) {
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+
+	__m128 acc = _mm_add_ps(acc0, acc1);
+	acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+	acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+
+	return _mm_cvtss_f32(acc);
+}
+
+SAS_TARGET_AVX2 float dot_avx2(const float* a, const float* b, int n)
+{
+	__m256 acc = _mm256_setzero_ps();
+
+	for (int i = 0; i < n; i += 8)
+		acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+
+	return _mm_cvtss_f32(sum);
+}
+#endif
+
+#ifdef SAS_SIMD_NEON
+float dot_neon(const float* a, const float* b, int n)
+{
+	float32x4_t acc0 = vdupq_n_f32(0);
+	float32x4_t acc1 = vdupq_n_f32(0);
+
+	for (int i = 0; i < n; i += 8) {
+		acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+		acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+	}
+
+	return vaddvq_f32(vaddq_f32(acc0, acc1));
+}
+#endif
+
+}
+
+Resampler::Resampler()
+{
+	m_in_rate = 0;
+	m_out_rate = 0;
+	m_channels = 0;
+
+	m_up = 1;
+	m_down = 1;
+	m_taps = 0;
+	m_delay = 0;
+
+	m_capacity = 0;
+	m_frames = 0;
+	m_pos = 0;
+	m_phase = 0;
+
+	m_level = GetSimdLevel();
+}
+
+bool Resampler::Init(int in_rate, int out_rate, int channels, ResamplerQuality quality)
+{
+	if (in_rate <= 0 || out_rate <= 0 || channels <= 0)
+		return false;
+
+	int taps;
+	double rolloff, beta;
+
+	switch (quality)
+	{
+		case ResamplerQuality::Low:
+			taps = 16;
+			rolloff = 0.80;
+			beta = 6.0;
+			break;
+
+		case ResamplerQuality::High:
+			taps = 64;
+			rolloff = 0.95;
+			beta = 10.0;
+			break;
+
+		default:
+			taps = 32;
+			rolloff = 0.90;
+			beta = 8.6;
+			break;
+	}
+
+	int g = gcd(in_rate, out_rate);
+	int up = out_rate / g;
+	int down = in_rate / g;
+
+	if (up > MAX_PHASES) {
+		down = std::max(1, (int)std::lround((double)down * MAX_PHASES / up));
+		up = MAX_PHASES;
+
+		LOG_INFO("(resampler): %d -> %d Hz approximated as %d/%d\n", in_rate, out_rate, up, down);
+	}
+
+	// The filter spans the same time at the lower rate either way
+	if (down > up)
+		taps = ((int)std::ceil(taps * (double)down / up) + 7) & ~7;
+
+	m_in_rate = in_rate;
+	m_out_rate = out_rate;
+	m_channels = channels;
+	m_up = up;
+	m_down = down;
+	m_taps = taps;
+
+	// Prototype lowpass at the upsampled rate, cut below the lower Nyquist
+	size_t length = (size_t)taps * up;
+	double center = (length - 1) / 2.0;
+	double cutoff = 0.5 * rolloff / std::max(up, down);
+	double i0_beta = bessel_i0(beta);
+
+	std::vector<double> prototype(length);
+
+	for (size_t k = 0; k < length; k++) {
+		double t = k - center;
+		double x = 2.0 * PI * cutoff * t;
+		double sinc = t == 0 ? 1.0 : std::sin(x) / x;
+		double w = 2.0 * t / (length - 1);
+
+		prototype[k] = sinc * bessel_i0(beta * std::sqrt(std::max(0.0, 1.0 - w * w))) / i0_beta;
+	}
+
+	// Each phase normalized to unity gain so DC passes exactly
+	m_coefs.assign(length, 0.0f);
+
+	for (int p = 0; p < up; p++) {
+		double sum = 0;
+
+		for (int j = 0; j < taps; j++)
+			sum += prototype[p + (size_t)j * up];
+
+		for (int j = 0; j < taps; j++)
+			m_coefs[(size_t)p * taps + (taps - 1 - j)] = (float)(prototype[p + (size_t)j * up] / sum);
+	}
+
+	m_delay = center / up;
+
+	m_capacity = 0;
+	m_history.clear();
+
+	Reset();
+
+	return true;
+}
+
+void Resampler::Reset()
+{
+	if (!m_taps)
+		return;
+
+	if (m_capacity < (size_t)m_taps * 4) {
+		m_capacity = (size_t)m_taps * 4;
+		m_history.assign(m_capacity * m_channels, 0.0f);
+	}
+
+	for (int c = 0; c < m_channels; c++)
+		std::fill_n(&m_history[c * m_capacity], m_taps - 1, 0.0f);
+
+	m_frames = m_taps - 1;
+	m_pos = m_taps - 1;
+	m_phase = 0;
+}
+
+int Resampler::GetInputRate() const
+{
+	return m_in_rate;
+}
+
+int Resampler::GetOutputRate() const
+{
+	return m_out_rate;
+}
+
+double Resampler::GetLatencyMs() const
+{
+	return m_in_rate ? m_delay * 1000.0 / m_in_rate : 0;
+}
+
+size_t Resampler::GetMaxOutput(size_t in_frames) const
+{
+	return in_frames * m_up / m_down + 2;
+}
+
+void Resampler::SetSimdLevel(SimdLevel level)
+{
+	m_level = IsSimdLevelSupported(level) ? level : SimdLevel::Scalar;
+}
+
+size_t Resampler::Process(const float* in, size_t in_frames, float* out, double* first_offset)
+{
+	if (!m_taps)
+		return 0;
+
+	// Grow so the new input fits behind the history
+	if (m_frames + in_frames > m_capacity) {
+		size_t capacity = (m_frames + in_frames) * 2;
+		std::vector<float> grown(capacity * m_channels);
+
+		for (int c = 0; c < m_channels; c++)
+			memcpy(&grown[c * capacity], &m_history[c * m_capacity], m_frames * sizeof(float));
+
+		m_history.swap(grown);
+		m_capacity = capacity;
+	}
+
+	size_t base = m_frames;
+
+	for (int c = 0; c < m_channels; c++) {
+		float* dst = &m_history[c * m_capacity + base];
+
+		for (size_t i = 0; i < in_frames; i++)
+			dst[i] = in[i * m_channels + c];
+	}
+
+	m_frames += in_frames;
+
+	*first_offset = (double)m_pos + (double)m_phase / m_up - m_delay - (double)base;
+
+	float (*dot)(const float*, const float*, int) = dot_scalar;
+
+	switch (m_level)
+	{
+#ifdef SAS_SIMD_X86
+		case SimdLevel::Avx2: dot = dot_avx2; break;
+		case SimdLevel::Sse2: dot = dot_sse2; break;
+#endif
+#ifdef SAS_SIMD_NEON
+		case SimdLevel::Neon: dot = dot_neon; break;
+#endif
+		default: break;
+	}
+
+	size_t produced = 0;
+
+	while (m_pos < m_frames) {
+		const float* coefs = &m_coefs[(size_t)m_phase * m_taps];
+		size_t start = m_pos + 1 - m_taps;
+
+		for (int c = 0; c < m_channels; c++)
+			out[produced * m_channels + c] = dot(coefs, &m_history[c * m_capacity + start], m_taps);
+
+		produced++;
+
+		m_phase += m_down;
+		m_pos += m_phase / m_up;
+		m_phase %= m_up;
+	}
+
+	// Keep the history the next output's window reaches back into
+	size_t discard = std::min(m_pos + 1 - m_taps, m_frames);
+
+	if (discard) {
+		for (int c = 0; c < m_channels; c++) {
+			float* plane = &m_history[c * m_capacity];
+			memmove(plane, plane + discard, (m_frames - discard) * sizeof(float));
+		}
+
+		m_frames -= discard;
+		m_pos -= discard;
+	}
+
+	return produced;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Simd.h"
+
+// Taps and passband of the prototype filter. Latency is half the taps at
+// the lower of the two rates: 8, 16 and 32 frames.
+enum class ResamplerQuality
+{
+	Low,
+	Medium,
+	High,
+};
+
+// low, medium or high
+bool ParseResamplerQuality(const std::string& name, ResamplerQuality* quality);
+
+// Polyphase windowed-sinc converter between two fixed rates, for turning
+// the native capture rate into a client's rate. The ratio is reduced to
+// up/down integers; one filter phase per output position, the dot products
+// run with AVX2/SSE/NEON. Unlike AdaptiveResampler the ratio is exact and
+// fixed, drift is corrected separately.
+class Resampler
+{
+public:
+	Resampler();
+
+	bool Init(int in_rate, int out_rate, int channels, ResamplerQuality quality);
+
+	// Drops the filter history, for a discontinuity in the input
+	void Reset();
+
+	int GetInputRate() const;
+	int GetOutputRate() const;
+
+	// Filter group delay
+	double GetLatencyMs() const;
+
+	// Upper bound of the frames Process produces for in_frames
+	size_t GetMaxOutput(size_t in_frames) const;
+
+	// Interleaved in and out. first_offset gets the time of the first output
+	// frame in input frames relative to in[0], including the filter delay.
+	size_t Process(const float* in, size_t in_frames, float* out, double* first_offset);
+
+	// Forces a kernel family, for benchmarks
+	void SetSimdLevel(SimdLevel level);
+
+private:
+	int m_in_rate;
+	int m_out_rate;
+	int m_channels;
+
+	// Output position advances by m_down/m_up input frames
+	int m_up;
+	int m_down;
+
+	// Taps per phase, a multiple of 8
+	int m_taps;
+	double m_delay;
+
+	// m_up phases of m_taps coefficients, time reversed
+	std::vector<float> m_coefs;
+
+	// Planar input per channel, the last m_taps - 1 frames stay as history
+	std::vector<float> m_history;
+	size_t m_capacity;
+	size_t m_frames;
+
+	// Newest input frame the next output needs, and its phase
+	size_t m_pos;
+	int m_phase;
+
+	SimdLevel m_level;
+};
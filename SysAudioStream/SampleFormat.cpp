@@ -0,0 +1,531 @@
+#include "SampleFormat.h"
+#include "Clock.h"
+#include "Log.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+// How converted samples are laid out in memory
+enum StoreKind
+{
+	STORE_S16,
+	STORE_S24,
+	STORE_S32,
+};
+
+// Noise shaping filter, NTF(z) = 1 - z^-1 + 0.5 z^-2: about -6 dB of
+// quantization noise at low frequencies, traded for more near Nyquist
+#define SHAPE_H1 1.0f
+#define SHAPE_H2 -0.5f
+
+SampleType GetSampleType(int audio_format, int bits_per_sample, int container_bits)
+{
+	if (audio_format == 1)
+		return SampleType::Float;
+
+	switch (bits_per_sample)
+	{
+		case 24:
+			return container_bits == 32 ? SampleType::S24In32 : SampleType::S24;
+		case 32:
+			return SampleType::S32;
+		default:
+			return SampleType::S16;
+	}
+}
+
+int GetSampleBytes(SampleType type)
+{
+	switch (type)
+	{
+		case SampleType::S16:
+			return 2;
+		case SampleType::S24:
+			return 3;
+		default:
+			return 4;
+	}
+}
+
+bool ParseDitherType(const std::string& name, DitherType* dither)
+{
+	if (name == "none")
+		*dither = DitherType::None;
+	else if (name == "tpdf")
+		*dither = DitherType::Tpdf;
+	else if (name == "shaped")
+		*dither = DitherType::Shaped;
+	else
+		return false;
+
+	return true;
+}
+
+namespace {
+
+// Per call conversion parameters shared by every kernel. A sample clips
+// when it would round outside [-scale, scale - 1]; the thresholds are
+// taken before rounding so the vector kernels don't need a round step.
+struct Limits
+{
+	float scale;
+	float hi;
+	float lo;
+	int32_t max;
+	int32_t min;
+};
+
+Limits make_limits(int bits)
+{
+	Limits limits;
+	double scale = (double)(1LL << (bits - 1));
+
+	limits.scale = (float)scale;
+	limits.hi = (float)(scale - 0.5);
+	limits.lo = (float)(-scale - 0.5);
+	limits.max = (int32_t)(scale - 1);
+	limits.min = (int32_t)(-scale);
+
+	return limits;
+}
+
+inline uint32_t xorshift(uint32_t& state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+
+	return state;
+}
+
+inline float uniform(uint32_t& state)
+{
+	uint32_t bits = (xorshift(state) >> 9) | 0x3F800000u;
+	float value;
+
+	memcpy(&value, &bits, sizeof(value));
+
+	return value - 1.0f;
+}
+
+inline int count_bits(unsigned mask)
+{
+	int n = 0;
+
+	for (; mask; mask &= mask - 1)
+		n++;
+
+	return n;
+}
+
+inline int32_t quantize_one(float v, const Limits& limits, size_t& clipped)
+{
+	if (v >= limits.hi) {
+		clipped++;
+		return limits.max;
+	}
+
+	if (v < limits.lo) {
+		clipped++;
+		return limits.min;
+	}
+
+	return (int32_t)std::lrint(v);
+}
+
+inline void store_one(int store, int32_t value, uint8_t* out, size_t i)
+{
+	switch (store)
+	{
+		case STORE_S16:
+			reinterpret_cast<int16_t*>(out)[i] = (int16_t)value;
+			break;
+
+		case STORE_S24:
+			out[i * 3 + 0] = (uint8_t)(value);
+			out[i * 3 + 1] = (uint8_t)(value >> 8);
+			out[i * 3 + 2] = (uint8_t)(value >> 16);
+			break;
+
+		default:
+			reinterpret_cast<int32_t*>(out)[i] = value;
+			break;
+	}
+}
+
+// Reference kernel, also handles the tails of the vector ones
+size_t convert_scalar(const float* in, size_t from, size_t count, const Limits& limits, bool dither, uint32_t& rng, int store, uint8_t* out)
+{
+	size_t clipped = 0;
+
+	for (size_t i = from; i < count; i++) {
+		float v = in[i] * limits.scale;
+
+		if (dither)
+			v += uniform(rng) - uniform(rng);
+
+		store_one(store, quantize_one(v, limits, clipped), out, i);
+	}
+
+	return clipped;
+}
+
+size_t convert_shaped(const float* in, size_t count, int channels, const Limits& limits, uint32_t& rng, float error[][2], int store, uint8_t* out)
+{
+	size_t clipped = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		float* e = error[i % channels];
+
+		float u = in[i] * limits.scale - (SHAPE_H1 * e[0] + SHAPE_H2 * e[1]);
+		float v = u + uniform(rng) - uniform(rng);
+
+		size_t before = clipped;
+		int32_t value = quantize_one(v, limits, clipped);
+
+		// Feeding back a clipping error would only make it ring
+		e[1] = clipped != before ? 0.0f : e[0];
+		e[0] = clipped != before ? 0.0f : (float)value - u;
+
+		store_one(store, value, out, i);
+	}
+
+	return clipped;
+}
+
+#ifdef SAS_SIMD_X86
+inline __m128 uniform_sse2(__m128i& state)
+{
+	state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+	state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+	state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+
+	__m128i bits = _mm_or_si128(_mm_srli_epi32(state, 9), _mm_set1_epi32(0x3F800000));
+
+	return _mm_sub_ps(_mm_castsi128_ps(bits), _mm_set1_ps(1.0f));
+}
+
+// SSE2 is the x86-64 baseline, it has no byte shuffle so packed 24-bit goes
+// through a small buffer
+size_t convert_sse2(const float* in, size_t count, const Limits& limits, bool dither, uint32_t* rng, int store, uint8_t* out, size_t* clipped)
+{
+	__m128 scale = _mm_set1_ps(limits.scale);
+	__m128 hi = _mm_set1_ps(limits.hi);
+	__m128 lo = _mm_set1_ps(limits.lo);
+	__m128 min = _mm_set1_ps((float)limits.min);
+	__m128i max = _mm_set1_epi32(limits.max);
+	__m128i state = _mm_loadu_si128((const __m128i*)rng);
+
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128 v = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+
+		if (dither)
+			v = _mm_add_ps(v, _mm_sub_ps(uniform_sse2(state), uniform_sse2(state)));
+
+		__m128 over = _mm_cmpge_ps(v, hi);
+		__m128 under = _mm_cmplt_ps(v, lo);
+
+		*clipped += count_bits(_mm_movemask_ps(_mm_or_ps(over, under)));
+
+		// Lanes at or above 2^31 convert to INT_MIN and are replaced
+		__m128i value = _mm_cvtps_epi32(_mm_max_ps(v, min));
+		__m128i over_mask = _mm_castps_si128(over);
+		value = _mm_or_si128(_mm_andnot_si128(over_mask, value), _mm_and_si128(over_mask, max));
+
+		switch (store)
+		{
+			case STORE_S16:
+				_mm_storel_epi64((__m128i*)(out + i * 2), _mm_packs_epi32(value, value));
+				break;
+
+			case STORE_S24:
+			{
+				alignas(16) int32_t tmp[4];
+				_mm_store_si128((__m128i*)tmp, value);
+
+				for (int j = 0; j < 4; j++)
+					store_one(STORE_S24, tmp[j], out, i + j);
+
+				break;
+			}
+
+			default:
+				_mm_storeu_si128((__m128i*)(out + i * 4), value);
+				break;
+		}
+	}
+
+	_mm_storeu_si128((__m128i*)rng, state);
+
+	return i;
+}
+
+SAS_TARGET_AVX2 inline __m256 uniform_avx2(__m256i& state)
+{
+	state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+	state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+	state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+
+	__m256i bits = _mm256_or_si256(_mm256_srli_epi32(state, 9), _mm256_set1_epi32(0x3F800000));
+
+	return _mm256_sub_ps(_mm256_castsi256_ps(bits), _mm256_set1_ps(1.0f));
+}
+
+SAS_TARGET_AVX2 size_t convert_avx2(const float* in, size_t count, const Limits& limits, bool dither, uint32_t* rng, int store, uint8_t* out, size_t* clipped)
+{
+	__m256 scale = _mm256_set1_ps(limits.scale);
+	__m256 hi = _mm256_set1_ps(limits.hi);
+	__m256 lo = _mm256_set1_ps(limits.lo);
+	__m256 min = _mm256_set1_ps((float)limits.min);
+	__m256i max = _mm256_set1_epi32(limits.max);
+	__m256i state = _mm256_loadu_si256((const __m256i*)rng);
+
+	const __m256i pack24 = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	// Packed 24-bit stores 16 bytes per half, keep two samples of slack
+	size_t step_end = store == STORE_S24 ? 10 : 8;
+	size_t i = 0;
+
+	for (; i + step_end <= count; i += 8) {
+		__m256 v = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale);
+
+		if (dither)
+			v = _mm256_add_ps(v, _mm256_sub_ps(uniform_avx2(state), uniform_avx2(state)));
+
+		__m256 over = _mm256_cmp_ps(v, hi, _CMP_GE_OQ);
+		__m256 under = _mm256_cmp_ps(v, lo, _CMP_LT_OQ);
+
+		*clipped += count_bits(_mm256_movemask_ps(_mm256_or_ps(over, under)));
+
+		__m256i value = _mm256_cvtps_epi32(_mm256_max_ps(v, min));
+		value = _mm256_blendv_epi8(value, max, _mm256_castps_si256(over));
+
+		switch (store)
+		{
+			case STORE_S16:
+			{
+				__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(value, value), 0x08);
+				_mm_storeu_si128((__m128i*)(out + i * 2), _mm256_castsi256_si128(packed));
+				break;
+			}
+
+			case STORE_S24:
+			{
+				__m256i packed = _mm256_shuffle_epi8(value, pack24);
+				_mm_storeu_si128((__m128i*)(out + i * 3), _mm256_castsi256_si128(packed));
+				_mm_storeu_si128((__m128i*)(out + i * 3 + 12), _mm256_extracti128_si256(packed, 1));
+				break;
+			}
+
+			default:
+				_mm256_storeu_si256((__m256i*)(out + i * 4), value);
+				break;
+		}
+	}
+
+	_mm256_storeu_si256((__m256i*)rng, state);
+
+	return i;
+}
+#endif
+
+#ifdef SAS_SIMD_NEON
+inline float32x4_t uniform_neon(uint32x4_t& state)
+{
+	state = veorq_u32(state, vshlq_n_u32(state, 13));
+	state = veorq_u32(state, vshrq_n_u32(state, 17));
+	state = veorq_u32(state, vshlq_n_u32(state, 5));
+
+	uint32x4_t bits = vorrq_u32(vshrq_n_u32(state, 9), vdupq_n_u32(0x3F800000));
+
+	return vsubq_f32(vreinterpretq_f32_u32(bits), vdupq_n_f32(1.0f));
+}
+
+size_t convert_neon(const float* in, size_t count, const Limits& limits, bool dither, uint32_t* rng, int store, uint8_t* out, size_t* clipped)
+{
+	float32x4_t scale = vdupq_n_f32(limits.scale);
+	float32x4_t hi = vdupq_n_f32(limits.hi);
+	float32x4_t lo = vdupq_n_f32(limits.lo);
+	float32x4_t min = vdupq_n_f32((float)limits.min);
+	int32x4_t max = vdupq_n_s32(limits.max);
+	uint32x4_t state = vld1q_u32(rng);
+
+	static const uint8_t pack24_idx[16] = { 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 255, 255, 255, 255 };
+	const uint8x16_t pack24 = vld1q_u8(pack24_idx);
+
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		float32x4_t v = vmulq_f32(vld1q_f32(in + i), scale);
+
+		if (dither)
+			v = vaddq_f32(v, vsubq_f32(uniform_neon(state), uniform_neon(state)));
+
+		uint32x4_t over = vcgeq_f32(v, hi);
+		uint32x4_t under = vcltq_f32(v, lo);
+
+		*clipped += vaddvq_u32(vshrq_n_u32(vorrq_u32(over, under), 31));
+
+		int32x4_t value = vcvtnq_s32_f32(vmaxq_f32(v, min));
+		value = vbslq_s32(over, max, value);
+
+		switch (store)
+		{
+			case STORE_S16:
+				vst1_s16((int16_t*)(out + i * 2), vqmovn_s32(value));
+				break;
+
+			case STORE_S24:
+			{
+				uint8x16_t packed = vqtbl1q_u8(vreinterpretq_u8_s32(value), pack24);
+				vst1_u8(out + i * 3, vget_low_u8(packed));
+				vst1q_lane_u32((uint32_t*)(out + i * 3 + 8), vreinterpretq_u32_u8(packed), 2);
+				break;
+			}
+
+			default:
+				vst1q_s32((int32_t*)(out + i * 4), value);
+				break;
+		}
+	}
+
+	vst1q_u32(rng, state);
+
+	return i;
+}
+#endif
+
+}
+
+SampleConverter::SampleConverter()
+{
+	m_type = SampleType::S16;
+	m_channels = 2;
+	m_dither = DitherType::None;
+	m_level = GetSimdLevel();
+
+	m_clipped = 0;
+
+	Reset(SampleType::S16, 2, DitherType::None);
+}
+
+void SampleConverter::Reset(SampleType type, int channels, DitherType dither)
+{
+	m_type = type;
+	m_channels = channels > 0 ? channels : 1;
+	m_dither = dither;
+
+	// The error feedback state is kept for up to 8 channels
+	if (m_dither == DitherType::Shaped && m_channels > 8)
+		m_dither = DitherType::Tpdf;
+
+	for (int i = 0; i < 8; i++)
+		m_rng[i] = 0x9E3779B9u * (i + 1);
+
+	memset(m_error, 0, sizeof(m_error));
+
+	m_stat_clipped = 0;
+	m_stat_samples = 0;
+	m_stat_start_ns = MonotonicNowNs();
+}
+
+void SampleConverter::SetSimdLevel(SimdLevel level)
+{
+	m_level = IsSimdLevelSupported(level) ? level : SimdLevel::Scalar;
+}
+
+size_t SampleConverter::Convert(const float* in, size_t count, uint8_t* out)
+{
+	switch (m_type)
+	{
+		case SampleType::S16:
+			return Run(in, count, 16, STORE_S16, out);
+		case SampleType::S24:
+			return Run(in, count, 24, STORE_S24, out);
+		case SampleType::S24In32:
+			return Run(in, count, 24, STORE_S32, out);
+		case SampleType::S32:
+			return Run(in, count, 32, STORE_S32, out);
+		default:
+			memcpy(out, in, count * sizeof(float));
+			return 0;
+	}
+}
+
+size_t SampleConverter::Quantize(const float* in, size_t count, int bits_per_sample, int32_t* out)
+{
+	return Run(in, count, bits_per_sample, STORE_S32, reinterpret_cast<uint8_t*>(out));
+}
+
+uint64_t SampleConverter::GetClippedSamples() const
+{
+	return m_clipped;
+}
+
+size_t SampleConverter::Run(const float* in, size_t count, int bits, int store, uint8_t* out)
+{
+	Limits limits = make_limits(bits);
+
+	// A float carries 24 significant bits, there is nothing to dither at 32
+	DitherType dither = bits < 32 ? m_dither : DitherType::None;
+
+	size_t clipped = 0;
+	size_t done = 0;
+
+	if (dither == DitherType::Shaped) {
+		clipped = convert_shaped(in, count, m_channels, limits, m_rng[0], m_error, store, out);
+		done = count;
+	}
+	else {
+		bool tpdf = dither == DitherType::Tpdf;
+
+		switch (m_level)
+		{
+#ifdef SAS_SIMD_X86
+			case SimdLevel::Avx2:
+				done = convert_avx2(in, count, limits, tpdf, m_rng, store, out, &clipped);
+				break;
+			case SimdLevel::Sse2:
+				done = convert_sse2(in, count, limits, tpdf, m_rng, store, out, &clipped);
+				break;
+#endif
+#ifdef SAS_SIMD_NEON
+			case SimdLevel::Neon:
+				done = convert_neon(in, count, limits, tpdf, m_rng, store, out, &clipped);
+				break;
+#endif
+			default:
+				break;
+		}
+
+		clipped += convert_scalar(in, done, count, limits, tpdf, m_rng[0], store, out);
+	}
+
+	m_clipped += clipped;
+	m_stat_clipped += clipped;
+	m_stat_samples += count;
+
+	int64_t now_ns = MonotonicNowNs();
+
+	if (now_ns - m_stat_start_ns >= 10000000000LL)
+		Report(now_ns);
+
+	return clipped;
+}
+
+void SampleConverter::Report(int64_t now_ns)
+{
+	if (m_stat_clipped) {
+		LOG_WARNING("(convert): %llu of %llu samples clipped in the last %.0f s\n",
+			(unsigned long long)m_stat_clipped, (unsigned long long)m_stat_samples, (now_ns - m_stat_start_ns) / 1e9);
+	}
+
+	m_stat_clipped = 0;
+	m_stat_samples = 0;
+	m_stat_start_ns = now_ns;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "Simd.h"
+
+// Sample layouts sent on the wire. Capture always runs in float and is
+// converted to one of these right before packetization.
+enum class SampleType
+{
+	S16,
+	S24,
+	// 24-bit value sign extended to 32 bits, little endian
+	S24In32,
+	S32,
+	Float,
+};
+
+enum class DitherType
+{
+	None,
+	// Triangular noise of +-1 LSB
+	Tpdf,
+	// TPDF with the quantization error pushed towards high frequencies
+	Shaped,
+};
+
+// audio_format/bits_per_sample/container_bits as carried in StreamSettings
+SampleType GetSampleType(int audio_format, int bits_per_sample, int container_bits = 0);
+int GetSampleBytes(SampleType type);
+
+// none, tpdf or shaped
+bool ParseDitherType(const std::string& name, DitherType* dither);
+
+// Float to integer conversion for one stream. Keeps the dither state and
+// clipping counters between calls. Uses the widest kernel the CPU has,
+// except noise shaping, whose error feedback is sequential per channel.
+class SampleConverter
+{
+public:
+	SampleConverter();
+
+	void Reset(SampleType type, int channels, DitherType dither);
+
+	// Forces a kernel family, for benchmarks
+	void SetSimdLevel(SimdLevel level);
+
+	// Converts count interleaved samples, returns how many were clipped
+	size_t Convert(const float* in, size_t count, uint8_t* out);
+
+	// Right aligned integers of any width up to 32 bits, same dither and
+	// counters as Convert
+	size_t Quantize(const float* in, size_t count, int bits_per_sample, int32_t* out);
+
+	uint64_t GetClippedSamples() const;
+
+private:
+	size_t Run(const float* in, size_t count, int bits, int store, uint8_t* out);
+	void Report(int64_t now_ns);
+
+	SampleType m_type;
+	int m_channels;
+	DitherType m_dither;
+	SimdLevel m_level;
+
+	// xorshift32 state, one per vector lane
+	uint32_t m_rng[8];
+
+	// Last two shaped quantization errors per channel
+	float m_error[8][2];
+
+	uint64_t m_clipped;
+
+	// Clipping since the last report
+	uint64_t m_stat_clipped;
+	uint64_t m_stat_samples;
+	int64_t m_stat_start_ns;
+};
@@ -0,0 +1,220 @@
+#include "SilenceDetector.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+void scalar_measure(const float* in, size_t count, float* peak, double* sum_squares)
+{
+	float max = 0;
+	double sum = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		max = std::max(max, std::fabs(in[i]));
+		sum += (double)in[i] * in[i];
+	}
+
+	*peak = max;
+	*sum_squares = sum;
+}
+
+#ifdef SAS_SIMD_X86
+void sse2_measure(const float* in, size_t count, float* peak, double* sum_squares)
+{
+	const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+	__m128 max = _mm_setzero_ps();
+	__m128 sum = _mm_setzero_ps();
+
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128 x = _mm_loadu_ps(in + i);
+
+		max = _mm_max_ps(max, _mm_and_ps(x, abs_mask));
+		sum = _mm_add_ps(sum, _mm_mul_ps(x, x));
+	}
+
+	alignas(16) float maxes[4], sums[4];
+
+	_mm_store_ps(maxes, max);
+	_mm_store_ps(sums, sum);
+
+	float tail_peak;
+	double tail_sum;
+
+	scalar_measure(in + i, count - i, &tail_peak, &tail_sum);
+
+	*peak = std::max({ maxes[0], maxes[1], maxes[2], maxes[3], tail_peak });
+	*sum_squares = (double)sums[0] + sums[1] + sums[2] + sums[3] + tail_sum;
+}
+
+SAS_TARGET_AVX2 void avx2_measure(const float* in, size_t count, float* peak, double* sum_squares)
+{
+	const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+
+	__m256 max = _mm256_setzero_ps();
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+
+	size_t i = 0;
+
+	for (; i + 16 <= count; i += 16) {
+		__m256 x0 = _mm256_loadu_ps(in + i);
+		__m256 x1 = _mm256_loadu_ps(in + i + 8);
+
+		max = _mm256_max_ps(max, _mm256_and_ps(x0, abs_mask));
+		max = _mm256_max_ps(max, _mm256_and_ps(x1, abs_mask));
+		sum0 = _mm256_fmadd_ps(x0, x0, sum0);
+		sum1 = _mm256_fmadd_ps(x1, x1, sum1);
+	}
+
+	alignas(32) float maxes[8], sums[8];
+
+	_mm256_store_ps(maxes, max);
+	_mm256_store_ps(sums, _mm256_add_ps(sum0, sum1));
+
+	float tail_peak;
+	double tail_sum;
+
+	scalar_measure(in + i, count - i, &tail_peak, &tail_sum);
+
+	double total = tail_sum;
+
+	for (int k = 0; k < 8; k++) {
+		tail_peak = std::max(tail_peak, maxes[k]);
+		total += sums[k];
+	}
+
+	*peak = tail_peak;
+	*sum_squares = total;
+}
+#endif
+
+#ifdef SAS_SIMD_NEON
+void neon_measure(const float* in, size_t count, float* peak, double* sum_squares)
+{
+	float32x4_t max = vdupq_n_f32(0);
+	float32x4_t sum0 = vdupq_n_f32(0);
+	float32x4_t sum1 = vdupq_n_f32(0);
+
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		float32x4_t x0 = vld1q_f32(in + i);
+		float32x4_t x1 = vld1q_f32(in + i + 4);
+
+		max = vmaxq_f32(max, vmaxq_f32(vabsq_f32(x0), vabsq_f32(x1)));
+		sum0 = vfmaq_f32(sum0, x0, x0);
+		sum1 = vfmaq_f32(sum1, x1, x1);
+	}
+
+	float tail_peak;
+	double tail_sum;
+
+	scalar_measure(in + i, count - i, &tail_peak, &tail_sum);
+
+	*peak = std::max(vmaxvq_f32(max), tail_peak);
+	*sum_squares = (double)vaddvq_f32(vaddq_f32(sum0, sum1)) + tail_sum;
+}
+#endif
+
+float db_to_linear(double dbfs)
+{
+	return (float)std::pow(10.0, dbfs / 20.0);
+}
+
+}
+
+SilenceDetector::SilenceDetector()
+{
+	m_level = GetSimdLevel();
+
+	Reset(48000, -80.0, 300);
+}
+
+void SilenceDetector::Reset(int sample_rate, double threshold_dbfs, int hold_ms)
+{
+	m_sample_rate = sample_rate;
+
+	m_quiet_peak = db_to_linear(threshold_dbfs);
+	m_quiet_rms = db_to_linear(threshold_dbfs - 10.0);
+	m_loud_peak = db_to_linear(threshold_dbfs + 6.0);
+	m_loud_rms = db_to_linear(threshold_dbfs - 4.0);
+
+	m_hold_frames = (int64_t)sample_rate * hold_ms / 1000;
+
+	m_quiet_frames = 0;
+	m_silent = false;
+}
+
+bool SilenceDetector::Process(const float* in, size_t frames, int channels)
+{
+	size_t count = frames * channels;
+
+	if (!count)
+		return m_silent;
+
+	float peak;
+	double sum_squares;
+
+	Measure(in, count, &peak, &sum_squares);
+
+	float rms = (float)std::sqrt(sum_squares / count);
+
+	if (m_silent) {
+		if (peak > m_loud_peak || rms > m_loud_rms) {
+			m_silent = false;
+			m_quiet_frames = 0;
+		}
+
+		return m_silent;
+	}
+
+	if (peak < m_quiet_peak && rms < m_quiet_rms) {
+		m_quiet_frames += frames;
+
+		if (m_quiet_frames >= m_hold_frames)
+			m_silent = true;
+	}
+	else {
+		m_quiet_frames = 0;
+	}
+
+	return m_silent;
+}
+
+bool SilenceDetector::IsSilent() const
+{
+	return m_silent;
+}
+
+void SilenceDetector::Measure(const float* in, size_t count, float* peak, double* sum_squares) const
+{
+	switch (m_level)
+	{
+#ifdef SAS_SIMD_X86
+		case SimdLevel::Avx2:
+			avx2_measure(in, count, peak, sum_squares);
+			return;
+
+		case SimdLevel::Sse2:
+			sse2_measure(in, count, peak, sum_squares);
+			return;
+#endif
+#ifdef SAS_SIMD_NEON
+		case SimdLevel::Neon:
+			neon_measure(in, count, peak, sum_squares);
+			return;
+#endif
+		default:
+			scalar_measure(in, count, peak, sum_squares);
+			return;
+	}
+}
+
+void SilenceDetector::SetSimdLevel(SimdLevel level)
+{
+	m_level = IsSimdLevelSupported(level) ? level : SimdLevel::Scalar;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Simd.h"
+
+// Decides when the capture is silent enough to stop sending audio (DTX).
+// Every capture block is measured for peak and RMS. Silence starts once
+// blocks have stayed under the threshold for the hold time and ends on the
+// first block that clearly isn't quiet anymore, so fades and quiet
+// passages keep playing:
+//   quiet block: peak < threshold and RMS < threshold - 10 dB
+//   loud block:  peak > threshold + 6 dB or RMS > threshold - 4 dB
+class SilenceDetector
+{
+public:
+	SilenceDetector();
+
+	void Reset(int sample_rate, double threshold_dbfs, int hold_ms);
+
+	// Interleaved block, returns whether the stream is silent from it on
+	bool Process(const float* in, size_t frames, int channels);
+
+	bool IsSilent() const;
+
+	// Peak magnitude and sum of squares of count samples, with AVX2, SSE2
+	// or NEON
+	void Measure(const float* in, size_t count, float* peak, double* sum_squares) const;
+
+	// Forces a kernel family, for benchmarks
+	void SetSimdLevel(SimdLevel level);
+
+private:
+	int m_sample_rate;
+
+	// Linear levels derived from the threshold
+	float m_quiet_peak;
+	float m_quiet_rms;
+	float m_loud_peak;
+	float m_loud_rms;
+
+	int64_t m_hold_frames;
+
+	// Frames of quiet blocks in a row
+	int64_t m_quiet_frames;
+	bool m_silent;
+
+	SimdLevel m_level;
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+// Kernels are built for the baseline target and given AVX2 variants that
+// are picked at run time, so one binary runs everywhere.
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SAS_SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define SAS_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(SAS_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SAS_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define SAS_TARGET_AVX2
+#endif
+
+#if defined(_WIN32) && defined(SAS_SIMD_X86)
+#include <windows.h>
+#endif
+
+// Kernel families, best first on each architecture
+enum class SimdLevel
+{
+	Scalar,
+	Sse2,
+	Avx2,
+	Neon,
+};
+
+inline bool CpuHasAvx2()
+{
+#if defined(SAS_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+	static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	return has_avx2;
+#elif defined(SAS_SIMD_X86) && defined(_WIN32)
+	static const bool has_avx2 = IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE) != 0;
+	return has_avx2;
+#else
+	return false;
+#endif
+}
+
+inline SimdLevel GetSimdLevel()
+{
+#if defined(SAS_SIMD_X86)
+	return CpuHasAvx2() ? SimdLevel::Avx2 : SimdLevel::Sse2;
+#elif defined(SAS_SIMD_NEON)
+	return SimdLevel::Neon;
+#else
+	return SimdLevel::Scalar;
+#endif
+}
+
+inline bool IsSimdLevelSupported(SimdLevel level)
+{
+	switch (level)
+	{
+		case SimdLevel::Scalar:
+			return true;
+#if defined(SAS_SIMD_X86)
+		case SimdLevel::Sse2:
+			return true;
+		case SimdLevel::Avx2:
+			return CpuHasAvx2();
+#elif defined(SAS_SIMD_NEON)
+		case SimdLevel::Neon:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+inline const char* GetSimdLevelName(SimdLevel level)
+{
+	switch (level)
+	{
+		case SimdLevel::Sse2: return "sse2";
+		case SimdLevel::Avx2: return "avx2";
+		case SimdLevel::Neon: return "neon";
+		default: return "scalar";
+	}
+}
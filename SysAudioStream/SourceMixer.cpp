@@ -0,0 +1,412 @@
+#include "SourceMixer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Clock.h"
+#include "Log.h"
+
+// Pts jitter of a source that is taken as continuous audio
+#define MIX_TOLERANCE_MS 5
+
+namespace {
+
+void scalar_gain_copy(const float* in, size_t count, float gain, float* out)
+{
+	for (size_t i = 0; i < count; i++)
+		out[i] = in[i] * gain;
+}
+
+void scalar_gain_add(const float* in, size_t count, float gain, float* out)
+{
+	for (size_t i = 0; i < count; i++)
+		out[i] += in[i] * gain;
+}
+
+#ifdef SAS_SIMD_X86
+void sse2_gain_copy(const float* in, size_t count, float gain, float* out)
+{
+	__m128 g = _mm_set1_ps(gain);
+
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(in + i), g));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_loadu_ps(in + i + 4), g));
+	}
+
+	scalar_gain_copy(in + i, count - i, gain, out + i);
+}
+
+void sse2_gain_add(const float* in, size_t count, float gain, float* out)
+{
+	__m128 g = _mm_set1_ps(gain);
+
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), g)));
+		_mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_loadu_ps(out + i + 4), _mm_mul_ps(_mm_loadu_ps(in + i + 4), g)));
+	}
+
+	scalar_gain_add(in + i, count - i, gain, out + i);
+}
+
+SAS_TARGET_AVX2 void avx2_gain_copy(const float* in, size_t count, float gain, float* out)
+{
+	__m256 g = _mm256_set1_ps(gain);
+
+	size_t i = 0;
+
+	for (; i + 16 <= count; i += 16) {
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(in + i), g));
+		_mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_loadu_ps(in + i + 8), g));
+	}
+
+	scalar_gain_copy(in + i, count - i, gain, out + i);
+}
+
+SAS_TARGET_AVX2 void avx2_gain_add(const float* in, size_t count, float gain, float* out)
+{
+	__m256 g = _mm256_set1_ps(gain);
+
+	size_t i = 0;
+
+	for (; i + 16 <= count; i += 16) {
+		_mm256_storeu_ps(out + i, _mm256_fmadd_ps(_mm256_loadu_ps(in + i), g, _mm256_loadu_ps(out + i)));
+		_mm256_storeu_ps(out + i + 8, _mm256_fmadd_ps(_mm256_loadu_ps(in + i + 8), g, _mm256_loadu_ps(out + i + 8)));
+	}
+
+	scalar_gain_add(in + i, count - i, gain, out + i);
+}
+#endif
+
+#ifdef SAS_SIMD_NEON
+void neon_gain_copy(const float* in, size_t count, float gain, float* out)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		vst1q_f32(out + i, vmulq_n_f32(vld1q_f32(in + i), gain));
+		vst1q_f32(out + i + 4, vmulq_n_f32(vld1q_f32(in + i + 4), gain));
+	}
+
+	scalar_gain_copy(in + i, count - i, gain, out + i);
+}
+
+void neon_gain_add(const float* in, size_t count, float gain, float* out)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		vst1q_f32(out + i, vfmaq_n_f32(vld1q_f32(out + i), vld1q_f32(in + i), gain));
+		vst1q_f32(out + i + 4, vfmaq_n_f32(vld1q_f32(out + i + 4), vld1q_f32(in + i + 4), gain));
+	}
+
+	scalar_gain_add(in + i, count - i, gain, out + i);
+}
+#endif
+
+void gain_copy(SimdLevel level, const float* in, size_t count, float gain, float* out)
+{
+	switch (level)
+	{
+#ifdef SAS_SIMD_X86
+		case SimdLevel::Avx2:
+			avx2_gain_copy(in, count, gain, out);
+			return;
+
+		case SimdLevel::Sse2:
+			sse2_gain_copy(in, count, gain, out);
+			return;
+#endif
+#ifdef SAS_SIMD_NEON
+		case SimdLevel::Neon:
+			neon_gain_copy(in, count, gain, out);
+			return;
+#endif
+		default:
+			scalar_gain_copy(in, count, gain, out);
+			return;
+	}
+}
+
+void gain_add(SimdLevel level, const float* in, size_t count, float gain, float* out)
+{
+	switch (level)
+	{
+#ifdef SAS_SIMD_X86
+		case SimdLevel::Avx2:
+			avx2_gain_add(in, count, gain, out);
+			return;
+
+		case SimdLevel::Sse2:
+			sse2_gain_add(in, count, gain, out);
+			return;
+#endif
+#ifdef SAS_SIMD_NEON
+		case SimdLevel::Neon:
+			neon_gain_add(in, count, gain, out);
+			return;
+#endif
+		default:
+			scalar_gain_add(in, count, gain, out);
+			return;
+	}
+}
+
+}
+
+SourceMixer::SourceMixer()
+{
+	m_channels = 0;
+	m_sample_rate = 0;
+
+	m_capacity = 0;
+	m_max_latency_frames = 0;
+	m_tolerance_frames = 0;
+
+	m_out_pts_ns = 0;
+
+	m_level = GetSimdLevel();
+
+	m_stat_late_frames = 0;
+	m_stat_dropped_frames = 0;
+	m_stat_start_ns = 0;
+}
+
+void SourceMixer::Init(int sources, int channels, int sample_rate, int max_latency_ms)
+{
+	std::lock_guard<std::mutex> lk(m_mutex);
+
+	m_channels = channels;
+	m_sample_rate = sample_rate;
+
+	m_max_latency_frames = (size_t)sample_rate * max_latency_ms / 1000;
+	m_tolerance_frames = (size_t)sample_rate * MIX_TOLERANCE_MS / 1000;
+
+	// Room for the latency bound plus a few capture periods of every source
+	m_capacity = std::max<size_t>(m_max_latency_frames * 4, 16384);
+
+	std::vector<float> gains;
+
+	for (auto& source : m_sources)
+		gains.push_back(source.gain);
+
+	m_sources.resize(sources);
+
+	for (int i = 0; i < sources; i++) {
+		Source& source = m_sources[i];
+
+		source.buffer.assign(m_capacity * channels, 0.0f);
+		source.frames = 0;
+		source.pts_ns = 0;
+		source.gain = i < (int)gains.size() ? gains[i] : 1.0f;
+		source.aligned = false;
+	}
+
+	m_leads.assign(sources, 0);
+	m_output.assign(m_capacity * channels, 0.0f);
+	m_out_pts_ns = 0;
+}
+
+void SourceMixer::Reset()
+{
+	std::lock_guard<std::mutex> lk(m_mutex);
+
+	for (auto& source : m_sources) {
+		source.frames = 0;
+		source.pts_ns = 0;
+		source.aligned = false;
+	}
+
+	m_out_pts_ns = 0;
+}
+
+void SourceMixer::SetGain(int source, double gain_db)
+{
+	std::lock_guard<std::mutex> lk(m_mutex);
+
+	if (source < 0)
+		return;
+
+	if (source >= (int)m_sources.size())
+		m_sources.resize(source + 1, Source{ {}, 0, 0, 1.0f, false });
+
+	m_sources[source].gain = (float)std::pow(10.0, gain_db / 20.0);
+}
+
+void SourceMixer::SetOutputCallback(OutputCallback callback)
+{
+	m_callback = callback;
+}
+
+int SourceMixer::GetChannels() const
+{
+	return m_channels;
+}
+
+int SourceMixer::GetSampleRate() const
+{
+	return m_sample_rate;
+}
+
+void SourceMixer::SetSimdLevel(SimdLevel level)
+{
+	m_level = IsSimdLevelSupported(level) ? level : SimdLevel::Scalar;
+}
+
+int64_t SourceMixer::FramesToNs(int64_t frames) const
+{
+	return frames * 1000000000LL / m_sample_rate;
+}
+
+void SourceMixer::Push(int source_index, const float* in, size_t frames, int channels, int64_t pts_ns)
+{
+	std::lock_guard<std::mutex> lk(m_mutex);
+
+	if (source_index < 0 || source_index >= (int)m_sources.size() || channels != m_channels || !m_capacity || !frames)
+		return;
+
+	Source& source = m_sources[source_index];
+
+	if (source.frames) {
+		// A jump past the latency bound (a suspended device resuming) is a
+		// new stretch of audio, the queued rest is stale then. Smaller pts
+		// jitter is left to Align.
+		int64_t expected_ns = source.pts_ns + FramesToNs(source.frames);
+
+		if (source_index && std::abs(pts_ns - expected_ns) > FramesToNs(m_max_latency_frames)) {
+			m_stat_dropped_frames += source.frames;
+			source.frames = 0;
+			source.aligned = false;
+		}
+	}
+
+	// Keep the newest audio if a source runs far ahead of the first one
+	if (frames > m_capacity) {
+		in += (frames - m_capacity) * m_channels;
+		pts_ns += FramesToNs(frames - m_capacity);
+		m_stat_dropped_frames += frames - m_capacity;
+		frames = m_capacity;
+	}
+
+	if (source.frames + frames > m_capacity) {
+		size_t excess = source.frames + frames - m_capacity;
+
+		m_stat_dropped_frames += excess;
+		Consume(source, excess);
+	}
+
+	if (!source.frames)
+		source.pts_ns = pts_ns;
+
+	memcpy(source.buffer.data() + source.frames * m_channels, in, frames * m_channels * sizeof(float));
+	source.frames += frames;
+
+	MixAvailable();
+}
+
+size_t SourceMixer::Align(Source& source)
+{
+	if (!source.frames)
+		return 0;
+
+	int64_t offset = (source.pts_ns - m_out_pts_ns) * m_sample_rate / 1000000000LL;
+
+	// Once lined up the queue follows on from the mixed audio, small pts
+	// jitter is not worth a click
+	if (source.aligned && (size_t)std::abs(offset) <= m_tolerance_frames)
+		return 0;
+
+	source.aligned = true;
+
+	if (offset >= 0)
+		return (size_t)offset;
+
+	// Audio from before the mix position is too late to use
+	size_t late = std::min((size_t)-offset, source.frames);
+
+	m_stat_late_frames += late;
+	Consume(source, late);
+
+	if (!source.frames)
+		source.aligned = false;
+
+	return 0;
+}
+
+void SourceMixer::Consume(Source& source, size_t frames)
+{
+	frames = std::min(frames, source.frames);
+
+	source.frames -= frames;
+	source.pts_ns += FramesToNs(frames);
+
+	if (source.frames)
+		memmove(source.buffer.data(), source.buffer.data() + frames * m_channels, source.frames * m_channels * sizeof(float));
+}
+
+void SourceMixer::MixAvailable()
+{
+	Source& first = m_sources[0];
+
+	while (first.frames) {
+		m_out_pts_ns = first.pts_ns;
+
+		size_t frames = first.frames;
+		size_t ready = frames;
+
+		for (size_t i = 1; i < m_sources.size(); i++) {
+			m_leads[i] = Align(m_sources[i]);
+			ready = std::min(ready, m_leads[i] + m_sources[i].frames);
+		}
+
+		// Wait for the others until the bound, then go without them
+		if (!ready && frames < m_max_latency_frames)
+			break;
+
+		if (frames >= m_max_latency_frames)
+			ready = frames;
+
+		gain_copy(m_level, first.buffer.data(), ready * m_channels, first.gain, m_output.data());
+
+		for (size_t i = 1; i < m_sources.size(); i++) {
+			Source& source = m_sources[i];
+
+			size_t lead = std::min(m_leads[i], ready);
+			size_t count = std::min(source.frames, ready - lead);
+
+			if (lead + count < ready && source.aligned)
+				m_stat_late_frames += ready - lead - count;
+
+			gain_add(m_level, source.buffer.data(), count * m_channels, source.gain, m_output.data() + lead * m_channels);
+			Consume(source, count);
+		}
+
+		Consume(first, ready);
+
+		if (m_callback)
+			m_callback(m_output.data(), ready, m_out_pts_ns);
+	}
+
+	int64_t now_ns = MonotonicNowNs();
+
+	if (!m_stat_start_ns)
+		m_stat_start_ns = now_ns;
+
+	if (now_ns - m_stat_start_ns < 10000000000LL)
+		return;
+
+	if (m_stat_late_frames || m_stat_dropped_frames) {
+		LOG_WARNING("(mixer): %.1f ms of late source audio mixed as silence, %.1f ms dropped in the last 10 s\n",
+			m_stat_late_frames * 1000.0 / m_sample_rate, m_stat_dropped_frames * 1000.0 / m_sample_rate);
+	}
+
+	m_stat_late_frames = 0;
+	m_stat_dropped_frames = 0;
+	m_stat_start_ns = now_ns;
+}
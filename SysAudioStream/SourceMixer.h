@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "Simd.h"
+
+// Mixes several capture sources of the same rate and channel count into
+// one stream, e.g. the desktop monitor and a microphone. Source 0 is the
+// clock: its audio is held until every other source has delivered the same
+// stretch of time (by pts), or for at most the latency bound, then mixed
+// with per-source gain and passed on. Late or missing audio of the others
+// mixes as silence, so source 0 never waits longer than the bound.
+//
+// Every buffer is allocated by Init, Push and the mix don't allocate. The
+// mix runs in whichever source callback completes a stretch, with PulseAudio
+// all of them are on the one mainloop thread.
+class SourceMixer
+{
+public:
+	typedef std::function<void(const float* samples, size_t frames, int64_t pts_ns)> OutputCallback;
+
+	SourceMixer();
+
+	void Init(int sources, int channels, int sample_rate, int max_latency_ms);
+
+	// Drops queued audio, for a capture restart
+	void Reset();
+
+	void SetGain(int source, double gain_db);
+	void SetOutputCallback(OutputCallback callback);
+
+	int GetChannels() const;
+	int GetSampleRate() const;
+
+	// Interleaved audio of one source, pts_ns being the time of its first
+	// frame. Blocks of another channel count than Init's are dropped.
+	void Push(int source, const float* in, size_t frames, int channels, int64_t pts_ns);
+
+	// Forces a kernel family, for benchmarks
+	void SetSimdLevel(SimdLevel level);
+
+private:
+	struct Source
+	{
+		std::vector<float> buffer;
+		size_t frames;
+		int64_t pts_ns;
+
+		float gain;
+
+		// Set once the queue has been lined up with the output, later pts
+		// jitter within the tolerance is ignored
+		bool aligned;
+	};
+
+	void MixAvailable();
+
+	// Discards the frames of source before m_out_pts_ns, or returns how
+	// many frames of silence come first
+	size_t Align(Source& source);
+
+	void Consume(Source& source, size_t frames);
+
+	int64_t FramesToNs(int64_t frames) const;
+
+	std::mutex m_mutex;
+
+	int m_channels;
+	int m_sample_rate;
+
+	size_t m_capacity;
+	size_t m_max_latency_frames;
+	size_t m_tolerance_frames;
+
+	std::vector<Source> m_sources;
+	std::vector<float> m_output;
+
+	// Frames of silence before each source's audio starts, per mix
+	std::vector<size_t> m_leads;
+
+	// pts of the next frame to mix, 0 before source 0 delivered any
+	int64_t m_out_pts_ns;
+
+	OutputCallback m_callback;
+
+	SimdLevel m_level;
+
+	// Late audio of the other sources since the last report
+	int64_t m_stat_late_frames;
+	int64_t m_stat_dropped_frames;
+	int64_t m_stat_start_ns;
+};
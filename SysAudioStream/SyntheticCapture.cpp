@@ -0,0 +1,249 @@
+#ifdef __linux__
+
+#include "pch.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+#include "SyntheticCapture.h"
+#include "ChannelMixer.h"
+#include "Clock.h"
+#include "Log.h"
+#include "Realtime.h"
+#include "Trace.h"
+
+std::atomic<int> SyntheticCapture::s_impulse_interval_ms{ 500 };
+std::mutex SyntheticCapture::s_impulse_mutex;
+int64_t SyntheticCapture::s_impulses[MAX_LOGGED_IMPULSES];
+size_t SyntheticCapture::s_impulse_first = 0;
+size_t SyntheticCapture::s_impulse_count = 0;
+
+SyntheticCapture::SyntheticCapture()
+{
+    m_sampleRate = 48000;
+    m_nChannels = 2;
+    m_enginePeriod = 480;
+
+    m_running = false;
+    m_playing = false;
+}
+
+SyntheticCapture::~SyntheticCapture()
+{
+    StopCapture();
+}
+
+void SyntheticCapture::SetAudioReadyCallback(PacketCallback callback)
+{
+    m_callback = callback;
+}
+
+void SyntheticCapture::SetDeviceName(std::string device_name)
+{
+}
+
+void SyntheticCapture::SetMetrics(StreamMetrics* metrics)
+{
+}
+
+bool SyntheticCapture::InitializeAudioDevice(const std::string& audio_fmt)
+{
+    std::vector<std::string> audio_config;
+
+    std::string temp;
+    std::stringstream sstr(audio_fmt);
+
+    while (sstr >> temp) {
+        audio_config.push_back(temp);
+    }
+
+    if (audio_config.size() != 3 && audio_config.size() != 4) {
+        LOG_ERROR("(synthetic): Audio format has invalid number of configurations\n");
+        return false;
+    }
+
+    int sample_rate = audio_config[2] == "native" ? 48000 : std::stoi(audio_config[2]);
+    int channels = audio_config.size() == 4 ? std::stoi(audio_config[3]) : 2;
+
+    if (sample_rate < 8000 || sample_rate > 384000 || channels < 1 || channels > MAX_MIX_CHANNELS) {
+        LOG_ERROR("(synthetic): Unsupported format '%s'\n", audio_fmt.c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lk(m_mutex);
+
+    m_sampleRate = sample_rate;
+    m_nChannels = channels;
+    m_enginePeriod = sample_rate / 100;
+
+    m_block.assign((size_t)m_enginePeriod * channels, 0.0f);
+
+    return true;
+}
+
+void SyntheticCapture::StopCapture()
+{
+    std::lock_guard<std::mutex> thread_lk(m_thread_mutex);
+
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_running = false;
+    }
+
+    m_cv.notify_all();
+
+    if (m_thread && m_thread->joinable())
+        m_thread->join();
+
+    m_thread.reset();
+}
+
+void SyntheticCapture::AsyncStartCapture()
+{
+    std::lock_guard<std::mutex> thread_lk(m_thread_mutex);
+
+    if (m_thread)
+        return;
+
+    m_running = true;
+    m_thread = std::make_unique<std::thread>(&SyntheticCapture::t_render, this);
+}
+
+void SyntheticCapture::AsyncStopCapture()
+{
+    StopCapture();
+}
+
+void SyntheticCapture::SetPlaybackState(bool playing)
+{
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_playing = playing;
+    }
+
+    m_cv.notify_all();
+}
+
+int SyntheticCapture::GetAudioFormat() const
+{
+    return 1;
+}
+
+int SyntheticCapture::GetBitsPerSample() const
+{
+    return 32;
+}
+
+int SyntheticCapture::GetChannels() const
+{
+    return m_nChannels;
+}
+
+int SyntheticCapture::GetSamplerate() const
+{
+    return m_sampleRate;
+}
+
+int SyntheticCapture::GetEnginePeriod() const
+{
+    return m_enginePeriod;
+}
+
+void SyntheticCapture::SetImpulseInterval(int interval_ms)
+{
+    s_impulse_interval_ms = std::max(interval_ms, IMPULSE_MS * 2);
+}
+
+bool SyntheticCapture::PopImpulse(int64_t* render_ns)
+{
+    std::lock_guard<std::mutex> lk(s_impulse_mutex);
+
+    if (!s_impulse_count)
+        return false;
+
+    *render_ns = s_impulses[s_impulse_first];
+    s_impulse_first = (s_impulse_first + 1) % MAX_LOGGED_IMPULSES;
+    s_impulse_count--;
+
+    return true;
+}
+
+void SyntheticCapture::t_render()
+{
+    SetThreadName("sas-synthetic");
+    TRACE_THREAD("synthetic");
+
+    std::unique_lock<std::mutex> lk(m_mutex);
+
+    // Frame count since the stream (re)started playing and its start time
+    int64_t frame = 0;
+    int64_t start_ns = 0;
+
+    while (m_running) {
+        if (!m_playing) {
+            start_ns = 0;
+            m_cv.wait(lk, [this] { return !m_running || m_playing; });
+            continue;
+        }
+
+        if (!start_ns) {
+            start_ns = MonotonicNowNs();
+            frame = 0;
+        }
+
+        int rate = m_sampleRate;
+        int channels = m_nChannels;
+        int period = m_enginePeriod;
+
+        int64_t pts_ns = start_ns + frame * 1000000000LL / rate;
+
+        // Like a device, a block is handed over once its last frame was
+        // rendered
+        int64_t due_ns = start_ns + (frame + period) * 1000000000LL / rate;
+
+        m_cv.wait_for(lk, std::chrono::nanoseconds(std::max<int64_t>(due_ns - MonotonicNowNs(), 0)),
+            [this] { return !m_running || !m_playing; });
+
+        if (!m_running || !m_playing)
+            continue;
+
+        int64_t interval = (int64_t)rate * s_impulse_interval_ms / 1000;
+        int64_t burst = (int64_t)rate * IMPULSE_MS / 1000;
+
+        for (int f = 0; f < period; f++) {
+            int64_t phase = (frame + f) % interval;
+
+            // Square wave at a quarter of the rate, survives resampling
+            // and Opus better than a single sample
+            float value = phase < burst ? ((phase / 2) % 2 ? -0.9f : 0.9f) : 0.0f;
+
+            for (int c = 0; c < channels; c++)
+                m_block[(size_t)f * channels + c] = value;
+
+            if (phase == 0) {
+                std::lock_guard<std::mutex> impulse_lk(s_impulse_mutex);
+
+                s_impulses[(s_impulse_first + s_impulse_count) % MAX_LOGGED_IMPULSES] = start_ns + (frame + f) * 1000000000LL / rate;
+
+                if (s_impulse_count < MAX_LOGGED_IMPULSES)
+                    s_impulse_count++;
+                else
+                    s_impulse_first = (s_impulse_first + 1) % MAX_LOGGED_IMPULSES;
+            }
+        }
+
+        frame += period;
+
+        PacketCallback callback = m_callback;
+        std::vector<float>& block = m_block;
+
+        lk.unlock();
+
+        if (callback)
+            callback((uint32_t)(period * channels * sizeof(float)), reinterpret_cast<uint8_t*>(block.data()), pts_ns);
+
+        lk.lock();
+    }
+}
+
+#endif
@@ -0,0 +1,91 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AudioCapture.h"
+
+// Device name that selects SyntheticCapture instead of PulseAudio
+#define SYNTHETIC_DEVICE_NAME "synthetic"
+
+// Oldest bursts are dropped if nobody collects them
+#define MAX_LOGGED_IMPULSES 1024
+
+// Capture without an audio server, for tests and benchmarks. Delivers
+// silence with a short full scale burst every impulse interval, in 10 ms
+// blocks paced by the monotonic clock like a real device. The render time
+// of every burst is logged so a receiver can measure end to end latency.
+class SyntheticCapture : public AudioCapture
+{
+    public:
+        SyntheticCapture();
+        ~SyntheticCapture();
+
+        void SetAudioReadyCallback(PacketCallback callback) override;
+        void SetDeviceName(std::string device_name) override;
+
+        // Renders every block, there is nothing to count
+        void SetMetrics(StreamMetrics* metrics) override;
+
+        // "native" runs at 48000 Hz stereo
+        bool InitializeAudioDevice(const std::string& audio_fmt) override;
+        void StopCapture() override;
+
+        void AsyncStartCapture() override;
+        void AsyncStopCapture() override;
+
+        void SetPlaybackState(bool playing) override;
+
+        int GetAudioFormat() const override;
+        int GetBitsPerSample() const override;
+        int GetChannels() const override;
+        int GetSamplerate() const override;
+        int GetEnginePeriod() const override;
+
+        // Time between bursts, 500 ms by default
+        static void SetImpulseInterval(int interval_ms);
+
+        // Oldest logged burst render time, shared by every instance in the
+        // process
+        static bool PopImpulse(int64_t* render_ns);
+
+        // Length of a burst
+        static constexpr int IMPULSE_MS = 2;
+
+    private:
+        void t_render();
+
+        PacketCallback m_callback;
+
+        int m_sampleRate;
+        int m_nChannels;
+        int m_enginePeriod;
+
+        // Start and stop may come from the cmd thread and the destructor
+        // at once
+        std::mutex m_thread_mutex;
+        std::unique_ptr<std::thread> m_thread;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_running;
+        bool m_playing;
+
+        std::vector<float> m_block;
+
+        static std::atomic<int> s_impulse_interval_ms;
+        static std::mutex s_impulse_mutex;
+
+        // Ring of render times, fixed so the render thread never allocates
+        static int64_t s_impulses[MAX_LOGGED_IMPULSES];
+        static size_t s_impulse_first;
+        static size_t s_impulse_count;
+};
+
+#endif
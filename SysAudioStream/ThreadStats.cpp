@@ -0,0 +1,242 @@
+#include "pch.h"
+#include "ThreadStats.h"
+#include "Clock.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Realtime.h"
+
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+#include <dirent.h>
+#endif
+
+static std::mutex g_samples_mutex;
+static std::vector<ThreadSample> g_samples;
+
+static std::mutex g_stats_mutex;
+static std::condition_variable g_stats_cv;
+static bool g_stats_running = false;
+static std::unique_ptr<std::thread> g_stats_thread;
+
+#ifdef __linux__
+static bool read_file(const std::string& path, char* buffer, size_t size)
+{
+	FILE* file = fopen(path.c_str(), "r");
+
+	if (!file)
+		return false;
+
+	size_t length = fread(buffer, 1, size - 1, file);
+	buffer[length] = 0;
+	fclose(file);
+
+	return length > 0;
+}
+
+static bool read_thread(uint64_t tid, ThreadSample* sample)
+{
+	static const long ticks_per_second = sysconf(_SC_CLK_TCK);
+
+	std::string task = "/proc/self/task/" + std::to_string(tid);
+	char buffer[1024];
+
+	if (!read_file(task + "/stat", buffer, sizeof(buffer)))
+		return false;
+
+	// The name may hold spaces and parentheses itself
+	char* name_start = strchr(buffer, '(');
+	char* name_end = strrchr(buffer, ')');
+
+	if (!name_start || !name_end || name_end < name_start)
+		return false;
+
+	unsigned long long utime, stime;
+
+	// From the state, the third field, to utime and stime, the 14th and 15th
+	if (sscanf(name_end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+		return false;
+
+	sample->tid = tid;
+	sample->name.assign(name_start + 1, name_end);
+	sample->user_ns = (int64_t)(utime * 1000000000ULL / ticks_per_second);
+	sample->system_ns = (int64_t)(stime * 1000000000ULL / ticks_per_second);
+	sample->run_delay_ns = -1;
+	sample->cpu_ratio = 0;
+	sample->run_delay_ratio = 0;
+
+	unsigned long long run_ns, run_delay_ns;
+
+	// Missing on kernels without CONFIG_SCHED_INFO
+	if (read_file(task + "/schedstat", buffer, sizeof(buffer)) && sscanf(buffer, "%llu %llu", &run_ns, &run_delay_ns) == 2)
+		sample->run_delay_ns = (int64_t)run_delay_ns;
+
+	return true;
+}
+#endif
+
+bool ReadThreadSamples(std::vector<ThreadSample>* samples)
+{
+	samples->clear();
+
+	#ifdef __linux__
+	DIR* dir = opendir("/proc/self/task");
+
+	if (!dir)
+		return false;
+
+	while (dirent* entry = readdir(dir)) {
+		if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+			continue;
+
+		ThreadSample sample;
+
+		// Threads can exit between the listing and the read
+		if (read_thread(strtoull(entry->d_name, nullptr, 10), &sample))
+			samples->push_back(sample);
+	}
+
+	closedir(dir);
+
+	return true;
+	#else
+	return false;
+	#endif
+}
+
+static std::string thread_labels(const ThreadSample& sample)
+{
+	std::string name;
+
+	for (char c : sample.name) {
+		if (c == '"' || c == '\\')
+			name += '\\';
+
+		name += c;
+	}
+
+	return "thread=\"" + name + "\",tid=\"" + std::to_string(sample.tid) + "\"";
+}
+
+static void collect_metrics(MetricsWriter* writer)
+{
+	std::lock_guard<std::mutex> lk(g_samples_mutex);
+
+	for (const ThreadSample& sample : g_samples) {
+		std::string labels = thread_labels(sample);
+
+		writer->AddCounter("sas_thread_cpu_seconds", "CPU time of each thread", labels + ",mode=\"user\"", sample.user_ns / 1e9);
+		writer->AddCounter("sas_thread_cpu_seconds", "CPU time of each thread", labels + ",mode=\"system\"", sample.system_ns / 1e9);
+		writer->AddGauge("sas_thread_cpu_ratio", "Share of the last sample interval each thread ran", labels, sample.cpu_ratio);
+
+		if (sample.run_delay_ns < 0)
+			continue;
+
+		writer->AddCounter("sas_thread_run_delay_seconds", "Time each thread waited in a run queue", labels, sample.run_delay_ns / 1e9);
+		writer->AddGauge("sas_thread_run_delay_ratio", "Share of the last sample interval each thread waited in a run queue", labels, sample.run_delay_ratio);
+	}
+}
+
+static void sample_threads(int64_t interval_ns)
+{
+	std::vector<ThreadSample> samples;
+
+	if (!ReadThreadSamples(&samples))
+		return;
+
+	std::lock_guard<std::mutex> lk(g_samples_mutex);
+
+	std::map<uint64_t, const ThreadSample*> previous;
+
+	for (const ThreadSample& sample : g_samples)
+		previous[sample.tid] = &sample;
+
+	for (ThreadSample& sample : samples) {
+		auto it = previous.find(sample.tid);
+
+		if (it == previous.end() || interval_ns <= 0)
+			continue;
+
+		const ThreadSample& last = *it->second;
+
+		sample.cpu_ratio = (double)(sample.user_ns + sample.system_ns - last.user_ns - last.system_ns) / interval_ns;
+
+		if (sample.run_delay_ns >= 0 && last.run_delay_ns >= 0)
+			sample.run_delay_ratio = (double)(sample.run_delay_ns - last.run_delay_ns) / interval_ns;
+
+		if (sample.run_delay_ratio >= THREAD_STATS_DELAY_WARNING) {
+			LOG_WARNING("(threads): %s (%llu) waited %.1f%% of the last %d s for a CPU, running %.1f%%\n", sample.name.c_str(),
+				(unsigned long long)sample.tid, sample.run_delay_ratio * 100, THREAD_STATS_INTERVAL_MS / 1000, sample.cpu_ratio * 100);
+		}
+		else {
+			LOG_DEBUG("(threads): %s (%llu) cpu %.1f%%, run delay %.1f%%\n", sample.name.c_str(),
+				(unsigned long long)sample.tid, sample.cpu_ratio * 100, sample.run_delay_ratio * 100);
+		}
+	}
+
+	g_samples.swap(samples);
+}
+
+static void t_stats()
+{
+	SetThreadName("sas-threads");
+
+	int64_t last_ns = 0;
+	std::unique_lock<std::mutex> lk(g_stats_mutex);
+
+	while (g_stats_running) {
+		int64_t now_ns = MonotonicNowNs();
+
+		lk.unlock();
+		sample_threads(last_ns ? now_ns - last_ns : 0);
+		lk.lock();
+
+		last_ns = now_ns;
+		g_stats_cv.wait_for(lk, std::chrono::milliseconds(THREAD_STATS_INTERVAL_MS), [] { return !g_stats_running; });
+	}
+}
+
+bool StartThreadStats()
+{
+	#ifndef __linux__
+	LOG_WARNING("(threads): per-thread statistics need Linux\n");
+	return false;
+	#else
+	std::lock_guard<std::mutex> lk(g_stats_mutex);
+
+	if (g_stats_running)
+		return true;
+
+	g_stats_running = true;
+	g_stats_thread = std::make_unique<std::thread>(t_stats);
+
+	AddMetricsCollector(&g_samples, collect_metrics);
+
+	return true;
+	#endif
+}
+
+void StopThreadStats()
+{
+	{
+		std::lock_guard<std::mutex> lk(g_stats_mutex);
+
+		if (!g_stats_running)
+			return;
+
+		g_stats_running = false;
+	}
+
+	g_stats_cv.notify_all();
+
+	if (g_stats_thread && g_stats_thread->joinable())
+		g_stats_thread->join();
+
+	g_stats_thread.reset();
+
+	RemoveMetricsCollector(&g_samples);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Time between samples of the process' threads
+#define THREAD_STATS_INTERVAL_MS 10000
+
+// Share of an interval a thread may wait for a CPU before it is reported
+#define THREAD_STATS_DELAY_WARNING 0.05
+
+// One thread's totals since it started, from /proc/self/task/<tid>
+struct ThreadSample
+{
+	uint64_t tid;
+	std::string name;
+
+	int64_t user_ns;
+	int64_t system_ns;
+
+	// Time spent runnable but waiting in a run queue, -1 without schedstat
+	int64_t run_delay_ns;
+
+	// Shares of the last interval spent running and waiting, 0 on the
+	// first sample of a thread
+	double cpu_ratio;
+	double run_delay_ratio;
+};
+
+// Reads every thread of the process, false where /proc is not available
+bool ReadThreadSamples(std::vector<ThreadSample>* samples);
+
+// Samples every THREAD_STATS_INTERVAL_MS on a thread of its own, exports the
+// samples as metrics and warns about threads kept waiting for a CPU.
+// Linux only.
+bool StartThreadStats();
+void StopThreadStats();
@@ -0,0 +1,266 @@
+#include "pch.h"
+#include "Trace.h"
+#include "Log.h"
+#include "Realtime.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// Dumps after glitches at most this often, a stream of glitches would
+// otherwise keep the disk busy
+#define TRACE_DUMP_INTERVAL_MS 10000
+
+// Time after a glitch before its dump, so the trace shows how it ended
+#define TRACE_GLITCH_DELAY_MS 500
+
+static std::mutex g_rings_mutex;
+static std::vector<TraceRing*> g_rings;
+
+static std::atomic<bool> g_dump_running{ false };
+static std::atomic<const char*> g_glitch_name{ nullptr };
+static std::atomic<int64_t> g_glitch_ns{ 0 };
+static std::atomic<int64_t> g_last_glitch_dump_ns{ 0 };
+static std::unique_ptr<std::thread> g_dump_thread;
+
+// Only the dump thread and the signal handler use these
+#ifdef SAS_WITH_TRACE
+static std::atomic<bool> g_dump_requested{ false };
+static std::string g_dump_directory;
+#endif
+
+// Hands the ring back when its thread exits
+struct TraceRingOwner
+{
+	TraceRing* ring = nullptr;
+
+	~TraceRingOwner()
+	{
+		if (ring)
+			ring->released.store(true, std::memory_order_release);
+	}
+};
+
+static thread_local TraceRingOwner t_ring_owner;
+
+static uint64_t current_thread_id()
+{
+	#if defined(_WIN32)
+	return GetCurrentThreadId();
+	#elif defined(__linux__)
+	return (uint64_t)syscall(SYS_gettid);
+	#endif
+}
+
+TraceRing* GetTraceRing()
+{
+	if (t_ring_owner.ring)
+		return t_ring_owner.ring;
+
+	TraceRing* ring = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lk(g_rings_mutex);
+
+		for (TraceRing* released : g_rings) {
+			if (released->released.load(std::memory_order_acquire)) {
+				ring = released;
+				break;
+			}
+		}
+
+		// Rings are never freed, a dump may be reading them
+		if (!ring) {
+			ring = new TraceRing();
+			g_rings.push_back(ring);
+		}
+
+		ring->head.store(0, std::memory_order_relaxed);
+		ring->thread_name.store(nullptr, std::memory_order_relaxed);
+		ring->thread_id = current_thread_id();
+		ring->released.store(false, std::memory_order_relaxed);
+	}
+
+	t_ring_owner.ring = ring;
+
+	return ring;
+}
+
+void TraceThreadName(const char* name)
+{
+	GetTraceRing()->thread_name.store(name, std::memory_order_relaxed);
+}
+
+void TraceGlitch(const char* name)
+{
+	int64_t now_ns = MonotonicNowNs();
+	int64_t none = 0;
+
+	TraceRecord(name, now_ns, -1);
+
+	if (!g_dump_running || now_ns - g_last_glitch_dump_ns < TRACE_DUMP_INTERVAL_MS * 1000000LL)
+		return;
+
+	// The first glitch of a burst names the dump
+	if (g_glitch_ns.compare_exchange_strong(none, now_ns))
+		g_glitch_name = name;
+}
+
+bool WriteTrace(const std::string& path)
+{
+	FILE* file = fopen(path.c_str(), "w");
+
+	if (!file)
+		return false;
+
+	#if defined(_WIN32)
+	unsigned long pid = GetCurrentProcessId();
+	#elif defined(__linux__)
+	unsigned long pid = (unsigned long)getpid();
+	#endif
+
+	std::vector<TraceEvent> events;
+	bool first = true;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	std::lock_guard<std::mutex> lk(g_rings_mutex);
+
+	for (TraceRing* ring : g_rings) {
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		uint64_t start = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+		events.clear();
+
+		for (uint64_t i = start; i < head; i++)
+			events.push_back(ring->events[i % TRACE_RING_EVENTS]);
+
+		// Events the thread wrote over while they were copied, and the slot
+		// it may be writing now, are left out
+		uint64_t new_head = ring->head.load(std::memory_order_acquire);
+		uint64_t valid = new_head >= TRACE_RING_EVENTS ? new_head - TRACE_RING_EVENTS + 1 : 0;
+		size_t skip = valid > start ? (size_t)std::min<uint64_t>(valid - start, events.size()) : 0;
+
+		if (events.size() == skip)
+			continue;
+
+		const char* name = ring->thread_name.load(std::memory_order_relaxed);
+
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%llu,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", pid, (unsigned long long)ring->thread_id, name ? name : "thread");
+		first = false;
+
+		for (size_t i = skip; i < events.size(); i++) {
+			const TraceEvent& event = events[i];
+
+			if (event.duration_ns < 0) {
+				fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"pid\":%lu,\"tid\":%llu,\"ts\":%.3f}",
+					event.name, pid, (unsigned long long)ring->thread_id, event.start_ns / 1e3);
+			}
+			else {
+				fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%lu,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f}",
+					event.name, pid, (unsigned long long)ring->thread_id, event.start_ns / 1e3, event.duration_ns / 1e3);
+			}
+		}
+	}
+
+	fprintf(file, "\n]}\n");
+
+	bool ok = !ferror(file);
+
+	return fclose(file) == 0 && ok;
+}
+
+#ifdef SAS_WITH_TRACE
+static void dump(const char* reason)
+{
+	long long now = (long long)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	std::string path = g_dump_directory + "/sas-trace-" + std::to_string(now) + ".json";
+
+	if (WriteTrace(path))
+		LOG_INFO("(trace): %s, wrote %s\n", reason, path.c_str());
+	else
+		LOG_WARNING("(trace): %s, unable to write %s\n", reason, path.c_str());
+}
+
+static void t_dump()
+{
+	SetThreadName("sas-trace");
+
+	while (g_dump_running) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+		if (g_dump_requested.exchange(false))
+			dump("dump requested");
+
+		int64_t glitch_ns = g_glitch_ns;
+		int64_t now_ns = MonotonicNowNs();
+
+		if (glitch_ns && now_ns - glitch_ns >= TRACE_GLITCH_DELAY_MS * 1000000LL) {
+			const char* name = g_glitch_name.load();
+			std::string reason = std::string("glitch '") + (name ? name : "unknown") + "'";
+
+			g_last_glitch_dump_ns = now_ns;
+			g_glitch_ns = 0;
+
+			dump(reason.c_str());
+		}
+	}
+}
+
+#ifdef __linux__
+static void on_dump_signal(int)
+{
+	g_dump_requested = true;
+}
+#endif
+#endif
+
+bool StartTraceDumps(const std::string& directory)
+{
+	#ifndef SAS_WITH_TRACE
+	LOG_ERROR("(trace): built without SAS_WITH_TRACE, there are no trace points to dump\n");
+	return false;
+	#else
+	if (g_dump_running)
+		return true;
+
+	g_dump_directory = directory.empty() ? "." : directory;
+	g_dump_running = true;
+	g_dump_thread = std::make_unique<std::thread>(t_dump);
+
+	#ifdef __linux__
+	signal(SIGUSR1, on_dump_signal);
+	#endif
+
+	LOG_INFO("(trace): dumping traces into %s\n", g_dump_directory.c_str());
+
+	return true;
+	#endif
+}
+
+void StopTraceDumps()
+{
+	if (!g_dump_running)
+		return;
+
+	#ifdef __linux__
+	signal(SIGUSR1, SIG_DFL);
+	#endif
+
+	g_dump_running = false;
+
+	if (g_dump_thread && g_dump_thread->joinable())
+		g_dump_thread->join();
+
+	g_dump_thread.reset();
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "Clock.h"
+
+// Events kept per thread, the last few seconds of a busy thread
+#define TRACE_RING_EVENTS 8192
+
+// Hot path trace points, compiled in only with SAS_WITH_TRACE. Each thread
+// writes its events into a ring of its own without locks; the rings are
+// dumped as a Chrome/Perfetto JSON trace on request or after a glitch.
+//
+// TRACE_SCOPE(name)   a slice from here to the end of the scope
+// TRACE_THREAD(name)  names the calling thread in the trace
+// TRACE_GLITCH(name)  marks a glitch and schedules a dump
+//
+// name must be a string literal, only its pointer is stored.
+#ifdef SAS_WITH_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_THREAD(name) TraceThreadName(name)
+#define TRACE_GLITCH(name) TraceGlitch(name)
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_THREAD(name) do {} while (0)
+#define TRACE_GLITCH(name) do {} while (0)
+#endif
+
+struct TraceEvent
+{
+	const char* name;
+	int64_t start_ns;
+
+	// -1 for an instant event
+	int64_t duration_ns;
+};
+
+// Single writer, the thread it belongs to. The dump reads it racily and
+// drops whatever was overwritten while it copied.
+struct TraceRing
+{
+	TraceEvent events[TRACE_RING_EVENTS];
+	std::atomic<uint64_t> head;
+
+	std::atomic<const char*> thread_name;
+	uint64_t thread_id;
+
+	// Left by an exited thread, the next new thread takes it over
+	std::atomic<bool> released;
+};
+
+// The calling thread's ring, taken on its first event
+TraceRing* GetTraceRing();
+
+inline void TraceRecord(const char* name, int64_t start_ns, int64_t duration_ns)
+{
+	TraceRing* ring = GetTraceRing();
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	TraceEvent& event = ring->events[head % TRACE_RING_EVENTS];
+
+	event.name = name;
+	event.start_ns = start_ns;
+	event.duration_ns = duration_ns;
+
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+class TraceScope
+{
+public:
+	TraceScope(const char* name)
+		: m_name(name), m_start_ns(MonotonicNowNs())
+	{
+	}
+
+	~TraceScope()
+	{
+		TraceRecord(m_name, m_start_ns, MonotonicNowNs() - m_start_ns);
+	}
+
+private:
+	const char* m_name;
+	int64_t m_start_ns;
+};
+
+void TraceThreadName(const char* name);
+
+// Records an instant event and asks for a dump once the events following it
+// are in too. Dumps after glitches are at least 10 s apart.
+void TraceGlitch(const char* name);
+
+// Starts the thread writing the dumps into directory, as
+// sas-trace-<unix time>.json. On Linux SIGUSR1 asks for one as well.
+bool StartTraceDumps(const std::string& directory);
+void StopTraceDumps();
+
+// Writes every ring as Chrome JSON trace events, returns false if path
+// can't be written
+bool WriteTrace(const std::string& path);
@@ -2,6 +2,8 @@
 
 #include "pch.h"
 #include "WASAPICapture.h"
+#include "Metrics.h"
+#include "Trace.h"
 
 using namespace winrt::Windows::Foundation;
 using namespace winrt::Windows::Media::Devices;
@@ -30,6 +32,16 @@ namespace winrt::SDKTemplate
         m_callback = callback;
     }
 
+    void WASAPICapture::SetDeviceName(std::string device_name)
+    {
+        m_deviceName = device_name;
+    }
+
+    void WASAPICapture::SetMetrics(StreamMetrics* metrics)
+    {
+        m_metrics = metrics;
+    }
+
     WASAPICapture::WASAPICapture()
     {
         m_audioFormat = 0;
@@ -50,13 +62,13 @@ namespace winrt::SDKTemplate
     //  Activates the default audio capture on a asynchronous callback thread.  This needs
     //  to be called from the main UI thread.
     //
-    void WASAPICapture::AsyncInitializeAudioDevice(std::string audio_fmt) noexcept try
+    void WASAPICapture::AsyncInitializeAudioDevice(const std::string& audio_fmt) noexcept try
     {
         m_audio_fmt = audio_fmt;
 
         com_ptr<IActivateAudioInterfaceAsyncOperation> asyncOp;
 
-        hstring deviceIdString = MediaDevice::GetDefaultAudioRenderId(AudioDeviceRole::Default);        
+        hstring deviceIdString = m_deviceName.empty() ? MediaDevice::GetDefaultAudioRenderId(AudioDeviceRole::Default) : to_hstring(m_deviceName);
 
         // This call must be made on the main UI thread.  Async operation will call back to 
         // IActivateAudioInterfaceCompletionHandler::ActivateCompleted, which must be an agile interface implementation
@@ -67,11 +79,17 @@ namespace winrt::SDKTemplate
         SetState(DeviceState::Error, to_hresult());
     }
 
-    bool WASAPICapture::InitializeAudioDevice(std::string audio_fmt)
+    bool WASAPICapture::InitializeAudioDevice(const std::string& audio_fmt)
     {
         // TODO: Do a proper sync call
         // Check 'ActivateCompleted' for the condition_variable notification
 
+        // Keep the running client across sessions if nothing about it changed
+        if ((m_deviceState == DeviceState::Initialized || m_deviceState == DeviceState::Capturing) && audio_fmt == m_audio_fmt)
+            return true;
+
+        StopCapture();
+
         std::unique_lock lk(m_mutex);
 
         AsyncInitializeAudioDevice(audio_fmt);
@@ -126,22 +144,24 @@ namespace winrt::SDKTemplate
         else if (config_fmt == "float") {
             m_audioFormat = 1;
         }
+        else if (config_fmt == "lossless") {
+            m_audioFormat = 3;
+        }
         else throw hresult_invalid_argument();
 
-        m_bitsPerSample = std::stoi(config_bits);
-        m_sampleRate = std::stoi(config_rate);
+        m_bitsPerSample = m_audioFormat == 1 ? 32 : std::stoi(config_bits);
+        // "native" keeps the engine's mix rate so Windows doesn't resample,
+        // AudioStream converts per client instead
+        m_sampleRate = config_rate == "native" ? (int)m_mixFormat->nSamplesPerSec : std::stoi(config_rate);
         
         switch (m_mixFormat->wFormatTag)
         {
         case WAVE_FORMAT_PCM:
         case WAVE_FORMAT_IEEE_FLOAT:
 
-            if (m_audioFormat == 0)
-                m_mixFormat->wFormatTag = WAVE_FORMAT_PCM;
-            else
-                m_mixFormat->wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
-
-            m_mixFormat->wBitsPerSample = m_bitsPerSample;
+            // Capture always runs in float, AudioStream converts to the wire format
+            m_mixFormat->wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
+            m_mixFormat->wBitsPerSample = 32;
             m_mixFormat->nSamplesPerSec = m_sampleRate;
 
             m_nChannels = m_mixFormat->nChannels;
@@ -155,12 +175,8 @@ namespace winrt::SDKTemplate
         {
             WAVEFORMATEXTENSIBLE* pWaveFormatExtensible = reinterpret_cast<WAVEFORMATEXTENSIBLE*>(m_mixFormat.get());
 
-            if (m_audioFormat == 0)
-                pWaveFormatExtensible->SubFormat = KSDATAFORMAT_SUBTYPE_PCM; 
-            else
-                pWaveFormatExtensible->SubFormat = KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
-
-            pWaveFormatExtensible->Format.wBitsPerSample = m_bitsPerSample;
+            pWaveFormatExtensible->SubFormat = KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
+            pWaveFormatExtensible->Format.wBitsPerSample = 32;
             pWaveFormatExtensible->Format.nSamplesPerSec = m_sampleRate;
 
             m_nChannels = pWaveFormatExtensible->Format.nChannels;
@@ -408,6 +424,9 @@ namespace winrt::SDKTemplate
     //
     void WASAPICapture::OnAudioSampleRequested()
     {
+        TRACE_THREAD("wasapi");
+        TRACE_SCOPE("wasapi_read");
+
         auto guard = slim_lock_guard(m_lock);
 
         // If this flag is set, we have already queued up the async call to finialize the WAV header
@@ -461,7 +480,17 @@ namespace winrt::SDKTemplate
                 memset(data, 0, m_mixFormat->nBlockAlign * framesAvailable);
             }
 
-            m_callback(mixFormat->nBlockAlign * framesAvailable, data);
+            // Audio was lost because this routine ran too late
+            if (dwCaptureFlags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY)
+            {
+                if (m_metrics)
+                    m_metrics->capture_overruns.Add();
+
+                TRACE_GLITCH("capture discontinuity");
+            }
+
+            // qpcPosition is in 100 ns units, the same clock as steady_clock
+            m_callback(mixFormat->nBlockAlign * framesAvailable, data, (int64_t)qpcPosition * 100);
 
             m_audioCaptureClient->ReleaseBuffer(framesAvailable);
         }
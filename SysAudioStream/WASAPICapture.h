@@ -3,6 +3,8 @@
 #ifdef _WIN32
 #include <functional>
 
+struct StreamMetrics;
+
 namespace winrt::SDKTemplate
 {
     enum DeviceState
@@ -28,17 +30,24 @@ namespace winrt::SDKTemplate
     public:
         WASAPICapture();
 
-        typedef std::function<int(uint32_t audio_size, uint8_t* data)> PacketCallback;
+        // pts_ns is the QPC time the first frame was rendered
+        typedef std::function<int(uint32_t audio_size, uint8_t* data, int64_t pts_ns)> PacketCallback;
 
         void SetAudioReadyCallback(PacketCallback callback);
 
-        void AsyncInitializeAudioDevice(std::string audio_fmt) noexcept;
+        // Render endpoint to loopback, empty selects the default device
+        void SetDeviceName(std::string device_name);
+
+        // Where discontinuities of the capture are counted as overruns
+        void SetMetrics(StreamMetrics* metrics);
+
+        void AsyncInitializeAudioDevice(const std::string& audio_fmt) noexcept;
         void AsyncStartCapture();
         void AsyncStopCapture();
 
         void SetPlaybackState(bool playing);
 
-        bool InitializeAudioDevice(std::string audio_fmt);
+        bool InitializeAudioDevice(const std::string& audio_fmt);
         void StopCapture();
 
         int GetAudioFormat() const;
@@ -74,7 +83,9 @@ namespace winrt::SDKTemplate
         unique_shared_work_queue m_queueId{ L"Capture" };
 
         PacketCallback m_callback;
+        StreamMetrics* m_metrics = nullptr;
         std::string m_audio_fmt;
+        std::string m_deviceName;
         
         // true     = playing
         // false    = paused
@@ -0,0 +1,283 @@
+// Proves the streaming path allocates nothing once it runs: a server on the
+// synthetic capture feeds receivers of several formats in this process
+// while every malloc and operator new is counted by the thread that made
+// it. After a warm-up the capture thread, which runs the callback,
+// conversion, encryption and send, must not allocate at all. The first
+// allocations it makes are printed with their stack.
+//
+// SASAllocCheck [seconds] [warm-up seconds]
+// Exits non-zero if the capture thread allocated, or if no audio arrived
+// while the check was armed. Other threads are listed for information.
+// glibc only, the allocator is replaced through its __libc_ entry points.
+
+#include "pch.h"
+#include "AudioStream.h"
+#include "AudioReceiver.h"
+#include "SyntheticCapture.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <execinfo.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+
+#define CHECK_PORT 47185
+#define CHECK_PAIR_CODE "alloccheck"
+
+// Threads that must not allocate, by name
+#define CAPTURE_THREAD_NAME "sas-synthetic"
+
+#define MAX_COUNTED_THREADS 64
+#define MAX_PRINTED_STACKS 4
+#define STACK_DEPTH 24
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void* ptr);
+
+struct ThreadCount
+{
+	char name[16];
+	std::atomic<uint64_t> allocations;
+};
+
+static std::atomic<bool> g_armed{ false };
+static std::atomic_flag g_table_lock = ATOMIC_FLAG_INIT;
+static ThreadCount g_threads[MAX_COUNTED_THREADS];
+static int g_thread_count = 0;
+static std::atomic<int> g_printed_stacks{ 0 };
+
+// Set while the hook itself runs, so backtrace() can't recurse into it
+static thread_local bool t_in_hook = false;
+
+static void count_allocation(size_t size)
+{
+	if (!g_armed.load(std::memory_order_relaxed) || t_in_hook)
+		return;
+
+	t_in_hook = true;
+
+	// Read every time, threads name themselves after they started
+	char name[16] = {};
+	prctl(PR_GET_NAME, name, 0, 0, 0);
+
+	while (g_table_lock.test_and_set(std::memory_order_acquire));
+
+	int i = 0;
+
+	while (i < g_thread_count && strcmp(g_threads[i].name, name) != 0)
+		i++;
+
+	if (i == g_thread_count && g_thread_count < MAX_COUNTED_THREADS) {
+		memcpy(g_threads[i].name, name, sizeof(name));
+		g_thread_count++;
+	}
+
+	if (i < g_thread_count)
+		g_threads[i].allocations.fetch_add(1, std::memory_order_relaxed);
+
+	g_table_lock.clear(std::memory_order_release);
+
+	if (strcmp(name, CAPTURE_THREAD_NAME) == 0 && g_printed_stacks.fetch_add(1) < MAX_PRINTED_STACKS) {
+		void* frames[STACK_DEPTH];
+		int depth = backtrace(frames, STACK_DEPTH);
+
+		fprintf(stderr, "\n%s allocated %zu bytes:\n", name, size);
+		backtrace_symbols_fd(frames, depth, 2);
+	}
+
+	t_in_hook = false;
+}
+
+extern "C" void* malloc(size_t size)
+{
+	count_allocation(size);
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+	count_allocation(count * size);
+	return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+	count_allocation(size);
+	return __libc_realloc(ptr, size);
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+	count_allocation(size);
+	return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+	count_allocation(size);
+	*ptr = __libc_memalign(alignment, size);
+
+	return *ptr ? 0 : ENOMEM;
+}
+
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+	count_allocation(size);
+	return __libc_memalign(alignment, size);
+}
+
+extern "C" void* valloc(size_t size)
+{
+	count_allocation(size);
+	return __libc_memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+extern "C" void* pvalloc(size_t size)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+	// Rounded up to whole pages, a single one for 0
+	size = size ? (size + page - 1) & ~(page - 1) : page;
+
+	count_allocation(size);
+	return __libc_memalign(page, size);
+}
+
+extern "C" void free(void* ptr)
+{
+	__libc_free(ptr);
+}
+
+void* operator new(size_t size)
+{
+	void* ptr = malloc(size ? size : 1);
+
+	if (!ptr)
+		throw std::bad_alloc();
+
+	return ptr;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+	count_allocation(size);
+	void* ptr = __libc_memalign((size_t)alignment, size ? size : 1);
+
+	if (!ptr)
+		throw std::bad_alloc();
+
+	return ptr;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+
+int main(int argc, char* argv[])
+{
+	int seconds = argc > 1 ? std::stoi(argv[1]) : 12;
+	int warmup_seconds = argc > 2 ? std::stoi(argv[2]) : 3;
+
+	// Loads what backtrace needs before it may be called from the hook
+	void* frames[1];
+	backtrace(frames, 1);
+
+	AudioStream stream(CHECK_PAIR_CODE, CHECK_PORT, "pcm 16 48000", SYNTHETIC_DEVICE_NAME);
+
+	if (!stream.Init())
+		return 1;
+
+	// A plain tier, a converted one, a resampled one and an encoded one
+	std::vector<ReceiverConfig> configs(4);
+
+	configs[1].bits_per_sample = 24;
+	configs[2].audio_format = AUDIO_FORMAT_FLOAT;
+	configs[2].bits_per_sample = 32;
+	configs[2].sample_rate = 96000;
+	configs[3].audio_format = AUDIO_FORMAT_LOSSLESS;
+	configs[3].bits_per_sample = 16;
+
+	std::vector<std::unique_ptr<AudioReceiver>> receivers;
+
+	for (ReceiverConfig& config : configs) {
+		config.port = CHECK_PORT;
+		config.password = CHECK_PAIR_CODE;
+
+		receivers.push_back(std::make_unique<AudioReceiver>());
+
+		if (!receivers.back()->Start(config))
+			return 1;
+	}
+
+	std::this_thread::sleep_for(std::chrono::seconds(warmup_seconds));
+
+	// Only packets of the armed window count as checked streaming
+	std::vector<uint64_t> armed_packets(receivers.size());
+
+	for (size_t i = 0; i < receivers.size(); i++)
+		armed_packets[i] = receivers[i]->GetStats().packets;
+
+	g_armed = true;
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	g_armed = false;
+
+	uint64_t capture_allocations = 0;
+	uint64_t packets = 0;
+
+	for (size_t i = 0; i < receivers.size(); i++) {
+		packets += receivers[i]->GetStats().packets - armed_packets[i];
+		receivers[i]->Stop();
+	}
+
+	printf("\nallocations per thread over %d s after %d s of warm-up, %llu packets received meanwhile:\n",
+		seconds, warmup_seconds, (unsigned long long)packets);
+
+	for (int i = 0; i < g_thread_count; i++) {
+		uint64_t allocations = g_threads[i].allocations.load();
+
+		printf("  %-16s %llu\n", g_threads[i].name, (unsigned long long)allocations);
+
+		if (strcmp(g_threads[i].name, CAPTURE_THREAD_NAME) == 0)
+			capture_allocations = allocations;
+	}
+
+	if (!packets) {
+		printf("no audio arrived while armed, nothing was checked\n");
+		return 1;
+	}
+
+	if (capture_allocations) {
+		printf("FAIL: the capture thread allocated %llu times\n", (unsigned long long)capture_allocations);
+		return 1;
+	}
+
+	printf("ok: the capture thread did not allocate\n");
+
+	return 0;
+}
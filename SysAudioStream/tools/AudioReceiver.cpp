@@ -0,0 +1,721 @@
+#include "pch.h"
+#include "AudioReceiver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <errno.h>
+
+#include "Clock.h"
+#include "LosslessCodec.h"
+#include "SampleFormat.h"
+
+// Hellos sent before giving up, one per second
+#define HELLO_ATTEMPTS 5
+
+// Pings keep the session and measure the round trip, protocol 7 receivers
+// send link reports instead
+#define CMD_INTERVAL_MS 1000
+
+// Most samples a lossless frame decodes to
+#define MAX_SAMPLES_PER_PACKET 65536
+
+// Audio the playout thread pulls at once, and how far behind it may fall
+// before it skips ahead instead of catching up
+#define PULL_MS 10
+#define MAX_PULL_LAG_MS 100
+
+static void SetReceiveTimeout(int socket, int timeout_ms)
+{
+	timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+bool ParseReceiverFormat(const std::string& name, ReceiverConfig* config, std::string* server_format)
+{
+	std::string line;
+
+	config->container_bits = 0;
+
+	try {
+		if (name == "pcm16" || name == "pcm24" || name == "pcm32") {
+			config->audio_format = AUDIO_FORMAT_PCM;
+			config->bits_per_sample = std::stoi(name.substr(3));
+			line = "pcm " + name.substr(3) + " 48000";
+		}
+		else if (name == "pcm24in32") {
+			config->audio_format = AUDIO_FORMAT_PCM;
+			config->bits_per_sample = 24;
+			config->container_bits = 32;
+			line = "pcm 24in32 48000";
+		}
+		else if (name == "float") {
+			config->audio_format = AUDIO_FORMAT_FLOAT;
+			config->bits_per_sample = 32;
+			line = "float 32 48000";
+		}
+		else if (name.rfind("opus", 0) == 0) {
+			// Without a bitrate the server picks, 96 kbit/s for a server of our own
+			config->audio_format = AUDIO_FORMAT_OPUS;
+			config->bits_per_sample = 16;
+			config->codec_bitrate = name.size() > 4 ? std::stoi(name.substr(4)) * 1000 : 0;
+			line = "opus " + std::to_string(config->codec_bitrate ? config->codec_bitrate / 1000 : 96) + " 48000 10";
+		}
+		else if (name == "lossless16" || name == "lossless24") {
+			config->audio_format = AUDIO_FORMAT_LOSSLESS;
+			config->bits_per_sample = std::stoi(name.substr(8));
+			line = "lossless " + name.substr(8) + " 48000";
+		}
+		else {
+			return false;
+		}
+	}
+	catch (const std::exception&) {
+		return false;
+	}
+
+	if (server_format)
+		*server_format = line;
+
+	return true;
+}
+
+AudioReceiver::AudioReceiver()
+{
+	m_settings = {};
+
+	m_audio_socket = -1;
+	m_cmd_socket = -1;
+	m_cmd_addr = {};
+
+	m_running = false;
+
+	m_play_format = {};
+	m_buffering = false;
+
+	memset(m_formats, 0, sizeof(m_formats));
+	m_generation = 0;
+
+	m_have_sequence = false;
+	m_first_sequence = 0;
+	m_highest_sequence = 0;
+	m_last_transit_ns = 0;
+	m_jitter_ns = 0;
+
+	#ifdef SAS_WITH_OPUS
+	m_opus = nullptr;
+	m_opus_rate = 0;
+	m_opus_channels = 0;
+	#endif
+
+	m_stats = {};
+
+	m_reported_received = 0;
+	m_reported_lost = 0;
+}
+
+AudioReceiver::~AudioReceiver()
+{
+	Stop();
+
+	#ifdef SAS_WITH_OPUS
+	if (m_opus)
+		opus_decoder_destroy(m_opus);
+	#endif
+}
+
+void AudioReceiver::SetSinkCallback(SinkCallback callback)
+{
+	m_sink = callback;
+}
+
+void AudioReceiver::SetPacketCallback(PacketCallback callback)
+{
+	m_packet_callback = callback;
+}
+
+bool AudioReceiver::Start(const ReceiverConfig& config)
+{
+	m_config = config;
+
+	m_cmd_aes.GenerateKey(config.password);
+
+	m_audio_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	m_cmd_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+	if (m_audio_socket < 0 || m_cmd_socket < 0) {
+		printf("(receiver): socket failed: %s (errno: %d)\n", strerror(errno), errno);
+		return false;
+	}
+
+	// Room for bursts while the receive thread is busy
+	int buffer_size = 4 * 1024 * 1024;
+	setsockopt(m_audio_socket, SOL_SOCKET, SO_RCVBUF, (const char*)&buffer_size, sizeof(buffer_size));
+
+	sockaddr_in local_addr{};
+	local_addr.sin_family = AF_INET;
+	local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	local_addr.sin_port = htons(0);
+
+	if (bind(m_audio_socket, reinterpret_cast<sockaddr*>(&local_addr), sizeof(local_addr)) < 0) {
+		printf("(receiver): bind failed: %s (errno: %d)\n", strerror(errno), errno);
+		return false;
+	}
+
+	socklen_t addrlen = sizeof(local_addr);
+	getsockname(m_audio_socket, reinterpret_cast<sockaddr*>(&local_addr), &addrlen);
+
+	sockaddr_in server_addr{};
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons((u_short)config.port);
+
+	if (inet_pton(AF_INET, config.host.c_str(), &server_addr.sin_addr) != 1) {
+		printf("(receiver): invalid host '%s'\n", config.host.c_str());
+		return false;
+	}
+
+	StreamSettings hello{};
+	hello.android_port = ntohs(local_addr.sin_port);
+	hello.audio_format = config.audio_format;
+	hello.bits_per_sample = config.bits_per_sample;
+	hello.container_bits = config.container_bits;
+	hello.n_channels = config.channels;
+	hello.sample_rate = config.sample_rate;
+	hello.codec_bitrate = config.codec_bitrate;
+	hello.protocol_version = config.protocol_version;
+
+	SetReceiveTimeout(m_cmd_socket, 1000);
+
+	bool answered = false;
+
+	m_stats.hello_ns = MonotonicNowNs();
+
+	for (int attempt = 0; attempt < HELLO_ATTEMPTS && !answered; attempt++)
+		answered = SendHello(hello, server_addr, &m_settings);
+
+	m_stats.settings_ns = MonotonicNowNs();
+
+	if (!answered) {
+		printf("(receiver): no answer from %s:%d\n", config.host.c_str(), config.port);
+		return false;
+	}
+
+	m_formats[0] = {
+		m_settings.audio_format, m_settings.bits_per_sample, m_settings.container_bits,
+		m_settings.sample_rate, m_settings.n_channels, m_settings.codec_bitrate
+	};
+
+	m_cmd_addr = server_addr;
+	m_cmd_addr.sin_port = htons((u_short)m_settings.cmd_port);
+
+	printf("(receiver): session %d, protocol %d, format %d/%d bits %d Hz %d channels\n",
+		m_settings.session_id, m_settings.protocol_version, m_settings.audio_format,
+		m_settings.bits_per_sample, m_settings.sample_rate, m_settings.n_channels);
+
+	m_running = true;
+
+	// Wakes the receive thread now and then to notice Stop
+	SetReceiveTimeout(m_audio_socket, 200);
+
+	m_receive_thread = std::make_unique<std::thread>(&AudioReceiver::t_receive, this);
+	m_playout_thread = std::make_unique<std::thread>(&AudioReceiver::t_playout, this);
+
+	for (int i = 0; i < config.duplicate_hellos; i++) {
+		StreamSettings reply{};
+
+		if (!SendHello(hello, server_addr, &reply) || reply.session_id != m_settings.session_id) {
+			printf("(receiver): duplicate hello %d got session %d instead of %d\n", i + 1, reply.session_id, m_settings.session_id);
+			Stop();
+			return false;
+		}
+	}
+
+	SendCmd(1);
+	ReceiveCmdReply(MonotonicNowNs());
+
+	m_cmd_thread = std::make_unique<std::thread>(&AudioReceiver::t_cmd, this);
+
+	return true;
+}
+
+bool AudioReceiver::SendHello(const StreamSettings& hello, const sockaddr_in& server_addr, StreamSettings* reply)
+{
+	byte buffer[8192];
+	EncryptedData* enc_data = reinterpret_cast<EncryptedData*>(buffer);
+
+	m_random_gen.Generate(enc_data->iv, 16);
+	m_cmd_aes.SetIv(enc_data->iv, 16);
+
+	int data_size = m_cmd_aes.Encrypt(reinterpret_cast<const byte*>(&hello), sizeof(hello), &buffer[16]);
+
+	sendto(m_cmd_socket, (const char*)buffer, 16 + data_size, 0, (const sockaddr*)&server_addr, sizeof(server_addr));
+
+	int recv_bytes = recvfrom(m_cmd_socket, (char*)buffer, sizeof(buffer), 0, nullptr, nullptr);
+
+	if (recv_bytes <= 16)
+		return false;
+
+	m_cmd_aes.SetIv(enc_data->iv, 16);
+	int ret = m_cmd_aes.Decrypt(&buffer[16], recv_bytes - 16, &buffer[16]);
+
+	if (ret <= 0) {
+		printf("(receiver): undecryptable hello reply, wrong password?\n");
+		return false;
+	}
+
+	memcpy(reply, &buffer[16], std::min((size_t)ret, sizeof(*reply)));
+
+	return true;
+}
+
+void AudioReceiver::Stop()
+{
+	if (!m_running) {
+		if (m_audio_socket >= 0)
+			close(m_audio_socket);
+
+		if (m_cmd_socket >= 0)
+			close(m_cmd_socket);
+
+		m_audio_socket = -1;
+		m_cmd_socket = -1;
+		return;
+	}
+
+	m_running = false;
+	m_cv.notify_all();
+
+	for (auto thread : { &m_cmd_thread, &m_receive_thread, &m_playout_thread }) {
+		if (*thread && (*thread)->joinable())
+			(*thread)->join();
+
+		thread->reset();
+	}
+
+	SendCmd(3);
+
+	close(m_audio_socket);
+	close(m_cmd_socket);
+
+	m_audio_socket = -1;
+	m_cmd_socket = -1;
+}
+
+const StreamSettings& AudioReceiver::GetSettings() const
+{
+	return m_settings;
+}
+
+ReceiverStats AudioReceiver::GetStats() const
+{
+	std::lock_guard<std::mutex> lk(m_mutex);
+
+	return CollectStats();
+}
+
+ReceiverStats AudioReceiver::CollectStats() const
+{
+	ReceiverStats stats = m_stats;
+	JitterStats jitter = m_jitter.GetStats();
+
+	stats.lost += jitter.lost;
+	stats.late += jitter.late;
+	stats.duplicates += jitter.duplicates;
+	stats.concealed_frames += jitter.concealed_frames;
+	stats.underruns += jitter.underruns;
+	stats.underrun_frames += jitter.underrun_frames;
+	stats.expanded_frames += jitter.expanded_frames;
+	stats.compressed_frames += jitter.compressed_frames;
+	stats.target_ms = jitter.target_ms;
+	stats.level_ms = jitter.level_ms;
+
+	return stats;
+}
+
+bool AudioReceiver::SendCmd(int cmd)
+{
+	CmdStreamPacket packet{};
+	packet.cmd = cmd;
+	packet.session_id = (uint32_t)m_settings.session_id;
+
+	{
+		std::lock_guard<std::mutex> lk(m_mutex);
+
+		if (cmd == 5) {
+			uint64_t expected = m_have_sequence ? (uint64_t)(m_highest_sequence - m_first_sequence) + 1 : 0;
+			uint64_t received = m_stats.packets - CollectStats().duplicates;
+			uint64_t lost = expected > received ? expected - received : 0;
+
+			packet.packets_received = (uint32_t)(m_stats.packets - m_reported_received);
+			packet.packets_lost = (uint32_t)(lost > m_reported_lost ? lost - m_reported_lost : 0);
+			packet.jitter_us = m_stats.jitter_us;
+			packet.rtt_us = m_stats.rtt_us;
+
+			m_reported_received = m_stats.packets;
+			m_reported_lost = std::max(lost, m_reported_lost);
+		}
+
+		packet.format_generation = m_generation;
+	}
+
+	byte buffer[256];
+	EncryptedData* enc_data = reinterpret_cast<EncryptedData*>(buffer);
+
+	m_random_gen.Generate(enc_data->iv, 16);
+	m_cmd_aes.SetIv(enc_data->iv, 16);
+
+	int data_size = m_cmd_aes.Encrypt(reinterpret_cast<const byte*>(&packet), sizeof(packet), &buffer[16]);
+
+	return sendto(m_cmd_socket, (const char*)buffer, 16 + data_size, 0, (sockaddr*)&m_cmd_addr, sizeof(m_cmd_addr)) > 0;
+}
+
+bool AudioReceiver::ReceiveCmdReply(int64_t sent_ns)
+{
+	byte buffer[256];
+	EncryptedData* enc_data = reinterpret_cast<EncryptedData*>(buffer);
+
+	int recv_bytes = recvfrom(m_cmd_socket, (char*)buffer, sizeof(buffer), 0, nullptr, nullptr);
+
+	if (recv_bytes <= 16)
+		return false;
+
+	int64_t now_ns = MonotonicNowNs();
+
+	m_cmd_aes.SetIv(enc_data->iv, 16);
+	int ret = m_cmd_aes.Decrypt(&buffer[16], recv_bytes - 16, &buffer[16]);
+
+	if (ret <= 0)
+		return false;
+
+	CmdStreamPacket reply{};
+	memcpy(&reply, &buffer[16], std::min((size_t)ret, sizeof(reply)));
+
+	std::lock_guard<std::mutex> lk(m_mutex);
+
+	m_stats.rtt_us = (int)((now_ns - sent_ns) / 1000);
+
+	// The next cmd echoes a new generation, from then on its packets use it
+	if (m_settings.protocol_version >= 7 && reply.format_generation != m_generation && reply.sample_rate > 0) {
+		m_generation = reply.format_generation;
+		m_formats[m_generation & 0xff] = {
+			reply.audio_format, reply.bits_per_sample, reply.container_bits,
+			reply.sample_rate, reply.n_channels, reply.codec_bitrate
+		};
+
+		printf("(receiver): format generation %u: %d/%d bits %d Hz %d channels\n", m_generation,
+			reply.audio_format, reply.bits_per_sample, reply.sample_rate, reply.n_channels);
+	}
+
+	return true;
+}
+
+void AudioReceiver::t_cmd()
+{
+	int cmd = m_settings.protocol_version >= 7 ? 5 : 0;
+
+	while (m_running) {
+		int64_t sent_ns = MonotonicNowNs();
+
+		if (SendCmd(cmd))
+			ReceiveCmdReply(sent_ns);
+
+		int64_t next_ns = sent_ns + CMD_INTERVAL_MS * 1000000LL;
+
+		std::unique_lock<std::mutex> lk(m_mutex);
+		m_cv.wait_for(lk, std::chrono::nanoseconds(std::max<int64_t>(next_ns - MonotonicNowNs(), 0)), [this] { return !m_running; });
+	}
+}
+
+int AudioReceiver::Decode(const ReceiverFormat& format, const uint8_t* data, size_t size, uint32_t frames, std::vector<float>* out)
+{
+	int channels = std::max(format.channels, 1);
+
+	// DTX, frames of silence
+	if (!size) {
+		out->assign((size_t)frames * channels, 0.0f);
+		return (int)frames;
+	}
+
+	switch (format.audio_format)
+	{
+		case AUDIO_FORMAT_PCM:
+		case AUDIO_FORMAT_FLOAT:
+		{
+			SampleType type = GetSampleType(format.audio_format, format.bits_per_sample, format.container_bits);
+			int sample_bytes = GetSampleBytes(type);
+			size_t count = size / sample_bytes;
+
+			out->resize(count);
+
+			for (size_t i = 0; i < count; i++) {
+				const uint8_t* p = data + i * sample_bytes;
+				float value;
+
+				switch (type)
+				{
+					case SampleType::S16:
+						value = (int16_t)(p[0] | (p[1] << 8)) / 32768.0f;
+						break;
+
+					case SampleType::S24:
+						value = ((int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8) / 8388608.0f;
+						break;
+
+					case SampleType::S24In32:
+					case SampleType::S32:
+					{
+						int32_t v;
+						memcpy(&v, p, 4);
+						value = type == SampleType::S32 ? v / 2147483648.0f : v / 8388608.0f;
+						break;
+					}
+
+					default:
+						memcpy(&value, p, 4);
+						break;
+				}
+
+				(*out)[i] = value;
+			}
+
+			return (int)(count / channels);
+		}
+
+		case AUDIO_FORMAT_LOSSLESS:
+		{
+			m_lossless_buffer.resize(MAX_SAMPLES_PER_PACKET);
+
+			int decoded = LosslessCodec::Decode(data, size, channels, m_lossless_buffer.data(), m_lossless_buffer.size() / channels);
+
+			if (decoded < 0)
+				return -1;
+
+			float scale = 1.0f / (float)(1 << (format.bits_per_sample - 1));
+
+			out->resize((size_t)decoded * channels);
+
+			for (size_t i = 0; i < out->size(); i++)
+				(*out)[i] = m_lossless_buffer[i] * scale;
+
+			return decoded;
+		}
+
+		case AUDIO_FORMAT_OPUS:
+		{
+			#ifdef SAS_WITH_OPUS
+			if (!m_opus || m_opus_rate != format.sample_rate || m_opus_channels != channels) {
+				if (m_opus)
+					opus_decoder_destroy(m_opus);
+
+				int error;
+				m_opus = opus_decoder_create(format.sample_rate, channels, &error);
+				m_opus_rate = format.sample_rate;
+				m_opus_channels = channels;
+
+				if (error != OPUS_OK) {
+					m_opus = nullptr;
+					return -1;
+				}
+			}
+
+			// 120 ms is the longest Opus frame
+			int max_frames = format.sample_rate * 120 / 1000;
+
+			out->resize((size_t)max_frames * channels);
+
+			int decoded = opus_decode_float(m_opus, data, (opus_int32)size, out->data(), max_frames, 0);
+
+			if (decoded < 0)
+				return -1;
+
+			out->resize((size_t)decoded * channels);
+			return decoded;
+			#else
+			return -1;
+			#endif
+		}
+	}
+
+	return -1;
+}
+
+void AudioReceiver::t_receive()
+{
+	AESWrapper aes;
+	aes.GenerateKey(m_config.password);
+
+	std::vector<uint8_t> buffer(65536);
+	std::vector<float> samples;
+
+	bool has_header = m_settings.protocol_version >= 1;
+	bool has_generation = m_settings.protocol_version >= 7;
+
+	// Receivers before protocol 1 number and time packets themselves
+	uint32_t local_sequence = 0;
+
+	while (m_running) {
+		int recv_bytes = recvfrom(m_audio_socket, (char*)buffer.data(), (int)buffer.size(), 0, nullptr, nullptr);
+
+		if (recv_bytes <= 16)
+			continue;
+
+		int64_t arrival_ns = MonotonicNowNs();
+
+		aes.SetIv(buffer.data(), 16);
+		int size = aes.Decrypt(&buffer[16], recv_bytes - 16, &buffer[16]);
+
+		if (size <= 0 || (has_header && size < (int)sizeof(AudioPacketHeader))) {
+			printf("(receiver): undecryptable audio packet\n");
+
+			std::lock_guard<std::mutex> lk(m_mutex);
+			m_stats.invalid++;
+			continue;
+		}
+
+		AudioPacketHeader header{};
+		const uint8_t* payload = &buffer[16];
+
+		if (has_header) {
+			memcpy(&header, payload, sizeof(header));
+			payload += sizeof(header);
+			size -= sizeof(header);
+		}
+		else {
+			header.sequence = local_sequence++;
+			header.pts_ns = arrival_ns;
+		}
+
+		uint8_t generation = has_generation ? (uint8_t)(header.frames >> AUDIO_GENERATION_SHIFT) : 0;
+		uint32_t frames = has_generation ? header.frames & AUDIO_FRAMES_MASK : header.frames;
+
+		if (m_packet_callback)
+			m_packet_callback(header, arrival_ns);
+
+		ReceiverFormat format;
+
+		{
+			std::lock_guard<std::mutex> lk(m_mutex);
+			format = m_formats[generation];
+		}
+
+		int decoded = Decode(format, payload, size, frames, &samples);
+
+		if (decoded < 0) {
+			printf("(receiver): packet %u could not be decoded\n", header.sequence);
+
+			std::lock_guard<std::mutex> lk(m_mutex);
+			m_stats.invalid++;
+			continue;
+		}
+
+		std::lock_guard<std::mutex> lk(m_mutex);
+
+		m_stats.packets++;
+		m_stats.bytes += recv_bytes;
+
+		if (!m_stats.first_packet_ns)
+			m_stats.first_packet_ns = arrival_ns;
+
+		if (!size)
+			m_stats.silence_frames += frames;
+
+		// Interarrival jitter as in RFC 3550, pts stands in for the
+		// RTP timestamp
+		int64_t transit_ns = arrival_ns - header.pts_ns;
+
+		if (m_have_sequence)
+			m_jitter_ns += (std::abs((double)(transit_ns - m_last_transit_ns)) - m_jitter_ns) / 16;
+
+		m_last_transit_ns = transit_ns;
+		m_stats.jitter_us = (int)(m_jitter_ns / 1000);
+
+		if (!m_have_sequence) {
+			m_have_sequence = true;
+			m_first_sequence = header.sequence;
+			m_highest_sequence = header.sequence;
+		}
+		else if ((int32_t)(header.sequence - m_highest_sequence) > 0) {
+			m_highest_sequence = header.sequence;
+		}
+		else {
+			m_stats.reordered++;
+		}
+
+		// Another rate or layout can't be stretched or concealed across
+		if (!m_buffering || format.sample_rate != m_play_format.sample_rate || format.channels != m_play_format.channels) {
+			JitterStats jitter = m_jitter.GetStats();
+
+			m_stats.lost += jitter.lost;
+			m_stats.late += jitter.late;
+			m_stats.duplicates += jitter.duplicates;
+			m_stats.concealed_frames += jitter.concealed_frames;
+			m_stats.underruns += jitter.underruns;
+			m_stats.underrun_frames += jitter.underrun_frames;
+			m_stats.expanded_frames += jitter.expanded_frames;
+			m_stats.compressed_frames += jitter.compressed_frames;
+
+			JitterConfig config;
+			config.sample_rate = format.sample_rate;
+			config.channels = format.channels;
+			config.percentile = m_config.jitter_percentile;
+			config.min_delay_ms = m_config.jitter_ms;
+			config.max_delay_ms = m_config.max_jitter_ms;
+
+			m_jitter.Reset(config);
+			m_buffering = true;
+		}
+
+		// Formats of one rate and layout differ only in coding, what plays is
+		// the latest
+		m_play_format = format;
+
+		m_jitter.Push(header.sequence, header.pts_ns, arrival_ns, samples.data(), (size_t)decoded);
+	}
+}
+
+void AudioReceiver::t_playout()
+{
+	std::vector<float> out;
+
+	int64_t next_ns = MonotonicNowNs();
+
+	std::unique_lock<std::mutex> lk(m_mutex);
+
+	while (m_running) {
+		m_cv.wait_until(lk, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(next_ns)), [this] { return !m_running; });
+
+		if (!m_running)
+			break;
+
+		int64_t play_ns = next_ns;
+		int64_t now_ns = MonotonicNowNs();
+
+		next_ns += PULL_MS * 1000000LL;
+
+		if (now_ns - next_ns > MAX_PULL_LAG_MS * 1000000LL)
+			next_ns = now_ns;
+
+		// Nothing to pull before the first packet tells the format
+		if (!m_buffering)
+			continue;
+
+		ReceiverFormat format = m_play_format;
+		size_t frames = (size_t)format.sample_rate * PULL_MS / 1000;
+
+		out.resize(frames * std::max(format.channels, 1));
+		m_jitter.Pull(out.data(), frames);
+
+		m_stats.frames_played += frames;
+
+		SinkCallback sink = m_sink;
+
+		lk.unlock();
+
+		if (sink)
+			sink(out.data(), frames, format, play_ns);
+
+		lk.lock();
+	}
+}
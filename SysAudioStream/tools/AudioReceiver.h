@@ -0,0 +1,209 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AESWrapper.h"
+#include "AudioPacket.h"
+#include "JitterBuffer.h"
+#include "RandomGenerator.h"
+
+#ifdef SAS_WITH_OPUS
+#include <opus/opus.h>
+#endif
+
+// Wire format of the stream, from the hello reply and protocol 7 cmd replies
+struct ReceiverFormat
+{
+	int audio_format;
+	int bits_per_sample;
+	int container_bits;
+	int sample_rate;
+	int channels;
+	int codec_bitrate;
+};
+
+struct ReceiverConfig
+{
+	std::string host = "127.0.0.1";
+	int port = 0;
+	std::string password;
+
+	// Asked for in the hello, the server may answer with another format
+	int protocol_version = AUDIO_PROTOCOL_VERSION;
+	int audio_format = AUDIO_FORMAT_PCM;
+	int bits_per_sample = 16;
+	int container_bits = 0;
+	int sample_rate = 0;
+	int channels = 2;
+	int codec_bitrate = 0;
+
+	// The jitter buffer covers this share of packets, within these delays
+	// on top of the fastest transit seen
+	double jitter_percentile = 0.95;
+	int jitter_ms = 0;
+	int max_jitter_ms = 500;
+
+	// Hellos sent again once answered, as a phone retrying on a lossy link
+	// would. Each must get the same session back.
+	int duplicate_hellos = 0;
+};
+
+// Format names of the tools' -f options: pcm16, pcm24, pcm24in32, pcm32,
+// float, opus[kbit/s], lossless16 and lossless24. Sets the hello's format
+// and, when server_format isn't null, the format line of a server at
+// 48 kHz that offers it. False for an unknown name.
+bool ParseReceiverFormat(const std::string& name, ReceiverConfig* config, std::string* server_format);
+
+struct ReceiverStats
+{
+	uint64_t packets;
+	uint64_t bytes;
+
+	// Missing by sequence when their turn came
+	uint64_t lost;
+
+	// Arrived after their turn, dropped
+	uint64_t late;
+
+	// Arrived after a higher sequence
+	uint64_t reordered;
+	uint64_t duplicates;
+
+	// Undecryptable or undecodable, dropped
+	uint64_t invalid;
+
+	uint64_t frames_played;
+
+	// DTX packets
+	uint64_t silence_frames;
+
+	// Jitter buffer, see JitterStats
+	uint64_t concealed_frames;
+	uint64_t underruns;
+	uint64_t underrun_frames;
+	uint64_t expanded_frames;
+	uint64_t compressed_frames;
+	double target_ms;
+	double level_ms;
+
+	int jitter_us;
+	int rtt_us;
+
+	// Monotonic times of the first hello, its reply and the first audio
+	// packet, 0 until they happen
+	int64_t hello_ns;
+	int64_t settings_ns;
+	int64_t first_packet_ns;
+};
+
+// Reference receiver for tests and benchmarks, the parts of the Android app
+// that matter for the stream: the StreamSettings handshake, pings and link
+// reports, decryption, and an adaptive jitter buffer that a playout thread
+// pulls 10 ms blocks of decoded float audio from, as a sound card would.
+//
+// Play times are on the receiver's monotonic clock, when the block's pull
+// was due.
+class AudioReceiver
+{
+public:
+	// Interleaved float at the format's rate and channels
+	typedef std::function<void(const float* samples, size_t frames, const ReceiverFormat& format, int64_t play_ns)> SinkCallback;
+
+	// Every audio packet as it arrives, before the jitter buffer
+	typedef std::function<void(const AudioPacketHeader& header, int64_t arrival_ns)> PacketCallback;
+
+	AudioReceiver();
+	~AudioReceiver();
+
+	// Set before Start. Without a sink the audio is played to nowhere.
+	void SetSinkCallback(SinkCallback callback);
+	void SetPacketCallback(PacketCallback callback);
+
+	// Handshake and cmd 1, false if the server doesn't answer
+	bool Start(const ReceiverConfig& config);
+
+	// Sends cmd 3 and joins the threads
+	void Stop();
+
+	// The hello reply
+	const StreamSettings& GetSettings() const;
+	ReceiverStats GetStats() const;
+
+private:
+	void t_receive();
+	void t_playout();
+	void t_cmd();
+
+	// One hello and its reply, false on timeout or an undecryptable reply
+	bool SendHello(const StreamSettings& hello, const sockaddr_in& server_addr, StreamSettings* reply);
+
+	bool SendCmd(int cmd);
+	bool ReceiveCmdReply(int64_t sent_ns);
+
+	// Decodes one packet's payload into float, returns the frames
+	int Decode(const ReceiverFormat& format, const uint8_t* data, size_t size, uint32_t frames, std::vector<float>* out);
+
+	// Own counters and the jitter buffer's, with m_mutex held
+	ReceiverStats CollectStats() const;
+
+	ReceiverConfig m_config;
+	StreamSettings m_settings;
+
+	SinkCallback m_sink;
+	PacketCallback m_packet_callback;
+
+	int m_audio_socket;
+	int m_cmd_socket;
+	sockaddr_in m_cmd_addr;
+
+	AESWrapper m_cmd_aes;
+	RandomGenerator m_random_gen;
+
+	std::atomic<bool> m_running;
+
+	std::unique_ptr<std::thread> m_receive_thread;
+	std::unique_ptr<std::thread> m_playout_thread;
+	std::unique_ptr<std::thread> m_cmd_thread;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_cv;
+
+	// Holds audio of one rate and layout, a switch to another one starts it
+	// over. The counters of the buffers before are kept in m_stats.
+	JitterBuffer m_jitter;
+	ReceiverFormat m_play_format;
+	bool m_buffering;
+
+	// Protocol 7 formats by generation, and the newest one announced
+	ReceiverFormat m_formats[256];
+	uint32_t m_generation;
+
+	// Sequence and transit tracking of the receive thread
+	bool m_have_sequence;
+	uint32_t m_first_sequence;
+	uint32_t m_highest_sequence;
+	int64_t m_last_transit_ns;
+	double m_jitter_ns;
+
+	std::vector<int32_t> m_lossless_buffer;
+
+	#ifdef SAS_WITH_OPUS
+	OpusDecoder* m_opus;
+	int m_opus_rate;
+	int m_opus_channels;
+	#endif
+
+	ReceiverStats m_stats;
+
+	// Counts sent with the previous link report
+	uint64_t m_reported_received;
+	uint64_t m_reported_lost;
+};
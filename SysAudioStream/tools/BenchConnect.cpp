@@ -0,0 +1,115 @@
+// Time to first audio across reconnects: a server on the synthetic capture
+// and a reference receiver in one process, the receiver connecting,
+// waiting for its first packet and leaving again, over and over. Every
+// other connection sends its hello again after the reply, as a phone
+// retrying on a lossy link does, and must get the same session back.
+// Reports hello to settings reply, reply to first packet and hello to
+// first packet for both kinds of connection.
+//
+// SASBenchConnect [connections] [duplicate hellos] [pause ms]
+// Exits non-zero if a connection fails, a duplicate hello starts another
+// session or no audio arrives within a second.
+
+#include "pch.h"
+#include "AudioStream.h"
+#include "AudioReceiver.h"
+#include "SyntheticCapture.h"
+#include "Clock.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#define BENCH_PORT 47190
+#define BENCH_PAIR_CODE "connect"
+
+#define FIRST_PACKET_TIMEOUT_MS 1000
+
+struct ConnectTimes
+{
+	std::vector<int64_t> settings;
+	std::vector<int64_t> first_packet;
+	std::vector<int64_t> total;
+};
+
+static void print_percentiles(const char* name, std::vector<int64_t> values)
+{
+	if (values.empty()) {
+		printf("%-28s no samples\n", name);
+		return;
+	}
+
+	std::sort(values.begin(), values.end());
+
+	auto at = [&](double p) { return values[std::min(values.size() - 1, (size_t)(p * values.size()))] / 1e6; };
+
+	printf("%-28s n %6zu  min %7.2f  p50 %7.2f  p90 %7.2f  p99 %7.2f  max %7.2f ms\n", name, values.size(),
+		values.front() / 1e6, at(0.50), at(0.90), at(0.99), values.back() / 1e6);
+}
+
+int main(int argc, char* argv[])
+{
+	int connections = argc > 1 ? std::stoi(argv[1]) : 50;
+	int duplicate_hellos = argc > 2 ? std::stoi(argv[2]) : 2;
+	int pause_ms = argc > 3 ? std::stoi(argv[3]) : 100;
+
+	AudioStream stream(BENCH_PAIR_CODE, BENCH_PORT, "pcm 16 48000", SYNTHETIC_DEVICE_NAME);
+
+	if (!stream.Init())
+		return 1;
+
+	// [0] single hellos, [1] with duplicates
+	ConnectTimes times[2];
+
+	for (int i = 0; i < connections; i++) {
+		bool duplicates = i % 2 == 1;
+
+		ReceiverConfig config;
+		config.port = BENCH_PORT;
+		config.password = BENCH_PAIR_CODE;
+		config.duplicate_hellos = duplicates ? duplicate_hellos : 0;
+
+		AudioReceiver receiver;
+
+		if (!receiver.Start(config)) {
+			printf("connection %d failed\n", i + 1);
+			return 1;
+		}
+
+		int64_t deadline_ns = MonotonicNowNs() + FIRST_PACKET_TIMEOUT_MS * 1000000LL;
+		ReceiverStats stats = receiver.GetStats();
+
+		while (!stats.first_packet_ns && MonotonicNowNs() < deadline_ns) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			stats = receiver.GetStats();
+		}
+
+		receiver.Stop();
+
+		if (!stats.first_packet_ns) {
+			printf("connection %d got no audio within %d ms\n", i + 1, FIRST_PACKET_TIMEOUT_MS);
+			return 1;
+		}
+
+		times[duplicates].settings.push_back(stats.settings_ns - stats.hello_ns);
+		times[duplicates].first_packet.push_back(stats.first_packet_ns - stats.settings_ns);
+		times[duplicates].total.push_back(stats.first_packet_ns - stats.hello_ns);
+
+		// The server drops the session and goes idle in between
+		std::this_thread::sleep_for(std::chrono::milliseconds(pause_ms));
+	}
+
+	printf("\n%d connections, every other one with %d duplicate hellos, %d ms apart\n\n", connections, duplicate_hellos, pause_ms);
+
+	const char* kinds[] = { "single hello", "duplicate hellos" };
+
+	for (int k = 0; k < 2; k++) {
+		printf("%s\n", kinds[k]);
+		print_percentiles("  hello to settings", times[k].settings);
+		print_percentiles("  settings to first packet", times[k].first_packet);
+		print_percentiles("  hello to first packet", times[k].total);
+	}
+
+	return 0;
+}
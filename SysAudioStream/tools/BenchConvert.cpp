@@ -0,0 +1,175 @@
+// Throughput of the float to wire sample kernels against the scalar code.
+// Every vector kernel is also checked to produce the same samples and clip
+// counts as scalar when no dither is applied. The downmix kernels follow,
+// checked against scalar within float rounding since AVX2 and NEON fuse
+// the multiply-adds.
+
+#include "SampleFormat.h"
+#include "ChannelMixer.h"
+#include "Clock.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const size_t SAMPLES = (1 << 16) + 7;
+static const int64_t RUN_NS = 300000000LL;
+
+struct Case
+{
+	const char* name;
+	SampleType type;
+};
+
+static const Case cases[] = {
+	{ "s16", SampleType::S16 },
+	{ "s24", SampleType::S24 },
+	{ "s24in32", SampleType::S24In32 },
+	{ "s32", SampleType::S32 },
+};
+
+static double measure(SampleConverter& converter, const std::vector<float>& in, std::vector<uint8_t>& out)
+{
+	int64_t start_ns = MonotonicNowNs();
+	int64_t now_ns = start_ns;
+	uint64_t samples = 0;
+
+	while (now_ns - start_ns < RUN_NS) {
+		converter.Convert(in.data(), in.size(), out.data());
+		samples += in.size();
+		now_ns = MonotonicNowNs();
+	}
+
+	return samples / ((now_ns - start_ns) / 1e9) / 1e6;
+}
+
+static double measure_mix(ChannelMixer& mixer, const std::vector<float>& in, size_t frames, std::vector<float>& out)
+{
+	int64_t start_ns = MonotonicNowNs();
+	int64_t now_ns = start_ns;
+	uint64_t processed = 0;
+
+	while (now_ns - start_ns < RUN_NS) {
+		mixer.Process(in.data(), frames, out.data());
+		processed += frames;
+		now_ns = MonotonicNowNs();
+	}
+
+	return processed / ((now_ns - start_ns) / 1e9) / 1e6;
+}
+
+int main()
+{
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> dist(-1.05f, 1.05f);
+
+	// A few percent of the input clips, so the counters get exercised too
+	std::vector<float> in(SAMPLES);
+
+	for (float& sample : in)
+		sample = dist(rng);
+
+	std::vector<uint8_t> reference(SAMPLES * 4 + 16);
+	std::vector<uint8_t> out(SAMPLES * 4 + 16);
+
+	const SimdLevel levels[] = { SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Avx2, SimdLevel::Neon };
+	const DitherType dithers[] = { DitherType::None, DitherType::Tpdf, DitherType::Shaped };
+	const char* dither_names[] = { "none", "tpdf", "shaped" };
+
+	bool ok = true;
+
+	printf("%-8s %-7s %-7s %10s %8s\n", "format", "dither", "kernel", "Msample/s", "speedup");
+
+	for (const Case& c : cases) {
+		size_t bytes = SAMPLES * GetSampleBytes(c.type);
+
+		SampleConverter scalar;
+		scalar.Reset(c.type, 2, DitherType::None);
+		scalar.SetSimdLevel(SimdLevel::Scalar);
+
+		size_t reference_clipped = scalar.Convert(in.data(), in.size(), reference.data());
+
+		for (int d = 0; d < 3; d++) {
+			double scalar_rate = 0;
+
+			for (SimdLevel level : levels) {
+				if (!IsSimdLevelSupported(level))
+					continue;
+
+				// Shaped dither always runs the scalar loop
+				if (dithers[d] == DitherType::Shaped && level != SimdLevel::Scalar)
+					continue;
+
+				SampleConverter converter;
+				converter.Reset(c.type, 2, dithers[d]);
+				converter.SetSimdLevel(level);
+
+				if (dithers[d] == DitherType::None) {
+					size_t clipped = converter.Convert(in.data(), in.size(), out.data());
+
+					if (clipped != reference_clipped || memcmp(out.data(), reference.data(), bytes)) {
+						printf("%-8s %-7s %-7s MISMATCH against scalar\n", c.name, dither_names[d], GetSimdLevelName(level));
+						ok = false;
+					}
+				}
+
+				double rate = measure(converter, in, out);
+
+				if (level == SimdLevel::Scalar)
+					scalar_rate = rate;
+
+				printf("%-8s %-7s %-7s %10.1f %7.2fx\n", c.name, dither_names[d], GetSimdLevelName(level), rate, rate / scalar_rate);
+			}
+		}
+	}
+
+	const int mixes[][2] = { { 8, 6 }, { 8, 2 }, { 6, 2 }, { 2, 1 } };
+
+	printf("\n%-8s %-7s %10s %8s\n", "downmix", "kernel", "Mframe/s", "speedup");
+
+	for (const auto& mix : mixes) {
+		size_t frames = SAMPLES / mix[0];
+
+		std::vector<float> mix_reference(frames * mix[1]);
+		std::vector<float> mix_out(frames * mix[1]);
+
+		ChannelMixer scalar;
+		scalar.Init(mix[0], mix[1]);
+		scalar.SetSimdLevel(SimdLevel::Scalar);
+		scalar.Process(in.data(), frames, mix_reference.data());
+
+		char name[16];
+		snprintf(name, sizeof(name), "%d->%d", mix[0], mix[1]);
+
+		double scalar_rate = 0;
+
+		for (SimdLevel level : levels) {
+			if (!IsSimdLevelSupported(level))
+				continue;
+
+			ChannelMixer mixer;
+			mixer.Init(mix[0], mix[1]);
+			mixer.SetSimdLevel(level);
+			mixer.Process(in.data(), frames, mix_out.data());
+
+			for (size_t i = 0; i < mix_out.size(); i++) {
+				if (std::fabs(mix_out[i] - mix_reference[i]) > 1e-6f) {
+					printf("%-8s %-7s MISMATCH against scalar\n", name, GetSimdLevelName(level));
+					ok = false;
+					break;
+				}
+			}
+
+			double rate = measure_mix(mixer, in, frames, mix_out);
+
+			if (level == SimdLevel::Scalar)
+				scalar_rate = rate;
+
+			printf("%-8s %-7s %10.1f %7.2fx\n", name, GetSimdLevelName(level), rate, rate / scalar_rate);
+		}
+	}
+
+	return ok ? 0 : 1;
+}
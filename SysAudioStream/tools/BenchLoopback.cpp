@@ -0,0 +1,154 @@
+// End to end latency over 127.0.0.1: a server streaming the synthetic
+// capture and a reference receiver run in one process, so both share the
+// monotonic clock. Each burst the capture renders is found again in the
+// receiver's output, and the time between the two is the glass to glass
+// latency: capture block, conversion, encryption, network, jitter buffer.
+// The first frame render to packet arrival part is reported on its own.
+//
+// SASBenchLoopback [seconds] [format] [min jitter ms] [impulse interval ms] [proxy port]
+// format as in SASReceiver -f, pcm16 by default. With a proxy port the
+// receiver connects through SASImpairProxy listening there, started as
+// SASImpairProxy <proxy port> 127.0.0.1 47180 loopback [impairments].
+
+#include "pch.h"
+#include "AudioStream.h"
+#include "AudioReceiver.h"
+#include "SyntheticCapture.h"
+#include "Clock.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_PORT 47180
+#define BENCH_PAIR_CODE "loopback"
+
+// Samples above this are part of a burst
+#define ONSET_THRESHOLD 0.5f
+
+static void print_percentiles(const char* name, std::vector<int64_t> values)
+{
+	if (values.empty()) {
+		printf("%-28s no samples\n", name);
+		return;
+	}
+
+	std::sort(values.begin(), values.end());
+
+	auto at = [&](double p) { return values[std::min(values.size() - 1, (size_t)(p * values.size()))] / 1e6; };
+
+	printf("%-28s n %6zu  min %7.2f  p50 %7.2f  p90 %7.2f  p99 %7.2f  max %7.2f ms\n", name, values.size(),
+		values.front() / 1e6, at(0.50), at(0.90), at(0.99), values.back() / 1e6);
+}
+
+int main(int argc, char* argv[])
+{
+	int seconds = argc > 1 ? std::stoi(argv[1]) : 20;
+	std::string format_name = argc > 2 ? argv[2] : "pcm16";
+	int jitter_ms = argc > 3 ? std::stoi(argv[3]) : 0;
+	int interval_ms = argc > 4 ? std::stoi(argv[4]) : 250;
+	int proxy_port = argc > 5 ? std::stoi(argv[5]) : 0;
+
+	ReceiverConfig config;
+	config.port = proxy_port ? proxy_port : BENCH_PORT;
+	config.password = BENCH_PAIR_CODE;
+	config.jitter_ms = jitter_ms;
+
+	std::string server_format;
+
+	if (!ParseReceiverFormat(format_name, &config, &server_format)) {
+		printf("unknown format %s\n", format_name.c_str());
+		return 1;
+	}
+
+	SyntheticCapture::SetImpulseInterval(interval_ms);
+
+	AudioStream stream(BENCH_PAIR_CODE, BENCH_PORT, server_format, SYNTHETIC_DEVICE_NAME);
+
+	if (!stream.Init())
+		return 1;
+
+	std::mutex mutex;
+	std::vector<int64_t> onsets;
+	std::vector<int64_t> transits;
+
+	// Receiver side burst detection, a burst starts after half an interval
+	// of quiet
+	int64_t last_loud_ns = 0;
+
+	AudioReceiver receiver;
+
+	receiver.SetSinkCallback([&](const float* samples, size_t frames, const ReceiverFormat& format, int64_t play_ns)
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+
+		for (size_t i = 0; i < frames; i++) {
+			if (std::fabs(samples[i * format.channels]) < ONSET_THRESHOLD)
+				continue;
+
+			int64_t frame_ns = play_ns + (int64_t)i * 1000000000LL / format.sample_rate;
+
+			if (frame_ns - last_loud_ns > interval_ms * 500000LL)
+				onsets.push_back(frame_ns);
+
+			last_loud_ns = frame_ns;
+		}
+	});
+
+	receiver.SetPacketCallback([&](const AudioPacketHeader& header, int64_t arrival_ns)
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+
+		transits.push_back(arrival_ns - header.pts_ns);
+	});
+
+	if (!receiver.Start(config))
+		return 1;
+
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+	receiver.Stop();
+
+	ReceiverStats stats = receiver.GetStats();
+	double frame_rate = std::max(receiver.GetSettings().sample_rate, 1);
+
+	// Every burst rendered, matched with the first onset within half an
+	// interval after it
+	std::vector<int64_t> impulses;
+	int64_t impulse_ns;
+
+	while (SyntheticCapture::PopImpulse(&impulse_ns))
+		impulses.push_back(impulse_ns);
+
+	std::vector<int64_t> latencies;
+	size_t onset = 0;
+	size_t missed = 0;
+
+	for (int64_t rendered_ns : impulses) {
+		while (onset < onsets.size() && onsets[onset] < rendered_ns)
+			onset++;
+
+		if (onset < onsets.size() && onsets[onset] - rendered_ns < interval_ms * 500000LL)
+			latencies.push_back(onsets[onset++] - rendered_ns);
+		else
+			missed++;
+	}
+
+	printf("\n%s, jitter buffer at least %d ms, %zu bursts rendered, %zu found, %zu missed (the last ones are still in flight)\n",
+		format_name.c_str(), jitter_ms, impulses.size(), latencies.size(), missed);
+	printf("packets %llu lost %llu late %llu reordered %llu, jitter %.3f ms\n",
+		(unsigned long long)stats.packets, (unsigned long long)stats.lost, (unsigned long long)stats.late,
+		(unsigned long long)stats.reordered, stats.jitter_us / 1000.0);
+	printf("buffer %.1f ms of %.1f ms, %llu underruns, concealed %.1f ms, expanded %.1f ms, compressed %.1f ms\n\n",
+		stats.level_ms, stats.target_ms, (unsigned long long)stats.underruns, stats.concealed_frames * 1000 / frame_rate,
+		stats.expanded_frames * 1000 / frame_rate, stats.compressed_frames * 1000 / frame_rate);
+
+	print_percentiles("glass to glass", latencies);
+	print_percentiles("render to packet arrival", transits);
+
+	return 0;
+}
@@ -0,0 +1,108 @@
+// Encode cost and output rate of the server's Opus stage for every frame
+// size and a range of bitrates, on a fixed test signal: a few seconds of
+// chords over low noise, 48 kHz stereo, the same on every run. Prints the
+// encode time per frame and the bitrate Opus actually produced.
+//
+// SASBenchOpus [seconds of signal]
+// Exits non-zero if the encoder fails. Built only with libopus.
+
+#include "OpusCodec.h"
+#include "Clock.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#define SAMPLE_RATE 48000
+#define CHANNELS 2
+
+// Largest Opus packet, from the spec
+#define MAX_PACKET_BYTES 1275
+
+static const double FRAME_MS[] = { 2.5, 5, 10, 20 };
+static const int BITRATES_KBPS[] = { 32, 64, 96, 128, 256 };
+
+static std::vector<float> make_signal(double seconds)
+{
+	// A C major chord moving to A minor every half second, slightly apart
+	// between channels, so the encoder sees tonal music and stereo
+	static const double CHORDS[2][3] = { { 261.63, 329.63, 392.00 }, { 220.00, 261.63, 329.63 } };
+
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> noise(-0.01f, 0.01f);
+
+	size_t frames = (size_t)(seconds * SAMPLE_RATE);
+	std::vector<float> signal(frames * CHANNELS);
+
+	for (size_t i = 0; i < frames; i++) {
+		double t = (double)i / SAMPLE_RATE;
+		const double* chord = CHORDS[(i / (SAMPLE_RATE / 2)) % 2];
+
+		for (int c = 0; c < CHANNELS; c++) {
+			double sample = 0;
+
+			for (int n = 0; n < 3; n++)
+				sample += 0.2 * std::sin(2 * M_PI * chord[n] * (1 + 0.002 * c) * t);
+
+			signal[i * CHANNELS + c] = (float)sample + noise(rng);
+		}
+	}
+
+	return signal;
+}
+
+int main(int argc, char* argv[])
+{
+	double seconds = argc > 1 ? std::stod(argv[1]) : 10.0;
+	std::vector<float> signal = make_signal(seconds);
+	size_t frames = signal.size() / CHANNELS;
+
+	std::vector<uint8_t> packet(MAX_PACKET_BYTES);
+
+	printf("%.1f s of 48 kHz stereo per run\n\n", seconds);
+	printf("%8s %8s %10s %10s %8s\n", "frame ms", "kbit/s", "us/frame", "kbit/s out", "realtime");
+
+	for (double frame_ms : FRAME_MS) {
+		for (int kbps : BITRATES_KBPS) {
+			OpusCodec codec;
+
+			if (!codec.Init(SAMPLE_RATE, CHANNELS, kbps * 1000, frame_ms)) {
+				printf("%8.1f %8d Init failed\n", frame_ms, kbps);
+				return 1;
+			}
+
+			int64_t encode_ns = 0;
+			uint64_t bytes = 0;
+			uint64_t packets = 0;
+
+			// Pushed one frame at a time so the queue never holds more
+			size_t frame_size = (size_t)codec.GetFrameSize();
+
+			for (size_t offset = 0; offset + frame_size <= frames; offset += frame_size) {
+				int64_t pts_ns;
+
+				codec.Push(&signal[offset * CHANNELS], frame_size, 0);
+
+				int64_t start_ns = MonotonicNowNs();
+				int size = codec.EncodeNext(packet.data(), packet.size(), &pts_ns);
+				encode_ns += MonotonicNowNs() - start_ns;
+
+				if (size < 0) {
+					printf("%8.1f %8d encode failed\n", frame_ms, kbps);
+					return 1;
+				}
+
+				bytes += size;
+				packets++;
+			}
+
+			double audio_s = (double)(packets * frame_size) / SAMPLE_RATE;
+
+			printf("%8.1f %8d %10.1f %10.1f %7.0fx\n", frame_ms, kbps, encode_ns / 1e3 / packets,
+				bytes * 8 / audio_s / 1000, audio_s / (encode_ns / 1e9));
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,132 @@
+// Runs drift compensation against receivers whose clock is off by a few
+// ppm, on a virtual clock so hours pass in seconds. The server side is the
+// real DriftEstimator and AdaptiveResampler: capture blocks are resampled
+// by the estimator's ratio and added to the receiver's buffer, which the
+// receiver drains at its own rate and reports once a second, like cmd 4. Prints the estimate and the buffer's range per skew and exits
+// non-zero if, after the settling time, the estimate misses the skew or the
+// buffer leaves its bound.
+//
+// SASDriftSim [hours] [skew ppm ...]
+// Without skews the built-in ones run, from -500 to +500 ppm.
+
+#include "DriftCompensator.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#define SAMPLE_RATE 48000
+#define BLOCK_FRAMES 480
+#define REPORT_MS 1000
+
+// Buffer the receiver starts with, 100 ms
+#define START_FRAMES 4800
+
+// Checks start after this much simulated time
+#define SETTLE_S 600
+
+// Largest miss of the estimate, and distance of the buffer from where it
+// started, allowed after settling. A second's report carries less than a
+// frame of a ppm, so the estimate wanders by a few.
+#define MAX_ESTIMATE_ERROR_PPM 5.0
+#define MAX_BUFFER_OFFSET_FRAMES 480
+
+static const double BUILTIN_SKEWS_PPM[] = { -500, -100, -20, 0, 20, 100, 500 };
+
+struct SimResult
+{
+	double estimate_ppm;
+	double worst_estimate_error_ppm;
+	int64_t min_level;
+	int64_t max_level;
+	bool underrun;
+};
+
+static SimResult simulate(double skew_ppm, double hours)
+{
+	DriftEstimator estimator;
+	AdaptiveResampler resampler;
+
+	estimator.Reset(SAMPLE_RATE);
+
+	std::vector<float> in(BLOCK_FRAMES);
+	std::vector<float> out(BLOCK_FRAMES * 2 + 2);
+
+	for (int i = 0; i < BLOCK_FRAMES; i++)
+		in[i] = (float)std::sin(i * 2 * M_PI * 1000 / SAMPLE_RATE);
+
+	SimResult result = { 0, 0, START_FRAMES, START_FRAMES, false };
+
+	const int64_t block_ns = (int64_t)BLOCK_FRAMES * 1000000000LL / SAMPLE_RATE;
+	const int64_t end_ns = (int64_t)(hours * 3600e9);
+	const double receiver_rate = SAMPLE_RATE * (1 + skew_ppm * 1e-6);
+
+	int64_t produced = 0;
+	int64_t next_report_ns = 0;
+
+	for (int64_t now_ns = 0; now_ns < end_ns; now_ns += block_ns) {
+		// The receiver's level before this block arrives
+		int64_t pulled = (int64_t)(now_ns / 1e9 * receiver_rate);
+		int64_t level = START_FRAMES + produced - pulled;
+
+		produced += resampler.Process(in.data(), BLOCK_FRAMES, 1, estimator.GetRatio(), out.data());
+
+		if (level < 0)
+			result.underrun = true;
+
+		if (now_ns < next_report_ns)
+			continue;
+
+		next_report_ns += REPORT_MS * 1000000LL;
+		estimator.AddReport(now_ns, (int)level);
+
+		if (now_ns < SETTLE_S * 1000000000LL)
+			continue;
+
+		result.min_level = std::min(result.min_level, level);
+		result.max_level = std::max(result.max_level, level);
+		result.worst_estimate_error_ppm = std::max(result.worst_estimate_error_ppm, std::fabs(estimator.GetDriftPpm() - skew_ppm));
+	}
+
+	result.estimate_ppm = estimator.GetDriftPpm();
+
+	return result;
+}
+
+int main(int argc, char* argv[])
+{
+	double hours = argc > 1 ? std::stod(argv[1]) : 1.0;
+	std::vector<double> skews;
+
+	for (int i = 2; i < argc; i++)
+		skews.push_back(std::stod(argv[i]));
+
+	if (skews.empty())
+		skews.assign(std::begin(BUILTIN_SKEWS_PPM), std::end(BUILTIN_SKEWS_PPM));
+
+	// The estimator reports every window, hundreds of times per hour
+	g_log_level = (int)LogLevel::Warning;
+
+	printf("%.1f simulated hours per skew, checked after %d s: estimate within %.1f ppm, buffer within %d frames of %d\n\n",
+		hours, SETTLE_S, MAX_ESTIMATE_ERROR_PPM, MAX_BUFFER_OFFSET_FRAMES, START_FRAMES);
+
+	bool ok = true;
+
+	for (double skew_ppm : skews) {
+		SimResult result = simulate(skew_ppm, hours);
+
+		bool passed = !result.underrun && result.worst_estimate_error_ppm <= MAX_ESTIMATE_ERROR_PPM &&
+			result.min_level >= START_FRAMES - MAX_BUFFER_OFFSET_FRAMES && result.max_level <= START_FRAMES + MAX_BUFFER_OFFSET_FRAMES;
+
+		printf("skew %+7.1f ppm  estimate %+8.2f ppm (worst miss %5.2f)  buffer %5lld .. %5lld frames%s  %s\n",
+			skew_ppm, result.estimate_ppm, result.worst_estimate_error_ppm, (long long)result.min_level, (long long)result.max_level,
+			result.underrun ? "  underrun" : "", passed ? "ok" : "FAILED");
+
+		ok = ok && passed;
+	}
+
+	return ok ? 0 : 1;
+}
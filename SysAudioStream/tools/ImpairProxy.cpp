@@ -0,0 +1,499 @@
+// Userspace stand-in for tc netem between a server and receivers on one
+// machine. A receiver sends its hello to the proxy instead of the server;
+// the proxy points the session's audio at itself and forwards every audio
+// packet to the receiver through an impaired link: random and
+// Gilbert-Elliott burst loss, delay, jitter, reordering, duplication and a
+// bandwidth cap with a bounded queue. Cmd traffic goes straight to the
+// server, only the audio is impaired.
+//
+// Every packet draws the same random values whatever is enabled, so with
+// the same seed the nth packet of a session meets the same fate on every
+// run.
+//
+// SASImpairProxy <listen port> <server host> <server port> <pair code>
+//     [-l loss %] [-g enter %,leave %[,loss bad %[,loss good %]]]
+//     [-d delay ms] [-j jitter ms] [-r reorder %[,hold ms]] [-u duplicate %]
+//     [-b kbit/s] [-q queue ms] [-s seed]
+
+#include "pch.h"
+#include "AESWrapper.h"
+#include "AudioPacket.h"
+#include "RandomGenerator.h"
+#include "Clock.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <poll.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#define DEFAULT_SEED 1
+#define DEFAULT_REORDER_HOLD_MS 20
+#define DEFAULT_QUEUE_MS 200
+
+// Longest poll, so counters print and SIGINT is noticed
+#define MAX_WAIT_MS 200
+
+struct Impairment
+{
+	// Shares, not percent
+	double loss = 0;
+
+	// Gilbert-Elliott: chance per packet of entering and leaving the bad
+	// state, and the loss in either state. Off while enter is 0.
+	double burst_enter = 0;
+	double burst_leave = 0;
+	double burst_loss_bad = 1;
+	double burst_loss_good = 0;
+
+	double delay_ms = 0;
+
+	// Standard deviation of normally distributed extra delay, a packet
+	// jittered past the next one overtakes it
+	double jitter_ms = 0;
+
+	// Packets held back by hold_ms, the ones after them overtake them
+	double reorder = 0;
+	double reorder_hold_ms = DEFAULT_REORDER_HOLD_MS;
+
+	double duplicate = 0;
+
+	// Bottleneck before the delay, packets that would wait longer than
+	// queue_ms in front of it are dropped. Off while 0.
+	int bandwidth_kbps = 0;
+	int queue_ms = DEFAULT_QUEUE_MS;
+
+	uint32_t seed = DEFAULT_SEED;
+};
+
+struct LinkStats
+{
+	uint64_t packets;
+	uint64_t sent;
+	uint64_t lost_random;
+	uint64_t lost_burst;
+	uint64_t lost_queue;
+	uint64_t duplicated;
+	uint64_t reordered;
+	int64_t max_queue_ns;
+};
+
+// One direction of an impaired link, decides when each packet leaves
+class Link
+{
+public:
+	Link(const Impairment& impairment, uint32_t seed)
+		: m_impairment(impairment), m_rng(seed)
+	{
+		m_bad = false;
+		m_free_ns = 0;
+		m_last_departure_ns = 0;
+		m_stats = {};
+	}
+
+	// Departure times of the packet and its duplicate, none if dropped
+	void Schedule(size_t bytes, int64_t now_ns, std::vector<int64_t>* departures)
+	{
+		std::uniform_real_distribution<double> uniform(0, 1);
+		std::normal_distribution<double> normal(0, 1);
+
+		// Always the same draws, see the top of the file
+		double u_state = uniform(m_rng);
+		double u_burst = uniform(m_rng);
+		double u_loss = uniform(m_rng);
+		double u_reorder = uniform(m_rng);
+		double u_duplicate = uniform(m_rng);
+		double jitter[2] = { normal(m_rng), normal(m_rng) };
+
+		departures->clear();
+		m_stats.packets++;
+
+		if (m_impairment.burst_enter > 0) {
+			if (m_bad ? u_state < m_impairment.burst_leave : u_state < m_impairment.burst_enter)
+				m_bad = !m_bad;
+
+			if (u_burst < (m_bad ? m_impairment.burst_loss_bad : m_impairment.burst_loss_good)) {
+				m_stats.lost_burst++;
+				return;
+			}
+		}
+
+		if (u_loss < m_impairment.loss) {
+			m_stats.lost_random++;
+			return;
+		}
+
+		int copies = u_duplicate < m_impairment.duplicate ? 2 : 1;
+
+		for (int copy = 0; copy < copies; copy++) {
+			int64_t start_ns = now_ns;
+
+			if (m_impairment.bandwidth_kbps > 0) {
+				start_ns = std::max(now_ns, m_free_ns);
+
+				if (start_ns - now_ns > m_impairment.queue_ms * 1000000LL) {
+					m_stats.lost_queue++;
+					continue;
+				}
+
+				m_stats.max_queue_ns = std::max(m_stats.max_queue_ns, start_ns - now_ns);
+				m_free_ns = start_ns + (int64_t)(bytes * 8 * 1000000.0 / m_impairment.bandwidth_kbps);
+				start_ns = m_free_ns;
+			}
+
+			double delay_ms = std::max(m_impairment.delay_ms + jitter[copy] * m_impairment.jitter_ms, 0.0);
+
+			if (u_reorder < m_impairment.reorder)
+				delay_ms += m_impairment.reorder_hold_ms;
+
+			int64_t departure_ns = start_ns + (int64_t)(delay_ms * 1000000);
+
+			if (departure_ns < m_last_departure_ns)
+				m_stats.reordered++;
+
+			m_last_departure_ns = std::max(m_last_departure_ns, departure_ns);
+			departures->push_back(departure_ns);
+		}
+
+		if (departures->size() > 1)
+			m_stats.duplicated++;
+
+		m_stats.sent += departures->size();
+	}
+
+	const LinkStats& GetStats() const { return m_stats; }
+
+private:
+	Impairment m_impairment;
+	std::mt19937 m_rng;
+
+	bool m_bad;
+	int64_t m_free_ns;
+	int64_t m_last_departure_ns;
+
+	LinkStats m_stats;
+};
+
+// A receiver behind the proxy, known by where its audio goes
+struct ProxySession
+{
+	sockaddr_in hello_addr;
+	sockaddr_in audio_addr;
+
+	// Sends the hellos and receives the reply and the audio
+	int socket;
+
+	std::unique_ptr<Link> link;
+	uint64_t reported_packets;
+};
+
+struct Departure
+{
+	size_t session;
+	std::vector<uint8_t> packet;
+};
+
+static std::atomic<bool> s_stop{ false };
+
+static void on_signal(int)
+{
+	s_stop = true;
+}
+
+// Comma separated numbers, fewer than count leave the rest as they are
+static bool parse_list(const std::string& value, double* values, int count)
+{
+	std::istringstream fields(value);
+	std::string field;
+	int parsed = 0;
+
+	while (parsed < count && std::getline(fields, field, ','))
+		values[parsed++] = std::stod(field);
+
+	return parsed > 0;
+}
+
+static bool parse_option(const std::string& option, const std::string& value, Impairment* impairment)
+{
+	if (option == "-l") {
+		impairment->loss = std::stod(value) / 100;
+	}
+	else if (option == "-g") {
+		double percents[4] = { 0, 0, impairment->burst_loss_bad * 100, impairment->burst_loss_good * 100 };
+
+		if (!parse_list(value, percents, 4))
+			return false;
+
+		impairment->burst_enter = percents[0] / 100;
+		impairment->burst_leave = percents[1] / 100;
+		impairment->burst_loss_bad = percents[2] / 100;
+		impairment->burst_loss_good = percents[3] / 100;
+	}
+	else if (option == "-d") {
+		impairment->delay_ms = std::stod(value);
+	}
+	else if (option == "-j") {
+		impairment->jitter_ms = std::stod(value);
+	}
+	else if (option == "-r") {
+		double values[2] = { 0, impairment->reorder_hold_ms };
+
+		if (!parse_list(value, values, 2))
+			return false;
+
+		impairment->reorder = values[0] / 100;
+		impairment->reorder_hold_ms = values[1];
+	}
+	else if (option == "-u") {
+		impairment->duplicate = std::stod(value) / 100;
+	}
+	else if (option == "-b") {
+		impairment->bandwidth_kbps = std::stoi(value);
+	}
+	else if (option == "-q") {
+		impairment->queue_ms = std::stoi(value);
+	}
+	else if (option == "-s") {
+		impairment->seed = (uint32_t)std::stoul(value);
+	}
+	else {
+		return false;
+	}
+
+	return true;
+}
+
+static bool same_addr(const sockaddr_in& a, const sockaddr_in& b)
+{
+	return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 5) {
+		printf("usage: %s <listen port> <server host> <server port> <pair code> [-l loss %%] [-g enter %%,leave %%[,loss bad %%[,loss good %%]]] "
+			"[-d delay ms] [-j jitter ms] [-r reorder %%[,hold ms]] [-u duplicate %%] [-b kbit/s] [-q queue ms] [-s seed]\n", argv[0]);
+		return 1;
+	}
+
+	int listen_port = std::stoi(argv[1]);
+	std::string password = argv[4];
+
+	sockaddr_in server_addr{};
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons((u_short)std::stoi(argv[3]));
+
+	if (inet_pton(AF_INET, argv[2], &server_addr.sin_addr) != 1) {
+		printf("invalid host '%s'\n", argv[2]);
+		return 1;
+	}
+
+	Impairment impairment;
+
+	for (int i = 5; i + 1 < argc; i += 2) {
+		if (!parse_option(argv[i], argv[i + 1], &impairment)) {
+			printf("invalid option %s %s\n", argv[i], argv[i + 1]);
+			return 1;
+		}
+	}
+
+	int listen_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+	sockaddr_in listen_addr{};
+	listen_addr.sin_family = AF_INET;
+	listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	listen_addr.sin_port = htons((u_short)listen_port);
+
+	if (listen_socket < 0 || bind(listen_socket, reinterpret_cast<sockaddr*>(&listen_addr), sizeof(listen_addr)) < 0) {
+		printf("could not listen on port %d: %s (errno: %d)\n", listen_port, strerror(errno), errno);
+		return 1;
+	}
+
+	AESWrapper aes;
+	aes.GenerateKey(password);
+
+	RandomGenerator random_gen;
+
+	std::vector<std::unique_ptr<ProxySession>> sessions;
+
+	// Packets on their way, by departure time and then arrival order
+	std::multimap<int64_t, Departure> in_flight;
+
+	std::vector<uint8_t> buffer(65536);
+	std::vector<int64_t> departures;
+	std::vector<pollfd> fds;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	printf("proxying port %d to %s:%s, seed %u\n", listen_port, argv[2], argv[3], impairment.seed);
+
+	int64_t report_ns = MonotonicNowNs() + 1000000000LL;
+
+	while (!s_stop) {
+		int64_t now_ns = MonotonicNowNs();
+		int wait_ms = MAX_WAIT_MS;
+
+		if (!in_flight.empty())
+			wait_ms = (int)std::min<int64_t>(std::max<int64_t>((in_flight.begin()->first - now_ns + 999999) / 1000000, 0), MAX_WAIT_MS);
+
+		fds.assign(1, { listen_socket, POLLIN, 0 });
+
+		for (auto& session : sessions)
+			fds.push_back({ session->socket, POLLIN, 0 });
+
+		if (poll(fds.data(), fds.size(), wait_ms) < 0 && errno != EINTR) {
+			printf("poll failed: %s (errno: %d)\n", strerror(errno), errno);
+			break;
+		}
+
+		now_ns = MonotonicNowNs();
+
+		// A hello: the session's audio now comes to the proxy
+		if (fds[0].revents & POLLIN) {
+			sockaddr_in from{};
+			socklen_t from_size = sizeof(from);
+
+			int recv_bytes = recvfrom(listen_socket, (char*)buffer.data(), buffer.size(), 0, reinterpret_cast<sockaddr*>(&from), &from_size);
+
+			if (recv_bytes > 16) {
+				EncryptedData* enc_data = reinterpret_cast<EncryptedData*>(buffer.data());
+
+				aes.SetIv(enc_data->iv, 16);
+				int size = (int)aes.Decrypt(&buffer[16], recv_bytes - 16, &buffer[16]);
+
+				if (size < (int)sizeof(int)) {
+					printf("undecryptable hello, wrong pair code?\n");
+					continue;
+				}
+
+				StreamSettings hello{};
+				memcpy(&hello, &buffer[16], std::min((size_t)size, sizeof(hello)));
+
+				sockaddr_in audio_addr = from;
+				audio_addr.sin_port = htons((u_short)hello.android_port);
+
+				ProxySession* session = nullptr;
+
+				for (auto& existing : sessions) {
+					if (same_addr(existing->audio_addr, audio_addr))
+						session = existing.get();
+				}
+
+				if (!session) {
+					auto created = std::make_unique<ProxySession>();
+					created->audio_addr = audio_addr;
+					created->socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+					created->link = std::make_unique<Link>(impairment, impairment.seed + (uint32_t)sessions.size());
+					created->reported_packets = 0;
+
+					sockaddr_in relay_addr{};
+					relay_addr.sin_family = AF_INET;
+					relay_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+					if (created->socket < 0 || bind(created->socket, reinterpret_cast<sockaddr*>(&relay_addr), sizeof(relay_addr)) < 0) {
+						printf("relay socket failed: %s (errno: %d)\n", strerror(errno), errno);
+						continue;
+					}
+
+					int buffer_size = 4 * 1024 * 1024;
+					setsockopt(created->socket, SOL_SOCKET, SO_RCVBUF, (const char*)&buffer_size, sizeof(buffer_size));
+
+					session = created.get();
+					sessions.push_back(std::move(created));
+
+					printf("session %zu: receiver port %d\n", sessions.size() - 1, hello.android_port);
+				}
+
+				session->hello_addr = from;
+
+				sockaddr_in relay_addr{};
+				socklen_t relay_size = sizeof(relay_addr);
+				getsockname(session->socket, reinterpret_cast<sockaddr*>(&relay_addr), &relay_size);
+
+				hello.android_port = ntohs(relay_addr.sin_port);
+				memcpy(&buffer[16], &hello, std::min((size_t)size, sizeof(hello)));
+
+				random_gen.Generate(enc_data->iv, 16);
+				aes.SetIv(enc_data->iv, 16);
+
+				std::vector<uint8_t> plain(&buffer[16], &buffer[16] + size);
+				int data_size = (int)aes.Encrypt(plain.data(), plain.size(), &buffer[16]);
+
+				sendto(session->socket, (const char*)buffer.data(), 16 + data_size, 0, reinterpret_cast<sockaddr*>(&server_addr), sizeof(server_addr));
+			}
+		}
+
+		for (size_t i = 0; i < sessions.size(); i++) {
+			if (!(fds[i + 1].revents & POLLIN))
+				continue;
+
+			ProxySession& session = *sessions[i];
+
+			sockaddr_in from{};
+			socklen_t from_size = sizeof(from);
+
+			int recv_bytes = recvfrom(session.socket, (char*)buffer.data(), buffer.size(), 0, reinterpret_cast<sockaddr*>(&from), &from_size);
+
+			if (recv_bytes <= 0)
+				continue;
+
+			// The hello reply goes back unimpaired
+			if (same_addr(from, server_addr)) {
+				sendto(listen_socket, (const char*)buffer.data(), recv_bytes, 0, reinterpret_cast<sockaddr*>(&session.hello_addr), sizeof(session.hello_addr));
+				continue;
+			}
+
+			session.link->Schedule(recv_bytes, now_ns, &departures);
+
+			for (int64_t departure_ns : departures)
+				in_flight.emplace(departure_ns, Departure{ i, std::vector<uint8_t>(buffer.begin(), buffer.begin() + recv_bytes) });
+		}
+
+		now_ns = MonotonicNowNs();
+
+		while (!in_flight.empty() && in_flight.begin()->first <= now_ns) {
+			Departure& departure = in_flight.begin()->second;
+			ProxySession& session = *sessions[departure.session];
+
+			sendto(session.socket, (const char*)departure.packet.data(), (int)departure.packet.size(), 0,
+				reinterpret_cast<sockaddr*>(&session.audio_addr), sizeof(session.audio_addr));
+
+			in_flight.erase(in_flight.begin());
+		}
+
+		if (now_ns >= report_ns) {
+			report_ns += 1000000000LL;
+
+			// Idle sessions once, not every second
+			for (size_t i = 0; i < sessions.size(); i++) {
+				const LinkStats& stats = sessions[i]->link->GetStats();
+
+				if (stats.packets == sessions[i]->reported_packets)
+					continue;
+
+				sessions[i]->reported_packets = stats.packets;
+
+				printf("session %zu: packets %llu sent %llu lost %llu random %llu burst %llu queue, dup %llu reordered %llu, queue peak %.1f ms\n",
+					i, (unsigned long long)stats.packets, (unsigned long long)stats.sent, (unsigned long long)stats.lost_random,
+					(unsigned long long)stats.lost_burst, (unsigned long long)stats.lost_queue, (unsigned long long)stats.duplicated,
+					(unsigned long long)stats.reordered, stats.max_queue_ns / 1e6);
+			}
+		}
+	}
+
+	for (auto& session : sessions)
+		close(session->socket);
+
+	close(listen_socket);
+
+	return 0;
+}
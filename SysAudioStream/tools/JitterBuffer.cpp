@@ -0,0 +1,500 @@
+#include "JitterBuffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Pitch periods searched for stretching and concealment
+#define MIN_PERIOD_MS 2.5
+#define MAX_PERIOD_MS 15.0
+
+// Audio compared when looking for the period before a loss
+#define MATCH_MS 5.0
+
+// Cross-fade from concealed into real audio
+#define MERGE_MS 2.5
+
+// Concealment fades to silence over this long, after which the buffer
+// fills up to its target again before playing on
+#define MAX_CONCEAL_MS 30.0
+
+// Stretching is inaudible where the period matches this well, or where
+// the audio is below -50 dBFS
+#define STRETCH_CORRELATION 0.7f
+#define QUIET_RMS 0.003f
+
+// Pulls between two stretches, so the level can follow
+#define STRETCH_COOLDOWN 4
+
+// A gap this many packets long is a restarted stream rather than a loss
+#define MAX_CONCEALED_GAP 50
+
+JitterBuffer::JitterBuffer()
+{
+	Reset(JitterConfig());
+}
+
+void JitterBuffer::Reset(const JitterConfig& config)
+{
+	m_config = config;
+	m_channels = std::max(config.channels, 1);
+
+	m_min_period = std::max((int)(config.sample_rate * MIN_PERIOD_MS / 1000), 1);
+	m_max_period = std::max((int)(config.sample_rate * MAX_PERIOD_MS / 1000), m_min_period);
+	m_match_frames = std::max((int)(config.sample_rate * MATCH_MS / 1000), 1);
+	m_merge_frames = std::max((int)(config.sample_rate * MERGE_MS / 1000), 1);
+
+	m_fifo.clear();
+	m_fifo_pos = 0;
+	m_pending.clear();
+
+	m_started = false;
+	m_next_sequence = 0;
+	m_packet_frames = config.sample_rate / 100;
+	m_pull_frames = m_packet_frames;
+
+	m_playing = false;
+
+	m_history.clear();
+
+	m_concealing = false;
+	m_conceal_gain = 1.0f;
+	m_conceal_phase = 0;
+	m_conceal_cycle.clear();
+	m_merge_tail.clear();
+	m_underrun = false;
+
+	m_transits.assign(std::max(config.window_packets, 1), 0);
+	m_transit_count = 0;
+	m_transit_pos = 0;
+
+	m_target_frames = config.min_delay_ms * config.sample_rate / 1000.0;
+	m_level_frames = 0;
+	m_stretch_cooldown = 0;
+
+	m_stats = {};
+}
+
+bool JitterBuffer::Push(uint32_t sequence, int64_t pts_ns, int64_t arrival_ns, const float* samples, size_t frames)
+{
+	if (m_started && (int32_t)(sequence - m_next_sequence) < 0) {
+		m_stats.late++;
+		return false;
+	}
+
+	if (m_pending.count(sequence)) {
+		m_stats.duplicates++;
+		return false;
+	}
+
+	m_stats.packets++;
+
+	UpdateTarget(arrival_ns - pts_ns);
+
+	if (!m_started) {
+		m_started = true;
+		m_next_sequence = sequence;
+	}
+
+	if (frames)
+		m_packet_frames = frames;
+
+	std::vector<float>& packet = m_pending[sequence];
+
+	if (samples)
+		packet.assign(samples, samples + frames * m_channels);
+	else
+		packet.assign(frames * m_channels, 0.0f);
+
+	Drain();
+
+	return true;
+}
+
+void JitterBuffer::Pull(float* out, size_t frames)
+{
+	m_pull_frames = frames;
+
+	// Pull and packet granularity, plus the jitter
+	double target = m_pull_frames + m_packet_frames / 2.0 + m_target_frames;
+
+	if (!m_playing) {
+		if (FifoFrames() < target) {
+			memset(out, 0, frames * m_channels * sizeof(float));
+			return;
+		}
+
+		m_playing = true;
+		m_level_frames = (double)FifoFrames();
+	}
+
+	// Filtered level, a packet's arrival moves it less than a stretch does
+	m_level_frames += (FifoFrames() - m_level_frames) / 8;
+
+	double margin = std::max(m_packet_frames / 2.0, m_config.sample_rate * 0.005);
+
+	if (m_stretch_cooldown > 0)
+		m_stretch_cooldown--;
+	else if (m_level_frames > target + margin && Stretch(true))
+		m_stretch_cooldown = STRETCH_COOLDOWN;
+	else if (m_level_frames < target - margin && Stretch(false))
+		m_stretch_cooldown = STRETCH_COOLDOWN;
+
+	size_t done = 0;
+
+	while (done < frames) {
+		if (!FifoFrames()) {
+			if (!m_pending.empty()) {
+				// Later packets are here and the next one isn't, it's lost
+				uint32_t missing = m_pending.begin()->first - m_next_sequence;
+
+				m_stats.lost += missing;
+
+				if (missing <= MAX_CONCEALED_GAP)
+					Conceal(missing * m_packet_frames);
+
+				m_next_sequence = m_pending.begin()->first;
+				Drain();
+			}
+			else {
+				if (!m_underrun)
+					m_stats.underruns++;
+
+				m_underrun = true;
+				m_stats.underrun_frames += frames - done;
+
+				// Faded out, wait for the buffer to fill up again
+				if (m_concealing && m_conceal_gain <= 0.0f) {
+					m_playing = false;
+					memset(out + done * m_channels, 0, (frames - done) * m_channels * sizeof(float));
+					break;
+				}
+
+				Conceal(frames - done);
+			}
+
+			continue;
+		}
+
+		size_t count = std::min(FifoFrames(), frames - done);
+		const float* data = FifoData();
+
+		memcpy(out + done * m_channels, data, count * m_channels * sizeof(float));
+
+		m_history.insert(m_history.end(), data, data + count * m_channels);
+		m_fifo_pos += count * m_channels;
+		done += count;
+	}
+
+	// Concealment continues from the last period played
+	size_t history_size = (size_t)(m_max_period * 2 + m_match_frames) * m_channels;
+
+	if (m_history.size() > 2 * history_size)
+		m_history.erase(m_history.begin(), m_history.end() - history_size);
+
+	if (m_fifo_pos > 0 && m_fifo_pos * 2 > m_fifo.size()) {
+		m_fifo.erase(m_fifo.begin(), m_fifo.begin() + m_fifo_pos);
+		m_fifo_pos = 0;
+	}
+}
+
+JitterStats JitterBuffer::GetStats() const
+{
+	JitterStats stats = m_stats;
+
+	double frames_ms = 1000.0 / std::max(m_config.sample_rate, 1);
+
+	stats.target_ms = (m_pull_frames + m_packet_frames / 2.0 + m_target_frames) * frames_ms;
+	stats.level_ms = m_level_frames * frames_ms;
+
+	return stats;
+}
+
+void JitterBuffer::Append(const float* samples, size_t frames)
+{
+	size_t start = m_fifo.size();
+
+	m_fifo.insert(m_fifo.end(), samples, samples + frames * m_channels);
+
+	if (!m_concealing)
+		return;
+
+	// Fade from the concealment's continuation into the real audio
+	size_t merge = std::min(frames, m_merge_tail.size() / m_channels);
+
+	for (size_t i = 0; i < merge; i++) {
+		float w = (float)(i + 1) / (merge + 1);
+
+		for (int c = 0; c < m_channels; c++) {
+			float& sample = m_fifo[start + i * m_channels + c];
+			sample = sample * w + m_merge_tail[i * m_channels + c] * (1.0f - w);
+		}
+	}
+
+	m_concealing = false;
+	m_underrun = false;
+}
+
+void JitterBuffer::Drain()
+{
+	auto it = m_pending.begin();
+
+	while (it != m_pending.end() && it->first == m_next_sequence) {
+		Append(it->second.data(), it->second.size() / m_channels);
+
+		it = m_pending.erase(it);
+		m_next_sequence++;
+	}
+}
+
+void JitterBuffer::Conceal(size_t frames)
+{
+	if (!frames)
+		return;
+
+	if (!m_concealing) {
+		m_concealing = true;
+		m_conceal_gain = 1.0f;
+		m_conceal_phase = 0;
+		m_conceal_cycle.clear();
+		m_conceal_offset.assign(m_channels, 0.0f);
+
+		size_t history_frames = m_history.size() / m_channels;
+
+		if (history_frames >= (size_t)(m_max_period + m_match_frames)) {
+			m_mono.resize(history_frames);
+
+			for (size_t i = 0; i < history_frames; i++) {
+				float sum = 0;
+
+				for (int c = 0; c < m_channels; c++)
+					sum += m_history[i * m_channels + c];
+
+				m_mono[i] = sum;
+			}
+
+			float correlation;
+			int period = FindTailPeriod(m_mono.data(), history_frames, m_match_frames, &correlation);
+
+			// The last period played, repeated from where it matches the end
+			m_conceal_cycle.assign(m_history.end() - (size_t)period * m_channels, m_history.end());
+
+			// Its end fades into what preceded its start, so it loops without
+			// a step where the match isn't perfect
+			size_t fade = std::min((size_t)m_merge_frames, (size_t)period / 2);
+			const float* before = &*(m_history.end() - (size_t)(period + fade) * m_channels);
+			float* cycle_end = &m_conceal_cycle[((size_t)period - fade) * m_channels];
+
+			for (size_t i = 0; i < fade * m_channels; i++) {
+				float w = (float)(i / m_channels + 1) / (fade + 1);
+				cycle_end[i] = cycle_end[i] * (1.0f - w) + before[i] * w;
+			}
+
+			// Same for the step from the last frame played into the cycle, an
+			// offset that decays over the first frames
+			m_conceal_offset.resize(m_channels);
+
+			for (int c = 0; c < m_channels; c++)
+				m_conceal_offset[c] = *(m_history.end() - m_channels + c) - m_conceal_cycle[c];
+		}
+	}
+
+	size_t start = m_fifo.size();
+	size_t period = m_conceal_cycle.size() / m_channels;
+	float step = (float)(1000.0 / (MAX_CONCEAL_MS * m_config.sample_rate));
+
+	m_fifo.resize(start + frames * m_channels, 0.0f);
+
+	if (period) {
+		for (size_t i = 0; i < frames && m_conceal_gain > 0.0f; i++) {
+			const float* source = &m_conceal_cycle[(m_conceal_phase % period) * m_channels];
+			float decay = m_conceal_phase < (size_t)m_merge_frames ? 1.0f - (float)(m_conceal_phase + 1) / (m_merge_frames + 1) : 0.0f;
+
+			for (int c = 0; c < m_channels; c++)
+				m_fifo[start + i * m_channels + c] = (source[c] + m_conceal_offset[c] * decay) * m_conceal_gain;
+
+			m_conceal_phase++;
+			m_conceal_gain = std::max(m_conceal_gain - step, 0.0f);
+		}
+
+		// What would have come next, for the cross-fade into real audio
+		m_merge_tail.resize((size_t)m_merge_frames * m_channels);
+
+		for (int i = 0; i < m_merge_frames; i++) {
+			const float* source = &m_conceal_cycle[((m_conceal_phase + i) % period) * m_channels];
+
+			for (int c = 0; c < m_channels; c++)
+				m_merge_tail[i * m_channels + c] = source[c] * m_conceal_gain;
+		}
+	}
+	else {
+		m_conceal_gain = 0.0f;
+		m_merge_tail.assign((size_t)m_merge_frames * m_channels, 0.0f);
+	}
+
+	m_stats.concealed_frames += frames;
+}
+
+void JitterBuffer::UpdateTarget(int64_t transit_ns)
+{
+	m_transits[m_transit_pos] = transit_ns;
+	m_transit_pos = (m_transit_pos + 1) % m_transits.size();
+	m_transit_count = std::min(m_transit_count + 1, m_transits.size());
+
+	m_sorted.assign(m_transits.begin(), m_transits.begin() + m_transit_count);
+
+	int64_t fastest = *std::min_element(m_sorted.begin(), m_sorted.end());
+
+	auto nth = m_sorted.begin() + (size_t)(m_config.percentile * (m_sorted.size() - 1));
+	std::nth_element(m_sorted.begin(), nth, m_sorted.end());
+
+	double jitter_ms = (*nth - fastest) / 1e6;
+
+	jitter_ms = std::min(std::max(jitter_ms, (double)m_config.min_delay_ms), (double)m_config.max_delay_ms);
+
+	m_target_frames = jitter_ms * m_config.sample_rate / 1000.0;
+}
+
+int JitterBuffer::FindTailPeriod(const float* mono, size_t end, int len, float* correlation) const
+{
+	const float* tail = mono + end - len;
+
+	int best_period = m_max_period;
+	float best = -2.0f;
+
+	double tail_energy = 0;
+
+	for (int i = 0; i < len; i++)
+		tail_energy += tail[i] * tail[i];
+
+	for (int period = m_min_period; period <= m_max_period; period++) {
+		const float* earlier = tail - period;
+
+		double dot = 0, energy = 0;
+
+		for (int i = 0; i < len; i++) {
+			dot += tail[i] * earlier[i];
+			energy += earlier[i] * earlier[i];
+		}
+
+		float c = tail_energy > 0 && energy > 0 ? (float)(dot / std::sqrt(tail_energy * energy)) : 0.0f;
+
+		if (c > best) {
+			best = c;
+			best_period = period;
+		}
+	}
+
+	*correlation = best;
+	return best_period;
+}
+
+int JitterBuffer::FindHeadPeriod(const float* mono, float* correlation, float* rms) const
+{
+	int best_period = m_min_period;
+	float best = -2.0f;
+
+	double best_energy = 0;
+
+	for (int period = m_min_period; period <= m_max_period; period++) {
+		double dot = 0, first = 0, second = 0;
+
+		for (int i = 0; i < period; i++) {
+			dot += mono[i] * mono[i + period];
+			first += mono[i] * mono[i];
+			second += mono[i + period] * mono[i + period];
+		}
+
+		float c = first > 0 && second > 0 ? (float)(dot / std::sqrt(first * second)) : 0.0f;
+
+		if (c > best) {
+			best = c;
+			best_period = period;
+			best_energy = (first + second) / (2.0 * period);
+		}
+	}
+
+	*correlation = best;
+	*rms = (float)std::sqrt(best_energy / ((double)m_channels * m_channels));
+
+	return best_period;
+}
+
+bool JitterBuffer::Stretch(bool compress)
+{
+	if (FifoFrames() < (size_t)m_max_period * 2)
+		return false;
+
+	const float* data = FifoData();
+
+	m_mono.resize((size_t)m_max_period * 2);
+
+	for (int i = 0; i < m_max_period * 2; i++) {
+		float sum = 0;
+
+		for (int c = 0; c < m_channels; c++)
+			sum += data[i * m_channels + c];
+
+		m_mono[i] = sum;
+	}
+
+	float correlation, rms;
+	int period = FindHeadPeriod(m_mono.data(), &correlation, &rms);
+
+	if (correlation < STRETCH_CORRELATION && rms > QUIET_RMS)
+		return false;
+
+	size_t samples = (size_t)period * m_channels;
+
+	if (compress) {
+		// x[0..T) fading into x[T..2T) takes the place of both
+		float* first = &m_fifo[m_fifo_pos];
+		float* second = first + samples;
+
+		for (int i = 0; i < period; i++) {
+			float w = (float)(i + 1) / (period + 1);
+
+			for (int c = 0; c < m_channels; c++) {
+				size_t k = (size_t)i * m_channels + c;
+				second[k] = first[k] * (1.0f - w) + second[k] * w;
+			}
+		}
+
+		m_fifo_pos += samples;
+		m_stats.compressed_frames += period;
+		m_level_frames -= period;
+	}
+	else {
+		// x[T..2T) fading into x[0..T) goes in between x[0..T) and x[T..)
+		m_scratch.resize(samples);
+
+		const float* first = &m_fifo[m_fifo_pos];
+		const float* second = first + samples;
+
+		for (int i = 0; i < period; i++) {
+			float w = (float)(i + 1) / (period + 1);
+
+			for (int c = 0; c < m_channels; c++) {
+				size_t k = (size_t)i * m_channels + c;
+				m_scratch[k] = second[k] * (1.0f - w) + first[k] * w;
+			}
+		}
+
+		m_fifo.insert(m_fifo.begin() + m_fifo_pos + samples, m_scratch.begin(), m_scratch.end());
+
+		m_stats.expanded_frames += period;
+		m_level_frames += period;
+	}
+
+	return true;
+}
+
+size_t JitterBuffer::FifoFrames() const
+{
+	return (m_fifo.size() - m_fifo_pos) / m_channels;
+}
+
+const float* JitterBuffer::FifoData() const
+{
+	return m_fifo.data() + m_fifo_pos;
+}
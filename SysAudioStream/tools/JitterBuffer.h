@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+struct JitterConfig
+{
+	int sample_rate = 48000;
+	int channels = 2;
+
+	// Share of packets that should arrive in time, the delay covers this
+	// percentile of transit above the fastest packet in the window
+	double percentile = 0.95;
+
+	// Bounds of the delay on top of the packet and pull granularity
+	int min_delay_ms = 0;
+	int max_delay_ms = 500;
+
+	// Packets the percentile is taken over
+	int window_packets = 500;
+};
+
+struct JitterStats
+{
+	uint64_t packets;
+
+	// Arrived after their turn, dropped
+	uint64_t late;
+	uint64_t duplicates;
+
+	// Missing when their turn came, concealed or played as silence
+	uint64_t lost;
+
+	// Frames extrapolated from the audio before a lost packet or an underrun
+	uint64_t concealed_frames;
+
+	// Times the buffer ran dry while playing, and the frames that were
+	// concealed or silent because of it
+	uint64_t underruns;
+	uint64_t underrun_frames;
+
+	// Time stretching, frames inserted and removed
+	uint64_t expanded_frames;
+	uint64_t compressed_frames;
+
+	// Delay aimed for and the buffered audio, in ms
+	double target_ms;
+	double level_ms;
+};
+
+// Adaptive jitter buffer for one stream of interleaved float audio.
+// Packets are pushed as they arrive and the playback device pulls fixed
+// blocks. The buffer aims for the configured percentile of transit jitter
+// and moves towards it by time stretching: a pitch period is removed or
+// repeated where the audio is periodic or quiet (WSOLA, as in NetEQ's
+// accelerate and preemptive expand). A lost packet or an underrun is
+// concealed by continuing the last pitch period with a fade, and the real
+// audio that follows is cross-faded in. Not thread safe.
+class JitterBuffer
+{
+public:
+	JitterBuffer();
+
+	void Reset(const JitterConfig& config);
+
+	// False if the packet came too late or twice. frames of samples may be
+	// zero for DTX silence, samples is then ignored.
+	bool Push(uint32_t sequence, int64_t pts_ns, int64_t arrival_ns, const float* samples, size_t frames);
+
+	// Always fills frames frames, with silence while buffering
+	void Pull(float* out, size_t frames);
+
+	JitterStats GetStats() const;
+
+private:
+	void Append(const float* samples, size_t frames);
+	void Drain();
+
+	// Fills the empty FIFO with a lost packet's worth of audio
+	void Conceal(size_t frames);
+
+	void UpdateTarget(int64_t transit_ns);
+
+	// Best pitch period between min and max frames: where the len frames
+	// before end best match the len frames one period earlier
+	int FindTailPeriod(const float* mono, size_t end, int len, float* correlation) const;
+
+	// Best period at the head of the FIFO, x[0..T) against x[T..2T)
+	int FindHeadPeriod(const float* mono, float* correlation, float* rms) const;
+
+	bool Stretch(bool compress);
+
+	size_t FifoFrames() const;
+	const float* FifoData() const;
+
+	JitterConfig m_config;
+	int m_channels;
+
+	// Pitch period range and cross-fade length, in frames
+	int m_min_period;
+	int m_max_period;
+	int m_match_frames;
+	int m_merge_frames;
+
+	// Decoded audio in sequence order from m_fifo_pos on
+	std::vector<float> m_fifo;
+	size_t m_fifo_pos;
+
+	// Packets waiting for an earlier one
+	std::map<uint32_t, std::vector<float>> m_pending;
+
+	bool m_started;
+	uint32_t m_next_sequence;
+	size_t m_packet_frames;
+	size_t m_pull_frames;
+
+	bool m_playing;
+
+	// Last frames played, what concealment continues from
+	std::vector<float> m_history;
+
+	// Concealment in progress: the period it repeats, how far into it and
+	// at what gain, the step from the last frame played, and its
+	// continuation the next real audio fades from
+	bool m_concealing;
+	float m_conceal_gain;
+	size_t m_conceal_phase;
+	std::vector<float> m_conceal_cycle;
+	std::vector<float> m_conceal_offset;
+	std::vector<float> m_merge_tail;
+	bool m_underrun;
+
+	// Transit of the last window_packets packets
+	std::vector<int64_t> m_transits;
+	size_t m_transit_count;
+	size_t m_transit_pos;
+	std::vector<int64_t> m_sorted;
+
+	double m_target_frames;
+	double m_level_frames;
+	int m_stretch_cooldown;
+
+	std::vector<float> m_mono;
+	std::vector<float> m_scratch;
+
+	JitterStats m_stats;
+};
@@ -0,0 +1,319 @@
+// Replays packet arrival traces through JitterBuffer on a virtual clock, so
+// every run of a trace gives the same result. The packets carry a harmonic
+// tone and the output is checked for clicks, which concealment and time
+// stretching must not cause. Prints the buffer's counters per trace and
+// exits non-zero if a built-in trace misses its expectations.
+//
+// SASJitterReplay [trace ...] [-p percentile] [-m min delay ms]
+//
+// Without traces the built-in ones run: clean, jitter, spikes, loss and
+// reorder, generated from a fixed seed. A trace file, as written by
+// SASReceiver -a, has one packet per line: sequence pts_ns arrival_ns frames
+
+#include "JitterBuffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define SAMPLE_RATE 48000
+#define CHANNELS 2
+#define PACKET_FRAMES 480
+#define PULL_FRAMES 480
+
+#define TRACE_SECONDS 30
+#define TRACE_SEED 20261019
+
+// Second difference above this is a click, the tone stays far below it
+#define CLICK_THRESHOLD 0.05f
+
+struct TracePacket
+{
+	uint32_t sequence;
+	int64_t pts_ns;
+	int64_t arrival_ns;
+	uint32_t frames;
+};
+
+struct Expect
+{
+	bool no_underruns;
+	double max_late_share;
+	double max_underrun_share;
+	int64_t lost;
+};
+
+struct Trace
+{
+	std::string name;
+	std::vector<TracePacket> packets;
+	bool builtin;
+	Expect expect;
+};
+
+static const int64_t PACKET_NS = (int64_t)PACKET_FRAMES * 1000000000LL / SAMPLE_RATE;
+
+static float tone(int64_t frame)
+{
+	double t = (double)frame / SAMPLE_RATE;
+	double value = 0;
+
+	for (int harmonic = 1; harmonic <= 4; harmonic++)
+		value += 0.3 / harmonic * std::sin(2 * M_PI * 220.0 * harmonic * t);
+
+	return (float)value;
+}
+
+static std::vector<TracePacket> make_packets(int64_t base_transit_ns)
+{
+	std::vector<TracePacket> packets;
+
+	for (uint32_t i = 0; i < TRACE_SECONDS * 1000000000LL / PACKET_NS; i++)
+		packets.push_back({ i, i * PACKET_NS, i * PACKET_NS + base_transit_ns, PACKET_FRAMES });
+
+	return packets;
+}
+
+static std::vector<Trace> builtin_traces()
+{
+	std::mt19937 rng(TRACE_SEED);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	std::vector<Trace> traces;
+
+	// Loopback: a millisecond of transit, little jitter
+	{
+		Trace trace{ "clean", make_packets(1000000), true, { true, 0.0, 0.0, 0 } };
+
+		for (auto& packet : trace.packets)
+			packet.arrival_ns += (int64_t)(uniform(rng) * 200000);
+
+		traces.push_back(trace);
+	}
+
+	// Wi-Fi: exponential jitter with a 5 ms mean, the tail above the
+	// percentile comes late
+	{
+		Trace trace{ "jitter", make_packets(1000000), true, { false, 0.05, 0.02, 0 } };
+		std::exponential_distribution<double> exponential(1.0 / 5000000);
+
+		for (auto& packet : trace.packets)
+			packet.arrival_ns += std::min((int64_t)exponential(rng), (int64_t)60000000);
+
+		traces.push_back(trace);
+	}
+
+	// Background scans: the link stalls 150 ms every 2 s and then delivers
+	// everything at once
+	{
+		Trace trace{ "spikes", make_packets(1000000), true, { false, 0.0, 0.05, 0 } };
+
+		for (auto& packet : trace.packets) {
+			int64_t in_cycle = packet.pts_ns % 2000000000LL;
+
+			if (in_cycle >= 1000000000LL && in_cycle < 1150000000LL)
+				packet.arrival_ns = packet.pts_ns - in_cycle + 1150000000LL + 1000000;
+		}
+
+		traces.push_back(trace);
+	}
+
+	// 1% random loss and a burst of three every 5 s
+	{
+		Trace trace{ "loss", {}, true, { false, 0.0, 0.0, 0 } };
+
+		for (auto& packet : make_packets(1000000)) {
+			bool burst = packet.sequence % 500 >= 250 && packet.sequence % 500 < 253;
+
+			if (burst || uniform(rng) < 0.01) {
+				trace.expect.lost++;
+				continue;
+			}
+
+			trace.packets.push_back(packet);
+		}
+
+		traces.push_back(trace);
+	}
+
+	// 3% of packets overtaken by the next one, fewer than the percentile
+	// leaves out so they are dropped as late
+	{
+		Trace trace{ "reorder", make_packets(1000000), true, { false, 0.05, 0.01, 0 } };
+
+		for (auto& packet : trace.packets) {
+			if (uniform(rng) < 0.03)
+				packet.arrival_ns += PACKET_NS + 2000000;
+		}
+
+		traces.push_back(trace);
+	}
+
+	return traces;
+}
+
+static bool load_trace(const std::string& path, Trace* trace)
+{
+	std::ifstream file(path);
+
+	if (!file)
+		return false;
+
+	trace->name = path;
+	trace->builtin = false;
+
+	std::string line;
+
+	while (std::getline(file, line)) {
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		std::istringstream fields(line);
+		TracePacket packet;
+
+		if (fields >> packet.sequence >> packet.pts_ns >> packet.arrival_ns >> packet.frames)
+			trace->packets.push_back(packet);
+	}
+
+	return !trace->packets.empty();
+}
+
+static bool replay(Trace& trace, const JitterConfig& config)
+{
+	std::sort(trace.packets.begin(), trace.packets.end(),
+		[](const TracePacket& a, const TracePacket& b) { return a.arrival_ns < b.arrival_ns; });
+
+	JitterBuffer buffer;
+	buffer.Reset(config);
+
+	int64_t first_pts_ns = trace.packets.front().pts_ns;
+	int64_t pull_ns = trace.packets.front().arrival_ns;
+	int64_t pull_period_ns = (int64_t)PULL_FRAMES * 1000000000LL / SAMPLE_RATE;
+	int64_t end_ns = trace.packets.back().arrival_ns;
+
+	std::vector<float> samples;
+	std::vector<float> out((size_t)PULL_FRAMES * CHANNELS);
+
+	size_t next = 0;
+	uint64_t clicks = 0;
+	uint64_t played = 0;
+	bool audible = false;
+	float previous[2] = { 0, 0 };
+
+	double level_sum = 0;
+	uint64_t level_count = 0;
+
+	for (; pull_ns < end_ns; pull_ns += pull_period_ns) {
+		for (; next < trace.packets.size() && trace.packets[next].arrival_ns <= pull_ns; next++) {
+			const TracePacket& packet = trace.packets[next];
+			int64_t first_frame = (packet.pts_ns - first_pts_ns) * SAMPLE_RATE / 1000000000LL;
+
+			samples.resize((size_t)packet.frames * CHANNELS);
+
+			for (uint32_t i = 0; i < packet.frames; i++)
+				for (int c = 0; c < CHANNELS; c++)
+					samples[i * CHANNELS + c] = tone(first_frame + i);
+
+			buffer.Push(packet.sequence, packet.pts_ns, packet.arrival_ns, samples.data(), packet.frames);
+		}
+
+		buffer.Pull(out.data(), PULL_FRAMES);
+
+		for (size_t i = 0; i < PULL_FRAMES; i++) {
+			float sample = out[i * CHANNELS];
+
+			// Silence before the first audio isn't a click
+			if (sample != 0.0f)
+				audible = true;
+
+			if (audible && std::fabs(sample - 2 * previous[1] + previous[0]) > CLICK_THRESHOLD)
+				clicks++;
+
+			previous[0] = previous[1];
+			previous[1] = sample;
+		}
+
+		if (audible) {
+			played += PULL_FRAMES;
+
+			JitterStats stats = buffer.GetStats();
+			level_sum += stats.level_ms;
+			level_count++;
+		}
+	}
+
+	JitterStats stats = buffer.GetStats();
+
+	printf("%-10s packets %5llu late %3llu dup %2llu lost %3llu concealed %6.1f ms underruns %3llu (%6.1f ms) "
+		"expanded %6.1f ms compressed %6.1f ms target %5.1f ms level %5.1f ms clicks %llu\n",
+		trace.name.c_str(), (unsigned long long)stats.packets, (unsigned long long)stats.late,
+		(unsigned long long)stats.duplicates, (unsigned long long)stats.lost, stats.concealed_frames * 1000.0 / SAMPLE_RATE,
+		(unsigned long long)stats.underruns, stats.underrun_frames * 1000.0 / SAMPLE_RATE,
+		stats.expanded_frames * 1000.0 / SAMPLE_RATE, stats.compressed_frames * 1000.0 / SAMPLE_RATE,
+		stats.target_ms, level_count ? level_sum / level_count : 0.0, (unsigned long long)clicks);
+
+	if (!trace.builtin)
+		return true;
+
+	bool ok = clicks == 0;
+
+	if (trace.expect.no_underruns)
+		ok = ok && stats.underruns == 0;
+
+	ok = ok && stats.late <= trace.expect.max_late_share * trace.packets.size();
+
+	if (trace.expect.lost)
+		ok = ok && (int64_t)stats.lost == trace.expect.lost;
+
+	if (trace.expect.max_underrun_share > 0)
+		ok = ok && stats.underrun_frames <= trace.expect.max_underrun_share * played;
+
+	if (!ok)
+		printf("%-10s FAILED\n", trace.name.c_str());
+
+	return ok;
+}
+
+int main(int argc, char* argv[])
+{
+	JitterConfig config;
+	config.sample_rate = SAMPLE_RATE;
+	config.channels = CHANNELS;
+
+	std::vector<Trace> traces;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+
+		if (arg == "-p" && i + 1 < argc) {
+			config.percentile = std::stod(argv[++i]);
+		}
+		else if (arg == "-m" && i + 1 < argc) {
+			config.min_delay_ms = std::stoi(argv[++i]);
+		}
+		else {
+			Trace trace;
+
+			if (!load_trace(arg, &trace)) {
+				printf("could not read trace %s\n", arg.c_str());
+				return 1;
+			}
+
+			traces.push_back(trace);
+		}
+	}
+
+	if (traces.empty())
+		traces = builtin_traces();
+
+	bool ok = true;
+
+	for (auto& trace : traces)
+		ok = replay(trace, config) && ok;
+
+	return ok ? 0 : 1;
+}
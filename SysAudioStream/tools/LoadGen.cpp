@@ -0,0 +1,249 @@
+// How many receivers one server can take: virtual clients on loopback, each
+// a full reference receiver (hello, cmd packets, decryption, decoding and
+// jitter buffer), are added in steps while the server's CPU, the send path
+// latency and the packets lost, late or invalid are measured per step.
+//
+// Send path latency is from the capture of a packet's last frame to its
+// arrival: conversion, encoding, encryption, queueing and the socket. It
+// leaves out the packet's own duration, which DTX packets stretch over
+// all the silence they stand for.
+//
+// SASLoadGen [max clients] [seconds per step] [format] [port pid pair code]
+// format as in SASReceiver -f, pcm16 by default. Without a port the server
+// is forked off on the synthetic device. With one, the clients connect to
+// a running server on 127.0.0.1, and pid is that server's process to
+// measure the CPU of.
+//
+// Clients double each step until max clients, 32 by default, the most
+// sessions a server takes.
+
+#include "pch.h"
+#include "AudioStream.h"
+#include "AudioReceiver.h"
+#include "SyntheticCapture.h"
+#include "Clock.h"
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <vector>
+
+#define LOAD_PORT 47181
+#define LOAD_PAIR_CODE "loadgen"
+
+// Sessions settle into their format and jitter buffer before a step is
+// measured
+#define SETTLE_MS 1000
+
+struct Client
+{
+	AudioReceiver receiver;
+	bool connected = false;
+
+	std::mutex mutex;
+	std::vector<int64_t> transits;
+	bool measuring = false;
+
+	ReceiverStats start_stats{};
+};
+
+static std::atomic<bool> s_stop{ false };
+
+static void on_signal(int)
+{
+	s_stop = true;
+}
+
+// User and system time of a process so far, in ns
+static int64_t process_cpu_ns(pid_t pid)
+{
+	std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+	std::string stat;
+
+	if (!std::getline(file, stat))
+		return 0;
+
+	// The name in parentheses may contain spaces, the fields after it don't
+	std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+	std::string field;
+	unsigned long long utime = 0, stime = 0;
+
+	for (int i = 3; i <= 15 && fields >> field; i++) {
+		if (i == 14)
+			utime = std::stoull(field);
+		else if (i == 15)
+			stime = std::stoull(field);
+	}
+
+	return (int64_t)((utime + stime) * 1000000000ULL / sysconf(_SC_CLK_TCK));
+}
+
+// The server on its own, so its CPU isn't mixed up with the clients'
+static pid_t fork_server(const std::string& format)
+{
+	pid_t pid = fork();
+
+	if (pid != 0)
+		return pid;
+
+	signal(SIGTERM, on_signal);
+
+	// Its session logs would bury the table
+	if (!freopen("/dev/null", "w", stdout))
+		_exit(1);
+
+	{
+		AudioStream stream(LOAD_PAIR_CODE, LOAD_PORT, format, SYNTHETIC_DEVICE_NAME);
+
+		if (!stream.Init())
+			_exit(1);
+
+		while (!s_stop)
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	_exit(0);
+}
+
+int main(int argc, char* argv[])
+{
+	int max_clients = argc > 1 ? std::stoi(argv[1]) : 32;
+	int seconds = argc > 2 ? std::stoi(argv[2]) : 5;
+	std::string format_name = argc > 3 ? argv[3] : "pcm16";
+
+	ReceiverConfig config;
+	config.port = LOAD_PORT;
+	config.password = LOAD_PAIR_CODE;
+
+	std::string server_format;
+
+	if (!ParseReceiverFormat(format_name, &config, &server_format)) {
+		printf("unknown format %s\n", format_name.c_str());
+		return 1;
+	}
+
+	pid_t server_pid;
+	bool forked = argc <= 4;
+
+	if (forked) {
+		server_pid = fork_server(server_format);
+
+		if (server_pid < 0) {
+			printf("fork failed\n");
+			return 1;
+		}
+
+		// Time to bind its sockets
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	}
+	else if (argc > 6) {
+		config.port = std::stoi(argv[4]);
+		server_pid = std::stoi(argv[5]);
+		config.password = argv[6];
+	}
+	else {
+		printf("usage: %s [max clients] [seconds per step] [format] [port pid pair code]\n", argv[0]);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+
+	std::vector<std::unique_ptr<Client>> clients;
+
+	// The clients' own CPU, latency measured on starved clients says little
+	// about the server
+	printf("%7s %9s %10s %10s %10s %8s %8s %8s %8s %6s %6s %7s\n", "clients", "connected", "server cpu", "per client",
+		"client cpu", "p50 ms", "p90 ms", "p99 ms", "max ms", "lost", "late", "invalid");
+
+	for (int target = 1; !s_stop; target = std::min(target * 2, max_clients)) {
+		while ((int)clients.size() < target) {
+			auto client = std::make_unique<Client>();
+			Client* raw = client.get();
+
+			client->receiver.SetPacketCallback([raw](const AudioPacketHeader& header, int64_t arrival_ns)
+			{
+				const StreamSettings& settings = raw->receiver.GetSettings();
+				uint32_t frames = settings.protocol_version >= 7 ? header.frames & AUDIO_FRAMES_MASK : header.frames;
+				int64_t end_pts_ns = header.pts_ns + (int64_t)frames * 1000000000LL / std::max(settings.sample_rate, 1);
+
+				std::lock_guard<std::mutex> lk(raw->mutex);
+
+				if (raw->measuring)
+					raw->transits.push_back(arrival_ns - end_pts_ns);
+			});
+
+			client->connected = client->receiver.Start(config);
+			clients.push_back(std::move(client));
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(SETTLE_MS));
+
+		int connected = 0;
+
+		for (auto& client : clients) {
+			std::lock_guard<std::mutex> lk(client->mutex);
+
+			client->transits.clear();
+			client->measuring = true;
+			client->start_stats = client->receiver.GetStats();
+			connected += client->connected;
+		}
+
+		int64_t start_ns = MonotonicNowNs();
+		int64_t start_cpu_ns = process_cpu_ns(server_pid);
+		int64_t start_client_cpu_ns = process_cpu_ns(getpid());
+
+		for (int64_t end_ns = start_ns + seconds * 1000000000LL; !s_stop && MonotonicNowNs() < end_ns;)
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+		int64_t elapsed_ns = MonotonicNowNs() - start_ns;
+		double cpu = (double)(process_cpu_ns(server_pid) - start_cpu_ns) / elapsed_ns;
+		double client_cpu = (double)(process_cpu_ns(getpid()) - start_client_cpu_ns) / elapsed_ns;
+
+		std::vector<int64_t> transits;
+		uint64_t lost = 0, late = 0, invalid = 0;
+
+		for (auto& client : clients) {
+			std::lock_guard<std::mutex> lk(client->mutex);
+
+			ReceiverStats stats = client->receiver.GetStats();
+
+			lost += stats.lost - client->start_stats.lost;
+			late += stats.late - client->start_stats.late;
+			invalid += stats.invalid - client->start_stats.invalid;
+
+			client->measuring = false;
+			transits.insert(transits.end(), client->transits.begin(), client->transits.end());
+		}
+
+		std::sort(transits.begin(), transits.end());
+
+		auto at = [&](double p) { return transits.empty() ? 0.0 : transits[std::min(transits.size() - 1, (size_t)(p * transits.size()))] / 1e6; };
+
+		printf("%7zu %9d %9.1f%% %9.2f%% %9.1f%% %8.2f %8.2f %8.2f %8.2f %6llu %6llu %7llu\n", clients.size(), connected,
+			cpu * 100, connected ? cpu * 100 / connected : 0.0, client_cpu * 100, at(0.50), at(0.90), at(0.99), transits.empty() ? 0.0 : transits.back() / 1e6,
+			(unsigned long long)lost, (unsigned long long)late, (unsigned long long)invalid);
+
+		if (target == max_clients)
+			break;
+	}
+
+	for (auto& client : clients)
+		client->receiver.Stop();
+
+	clients.clear();
+
+	if (forked) {
+		kill(server_pid, SIGTERM);
+		waitpid(server_pid, nullptr, 0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,246 @@
+// Reference receiver: connects to a running server like the Android app
+// does and plays the stream into a float WAV file, or nowhere. Prints the
+// receiver's counters once a second. -a records when each packet arrived,
+// a trace SASJitterReplay plays back through the jitter buffer.
+//
+// SASReceiver <host> <port> <pair code> [-o out.wav] [-a trace.txt] [-t seconds]
+//     [-f pcm16|pcm24|pcm24in32|pcm32|float|opus<kbit/s>|lossless16|lossless24]
+//     [-r rate] [-c channels] [-j min jitter ms] [-m max jitter ms]
+//     [-q jitter percentile] [-p protocol]
+
+#include "pch.h"
+#include "AudioReceiver.h"
+#include "Clock.h"
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+
+static std::atomic<bool> s_stop{ false };
+
+static void on_signal(int)
+{
+	s_stop = true;
+}
+
+// IEEE float WAV, sizes filled in on close
+class WavWriter
+{
+public:
+	bool Open(const std::string& path, int sample_rate, int channels)
+	{
+		m_file = fopen(path.c_str(), "wb");
+
+		if (!m_file)
+			return false;
+
+		m_sample_rate = sample_rate;
+		m_channels = channels;
+		m_data_bytes = 0;
+
+		WriteHeader();
+		return true;
+	}
+
+	void Write(const float* samples, size_t frames)
+	{
+		m_data_bytes += fwrite(samples, sizeof(float) * m_channels, frames, m_file) * sizeof(float) * m_channels;
+	}
+
+	void Close()
+	{
+		if (!m_file)
+			return;
+
+		fseek(m_file, 0, SEEK_SET);
+		WriteHeader();
+		fclose(m_file);
+
+		m_file = nullptr;
+	}
+
+	int GetSampleRate() const { return m_sample_rate; }
+	int GetChannels() const { return m_channels; }
+
+private:
+	void WriteHeader()
+	{
+		uint32_t data_bytes = (uint32_t)m_data_bytes;
+		uint32_t riff_bytes = 36 + data_bytes;
+		uint32_t fmt_bytes = 16;
+		uint16_t format = 3;
+		uint16_t channels = (uint16_t)m_channels;
+		uint32_t rate = (uint32_t)m_sample_rate;
+		uint32_t byte_rate = rate * channels * 4;
+		uint16_t block_align = channels * 4;
+		uint16_t bits = 32;
+
+		fwrite("RIFF", 1, 4, m_file);
+		fwrite(&riff_bytes, 4, 1, m_file);
+		fwrite("WAVEfmt ", 1, 8, m_file);
+		fwrite(&fmt_bytes, 4, 1, m_file);
+		fwrite(&format, 2, 1, m_file);
+		fwrite(&channels, 2, 1, m_file);
+		fwrite(&rate, 4, 1, m_file);
+		fwrite(&byte_rate, 4, 1, m_file);
+		fwrite(&block_align, 2, 1, m_file);
+		fwrite(&bits, 2, 1, m_file);
+		fwrite("data", 1, 4, m_file);
+		fwrite(&data_bytes, 4, 1, m_file);
+	}
+
+	FILE* m_file = nullptr;
+	int m_sample_rate = 0;
+	int m_channels = 0;
+	uint64_t m_data_bytes = 0;
+};
+
+int main(int argc, char* argv[])
+{
+	if (argc < 4) {
+		printf("usage: %s <host> <port> <pair code> [-o out.wav] [-a trace.txt] [-t seconds] [-f format] [-r rate] [-c channels] "
+			"[-j min jitter ms] [-m max jitter ms] [-q jitter percentile] [-p protocol]\n", argv[0]);
+		return 1;
+	}
+
+	ReceiverConfig config;
+	config.host = argv[1];
+	config.port = std::stoi(argv[2]);
+	config.password = argv[3];
+
+	std::string out_path;
+	std::string trace_path;
+	int seconds = 0;
+
+	for (int i = 4; i + 1 < argc; i += 2) {
+		std::string option = argv[i];
+		std::string value = argv[i + 1];
+
+		if (option == "-o")
+			out_path = value;
+		else if (option == "-a")
+			trace_path = value;
+		else if (option == "-t")
+			seconds = std::stoi(value);
+		else if (option == "-f" && ParseReceiverFormat(value, &config, nullptr))
+			continue;
+		else if (option == "-r")
+			config.sample_rate = std::stoi(value);
+		else if (option == "-c")
+			config.channels = std::stoi(value);
+		else if (option == "-j")
+			config.jitter_ms = std::stoi(value);
+		else if (option == "-m")
+			config.max_jitter_ms = std::stoi(value);
+		else if (option == "-q")
+			config.jitter_percentile = std::stod(value);
+		else if (option == "-p")
+			config.protocol_version = std::stoi(value);
+		else {
+			printf("invalid option %s %s\n", option.c_str(), value.c_str());
+			return 1;
+		}
+	}
+
+	WavWriter wav;
+	std::atomic<uint64_t> skipped_frames{ 0 };
+	std::atomic<bool> writing{ false };
+
+	AudioReceiver receiver;
+
+	// A format switch to another rate or layout can't go into the same file
+	receiver.SetSinkCallback([&](const float* samples, size_t frames, const ReceiverFormat& format, int64_t play_ns)
+	{
+		if (!writing)
+			return;
+
+		if (format.sample_rate != wav.GetSampleRate() || format.channels != wav.GetChannels()) {
+			skipped_frames += frames;
+			return;
+		}
+
+		wav.Write(samples, frames);
+	});
+
+	FILE* trace = nullptr;
+
+	if (!trace_path.empty()) {
+		trace = fopen(trace_path.c_str(), "w");
+
+		if (!trace) {
+			printf("could not open %s\n", trace_path.c_str());
+			return 1;
+		}
+
+		fprintf(trace, "# sequence pts_ns arrival_ns frames\n");
+	}
+
+	// Protocol 7 puts the format generation above the frames
+	receiver.SetPacketCallback([&](const AudioPacketHeader& header, int64_t arrival_ns)
+	{
+		if (!trace)
+			return;
+
+		uint32_t frames = receiver.GetSettings().protocol_version >= 7 ? header.frames & AUDIO_FRAMES_MASK : header.frames;
+
+		fprintf(trace, "%u %lld %lld %u\n", header.sequence, (long long)header.pts_ns, (long long)arrival_ns, frames);
+	});
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (!receiver.Start(config)) {
+		if (trace)
+			fclose(trace);
+
+		return 1;
+	}
+
+	const StreamSettings& settings = receiver.GetSettings();
+
+	if (!out_path.empty()) {
+		if (!wav.Open(out_path, settings.sample_rate, settings.n_channels)) {
+			printf("could not open %s\n", out_path.c_str());
+			receiver.Stop();
+			return 1;
+		}
+
+		writing = true;
+	}
+
+	int64_t start_ns = MonotonicNowNs();
+
+	while (!s_stop && (!seconds || MonotonicNowNs() - start_ns < seconds * 1000000000LL)) {
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		ReceiverStats stats = receiver.GetStats();
+
+		double rate = std::max(settings.sample_rate, 1);
+
+		printf("packets %llu lost %llu late %llu reordered %llu dup %llu, %.1f s played, %.1f s silence, jitter %.2f ms rtt %.2f ms\n",
+			(unsigned long long)stats.packets, (unsigned long long)stats.lost, (unsigned long long)stats.late,
+			(unsigned long long)stats.reordered, (unsigned long long)stats.duplicates,
+			stats.frames_played / rate, stats.silence_frames / rate, stats.jitter_us / 1000.0, stats.rtt_us / 1000.0);
+		printf("    buffer %.1f ms of %.1f ms, %llu underruns %.1f ms, concealed %.1f ms, expanded %.1f ms, compressed %.1f ms\n",
+			stats.level_ms, stats.target_ms, (unsigned long long)stats.underruns, stats.underrun_frames * 1000 / rate,
+			stats.concealed_frames * 1000 / rate, stats.expanded_frames * 1000 / rate, stats.compressed_frames * 1000 / rate);
+	}
+
+	receiver.Stop();
+
+	if (trace)
+		fclose(trace);
+
+	if (writing) {
+		wav.Close();
+
+		if (skipped_frames)
+			printf("%llu frames in another format were not written\n", (unsigned long long)skipped_frames.load());
+	}
+
+	return 0;
+}